@@ -0,0 +1,441 @@
+// Microbenchmarks for libjsonval, the jq engine and JLS.
+//
+// Every benchmark runs until it has used --min-time seconds and reports the
+// time per operation, throughput where the operation reads a corpus, and
+// heap allocations per operation (operator new is counted below). Corpora
+// are generated from a fixed seed, so runs on different commits measure the
+// same input; --json output can be passed back as --baseline to compare.
+//
+//   bench [--size <n>[K|M]] [--shape deep,wide,...] [--filter <text>]
+//         [--min-time <seconds>] [--json] [--baseline <results.json>]
+//         [--schema <schema.json>] [--data <data.json>]
+
+#include "./include/jls.hpp"
+#include "./include/jq.hpp"
+#include "./include/libjsonval.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// --- allocation counting -----------------------------------------------------
+
+static std::atomic<size_t> alloc_count{0};
+static std::atomic<size_t> alloc_bytes{0};
+
+void *operator new(size_t size) {
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void *operator new[](size_t size) { return ::operator new(size); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+// Results are folded in here so the optimizer cannot drop the work.
+static volatile size_t sink = 0;
+static void keep(size_t v) { sink = sink + v; }
+
+// --- synthetic corpora -------------------------------------------------------
+
+static const char *const kShapes[] = {"deep", "wide", "strings", "numbers",
+                                      "records"};
+
+// Appends values of one shape until `out` holds about `size` bytes; the
+// result is always one valid JSON document (an array, or an object for
+// "wide").
+static std::string make_corpus(const std::string &shape, size_t size) {
+  std::mt19937_64 rng(42);
+  std::string out;
+  out.reserve(size + 4096);
+  auto num = [&](int lo, int hi) {
+    return std::uniform_int_distribution<int>(lo, hi)(rng);
+  };
+
+  if (shape == "wide") {
+    out += '{';
+    for (size_t i = 0; out.size() < size; ++i) {
+      if (i)
+        out += ',';
+      out += "\"key_" + std::to_string(i) + "\":";
+      switch (i % 4) {
+      case 0: out += std::to_string(num(0, 1000000)); break;
+      case 1: out += "\"v" + std::to_string(i) + "\""; break;
+      case 2: out += i % 8 == 2 ? "true" : "null"; break;
+      default: out += "[1,2,3]"; break;
+      }
+    }
+    return out + '}';
+  }
+
+  out += '[';
+  for (size_t i = 0; out.size() < size; ++i) {
+    if (i)
+      out += ',';
+    if (shape == "deep") {
+      // 64 levels of alternating objects and arrays around one number
+      for (int d = 0; d < 64; ++d)
+        out += d % 2 ? "[" : "{\"n\":";
+      out += std::to_string(num(0, 999));
+      for (int d = 63; d >= 0; --d)
+        out += d % 2 ? "]" : "}";
+    } else if (shape == "strings") {
+      out += '"';
+      int len = num(256, 4096);
+      for (int c = 0; c < len; ++c) {
+        int r = num(0, 99);
+        if (r == 0)
+          out += "\\n";
+        else if (r == 1)
+          out += "\\\"";
+        else if (r == 2)
+          out += "\\u00e9";
+        else
+          out += static_cast<char>('a' + r % 26);
+      }
+      out += '"';
+    } else if (shape == "numbers") {
+      switch (i % 3) {
+      case 0: out += std::to_string(num(-1000000, 1000000)); break;
+      case 1:
+        out += std::to_string(num(0, 99999)) + "." +
+               std::to_string(num(0, 99999));
+        break;
+      default:
+        out += std::to_string(num(1, 9)) + "." + std::to_string(num(0, 999)) +
+               "e" + std::to_string(num(-30, 30));
+        break;
+      }
+    } else { // records
+      out += "{\"id\":" + std::to_string(i) + ",\"name\":\"user" +
+             std::to_string(i) + "\",\"active\":" +
+             (num(0, 1) ? "true" : "false") +
+             ",\"score\":" + std::to_string(num(0, 100)) +
+             ",\"tags\":[\"a\",\"b\",\"c\"],\"address\":{\"city\":\"city" +
+             std::to_string(num(0, 50)) + "\",\"zip\":\"" +
+             std::to_string(num(10000, 99999)) + "\"}}";
+    }
+  }
+  return out + ']';
+}
+
+// --- harness -------------------------------------------------------------------
+
+struct Result {
+  std::string name;
+  size_t iterations = 0;
+  double ns_per_op = 0;
+  double mb_per_s = 0; // 0 when the operation does not read a corpus
+  double allocs_per_op = 0;
+  double alloc_bytes_per_op = 0;
+};
+
+struct Options {
+  size_t size = 1 << 20;
+  std::vector<std::string> shapes;
+  std::string filter;
+  double min_time = 0.5;
+  bool json = false;
+  std::string baseline;
+  std::string schema_path = "alac.schema.json";
+  std::string data_path = "alac.json";
+};
+
+static Options opts;
+static std::vector<Result> results;
+
+// Runs `op` in growing batches until min_time has passed. `bytes` is the
+// input size one call reads.
+static void bench(const std::string &name, size_t bytes,
+                  const std::function<void()> &op) {
+  if (!opts.filter.empty() && name.find(opts.filter) == std::string::npos)
+    return;
+  op(); // warm up caches and lazily built tables
+
+  using clock = std::chrono::steady_clock;
+  size_t iters = 0;
+  size_t batch = 1;
+  size_t allocs0 = alloc_count.load(), bytes0 = alloc_bytes.load();
+  auto start = clock::now();
+  double elapsed = 0;
+  while (elapsed < opts.min_time) {
+    for (size_t i = 0; i < batch; ++i)
+      op();
+    iters += batch;
+    batch *= 2;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  }
+
+  Result r;
+  r.name = name;
+  r.iterations = iters;
+  r.ns_per_op = elapsed * 1e9 / iters;
+  r.mb_per_s = bytes ? bytes * iters / elapsed / (1024.0 * 1024.0) : 0;
+  r.allocs_per_op = double(alloc_count.load() - allocs0) / iters;
+  r.alloc_bytes_per_op = double(alloc_bytes.load() - bytes0) / iters;
+  results.push_back(r);
+  if (!opts.json) {
+    std::fprintf(stderr, "  %s\n", name.c_str());
+  }
+}
+
+static bool read_file(const std::string &path, std::string &out) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    return false;
+  std::ostringstream ss;
+  ss << in.rdbuf();
+  out = ss.str();
+  return true;
+}
+
+// --- benchmarks ----------------------------------------------------------------
+
+static void bench_parsing(const std::string &shape, const std::string &text) {
+  std::string err;
+  bench("validate_json/" + shape, text.size(), [&] {
+    keep(validate_json(text, err));
+  });
+  bench("parse_json_dom/" + shape, text.size(), [&] {
+    JsonValue v;
+    keep(parse_json_dom(text, v, err));
+  });
+  JsonDocument doc;
+  bench("parse_json_document/" + shape, text.size(), [&] {
+    keep(parse_json_document(text, doc, err));
+  });
+  jq::JvValuePtr value = jq::from_json_view(doc.root());
+  bench("jv_to_string/" + shape, text.size(), [&] {
+    keep(value->to_string().size());
+  });
+}
+
+static void bench_schema() {
+  std::string schema, data, err;
+  if (!read_file(opts.schema_path, schema) || !read_file(opts.data_path, data)) {
+    std::fprintf(stderr, "skipping schema benchmarks: cannot read %s or %s\n",
+                 opts.schema_path.c_str(), opts.data_path.c_str());
+    return;
+  }
+  bench("schema/validate_text", data.size(), [&] {
+    keep(validate_json_with_schema(data, schema, err));
+  });
+  bench("schema/compile", schema.size(), [&] {
+    CompiledSchema compiled;
+    keep(compiled.compile(schema, err));
+  });
+  CompiledSchema compiled;
+  JsonDocument doc;
+  if (!compiled.compile(schema, err) || !parse_json_document(data, doc, err)) {
+    std::fprintf(stderr, "skipping compiled schema benchmark: %s\n",
+                 err.c_str());
+    return;
+  }
+  bench("schema/validate_compiled", data.size(), [&] {
+    keep(compiled.validate(doc.root(), err));
+  });
+}
+
+static void bench_jq(const std::string &records) {
+  static const std::pair<const char *, const char *> kFilters[] = {
+      {"identity", "."},
+      {"path", ".[100].address.city"},
+      {"select", ".[] | select(.score > 50) | .name"},
+      {"map_add", "map(.score) | add"},
+      {"construct", "[.[] | {id, name, city: .address.city}]"},
+      {"sort", "[.[] | .score] | sort | .[0]"},
+  };
+
+  jq::Engine engine;
+  std::string err;
+  JsonDocument doc;
+  parse_json_document(records, doc, err);
+  jq::JvValuePtr input = jq::from_json_view(doc.root());
+  for (const auto &[name, filter] : kFilters) {
+    bench(std::string("jq_compile/") + name, 0, [&] {
+      jq::CompiledFilter compiled;
+      keep(engine.compile(filter, compiled, err));
+    });
+    jq::CompiledFilter compiled;
+    if (!engine.compile(filter, compiled, err)) {
+      std::fprintf(stderr, "skipping jq filter %s: %s\n", filter, err.c_str());
+      continue;
+    }
+    std::vector<jq::JvValuePtr> outputs;
+    bench(std::string("jq_execute/") + name, records.size(), [&] {
+      outputs.clear();
+      keep(compiled.run(input, outputs, err));
+    });
+    bench(std::string("jq_execute_view/") + name, records.size(), [&] {
+      outputs.clear();
+      keep(compiled.run(doc.root(), outputs, err));
+    });
+  }
+}
+
+static void bench_jls() {
+  static const std::pair<const char *, const char *> kScripts[] = {
+      {"for_loop_100k", "LET s = 0\nFOR i = 1 TO 100000\n s = s + i * 2\n"
+                        "NEXT\ns"},
+      {"while_loop_100k", "LET w = 0\nWHILE w < 100000\n w = w + 1\nEND\nw"},
+      {"fib_20", "FUNCTION fib(n)\nIF n < 2 THEN\nRETURN n\nEND IF\n"
+                 "RETURN fib(n - 1) + fib(n - 2)\nEND\nfib(20)"},
+  };
+
+  for (const auto &[name, source] : kScripts) {
+    jls::Lexer lexer(source);
+    jls::Parser parser(lexer.tokenize());
+    auto ast = parser.parse();
+
+    jls::Evaluator vm_globals;
+    jls::Compiler compiler(vm_globals.get_global_env());
+    auto chunk = compiler.compile(ast);
+    jls::VM vm;
+    bench(std::string("jls_vm/") + name, 0, [&] {
+      keep(vm.execute(chunk));
+    });
+
+    jls::Evaluator evaluator;
+    bench(std::string("jls_eval/") + name, 0, [&] {
+      keep(evaluator.eval(ast).type() != jls::ValueType::NIL);
+    });
+  }
+}
+
+// --- output ----------------------------------------------------------------------
+
+// name -> ns/op of an earlier --json run
+static std::map<std::string, double> load_baseline(const std::string &path) {
+  std::map<std::string, double> out;
+  std::string text, err;
+  JsonValue root;
+  if (!read_file(path, text) || !parse_json_dom(text, root, err)) {
+    std::fprintf(stderr, "cannot read baseline %s %s\n", path.c_str(),
+                 err.c_str());
+    return out;
+  }
+  auto it = root.o.find("results");
+  if (it == root.o.end())
+    return out;
+  for (const auto &r : it->second.a) {
+    auto name = r.o.find("name");
+    auto ns = r.o.find("ns_per_op");
+    if (name != r.o.end() && ns != r.o.end())
+      out[name->second.s] = ns->second.n;
+  }
+  return out;
+}
+
+static std::string json_string(const std::string &s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    out += c;
+  }
+  return out + '"';
+}
+
+static void print_results() {
+  auto baseline = opts.baseline.empty() ? std::map<std::string, double>()
+                                        : load_baseline(opts.baseline);
+  if (opts.json) {
+    std::printf("{\"version\":%s,\"corpus_bytes\":%zu,\"results\":[",
+                json_string(VERSION).c_str(), opts.size);
+    for (size_t i = 0; i < results.size(); ++i) {
+      const Result &r = results[i];
+      std::printf("%s\n{\"name\":%s,\"iterations\":%zu,\"ns_per_op\":%.1f,"
+                  "\"mb_per_s\":%.2f,\"allocs_per_op\":%.2f,"
+                  "\"alloc_bytes_per_op\":%.1f",
+                  i ? "," : "", json_string(r.name).c_str(), r.iterations,
+                  r.ns_per_op, r.mb_per_s, r.allocs_per_op,
+                  r.alloc_bytes_per_op);
+      auto b = baseline.find(r.name);
+      if (b != baseline.end() && b->second > 0)
+        std::printf(",\"baseline_ns_per_op\":%.1f", b->second);
+      std::printf("}");
+    }
+    std::printf("\n]}\n");
+    return;
+  }
+
+  std::printf("%-36s %14s %10s %12s %14s%s\n", "benchmark", "ns/op", "MB/s",
+              "allocs/op", "alloc B/op", baseline.empty() ? "" : "   vs base");
+  for (const Result &r : results) {
+    std::printf("%-36s %14.1f %10.2f %12.2f %14.1f", r.name.c_str(),
+                r.ns_per_op, r.mb_per_s, r.allocs_per_op, r.alloc_bytes_per_op);
+    auto b = baseline.find(r.name);
+    if (b != baseline.end() && b->second > 0)
+      std::printf("   %+8.1f%%", (r.ns_per_op / b->second - 1) * 100);
+    std::printf("\n");
+  }
+}
+
+static size_t parse_size(const std::string &s) {
+  size_t n = std::strtoull(s.c_str(), nullptr, 10);
+  char unit = s.empty() ? 0 : s.back();
+  if (unit == 'K' || unit == 'k')
+    n <<= 10;
+  else if (unit == 'M' || unit == 'm')
+    n <<= 20;
+  return n;
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--size" && has_value) {
+      opts.size = parse_size(argv[++i]);
+    } else if (arg == "--shape" && has_value) {
+      std::stringstream list(argv[++i]);
+      std::string shape;
+      while (std::getline(list, shape, ','))
+        opts.shapes.push_back(shape);
+    } else if (arg == "--filter" && has_value) {
+      opts.filter = argv[++i];
+    } else if (arg == "--min-time" && has_value) {
+      opts.min_time = std::atof(argv[++i]);
+    } else if (arg == "--json") {
+      opts.json = true;
+    } else if (arg == "--baseline" && has_value) {
+      opts.baseline = argv[++i];
+    } else if (arg == "--schema" && has_value) {
+      opts.schema_path = argv[++i];
+    } else if (arg == "--data" && has_value) {
+      opts.data_path = argv[++i];
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--size <n>[K|M]] [--shape deep,wide,strings,numbers,"
+                   "records] [--filter <text>] [--min-time <seconds>] "
+                   "[--json] [--baseline <results.json>] [--schema <file>] "
+                   "[--data <file>]\n";
+      return 1;
+    }
+  }
+  if (opts.shapes.empty())
+    opts.shapes.assign(std::begin(kShapes), std::end(kShapes));
+
+  for (const auto &shape : opts.shapes)
+    bench_parsing(shape, make_corpus(shape, opts.size));
+  bench_schema();
+  bench_jq(make_corpus("records", opts.size));
+  bench_jls();
+
+  print_results();
+  return 0;
+}
@@ -5,8 +5,11 @@
 #include <cmath>
 #include <iostream>
 #include <random>
+#include <set>
 #include <sstream>
 
+#include "../src/jq/jq_types.hpp"
+
 namespace jls {
 
 static std::string str_tolower(const std::string &s) {
@@ -355,10 +358,55 @@ ASTNodePtr Parser::parse() {
   if (current_token().type == TokenType::EOF_TOKEN) {
     auto nil_node = std::make_shared<ASTNode>();
     nil_node->type = NodeType::LITERAL;
-    nil_node->literal_value = std::make_shared<Value>();
+    nil_node->literal_value = Value();
     return nil_node;
   }
-  return parse_statement();
+  auto block = parse_block({});
+  if (block->children.size() == 1)
+    return block->children[0];
+  return block;
+}
+
+ASTNodePtr Parser::parse_block(std::initializer_list<TokenType> terminators) {
+  auto node = std::make_shared<ASTNode>();
+  node->type = NodeType::BLOCK;
+
+  while (current_token().type != TokenType::EOF_TOKEN &&
+         std::find(terminators.begin(), terminators.end(),
+                   current_token().type) == terminators.end()) {
+    size_t start = position;
+    node->children.push_back(parse_statement());
+    if (!error_msg.empty())
+      break;
+    if (position == start) {
+      error_msg = "Unexpected token: " + current_token().value;
+      break;
+    }
+  }
+
+  return node;
+}
+
+void Parser::parse_block_end(TokenType keyword) {
+  Token tok = current_token();
+  bool closes = tok.type == TokenType::END ||
+                (keyword == TokenType::FOR && tok.type == TokenType::NEXT);
+  if (!closes) {
+    if (tok.type != TokenType::EOF_TOKEN && error_msg.empty())
+      error_msg = "Expected END";
+    return;
+  }
+  advance();
+
+  // END IF / END FOR / NEXT i, but only on the same line: the next line may
+  // start a new statement with that keyword.
+  Token next = current_token();
+  if (next.line != tok.line)
+    return;
+  if (tok.type == TokenType::NEXT ? next.type == TokenType::IDENTIFIER
+                                  : next.type == keyword) {
+    advance();
+  }
 }
 
 ASTNodePtr Parser::parse_statement() {
@@ -377,6 +425,11 @@ ASTNodePtr Parser::parse_statement() {
     return parse_while();
   case TokenType::FUNCTION:
     return parse_function();
+  case TokenType::RETURN:
+    return parse_return();
+  case TokenType::CALL:
+    advance(); // CALL name(args) is a plain call
+    return parse_expression();
   case TokenType::IDENTIFIER:
     // Could be assignment or function call
     if (peek_token().type == TokenType::EQUALS) {
@@ -450,33 +503,14 @@ ASTNodePtr Parser::parse_if() {
     advance();
   }
 
-  // Parse then branch (can be a statement or expression)
-  // Check if it's a statement keyword
-  if (current_token().type == TokenType::PRINT ||
-      current_token().type == TokenType::LET ||
-      current_token().type == TokenType::IDENTIFIER) {
-    node->then_branch = parse_statement();
-  } else {
-    node->then_branch = parse_expression();
-  }
+  node->then_branch = parse_block({TokenType::ELSE, TokenType::END});
 
-  // Parse optional else branch
   if (current_token().type == TokenType::ELSE) {
     advance();
-    if (current_token().type == TokenType::PRINT ||
-        current_token().type == TokenType::LET ||
-        current_token().type == TokenType::IDENTIFIER) {
-      node->else_branch = parse_statement();
-    } else {
-      node->else_branch = parse_expression();
-    }
-  }
-
-  // Skip optional END keyword
-  if (current_token().type == TokenType::END) {
-    advance();
+    node->else_branch = parse_block({TokenType::END});
   }
 
+  parse_block_end(TokenType::IF);
   return node;
 }
 
@@ -510,9 +544,12 @@ ASTNodePtr Parser::parse_for() {
     node->children.push_back(parse_expression());
   }
 
-  // Parse body (simplified for now)
-  // In full implementation, would parse until NEXT
+  if (current_token().type == TokenType::DO) {
+    advance();
+  }
 
+  node->body = parse_block({TokenType::NEXT, TokenType::END});
+  parse_block_end(TokenType::FOR);
   return node;
 }
 
@@ -527,8 +564,8 @@ ASTNodePtr Parser::parse_while() {
     advance();
   }
 
-  // Parse body (simplified)
-
+  node->body = parse_block({TokenType::END});
+  parse_block_end(TokenType::WHILE);
   return node;
 }
 
@@ -551,16 +588,36 @@ ASTNodePtr Parser::parse_function() {
     while (current_token().type != TokenType::RPAREN &&
            current_token().type != TokenType::EOF_TOKEN) {
       if (current_token().type == TokenType::IDENTIFIER) {
-        // Store parameter names (simplified)
+        node->params.push_back(current_token().value);
         advance();
-      }
-      if (current_token().type == TokenType::COMMA) {
+      } else if (current_token().type == TokenType::COMMA) {
         advance();
+      } else {
+        error_msg = "Expected parameter name";
+        return node;
       }
     }
     expect(TokenType::RPAREN);
   }
 
+  node->body = parse_block({TokenType::END});
+  parse_block_end(TokenType::FUNCTION);
+  return node;
+}
+
+ASTNodePtr Parser::parse_return() {
+  auto node = std::make_shared<ASTNode>();
+  node->type = NodeType::RETURN_STMT;
+  size_t line = current_token().line;
+  advance(); // Skip RETURN
+
+  // The value is optional; it must start on the RETURN line.
+  Token tok = current_token();
+  if (tok.line == line && tok.type != TokenType::EOF_TOKEN &&
+      tok.type != TokenType::END && tok.type != TokenType::ELSE &&
+      tok.type != TokenType::NEXT) {
+    node->children.push_back(parse_expression());
+  }
   return node;
 }
 
@@ -635,37 +692,37 @@ ASTNodePtr Parser::parse_primary() {
   switch (tok.type) {
   case TokenType::INTEGER: {
     node->type = NodeType::LITERAL;
-    node->literal_value = std::make_shared<Value>(std::stoll(tok.value));
+    node->literal_value = Value(std::stoll(tok.value));
     advance();
     break;
   }
   case TokenType::FLOAT: {
     node->type = NodeType::LITERAL;
-    node->literal_value = std::make_shared<Value>(std::stod(tok.value));
+    node->literal_value = Value(std::stod(tok.value));
     advance();
     break;
   }
   case TokenType::STRING: {
     node->type = NodeType::LITERAL;
-    node->literal_value = std::make_shared<Value>(tok.value);
+    node->literal_value = Value(tok.value);
     advance();
     break;
   }
   case TokenType::TRUE: {
     node->type = NodeType::LITERAL;
-    node->literal_value = std::make_shared<Value>(true);
+    node->literal_value = Value(true);
     advance();
     break;
   }
   case TokenType::FALSE: {
     node->type = NodeType::LITERAL;
-    node->literal_value = std::make_shared<Value>(false);
+    node->literal_value = Value(false);
     advance();
     break;
   }
   case TokenType::NIL: {
     node->type = NodeType::LITERAL;
-    node->literal_value = std::make_shared<Value>();
+    node->literal_value = Value();
     advance();
     break;
   }
@@ -748,10 +805,19 @@ ASTNodePtr Parser::parse_primary() {
 
 // ================= Environment Implementation =================
 
-ValuePtr Environment::get(const std::string &name) {
-  auto it = variables.find(name);
-  if (it != variables.end()) {
-    return it->second;
+size_t Environment::slot(const std::string &name) {
+  auto [it, added] = index.emplace(name, slots.size());
+  if (added) {
+    slots.push_back(Value::unset());
+    names.push_back(name);
+  }
+  return it->second;
+}
+
+const Value *Environment::get(const std::string &name) const {
+  auto it = index.find(name);
+  if (it != index.end() && !slots[it->second].is_unset()) {
+    return &slots[it->second];
   }
   if (parent) {
     return parent->get(name);
@@ -759,20 +825,175 @@ ValuePtr Environment::get(const std::string &name) {
   return nullptr;
 }
 
-void Environment::set(const std::string &name, const ValuePtr &value) {
-  variables[name] = value;
-}
-
-bool Environment::exists(const std::string &name) const {
-  if (variables.find(name) != variables.end()) {
+void Environment::set(const std::string &name, Value value) {
+  slots[slot(name)] = std::move(value);
+}
+
+// ================= Operations =================
+// Shared by the Evaluator and the VM so both compute the same results.
+
+// Deepest user function nesting before a call fails.
+static constexpr size_t kMaxCallDepth = 1000;
+
+static bool truthy(const Value &v) {
+  return v.type() == ValueType::BOOLEAN ? v.b() : v.type() != ValueType::NIL;
+}
+
+// Opcode for a BINARY_OP node's operator, or HALT if there is none.
+static OpCode binary_opcode(const std::string &op) {
+  if (op == "+")
+    return OpCode::ADD;
+  if (op == "-")
+    return OpCode::SUB;
+  if (op == "*")
+    return OpCode::MUL;
+  if (op == "/")
+    return OpCode::DIV;
+  if (op == "%")
+    return OpCode::MOD;
+  if (op == "^")
+    return OpCode::POW;
+  if (op == "<")
+    return OpCode::LT;
+  if (op == ">")
+    return OpCode::GT;
+  if (op == "<=")
+    return OpCode::LTE;
+  if (op == ">=")
+    return OpCode::GTE;
+  if (op == "==" || op == "=")
+    return OpCode::EQ;
+  if (op == "<>")
+    return OpCode::NEQ;
+  std::string lower = str_tolower(op);
+  if (lower == "and")
+    return OpCode::AND;
+  if (lower == "or")
+    return OpCode::OR;
+  return OpCode::HALT;
+}
+
+// l <op> r. On an error `out` still holds the value the operation stands
+// for (0 for a division by zero).
+static bool apply_binary(OpCode op, const Value &l, const Value &r,
+                         Value &out, std::string &err) {
+  bool ints =
+      l.type() == ValueType::INTEGER && r.type() == ValueType::INTEGER;
+
+  switch (op) {
+  case OpCode::ADD:
+    out = ints ? Value(l.i() + r.i()) : Value(l.number() + r.number());
+    return true;
+  case OpCode::SUB:
+    out = ints ? Value(l.i() - r.i()) : Value(l.number() - r.number());
+    return true;
+  case OpCode::MUL:
+    out = ints ? Value(l.i() * r.i()) : Value(l.number() * r.number());
+    return true;
+  case OpCode::DIV:
+    if (r.number() == 0.0) {
+      err = "Division by zero";
+      out = Value(0.0);
+      return false;
+    }
+    out = Value(l.number() / r.number());
+    return true;
+  case OpCode::MOD:
+    if (!ints) {
+      out = Value();
+      return true;
+    }
+    if (r.i() == 0) {
+      err = "Modulo by zero";
+      out = Value(0LL);
+      return false;
+    }
+    out = Value(l.i() % r.i());
+    return true;
+  case OpCode::POW:
+    out = Value(std::pow(l.number(), r.number()));
+    return true;
+  case OpCode::LT:
+    out = Value(l.number() < r.number());
+    return true;
+  case OpCode::GT:
+    out = Value(l.number() > r.number());
+    return true;
+  case OpCode::LTE:
+    out = Value(l.number() <= r.number());
+    return true;
+  case OpCode::GTE:
+    out = Value(l.number() >= r.number());
+    return true;
+  case OpCode::EQ:
+  case OpCode::NEQ: {
+    bool eq;
+    if (ints)
+      eq = l.i() == r.i();
+    else if (l.type() == ValueType::FLOAT || r.type() == ValueType::FLOAT)
+      eq = l.number() == r.number();
+    else {
+      out = Value();
+      return true;
+    }
+    out = Value(op == OpCode::EQ ? eq : !eq);
     return true;
   }
-  if (parent) {
-    return parent->exists(name);
+  case OpCode::AND:
+    out = Value(truthy(l) && truthy(r));
+    return true;
+  case OpCode::OR:
+    out = Value(truthy(l) || truthy(r));
+    return true;
+  default:
+    out = Value();
+    return true;
   }
-  return false;
 }
 
+static Value negate(const Value &v) {
+  if (v.type() == ValueType::INTEGER)
+    return Value(-v.i());
+  if (v.type() == ValueType::FLOAT)
+    return Value(-v.f());
+  return Value();
+}
+
+static void print_value(const Value &val) {
+  if (val.type() == ValueType::STRING) {
+    std::cout << val.s() << '\n';
+  } else if (val.type() == ValueType::INTEGER) {
+    std::cout << val.i() << '\n';
+  } else if (val.type() == ValueType::FLOAT) {
+    std::cout << val.f() << '\n';
+  } else if (val.type() == ValueType::BOOLEAN) {
+    std::cout << (val.b() ? "true" : "false") << '\n';
+  } else if (val.type() == ValueType::NIL) {
+    std::cout << "nil" << '\n';
+  } else if (val.type() == ValueType::LIST || val.type() == ValueType::MAP) {
+    jq::write_json(jq::from_jls_value(val), std::cout);
+    std::cout << '\n';
+  }
+}
+
+// FOR ends once the variable has passed `end` in the direction of `step`.
+static bool for_done(const Value &var, const Value &end, const Value &step) {
+  if (var.type() == ValueType::INTEGER && end.type() == ValueType::INTEGER &&
+      step.type() == ValueType::INTEGER)
+    return step.i() >= 0 ? var.i() > end.i() : var.i() < end.i();
+  return step.number() >= 0 ? var.number() > end.number()
+                            : var.number() < end.number();
+}
+
+static Value for_next(const Value &var, const Value &step) {
+  if (var.type() == ValueType::INTEGER && step.type() == ValueType::INTEGER)
+    return Value(var.i() + step.i());
+  return Value(var.number() + step.number());
+}
+
+static const char *const kForBoundsError =
+    "FOR requires numeric start, end and step values";
+
 // ================= Evaluator Implementation =================
 
 Evaluator::Evaluator() {
@@ -780,17 +1001,19 @@ Evaluator::Evaluator() {
   BSC::register_functions(global_env);
 }
 
-ValuePtr Evaluator::eval(const ASTNodePtr &node, EnvironmentPtr env) {
+Value Evaluator::eval(const ASTNodePtr &node, EnvironmentPtr env) {
   error_msg.clear(); // Clear previous error message
   if (!env) {
     env = global_env;
   }
-  return eval_node(node, env);
+  auto result = eval_node(node, env);
+  returning = false;
+  return result;
 }
 
-ValuePtr Evaluator::eval_node(const ASTNodePtr &node, EnvironmentPtr env) {
+Value Evaluator::eval_node(const ASTNodePtr &node, EnvironmentPtr env) {
   if (!node) {
-    return std::make_shared<Value>();
+    return Value();
   }
 
   switch (node->type) {
@@ -801,190 +1024,57 @@ ValuePtr Evaluator::eval_node(const ASTNodePtr &node, EnvironmentPtr env) {
     auto val = env->get(node->identifier_name);
     if (!val) {
       error_msg = "Undefined variable: " + node->identifier_name;
-      return std::make_shared<Value>();
+      return Value();
     }
-    return val;
+    return *val;
   }
   case NodeType::BINARY_OP: {
     if (node->children.size() < 2) {
       error_msg = "Binary operation requires two operands";
-      return std::make_shared<Value>();
+      return Value();
     }
 
     auto left = eval_node(node->children[0], env);
     auto right = eval_node(node->children[1], env);
 
-    // Arithmetic operations
-    if (node->op == "+") {
-      if (left->type == ValueType::INTEGER &&
-          right->type == ValueType::INTEGER) {
-        return std::make_shared<Value>(left->i + right->i);
-      } else {
-        double l = (left->type == ValueType::INTEGER) ? left->i : left->f;
-        double r = (right->type == ValueType::INTEGER) ? right->i : right->f;
-        return std::make_shared<Value>(l + r);
-      }
-    }
-    if (node->op == "-") {
-      if (left->type == ValueType::INTEGER &&
-          right->type == ValueType::INTEGER) {
-        return std::make_shared<Value>(left->i - right->i);
-      } else {
-        double l = (left->type == ValueType::INTEGER) ? left->i : left->f;
-        double r = (right->type == ValueType::INTEGER) ? right->i : right->f;
-        return std::make_shared<Value>(l - r);
-      }
-    }
-    if (node->op == "*") {
-      if (left->type == ValueType::INTEGER &&
-          right->type == ValueType::INTEGER) {
-        return std::make_shared<Value>(left->i * right->i);
-      } else {
-        double l = (left->type == ValueType::INTEGER) ? left->i : left->f;
-        double r = (right->type == ValueType::INTEGER) ? right->i : right->f;
-        return std::make_shared<Value>(l * r);
-      }
-    }
-    if (node->op == "/") {
-      double l = (left->type == ValueType::INTEGER) ? left->i : left->f;
-      double r = (right->type == ValueType::INTEGER) ? right->i : right->f;
-      if (r == 0.0) {
-        error_msg = "Division by zero";
-        return std::make_shared<Value>(0.0);
-      }
-      return std::make_shared<Value>(l / r);
-    }
-    if (node->op == "%") {
-      if (left->type == ValueType::INTEGER &&
-          right->type == ValueType::INTEGER) {
-        if (right->i == 0) {
-          error_msg = "Modulo by zero";
-          return std::make_shared<Value>(0LL);
-        }
-        return std::make_shared<Value>(left->i % right->i);
-      }
-    }
-    if (node->op == "^") {
-      double l = (left->type == ValueType::INTEGER) ? left->i : left->f;
-      double r = (right->type == ValueType::INTEGER) ? right->i : right->f;
-      return std::make_shared<Value>(std::pow(l, r));
-    }
-
-    // Comparison operations
-    if (node->op == "<") {
-      double l = (left->type == ValueType::INTEGER) ? left->i : left->f;
-      double r = (right->type == ValueType::INTEGER) ? right->i : right->f;
-      return std::make_shared<Value>(l < r);
-    }
-    if (node->op == ">") {
-      double l = (left->type == ValueType::INTEGER) ? left->i : left->f;
-      double r = (right->type == ValueType::INTEGER) ? right->i : right->f;
-      return std::make_shared<Value>(l > r);
-    }
-    if (node->op == "<=") {
-      double l = (left->type == ValueType::INTEGER) ? left->i : left->f;
-      double r = (right->type == ValueType::INTEGER) ? right->i : right->f;
-      return std::make_shared<Value>(l <= r);
-    }
-    if (node->op == ">=") {
-      double l = (left->type == ValueType::INTEGER) ? left->i : left->f;
-      double r = (right->type == ValueType::INTEGER) ? right->i : right->f;
-      return std::make_shared<Value>(l >= r);
-    }
-    if (node->op == "==" || node->op == "=") {
-      if (left->type == ValueType::INTEGER &&
-          right->type == ValueType::INTEGER) {
-        return std::make_shared<Value>(left->i == right->i);
-      } else if (left->type == ValueType::FLOAT ||
-                 right->type == ValueType::FLOAT) {
-        double l = (left->type == ValueType::INTEGER) ? left->i : left->f;
-        double r = (right->type == ValueType::INTEGER) ? right->i : right->f;
-        return std::make_shared<Value>(l == r);
-      }
-    }
-    if (node->op == "<>") {
-      if (left->type == ValueType::INTEGER &&
-          right->type == ValueType::INTEGER) {
-        return std::make_shared<Value>(left->i != right->i);
-      } else if (left->type == ValueType::FLOAT ||
-                 right->type == ValueType::FLOAT) {
-        double l = (left->type == ValueType::INTEGER) ? left->i : left->f;
-        double r = (right->type == ValueType::INTEGER) ? right->i : right->f;
-        return std::make_shared<Value>(l != r);
-      }
-    }
-
-    // Logical operations
-    if (node->op == "AND" || node->op == "and") {
-      bool l = (left->type == ValueType::BOOLEAN)
-                   ? left->b
-                   : (left->type != ValueType::NIL);
-      bool r = (right->type == ValueType::BOOLEAN)
-                   ? right->b
-                   : (right->type != ValueType::NIL);
-      return std::make_shared<Value>(l && r);
-    }
-    if (node->op == "OR" || node->op == "or") {
-      bool l = (left->type == ValueType::BOOLEAN)
-                   ? left->b
-                   : (left->type != ValueType::NIL);
-      bool r = (right->type == ValueType::BOOLEAN)
-                   ? right->b
-                   : (right->type != ValueType::NIL);
-      return std::make_shared<Value>(l || r);
+    Value out;
+    std::string err;
+    if (!apply_binary(binary_opcode(node->op), left, right, out, err)) {
+      error_msg = err;
     }
-
-    return std::make_shared<Value>();
+    return out;
   }
   case NodeType::UNARY_OP: {
     if (node->children.empty()) {
       error_msg = "Unary operation requires one operand";
-      return std::make_shared<Value>();
+      return Value();
     }
 
     auto operand = eval_node(node->children[0], env);
 
     if (node->op == "-") {
-      if (operand->type == ValueType::INTEGER) {
-        return std::make_shared<Value>(-operand->i);
-      } else if (operand->type == ValueType::FLOAT) {
-        return std::make_shared<Value>(-operand->f);
-      }
+      return negate(operand);
     }
-    if (node->op == "NOT" || node->op == "not") {
-      bool val = (operand->type == ValueType::BOOLEAN)
-                     ? operand->b
-                     : (operand->type != ValueType::NIL);
-      return std::make_shared<Value>(!val);
+    if (str_tolower(node->op) == "not") {
+      return Value(!truthy(operand));
     }
 
-    return std::make_shared<Value>();
+    return Value();
   }
   case NodeType::PRINT: {
     if (node->children.empty()) {
-      std::cout << std::endl;
-      return std::make_shared<Value>();
+      std::cout << '\n';
+      return Value();
     }
 
     auto val = eval_node(node->children[0], env);
-    if (val->type == ValueType::STRING) {
-      std::cout << val->s << std::endl;
-    } else if (val->type == ValueType::INTEGER) {
-      std::cout << val->i << std::endl;
-    } else if (val->type == ValueType::FLOAT) {
-      std::cout << val->f << std::endl;
-    } else if (val->type == ValueType::BOOLEAN) {
-      std::cout << (val->b ? "true" : "false") << std::endl;
-    } else if (val->type == ValueType::NIL) {
-      std::cout << "nil" << std::endl;
-    }
-
+    print_value(val);
     return val;
   }
   case NodeType::LET: {
     if (node->children.empty()) {
       error_msg = "LET requires a value";
-      return std::make_shared<Value>();
+      return Value();
     }
 
     auto val = eval_node(node->children[0], env);
@@ -994,7 +1084,7 @@ ValuePtr Evaluator::eval_node(const ASTNodePtr &node, EnvironmentPtr env) {
   case NodeType::ASSIGNMENT: {
     if (node->children.empty()) {
       error_msg = "Assignment requires a value";
-      return std::make_shared<Value>();
+      return Value();
     }
 
     auto val = eval_node(node->children[0], env);
@@ -1003,236 +1093,851 @@ ValuePtr Evaluator::eval_node(const ASTNodePtr &node, EnvironmentPtr env) {
   }
   case NodeType::IF_STMT: {
     auto cond = eval_node(node->condition, env);
-    bool condition = (cond->type == ValueType::BOOLEAN)
-                         ? cond->b
-                         : (cond->type != ValueType::NIL);
 
-    if (condition && node->then_branch) {
+    if (truthy(cond) && node->then_branch) {
       return eval_node(node->then_branch, env);
-    } else if (!condition && node->else_branch) {
+    } else if (!truthy(cond) && node->else_branch) {
       return eval_node(node->else_branch, env);
     }
 
-    return std::make_shared<Value>();
+    return Value();
+  }
+  case NodeType::BLOCK: {
+    Value result;
+    for (const auto &child : node->children) {
+      result = eval_node(child, env);
+      if (returning || !error_msg.empty())
+        break;
+    }
+    return result;
+  }
+  case NodeType::FOR_LOOP: {
+    if (node->children.size() < 2) {
+      error_msg = "FOR requires start and end values";
+      return Value();
+    }
+
+    auto start = eval_node(node->children[0], env);
+    auto end = eval_node(node->children[1], env);
+    auto step = node->children.size() > 2 ? eval_node(node->children[2], env)
+                                          : Value(1LL);
+    if (!error_msg.empty())
+      return Value();
+
+    // The body may add variables to `env`, so the slot is re-read each time
+    size_t var = env->slot(node->identifier_name);
+    env->at(var) = start;
+    while (true) {
+      const Value &current = env->at(var);
+      if (!current.is_number() || !end.is_number() || !step.is_number()) {
+        error_msg = kForBoundsError;
+        break;
+      }
+      if (for_done(current, end, step))
+        break;
+      eval_node(node->body, env);
+      if (returning || !error_msg.empty())
+        break;
+      env->at(var) = for_next(env->at(var), step);
+    }
+    return Value();
+  }
+  case NodeType::WHILE_LOOP: {
+    while (truthy(eval_node(node->condition, env)) && error_msg.empty()) {
+      eval_node(node->body, env);
+      if (returning || !error_msg.empty())
+        break;
+    }
+    return Value();
+  }
+  case NodeType::FUNCTION_DEF: {
+    // Functions see their parameters, then the scope they were defined in.
+    auto func = std::make_shared<Function>();
+    func->params = node->params;
+    func->body = node->body;
+    func->closure = env;
+    Value func_val(std::move(func));
+    env->set(node->identifier_name, func_val);
+    return func_val;
+  }
+  case NodeType::RETURN_STMT: {
+    auto val = node->children.empty() ? Value()
+                                      : eval_node(node->children[0], env);
+    returning = true;
+    return val;
   }
   case NodeType::FUNCTION_CALL: {
     // Get function
-    auto func_val = env->get(node->identifier_name);
+    const Value *found = env->get(node->identifier_name);
 
     // Support namespaced calls like math/sin()
-    if (!func_val) {
+    if (!found) {
       auto sep = node->identifier_name.find('/');
       if (sep != std::string::npos) {
         std::string lib_name = str_tolower(node->identifier_name.substr(0, sep));
         std::string inner_name =
             str_tolower(node->identifier_name.substr(sep + 1));
         auto lib_val = env->get(lib_name);
-        if (lib_val && lib_val->type == ValueType::MAP) {
-          auto it = lib_val->map.find(inner_name);
-          if (it != lib_val->map.end()) {
-            func_val = it->second;
+        if (lib_val && lib_val->type() == ValueType::MAP) {
+          auto it = lib_val->map().find(inner_name);
+          if (it != lib_val->map().end()) {
+            found = &it->second;
           }
         }
       }
     }
 
-    if (!func_val) {
+    if (!found) {
       error_msg = "Undefined function: " + node->identifier_name;
-      return std::make_shared<Value>();
+      return Value();
     }
+    // Arguments may add variables, which would invalidate `found`
+    Value func_val = *found;
 
     // Evaluate arguments
-    std::vector<ValuePtr> args;
+    std::vector<Value> args;
     for (const auto &arg_node : node->children) {
       args.push_back(eval_node(arg_node, env));
     }
 
-    // Call native function
-    if (func_val->native_func) {
-      return func_val->native_func(args);
-    }
+    return call_function(func_val, args, env);
+  }
+  default:
+    return Value();
+  }
+}
+
+Value Evaluator::call(const Value &func, const std::vector<Value> &args) {
+  error_msg.clear();
+  auto result = call_function(func, args, global_env);
+  returning = false;
+  return result;
+}
 
+Value Evaluator::call_function(const Value &func,
+                               const std::vector<Value> &args,
+                               EnvironmentPtr env) {
+  if (func.type() != ValueType::FUNCTION) {
     error_msg = "Not a callable function";
-    return std::make_shared<Value>();
+    return Value();
+  }
+
+  if (func.native_func()) {
+    return func.native_func()(args);
   }
+
+  if (func.func() && func.func()->chunk) {
+    VM vm(this);
+    if (!vm.call(func, args)) {
+      error_msg = vm.error_message();
+      return Value();
+    }
+    return vm.get_result();
+  }
+
+  if (func.func() && func.func()->body) {
+    if (depth >= static_cast<int>(kMaxCallDepth)) {
+      error_msg = "Call stack overflow";
+      return Value();
+    }
+    auto scope = func.func()->closure.lock();
+    auto local = std::make_shared<Environment>(scope ? scope : global_env);
+    const auto &params = func.func()->params;
+    for (size_t i = 0; i < params.size(); ++i) {
+      local->set(params[i], i < args.size() ? args[i] : Value());
+    }
+    ++depth;
+    auto result = eval_node(func.func()->body, local);
+    --depth;
+    returning = false;
+    return result;
+  }
+
+  error_msg = "Not a callable function";
+  return Value();
+}
+
+// ================= Compiler Implementation =================
+
+Compiler::Compiler(EnvironmentPtr globals) : globals(std::move(globals)) {}
+
+ChunkPtr Compiler::compile(const ASTNodePtr &ast) {
+  error_msg.clear();
+  auto out = std::make_shared<Chunk>();
+  out->globals = globals.get();
+  chunk = out.get();
+  variables.clear();
+  in_function = false;
+
+  compile_node(ast);
+  emit(OpCode::HALT);
+
+  chunk = nullptr;
+  if (!error_msg.empty())
+    return nullptr;
+  return out;
+}
+
+void Compiler::emit(OpCode op, int a, int b) {
+  chunk->code.emplace_back(op, a, b);
+}
+
+int Compiler::add_constant(Value val) {
+  chunk->constants.push_back(std::move(val));
+  return static_cast<int>(chunk->constants.size() - 1);
+}
+
+void Compiler::emit_constant(Value val) {
+  emit(OpCode::PUSH_CONST, add_constant(std::move(val)));
+}
+
+int Compiler::global_slot(const std::string &name) {
+  return static_cast<int>(globals->slot(name));
+}
+
+void Compiler::emit_load(const std::string &name, bool function) {
+  auto it = variables.find(name);
+  if (it != variables.end())
+    emit(OpCode::LOAD_LOCAL, it->second, function);
+  else
+    emit(OpCode::LOAD_VAR, global_slot(name), function);
+}
+
+// Inside a function a name becomes local at its first assignment; reads
+// compiled before that refer to the global of the same name.
+void Compiler::emit_store(const std::string &name) {
+  if (!in_function) {
+    emit(OpCode::STORE_VAR, global_slot(name));
+    return;
+  }
+  emit(OpCode::STORE_LOCAL, variable_operand(name));
+}
+
+int Compiler::variable_operand(const std::string &name) {
+  if (!in_function)
+    return -(global_slot(name) + 1);
+
+  auto it = variables.find(name);
+  if (it != variables.end())
+    return it->second;
+  int slot = static_cast<int>(chunk->local_names.size());
+  chunk->local_names.push_back(name);
+  variables.emplace(name, slot);
+  return slot;
+}
+
+// Names a function body makes local: its assignments, loop variables and
+// nested function definitions, not looking inside those definitions.
+static void collect_locals(const ASTNodePtr &node, std::set<std::string> &out) {
+  if (!node)
+    return;
+  switch (node->type) {
+  case NodeType::LET:
+  case NodeType::ASSIGNMENT:
+  case NodeType::FOR_LOOP:
+    out.insert(node->identifier_name);
+    break;
+  case NodeType::FUNCTION_DEF:
+    out.insert(node->identifier_name);
+    return;
   default:
-    return std::make_shared<Value>();
+    break;
   }
+  for (const auto &child : node->children)
+    collect_locals(child, out);
+  collect_locals(node->condition, out);
+  collect_locals(node->then_branch, out);
+  collect_locals(node->else_branch, out);
+  collect_locals(node->body, out);
+}
+
+// First name in `names` that the tree mentions, or nullptr.
+static const std::string *find_name(const ASTNodePtr &node,
+                                    const std::set<std::string> &names) {
+  if (!node)
+    return nullptr;
+  if (!node->identifier_name.empty() && names.count(node->identifier_name))
+    return &node->identifier_name;
+  for (const auto &child : node->children)
+    if (auto found = find_name(child, names))
+      return found;
+  for (const auto *sub : {&node->condition, &node->then_branch,
+                          &node->else_branch, &node->body})
+    if (auto found = find_name(*sub, names))
+      return found;
+  return nullptr;
+}
+
+// A local of the enclosing function that a function nested in `node` uses,
+// or nullptr. Compiled functions only see their own locals and the globals,
+// so such a script is left to the Evaluator, whose functions close over the
+// scope they were defined in.
+static const std::string *captured_local(const ASTNodePtr &node,
+                                         const std::set<std::string> &locals) {
+  if (!node)
+    return nullptr;
+  if (node->type == NodeType::FUNCTION_DEF) {
+    auto visible = locals;
+    for (const auto &param : node->params)
+      visible.erase(param);
+    return find_name(node->body, visible);
+  }
+  for (const auto &child : node->children)
+    if (auto found = captured_local(child, locals))
+      return found;
+  for (const auto *sub : {&node->condition, &node->then_branch,
+                          &node->else_branch, &node->body})
+    if (auto found = captured_local(*sub, locals))
+      return found;
+  return nullptr;
 }
 
-ValuePtr Evaluator::call_function(const ValuePtr &func,
-                                  const std::vector<ValuePtr> &args,
-                                  EnvironmentPtr env) {
-  if (func->native_func) {
-    return func->native_func(args);
+void Compiler::compile_function(const ASTNodePtr &node) {
+  std::set<std::string> locals(node->params.begin(), node->params.end());
+  collect_locals(node->body, locals);
+  if (auto name = captured_local(node->body, locals)) {
+    error_msg = "Nested function uses enclosing local: " + *name;
+    return;
   }
 
-  error_msg = "Invalid function";
-  return std::make_shared<Value>();
+  auto body = std::make_shared<Chunk>();
+  body->name = node->identifier_name;
+  body->globals = globals.get();
+  body->arity = static_cast<int>(node->params.size());
+  body->local_names = node->params;
+
+  Chunk *outer = chunk;
+  auto outer_variables = std::move(variables);
+  bool outer_in_function = in_function;
+
+  chunk = body.get();
+  variables.clear();
+  in_function = true;
+  for (size_t i = 0; i < node->params.size(); ++i)
+    variables[node->params[i]] = static_cast<int>(i);
+
+  // A body returns the value of its last statement unless it RETURNs.
+  compile_node(node->body);
+  emit(OpCode::RETURN);
+
+  chunk = outer;
+  variables = std::move(outer_variables);
+  in_function = outer_in_function;
+
+  auto func = std::make_shared<Function>();
+  func->params = node->params;
+  func->chunk = std::move(body);
+  emit_constant(Value(std::move(func)));
+  emit_store(node->identifier_name);
+}
+
+void Compiler::compile_node(const ASTNodePtr &node) {
+  if (!error_msg.empty())
+    return;
+  if (!node) {
+    emit(OpCode::PUSH_NIL);
+    return;
+  }
+
+  switch (node->type) {
+  case NodeType::LITERAL: {
+    const auto &val = node->literal_value;
+    if (val.type() == ValueType::NIL)
+      emit(OpCode::PUSH_NIL);
+    else if (val.type() == ValueType::BOOLEAN)
+      emit(val.b() ? OpCode::PUSH_TRUE : OpCode::PUSH_FALSE);
+    else
+      emit_constant(val);
+    break;
+  }
+  case NodeType::IDENTIFIER:
+    emit_load(node->identifier_name, false);
+    break;
+  case NodeType::BINARY_OP: {
+    OpCode op = binary_opcode(node->op);
+    if (node->children.size() < 2 || op == OpCode::HALT) {
+      error_msg = "Unsupported binary operation: " + node->op;
+      return;
+    }
+    compile_node(node->children[0]);
+    compile_node(node->children[1]);
+    emit(op);
+    break;
+  }
+  case NodeType::UNARY_OP: {
+    bool neg = node->op == "-";
+    if (node->children.empty() || (!neg && str_tolower(node->op) != "not")) {
+      error_msg = "Unsupported unary operation: " + node->op;
+      return;
+    }
+    compile_node(node->children[0]);
+    emit(neg ? OpCode::NEG : OpCode::NOT);
+    break;
+  }
+  case NodeType::PRINT:
+    if (node->children.empty()) {
+      emit(OpCode::PUSH_NIL);
+      emit(OpCode::PRINT, 1);
+    } else {
+      compile_node(node->children[0]);
+      emit(OpCode::PRINT);
+    }
+    break;
+  case NodeType::LET:
+  case NodeType::ASSIGNMENT:
+    if (node->children.empty()) {
+      error_msg = "Assignment requires a value";
+      return;
+    }
+    compile_node(node->children[0]);
+    emit_store(node->identifier_name);
+    break;
+  case NodeType::IF_STMT: {
+    compile_node(node->condition);
+    size_t to_else = here();
+    emit(OpCode::JMP_FALSE);
+    compile_node(node->then_branch);
+    size_t to_end = here();
+    emit(OpCode::JMP);
+    patch(to_else);
+    compile_node(node->else_branch);
+    patch(to_end);
+    break;
+  }
+  case NodeType::BLOCK:
+    if (node->children.empty())
+      emit(OpCode::PUSH_NIL);
+    for (size_t i = 0; i < node->children.size(); ++i) {
+      if (i > 0)
+        emit(OpCode::POP, 1);
+      compile_node(node->children[i]);
+    }
+    break;
+  case NodeType::FOR_LOOP: {
+    if (node->children.size() < 2) {
+      error_msg = "FOR requires start and end values";
+      return;
+    }
+    compile_node(node->children[0]);
+    emit_store(node->identifier_name);
+    emit(OpCode::POP, 1);
+    compile_node(node->children[1]);
+    if (node->children.size() > 2)
+      compile_node(node->children[2]);
+    else
+      emit_constant(Value(1LL));
+
+    int var = variable_operand(node->identifier_name);
+    size_t test = here();
+    emit(OpCode::FOR_TEST, 0, var);
+    compile_node(node->body);
+    emit(OpCode::POP, 1);
+    emit(OpCode::FOR_STEP, static_cast<int>(test), var);
+    patch(test);
+    emit(OpCode::POP, 2);
+    emit(OpCode::PUSH_NIL);
+    break;
+  }
+  case NodeType::WHILE_LOOP: {
+    size_t top = here();
+    compile_node(node->condition);
+    size_t to_end = here();
+    emit(OpCode::JMP_FALSE);
+    compile_node(node->body);
+    emit(OpCode::POP, 1);
+    emit(OpCode::JMP, static_cast<int>(top));
+    patch(to_end);
+    emit(OpCode::PUSH_NIL);
+    break;
+  }
+  case NodeType::FUNCTION_DEF:
+    compile_function(node);
+    break;
+  case NodeType::FUNCTION_CALL: {
+    const std::string &name = node->identifier_name;
+    auto sep = name.find('/');
+    if (sep != std::string::npos) {
+      int lib = global_slot(str_tolower(name.substr(0, sep)));
+      Value member(str_tolower(name.substr(sep + 1)));
+      emit(OpCode::LOAD_LIB, lib, add_constant(std::move(member)));
+    } else {
+      emit_load(name, true);
+    }
+    for (const auto &arg : node->children)
+      compile_node(arg);
+    emit(OpCode::CALL, static_cast<int>(node->children.size()));
+    break;
+  }
+  case NodeType::RETURN_STMT:
+    if (node->children.empty())
+      emit(OpCode::PUSH_NIL);
+    else
+      compile_node(node->children[0]);
+    emit(OpCode::RETURN);
+    break;
+  default:
+    error_msg = "Unsupported statement";
+    break;
+  }
+}
+
+// ================= VM Implementation =================
+
+VM::VM(Evaluator *interpreter) : interpreter(interpreter) {}
+
+bool VM::fail(const std::string &msg) {
+  error_msg = msg;
+  stack.clear();
+  frames.clear();
+  return false;
+}
+
+bool VM::execute(const ChunkPtr &chunk) {
+  error_msg.clear();
+  result = Value();
+  stack.clear();
+  frames.clear();
+  if (!chunk)
+    return fail("Nothing to execute");
+
+  frames.push_back({chunk.get(), 0, 0});
+  stack.resize(chunk->local_names.size(), Value::unset());
+  return run();
+}
+
+bool VM::call(const Value &func, const std::vector<Value> &call_args) {
+  error_msg.clear();
+  result = Value();
+  stack.clear();
+  frames.clear();
+  if (func.type() != ValueType::FUNCTION || !func.func() ||
+      !func.func()->chunk)
+    return fail("Not a callable function");
+
+  push(func);
+  for (const auto &arg : call_args)
+    push(arg);
+  return enter(*func.func()->chunk, static_cast<int>(call_args.size())) &&
+         run();
+}
+
+bool VM::enter(const Chunk &callee, int argc) {
+  if (frames.size() >= kMaxCallDepth)
+    return fail("Call stack overflow");
+
+  // Missing arguments are nil, extra ones are dropped; other locals start
+  // unset so reading them before assignment is an error.
+  size_t base = stack.size() - argc;
+  stack.resize(base + std::min(argc, callee.arity));
+  stack.resize(base + callee.arity);
+  stack.resize(base + callee.local_names.size(), Value::unset());
+  frames.push_back({&callee, 0, base});
+  return true;
+}
+
+bool VM::run() {
+  const Chunk *chunk = nullptr;
+  const Instruction *code = nullptr;
+  Environment *globals = nullptr;
+  size_t ip = 0;
+  size_t base = 0;
+  auto load_frame = [&] {
+    const Frame &frame = frames.back();
+    chunk = frame.chunk;
+    code = chunk->code.data();
+    globals = chunk->globals;
+    ip = frame.ip;
+    base = frame.base;
+  };
+  auto variable = [&](int operand) -> Value & {
+    return operand >= 0 ? stack[base + operand]
+                        : globals->at(-(operand + 1));
+  };
+  load_frame();
+
+  std::string err;
+  while (true) {
+    const Instruction &ins = code[ip++];
+    switch (ins.op) {
+    case OpCode::PUSH_NIL:
+      push(Value());
+      break;
+    case OpCode::PUSH_TRUE:
+      push(Value(true));
+      break;
+    case OpCode::PUSH_FALSE:
+      push(Value(false));
+      break;
+    case OpCode::PUSH_CONST:
+      push(chunk->constants[ins.a]);
+      break;
+    case OpCode::POP:
+      stack.resize(stack.size() - ins.a);
+      break;
+    case OpCode::LOAD_VAR:
+    case OpCode::LOAD_LOCAL: {
+      bool local = ins.op == OpCode::LOAD_LOCAL;
+      const Value &val = local ? stack[base + ins.a] : globals->at(ins.a);
+      if (val.is_unset()) {
+        const std::string &name =
+            local ? chunk->local_names[ins.a] : globals->name(ins.a);
+        return fail((ins.b ? "Undefined function: " : "Undefined variable: ") +
+                    name);
+      }
+      push(val);
+      break;
+    }
+    case OpCode::STORE_VAR:
+      globals->at(ins.a) = stack.back();
+      break;
+    case OpCode::STORE_LOCAL:
+      stack[base + ins.a] = stack.back();
+      break;
+    case OpCode::LOAD_LIB: {
+      const Value &lib = globals->at(ins.a);
+      const std::string &member = chunk->constants[ins.b].s();
+      if (lib.type() == ValueType::MAP) {
+        auto it = lib.map().find(member);
+        if (it != lib.map().end()) {
+          push(it->second);
+          break;
+        }
+      }
+      return fail("Undefined function: " + globals->name(ins.a) + "/" +
+                  member);
+    }
+    case OpCode::CALL: {
+      size_t at = stack.size() - ins.a - 1;
+      const Value &callee = stack[at];
+      if (callee.type() != ValueType::FUNCTION)
+        return fail("Not a callable function");
+      if (callee.native_func()) {
+        Value func = std::move(stack[at]);
+        args.assign(std::make_move_iterator(stack.begin() + at + 1),
+                    std::make_move_iterator(stack.end()));
+        stack.resize(at);
+        Value ret = func.native_func()(args);
+        args.clear();
+        push(std::move(ret));
+        break;
+      }
+      if (callee.func() && callee.func()->chunk) {
+        frames.back().ip = ip;
+        if (!enter(*callee.func()->chunk, ins.a))
+          return false;
+        load_frame();
+        break;
+      }
+      if (!interpreter)
+        return fail("Cannot call interpreted function from compiled code");
+      Value func = std::move(stack[at]);
+      args.assign(std::make_move_iterator(stack.begin() + at + 1),
+                  std::make_move_iterator(stack.end()));
+      stack.resize(at);
+      Value ret = interpreter->call(func, args);
+      args.clear();
+      if (!interpreter->error_message().empty())
+        return fail(interpreter->error_message());
+      push(std::move(ret));
+      break;
+    }
+    case OpCode::RETURN: {
+      Value ret = pop();
+      size_t frame_base = base;
+      frames.pop_back();
+      if (frames.empty()) {
+        result = std::move(ret);
+        stack.clear();
+        return true;
+      }
+      stack.resize(frame_base - 1); // drop locals and the callee
+      push(std::move(ret));
+      load_frame();
+      break;
+    }
+    case OpCode::ADD:
+    case OpCode::SUB:
+    case OpCode::MUL:
+    case OpCode::DIV:
+    case OpCode::MOD:
+    case OpCode::POW:
+    case OpCode::EQ:
+    case OpCode::NEQ:
+    case OpCode::LT:
+    case OpCode::LTE:
+    case OpCode::GT:
+    case OpCode::GTE:
+    case OpCode::AND:
+    case OpCode::OR: {
+      Value &lhs = stack[stack.size() - 2];
+      Value out;
+      if (!apply_binary(ins.op, lhs, stack.back(), out, err))
+        return fail(err);
+      stack.pop_back();
+      stack.back() = std::move(out);
+      break;
+    }
+    case OpCode::NEG:
+      stack.back() = negate(stack.back());
+      break;
+    case OpCode::NOT:
+      stack.back() = Value(!truthy(stack.back()));
+      break;
+    case OpCode::JMP:
+      ip = ins.a;
+      break;
+    case OpCode::JMP_FALSE:
+    case OpCode::JMP_TRUE: {
+      bool cond = truthy(stack.back());
+      stack.pop_back();
+      if (cond == (ins.op == OpCode::JMP_TRUE))
+        ip = ins.a;
+      break;
+    }
+    case OpCode::FOR_TEST: {
+      const Value &var = variable(ins.b);
+      const Value &end = stack[stack.size() - 2];
+      const Value &step = stack.back();
+      if (!var.is_number() || !end.is_number() || !step.is_number())
+        return fail(kForBoundsError);
+      if (for_done(var, end, step))
+        ip = ins.a;
+      break;
+    }
+    case OpCode::FOR_STEP: {
+      Value &var = variable(ins.b);
+      var = for_next(var, stack.back());
+      ip = ins.a;
+      break;
+    }
+    case OpCode::PRINT:
+      if (ins.a == 1)
+        std::cout << '\n';
+      else
+        print_value(stack.back());
+      break;
+    case OpCode::HALT:
+      result = stack.empty() ? Value() : stack.back();
+      stack.clear();
+      frames.clear();
+      return true;
+    default:
+      return fail("Invalid opcode");
+    }
+  }
 }
 
 // ================= BSC Implementation =================
 
 void BSC::register_functions(EnvironmentPtr env) {
   // Math functions
-  auto abs_val = std::make_shared<Value>();
-  abs_val->type = ValueType::FUNCTION;
-  abs_val->native_func = fn_abs;
-  env->set("ABS", abs_val);
-
-  auto sqrt_val = std::make_shared<Value>();
-  sqrt_val->type = ValueType::FUNCTION;
-  sqrt_val->native_func = fn_sqrt;
-  env->set("SQRT", sqrt_val);
-
-  auto pow_val = std::make_shared<Value>();
-  pow_val->type = ValueType::FUNCTION;
-  pow_val->native_func = fn_pow;
-  env->set("POW", pow_val);
-
-  auto floor_val = std::make_shared<Value>();
-  floor_val->type = ValueType::FUNCTION;
-  floor_val->native_func = fn_floor;
-  env->set("FLOOR", floor_val);
-
-  auto ceil_val = std::make_shared<Value>();
-  ceil_val->type = ValueType::FUNCTION;
-  ceil_val->native_func = fn_ceil;
-  env->set("CEIL", ceil_val);
-
-  auto min_val = std::make_shared<Value>();
-  min_val->type = ValueType::FUNCTION;
-  min_val->native_func = fn_min;
-  env->set("MIN", min_val);
-
-  auto max_val = std::make_shared<Value>();
-  max_val->type = ValueType::FUNCTION;
-  max_val->native_func = fn_max;
-  env->set("MAX", max_val);
-
-  auto random_val = std::make_shared<Value>();
-  random_val->type = ValueType::FUNCTION;
-  random_val->native_func = fn_random;
+  env->set("ABS", Value(NativeFunctionPtr(fn_abs)));
+  env->set("SQRT", Value(NativeFunctionPtr(fn_sqrt)));
+  env->set("POW", Value(NativeFunctionPtr(fn_pow)));
+  env->set("FLOOR", Value(NativeFunctionPtr(fn_floor)));
+  env->set("CEIL", Value(NativeFunctionPtr(fn_ceil)));
+  env->set("MIN", Value(NativeFunctionPtr(fn_min)));
+  env->set("MAX", Value(NativeFunctionPtr(fn_max)));
+  Value random_val{NativeFunctionPtr(fn_random)};
   env->set("RANDOM", random_val);
   env->set("RND", random_val); // Alias
 
   // String functions
-  auto len_val = std::make_shared<Value>();
-  len_val->type = ValueType::FUNCTION;
-  len_val->native_func = fn_length;
-  env->set("LEN", len_val);
-
-  auto str_val = std::make_shared<Value>();
-  str_val->type = ValueType::FUNCTION;
-  str_val->native_func = fn_string;
-  env->set("STR", str_val);
+  env->set("LEN", Value(NativeFunctionPtr(fn_length)));
+  env->set("STR", Value(NativeFunctionPtr(fn_string)));
 
   // I/O functions
-  auto input_val = std::make_shared<Value>();
-  input_val->type = ValueType::FUNCTION;
-  input_val->native_func = fn_input;
-  env->set("INPUT", input_val);
-
-  auto type_val = std::make_shared<Value>();
-  type_val->type = ValueType::FUNCTION;
-  type_val->native_func = fn_type;
-  env->set("TYPE", type_val);
+  env->set("INPUT", Value(NativeFunctionPtr(fn_input)));
+  env->set("TYPE", Value(NativeFunctionPtr(fn_type)));
 
   // Conversion functions
-  auto int_val = std::make_shared<Value>();
-  int_val->type = ValueType::FUNCTION;
-  int_val->native_func = fn_int;
-  env->set("INT", int_val);
-
-  auto float_val = std::make_shared<Value>();
-  float_val->type = ValueType::FUNCTION;
-  float_val->native_func = fn_float;
-  env->set("FLOAT", float_val);
+  env->set("INT", Value(NativeFunctionPtr(fn_int)));
+  env->set("FLOAT", Value(NativeFunctionPtr(fn_float)));
 }
 
-ValuePtr BSC::fn_abs(const std::vector<ValuePtr> &args) {
+Value BSC::fn_abs(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0LL);
+    return Value(0LL);
 
-  if (args[0]->type == ValueType::INTEGER) {
-    return std::make_shared<Value>(std::abs(args[0]->i));
-  } else if (args[0]->type == ValueType::FLOAT) {
-    return std::make_shared<Value>(std::abs(args[0]->f));
+  if (args[0].type() == ValueType::INTEGER) {
+    return Value(std::abs(args[0].i()));
+  } else if (args[0].type() == ValueType::FLOAT) {
+    return Value(std::abs(args[0].f()));
   }
 
-  return std::make_shared<Value>(0LL);
+  return Value(0LL);
 }
 
-ValuePtr BSC::fn_sqrt(const std::vector<ValuePtr> &args) {
+Value BSC::fn_sqrt(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0.0);
+    return Value(0.0);
 
   double val = 0.0;
-  if (args[0]->type == ValueType::INTEGER)
-    val = args[0]->i;
-  else if (args[0]->type == ValueType::FLOAT)
-    val = args[0]->f;
+  if (args[0].type() == ValueType::INTEGER)
+    val = args[0].i();
+  else if (args[0].type() == ValueType::FLOAT)
+    val = args[0].f();
 
-  return std::make_shared<Value>(std::sqrt(val));
+  return Value(std::sqrt(val));
 }
 
-ValuePtr BSC::fn_pow(const std::vector<ValuePtr> &args) {
+Value BSC::fn_pow(const std::vector<Value> &args) {
   if (args.size() < 2)
-    return std::make_shared<Value>(1.0);
+    return Value(1.0);
 
   double base = 0.0, exp = 0.0;
-  if (args[0]->type == ValueType::INTEGER)
-    base = args[0]->i;
-  else if (args[0]->type == ValueType::FLOAT)
-    base = args[0]->f;
+  if (args[0].type() == ValueType::INTEGER)
+    base = args[0].i();
+  else if (args[0].type() == ValueType::FLOAT)
+    base = args[0].f();
 
-  if (args[1]->type == ValueType::INTEGER)
-    exp = args[1]->i;
-  else if (args[1]->type == ValueType::FLOAT)
-    exp = args[1]->f;
+  if (args[1].type() == ValueType::INTEGER)
+    exp = args[1].i();
+  else if (args[1].type() == ValueType::FLOAT)
+    exp = args[1].f();
 
-  return std::make_shared<Value>(std::pow(base, exp));
+  return Value(std::pow(base, exp));
 }
 
-ValuePtr BSC::fn_floor(const std::vector<ValuePtr> &args) {
+Value BSC::fn_floor(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0.0);
+    return Value(0.0);
 
   double val = 0.0;
-  if (args[0]->type == ValueType::INTEGER)
+  if (args[0].type() == ValueType::INTEGER)
     return args[0];
-  else if (args[0]->type == ValueType::FLOAT)
-    val = args[0]->f;
+  else if (args[0].type() == ValueType::FLOAT)
+    val = args[0].f();
 
-  return std::make_shared<Value>(std::floor(val));
+  return Value(std::floor(val));
 }
 
-ValuePtr BSC::fn_ceil(const std::vector<ValuePtr> &args) {
+Value BSC::fn_ceil(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0.0);
+    return Value(0.0);
 
   double val = 0.0;
-  if (args[0]->type == ValueType::INTEGER)
+  if (args[0].type() == ValueType::INTEGER)
     return args[0];
-  else if (args[0]->type == ValueType::FLOAT)
-    val = args[0]->f;
+  else if (args[0].type() == ValueType::FLOAT)
+    val = args[0].f();
 
-  return std::make_shared<Value>(std::ceil(val));
+  return Value(std::ceil(val));
 }
 
-ValuePtr BSC::fn_min(const std::vector<ValuePtr> &args) {
+Value BSC::fn_min(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0LL);
+    return Value(0LL);
 
   double min_val = 0.0;
   bool first = true;
 
   for (const auto &arg : args) {
     double val = 0.0;
-    if (arg->type == ValueType::INTEGER)
-      val = arg->i;
-    else if (arg->type == ValueType::FLOAT)
-      val = arg->f;
+    if (arg.type() == ValueType::INTEGER)
+      val = arg.i();
+    else if (arg.type() == ValueType::FLOAT)
+      val = arg.f();
 
     if (first || val < min_val) {
       min_val = val;
@@ -1240,22 +1945,22 @@ ValuePtr BSC::fn_min(const std::vector<ValuePtr> &args) {
     }
   }
 
-  return std::make_shared<Value>(min_val);
+  return Value(min_val);
 }
 
-ValuePtr BSC::fn_max(const std::vector<ValuePtr> &args) {
+Value BSC::fn_max(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0LL);
+    return Value(0LL);
 
   double max_val = 0.0;
   bool first = true;
 
   for (const auto &arg : args) {
     double val = 0.0;
-    if (arg->type == ValueType::INTEGER)
-      val = arg->i;
-    else if (arg->type == ValueType::FLOAT)
-      val = arg->f;
+    if (arg.type() == ValueType::INTEGER)
+      val = arg.i();
+    else if (arg.type() == ValueType::FLOAT)
+      val = arg.f();
 
     if (first || val > max_val) {
       max_val = val;
@@ -1263,72 +1968,72 @@ ValuePtr BSC::fn_max(const std::vector<ValuePtr> &args) {
     }
   }
 
-  return std::make_shared<Value>(max_val);
+  return Value(max_val);
 }
 
-ValuePtr BSC::fn_string(const std::vector<ValuePtr> &args) {
+Value BSC::fn_string(const std::vector<Value> &args) {
   std::string result;
   for (const auto &arg : args) {
-    if (arg->type == ValueType::STRING) {
-      result += arg->s;
-    } else if (arg->type == ValueType::INTEGER) {
-      result += std::to_string(arg->i);
-    } else if (arg->type == ValueType::FLOAT) {
-      result += std::to_string(arg->f);
+    if (arg.type() == ValueType::STRING) {
+      result += arg.s();
+    } else if (arg.type() == ValueType::INTEGER) {
+      result += std::to_string(arg.i());
+    } else if (arg.type() == ValueType::FLOAT) {
+      result += std::to_string(arg.f());
     }
   }
-  return std::make_shared<Value>(result);
+  return Value(result);
 }
 
-ValuePtr BSC::fn_length(const std::vector<ValuePtr> &args) {
+Value BSC::fn_length(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0LL);
+    return Value(0LL);
 
-  if (args[0]->type == ValueType::STRING) {
-    return std::make_shared<Value>(static_cast<long long>(args[0]->s.size()));
-  } else if (args[0]->type == ValueType::LIST) {
-    return std::make_shared<Value>(
-        static_cast<long long>(args[0]->list.size()));
+  if (args[0].type() == ValueType::STRING) {
+    return Value(static_cast<long long>(args[0].s().size()));
+  } else if (args[0].type() == ValueType::LIST) {
+    return Value(
+        static_cast<long long>(args[0].list().size()));
   }
 
-  return std::make_shared<Value>(0LL);
+  return Value(0LL);
 }
 
-ValuePtr BSC::fn_input(const std::vector<ValuePtr> &args) {
+Value BSC::fn_input(const std::vector<Value> &args) {
   // Optional prompt
-  if (!args.empty() && args[0]->type == ValueType::STRING) {
-    std::cout << args[0]->s;
+  if (!args.empty() && args[0].type() == ValueType::STRING) {
+    std::cout << args[0].s();
   }
 
   std::string result;
   std::getline(std::cin, result);
-  return std::make_shared<Value>(result);
+  return Value(result);
 }
 
-ValuePtr BSC::fn_random(const std::vector<ValuePtr> &args) {
+Value BSC::fn_random(const std::vector<Value> &args) {
   static std::random_device rd;
   static std::mt19937 gen(rd());
 
   if (args.empty()) {
     std::uniform_real_distribution<> dis(0.0, 1.0);
-    return std::make_shared<Value>(dis(gen));
+    return Value(dis(gen));
   }
 
   long long max_val = 100;
-  if (args[0]->type == ValueType::INTEGER) {
-    max_val = args[0]->i;
+  if (args[0].type() == ValueType::INTEGER) {
+    max_val = args[0].i();
   }
 
   std::uniform_int_distribution<> dis(0, max_val - 1);
-  return std::make_shared<Value>(static_cast<long long>(dis(gen)));
+  return Value(static_cast<long long>(dis(gen)));
 }
 
-ValuePtr BSC::fn_type(const std::vector<ValuePtr> &args) {
+Value BSC::fn_type(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>("");
+    return Value("");
 
   const char *type_name = "";
-  switch (args[0]->type) {
+  switch (args[0].type()) {
   case ValueType::NIL:
     type_name = "nil";
     break;
@@ -1358,95 +2063,95 @@ ValuePtr BSC::fn_type(const std::vector<ValuePtr> &args) {
     break;
   }
 
-  return std::make_shared<Value>(type_name);
+  return Value(type_name);
 }
 
 // Placeholder implementations for other BSC functions
-ValuePtr BSC::fn_add(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>(0LL);
+Value BSC::fn_add(const std::vector<Value> &args) {
+  return Value(0LL);
 }
-ValuePtr BSC::fn_sub(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>(0LL);
+Value BSC::fn_sub(const std::vector<Value> &args) {
+  return Value(0LL);
 }
-ValuePtr BSC::fn_mul(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>(0LL);
+Value BSC::fn_mul(const std::vector<Value> &args) {
+  return Value(0LL);
 }
-ValuePtr BSC::fn_div(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>(0.0);
+Value BSC::fn_div(const std::vector<Value> &args) {
+  return Value(0.0);
 }
-ValuePtr BSC::fn_mod(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>(0LL);
+Value BSC::fn_mod(const std::vector<Value> &args) {
+  return Value(0LL);
 }
-ValuePtr BSC::fn_concat(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>("");
+Value BSC::fn_concat(const std::vector<Value> &args) {
+  return Value("");
 }
-ValuePtr BSC::fn_substring(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>("");
+Value BSC::fn_substring(const std::vector<Value> &args) {
+  return Value("");
 }
-ValuePtr BSC::fn_list(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>();
+Value BSC::fn_list(const std::vector<Value> &args) {
+  return Value();
 }
-ValuePtr BSC::fn_head(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>();
+Value BSC::fn_head(const std::vector<Value> &args) {
+  return Value();
 }
-ValuePtr BSC::fn_tail(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>();
+Value BSC::fn_tail(const std::vector<Value> &args) {
+  return Value();
 }
-ValuePtr BSC::fn_nth(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>();
+Value BSC::fn_nth(const std::vector<Value> &args) {
+  return Value();
 }
-ValuePtr BSC::fn_if(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>();
+Value BSC::fn_if(const std::vector<Value> &args) {
+  return Value();
 }
-ValuePtr BSC::fn_cond(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>();
+Value BSC::fn_cond(const std::vector<Value> &args) {
+  return Value();
 }
-ValuePtr BSC::fn_print(const std::vector<ValuePtr> &args) {
-  return std::make_shared<Value>();
+Value BSC::fn_print(const std::vector<Value> &args) {
+  return Value();
 }
 
-ValuePtr BSC::fn_int(const std::vector<ValuePtr> &args) {
+Value BSC::fn_int(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0LL);
+    return Value(0LL);
 
-  if (args[0]->type == ValueType::INTEGER) {
+  if (args[0].type() == ValueType::INTEGER) {
     return args[0];
-  } else if (args[0]->type == ValueType::FLOAT) {
-    return std::make_shared<Value>(static_cast<long long>(args[0]->f));
-  } else if (args[0]->type == ValueType::STRING) {
+  } else if (args[0].type() == ValueType::FLOAT) {
+    return Value(static_cast<long long>(args[0].f()));
+  } else if (args[0].type() == ValueType::STRING) {
     try {
-      long long val = std::stoll(args[0]->s);
-      return std::make_shared<Value>(val);
+      long long val = std::stoll(args[0].s());
+      return Value(val);
     } catch (...) {
-      return std::make_shared<Value>(0LL);
+      return Value(0LL);
     }
-  } else if (args[0]->type == ValueType::BOOLEAN) {
-    return std::make_shared<Value>(args[0]->b ? 1LL : 0LL);
+  } else if (args[0].type() == ValueType::BOOLEAN) {
+    return Value(args[0].b() ? 1LL : 0LL);
   }
 
-  return std::make_shared<Value>(0LL);
+  return Value(0LL);
 }
 
-ValuePtr BSC::fn_float(const std::vector<ValuePtr> &args) {
+Value BSC::fn_float(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0.0);
+    return Value(0.0);
 
-  if (args[0]->type == ValueType::FLOAT) {
+  if (args[0].type() == ValueType::FLOAT) {
     return args[0];
-  } else if (args[0]->type == ValueType::INTEGER) {
-    return std::make_shared<Value>(static_cast<double>(args[0]->i));
-  } else if (args[0]->type == ValueType::STRING) {
+  } else if (args[0].type() == ValueType::INTEGER) {
+    return Value(static_cast<double>(args[0].i()));
+  } else if (args[0].type() == ValueType::STRING) {
     try {
-      double val = std::stod(args[0]->s);
-      return std::make_shared<Value>(val);
+      double val = std::stod(args[0].s());
+      return Value(val);
     } catch (...) {
-      return std::make_shared<Value>(0.0);
+      return Value(0.0);
     }
-  } else if (args[0]->type == ValueType::BOOLEAN) {
-    return std::make_shared<Value>(args[0]->b ? 1.0 : 0.0);
+  } else if (args[0].type() == ValueType::BOOLEAN) {
+    return Value(args[0].b() ? 1.0 : 0.0);
   }
 
-  return std::make_shared<Value>(0.0);
+  return Value(0.0);
 }
 
 } // namespace jls
@@ -2,10 +2,12 @@
 #define JLS_HPP
 
 #include <functional>
+#include <initializer_list>
 #include <map>
 #include <memory>
 #include <string>
-#include <variant>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 // JsonLambdaScript (JLS) - A lambda-based scripting language for JSON
@@ -15,11 +17,12 @@
 namespace jls {
 
 // ================= Value Types =================
-enum class ValueType {
+enum class ValueType : unsigned char {
   NIL,
   BOOLEAN,
   INTEGER,
   FLOAT,
+  // heap types from here on
   STRING,
   FUNCTION,
   LAMBDA,
@@ -28,37 +31,219 @@ enum class ValueType {
 };
 
 // Forward declarations
-struct Value;
+class Value;
 struct Environment;
 struct Function;
+struct HeapObject;
+class Evaluator;
 
-using ValuePtr = std::shared_ptr<Value>;
 using EnvironmentPtr = std::shared_ptr<Environment>;
 using FunctionPtr = std::shared_ptr<Function>;
-using NativeFunctionPtr =
-    std::function<ValuePtr(const std::vector<ValuePtr> &)>;
+using List = std::vector<Value>;
+using Map = std::map<std::string, Value>;
+using NativeFunctionPtr = std::function<Value(const std::vector<Value> &)>;
 
 // ================= Value Representation =================
-struct Value {
-  ValueType type;
-  bool b = false;
-  long long i = 0;
-  double f = 0.0;
+// 16 bytes: a type tag and a payload. nil, booleans, integers and floats are
+// stored inline, so arithmetic and loop counters never allocate; strings,
+// lists, maps and functions point to a reference-counted HeapObject that
+// copies share (a list changed through one copy changes for all of them).
+// Counts are not atomic: a value and its copies belong to one thread.
+class Value {
+public:
+  Value() noexcept : type_(ValueType::NIL) { p_.i = 0; }
+  explicit Value(bool v) noexcept : type_(ValueType::BOOLEAN) {
+    p_.i = 0;
+    p_.b = v;
+  }
+  explicit Value(long long v) noexcept : type_(ValueType::INTEGER) {
+    p_.i = v;
+  }
+  explicit Value(int v) noexcept : Value(static_cast<long long>(v)) {}
+  explicit Value(double v) noexcept : type_(ValueType::FLOAT) { p_.f = v; }
+  explicit Value(std::string v);
+  explicit Value(const char *v) : Value(std::string(v)) {}
+  explicit Value(List items);
+  explicit Value(Map entries);
+  explicit Value(NativeFunctionPtr fn);
+  explicit Value(FunctionPtr fn);
+
+  Value(const Value &o) noexcept : type_(o.type_), p_(o.p_) { retain(); }
+  Value(Value &&o) noexcept : type_(o.type_), p_(o.p_) {
+    o.type_ = ValueType::NIL;
+    o.p_.i = 0;
+  }
+  Value &operator=(Value o) noexcept {
+    std::swap(type_, o.type_);
+    std::swap(p_, o.p_);
+    return *this;
+  }
+  ~Value() { release(); }
+
+  // The placeholder of a variable that was never assigned. It reads as nil;
+  // the VM and the Evaluator report it as undefined.
+  static Value unset() noexcept {
+    Value v;
+    v.p_.i = 1;
+    return v;
+  }
+  bool is_unset() const { return type_ == ValueType::NIL && p_.i == 1; }
+
+  ValueType type() const { return type_; }
+  bool is_number() const {
+    return type_ == ValueType::INTEGER || type_ == ValueType::FLOAT;
+  }
+
+  // Payload access; each is only meaningful for its own type
+  bool b() const { return p_.b; }
+  long long i() const { return p_.i; }
+  double f() const { return p_.f; }
+  // INTEGER or FLOAT as a double; 0 for anything else
+  double number() const {
+    if (type_ == ValueType::INTEGER)
+      return static_cast<double>(p_.i);
+    return type_ == ValueType::FLOAT ? p_.f : 0.0;
+  }
+  const std::string &s() const;
+  List &list();
+  const List &list() const;
+  Map &map();
+  const Map &map() const;
+  // FUNCTION: a user-defined function, or a native one
+  const FunctionPtr &func() const;
+  const NativeFunctionPtr &native_func() const;
+
+  // Wraps a newly made heap object (refs == 1) of the heap type `type`, for
+  // HeapObject subclasses defined elsewhere (see jq::to_jls_value).
+  static Value from_heap(ValueType type, HeapObject *obj) noexcept {
+    Value v;
+    v.type_ = type;
+    v.p_.obj = obj;
+    return v;
+  }
+  const HeapObject *heap() const { return on_heap() ? p_.obj : nullptr; }
+
+private:
+  ValueType type_;
+  union Payload {
+    bool b;
+    long long i;
+    double f;
+    HeapObject *obj;
+  } p_;
+
+  bool on_heap() const { return type_ >= ValueType::STRING; }
+  void retain() const;
+  void release();
+};
+
+// Heap part of a Value, freed when the last Value sharing it goes away.
+struct HeapObject {
+  int refs = 1;
+  virtual ~HeapObject() = default;
+};
+
+struct StringObject : HeapObject {
   std::string s;
-  std::vector<ValuePtr> list;
-  std::map<std::string, ValuePtr> map;
+  explicit StringObject(std::string v) : s(std::move(v)) {}
+};
+
+// A list or map built from other data (a jq result) may defer building its
+// elements: `pending` stays set until fill() has run. `written` records that
+// list()/map() was handed out for writing, after which the contents may no
+// longer match that data. Filling happens on read, so these objects belong
+// to one thread like the Values that share them.
+struct ListObject : HeapObject {
+  List list;
+  bool pending = false;
+  bool written = false;
+  ListObject() = default;
+  explicit ListObject(List v) : list(std::move(v)) {}
+  virtual void fill() {}
+};
+
+struct MapObject : HeapObject {
+  Map map;
+  bool pending = false;
+  bool written = false;
+  MapObject() = default;
+  explicit MapObject(Map v) : map(std::move(v)) {}
+  virtual void fill() {}
+};
+
+struct FunctionObject : HeapObject {
   FunctionPtr func;
   NativeFunctionPtr native_func;
-
-  Value() : type(ValueType::NIL) {}
-  explicit Value(bool v) : type(ValueType::BOOLEAN), b(v) {}
-  explicit Value(long long v) : type(ValueType::INTEGER), i(v) {}
-  explicit Value(int v) : type(ValueType::INTEGER), i(v) {}
-  explicit Value(double v) : type(ValueType::FLOAT), f(v) {}
-  explicit Value(const std::string &v) : type(ValueType::STRING), s(v) {}
-  explicit Value(const char *v) : type(ValueType::STRING), s(v) {}
 };
 
+inline Value::Value(std::string v) : type_(ValueType::STRING) {
+  p_.obj = new StringObject(std::move(v));
+}
+inline Value::Value(List items) : type_(ValueType::LIST) {
+  p_.obj = new ListObject(std::move(items));
+}
+inline Value::Value(Map entries) : type_(ValueType::MAP) {
+  p_.obj = new MapObject(std::move(entries));
+}
+inline Value::Value(NativeFunctionPtr fn) : type_(ValueType::FUNCTION) {
+  auto obj = new FunctionObject();
+  obj->native_func = std::move(fn);
+  p_.obj = obj;
+}
+inline Value::Value(FunctionPtr fn) : type_(ValueType::FUNCTION) {
+  auto obj = new FunctionObject();
+  obj->func = std::move(fn);
+  p_.obj = obj;
+}
+
+inline void Value::retain() const {
+  if (on_heap())
+    ++p_.obj->refs;
+}
+
+inline void Value::release() {
+  if (on_heap() && --p_.obj->refs == 0)
+    delete p_.obj;
+}
+
+inline const std::string &Value::s() const {
+  return static_cast<const StringObject *>(p_.obj)->s;
+}
+inline List &Value::list() {
+  auto obj = static_cast<ListObject *>(p_.obj);
+  if (obj->pending)
+    obj->fill();
+  obj->written = true;
+  return obj->list;
+}
+inline const List &Value::list() const {
+  auto obj = static_cast<ListObject *>(p_.obj);
+  if (obj->pending)
+    obj->fill();
+  return obj->list;
+}
+inline Map &Value::map() {
+  auto obj = static_cast<MapObject *>(p_.obj);
+  if (obj->pending)
+    obj->fill();
+  obj->written = true;
+  return obj->map;
+}
+inline const Map &Value::map() const {
+  auto obj = static_cast<MapObject *>(p_.obj);
+  if (obj->pending)
+    obj->fill();
+  return obj->map;
+}
+inline const FunctionPtr &Value::func() const {
+  return static_cast<const FunctionObject *>(p_.obj)->func;
+}
+inline const NativeFunctionPtr &Value::native_func() const {
+  return static_cast<const FunctionObject *>(p_.obj)->native_func;
+}
+
+static_assert(sizeof(Value) == 16, "jls::Value should stay two words");
+
 // ================= Tokens =================
 enum class TokenType {
   // Literals
@@ -174,13 +359,15 @@ enum class NodeType {
 
 struct ASTNode {
   NodeType type;
-  ValuePtr literal_value;
+  Value literal_value;
   std::string identifier_name;
   std::string op; // For binary/unary operations
   std::vector<std::shared_ptr<ASTNode>> children;
   std::shared_ptr<ASTNode> condition;
   std::shared_ptr<ASTNode> then_branch;
   std::shared_ptr<ASTNode> else_branch;
+  std::shared_ptr<ASTNode> body;  // FOR/WHILE/FUNCTION body (a BLOCK)
+  std::vector<std::string> params; // FUNCTION parameter names
 
   ASTNode() : type(NodeType::LITERAL) {}
 };
@@ -204,6 +391,11 @@ private:
   void advance();
   bool expect(TokenType type);
 
+  // Statements up to EOF or one of `terminators` (left unconsumed).
+  ASTNodePtr parse_block(std::initializer_list<TokenType> terminators);
+  // Consumes END (or NEXT for FOR) and an optional `END IF`-style keyword
+  // on the same line. A missing END is tolerated at end of input.
+  void parse_block_end(TokenType keyword);
   ASTNodePtr parse_statement();
   ASTNodePtr parse_print();
   ASTNodePtr parse_let();
@@ -212,6 +404,7 @@ private:
   ASTNodePtr parse_for();
   ASTNodePtr parse_while();
   ASTNodePtr parse_function();
+  ASTNodePtr parse_return();
   ASTNodePtr parse_expression();
   ASTNodePtr parse_comparison();
   ASTNodePtr parse_term();
@@ -220,21 +413,29 @@ private:
 };
 
 // ================= Bytecode =================
+// Operands live in Instruction::a/b; jump targets are absolute instruction
+// indexes. Variables are resolved to a (depth, slot) pair when compiling:
+// function parameters and names assigned inside a function live in the
+// call's stack frame (LOAD_LOCAL), every other name in a slot of the global
+// Environment (LOAD_VAR), so running a chunk never looks a name up by string.
 enum class OpCode : unsigned char {
   // Stack operations
   PUSH_NIL = 0,
   PUSH_TRUE = 1,
   PUSH_FALSE = 2,
-  PUSH_INT = 3,
-  PUSH_FLOAT = 4,
-  PUSH_STRING = 5,
+  PUSH_CONST = 3, // a: constant index
+  POP = 6,        // a: number of values
 
-  // Variables
-  LOAD_VAR = 10,
-  STORE_VAR = 11,
+  // Variables; stores leave the value on the stack
+  LOAD_VAR = 10,    // a: global slot; b = 1 reports "Undefined function"
+  STORE_VAR = 11,   // a: global slot
+  LOAD_LOCAL = 12,  // a: frame slot; b as for LOAD_VAR
+  STORE_LOCAL = 13, // a: frame slot
+  LOAD_LIB = 14,    // a: global slot of the library map, b: constant index
+                    // of the lowercase member name (lib/member)
 
   // Function calls
-  CALL = 20,
+  CALL = 20, // a: argument count; the callee sits below the arguments
   RETURN = 21,
 
   // Arithmetic
@@ -244,6 +445,7 @@ enum class OpCode : unsigned char {
   DIV = 33,
   MOD = 34,
   POW = 35,
+  NEG = 36,
 
   // Comparison
   EQ = 40,
@@ -259,20 +461,16 @@ enum class OpCode : unsigned char {
   NOT = 52,
 
   // Control flow
-  JMP = 60,
-  JMP_FALSE = 61,
-  JMP_TRUE = 62,
+  JMP = 60,       // a: target
+  JMP_FALSE = 61, // a: target; pops the condition
+  JMP_TRUE = 62,  // a: target; pops the condition
+  // FOR loops keep the end value and step on the stack. b names the loop
+  // variable: a frame slot when >= 0, global slot -(b + 1) otherwise.
+  FOR_TEST = 63, // a: loop exit; jumps once the variable is past the end
+  FOR_STEP = 64, // a: loop test; adds the step to the variable
 
-  // List operations
-  LIST_NEW = 70,
-  LIST_PUSH = 71,
-  LIST_GET = 72,
-  LIST_SET = 73,
-
-  // Map operations
-  MAP_NEW = 80,
-  MAP_SET = 81,
-  MAP_GET = 82,
+  // Output
+  PRINT = 90, // prints the top value and leaves it; a = 1 prints a newline
 
   // Halt
   HALT = 255
@@ -280,47 +478,97 @@ enum class OpCode : unsigned char {
 
 struct Instruction {
   OpCode op;
-  std::vector<unsigned char> args;
+  int a = 0;
+  int b = 0;
+
+  Instruction(OpCode o, int a = 0, int b = 0) : op(o), a(a), b(b) {}
+};
 
-  Instruction(OpCode o) : op(o) {}
+// A compiled script or function body. Global slots refer to the
+// Environment the chunk was compiled against, so it must only run while that
+// environment is alive.
+struct Chunk {
+  std::string name; // function name, empty for a script
+  std::vector<Instruction> code;
+  std::vector<Value> constants;
+  Environment *globals = nullptr;
+  std::vector<std::string> local_names; // by slot; parameters come first
+  int arity = 0;
 };
 
+using ChunkPtr = std::shared_ptr<const Chunk>;
+
 // ================= Bytecode Compiler =================
 class Compiler {
 public:
-  std::vector<Instruction> compile(const ASTNodePtr &ast);
+  // Global names get slots in `globals` (normally the Evaluator's global
+  // environment); names not yet defined get an unset slot.
+  explicit Compiler(EnvironmentPtr globals);
+
+  // Returns nullptr and sets error_message() for a tree it cannot compile;
+  // the caller then falls back to the Evaluator.
+  ChunkPtr compile(const ASTNodePtr &ast);
   std::string error_message() const { return error_msg; }
 
 private:
-  std::vector<Instruction> bytecode;
-  std::map<std::string, int> variables;
+  EnvironmentPtr globals;
+  Chunk *chunk = nullptr;                // chunk being emitted
+  std::map<std::string, int> variables; // locals of the current function
+  bool in_function = false;
   std::string error_msg;
-  int var_count = 0;
 
   void compile_node(const ASTNodePtr &node);
-  void emit(OpCode op);
-  void emit_int(long long val);
-  void emit_float(double val);
-  void emit_string(const std::string &val);
+  void compile_function(const ASTNodePtr &node);
+  void emit(OpCode op, int a = 0, int b = 0);
+  void emit_constant(Value val);
+  int add_constant(Value val);
+  void emit_load(const std::string &name, bool function);
+  void emit_store(const std::string &name);
+  int global_slot(const std::string &name);
+  // Loop variable operand of FOR_TEST/FOR_STEP (see OpCode).
+  int variable_operand(const std::string &name);
+  size_t here() const { return chunk->code.size(); }
+  void patch(size_t at) { chunk->code[at].a = static_cast<int>(here()); }
 };
 
 // ================= Bytecode Interpreter/VM =================
 class VM {
 public:
-  VM();
-  bool execute(const std::vector<Instruction> &bytecode);
-  ValuePtr get_result() const { return result; }
+  // Functions the Evaluator defined (Function::body) are run by
+  // `interpreter`; without one, calling them is an error.
+  explicit VM(Evaluator *interpreter = nullptr);
+  bool execute(const ChunkPtr &chunk);
+  // Calls a compiled function value (Function::chunk) with `args`.
+  bool call(const Value &func, const std::vector<Value> &args);
+  const Value &get_result() const { return result; }
   std::string error_message() const { return error_msg; }
 
 private:
-  std::vector<ValuePtr> stack;
-  std::map<std::string, ValuePtr> variables;
-  ValuePtr result;
+  struct Frame {
+    const Chunk *chunk;
+    size_t ip;
+    size_t base; // first local slot on the stack
+  };
+
+  std::vector<Value> stack;
+  std::vector<Frame> frames;
+  std::vector<Value> args; // native call arguments, reused
+  Value result;
   std::string error_msg;
-
-  void push(const ValuePtr &val);
-  ValuePtr pop();
-  ValuePtr peek();
+  Evaluator *interpreter;
+
+  bool run();
+  bool fail(const std::string &msg);
+  // Enters a compiled function whose arguments are the top `argc` values
+  // (the callee sits just below them).
+  bool enter(const Chunk &callee, int argc);
+
+  void push(Value val) { stack.push_back(std::move(val)); }
+  Value pop() {
+    Value val = std::move(stack.back());
+    stack.pop_back();
+    return val;
+  }
 };
 
 // ================= Bvald Standard Collection (BSC) =================
@@ -330,79 +578,102 @@ public:
 
 private:
   // Math functions
-  static ValuePtr fn_add(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_sub(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_mul(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_div(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_mod(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_pow(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_sqrt(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_floor(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_ceil(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_abs(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_min(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_max(const std::vector<ValuePtr> &args);
+  static Value fn_add(const std::vector<Value> &args);
+  static Value fn_sub(const std::vector<Value> &args);
+  static Value fn_mul(const std::vector<Value> &args);
+  static Value fn_div(const std::vector<Value> &args);
+  static Value fn_mod(const std::vector<Value> &args);
+  static Value fn_pow(const std::vector<Value> &args);
+  static Value fn_sqrt(const std::vector<Value> &args);
+  static Value fn_floor(const std::vector<Value> &args);
+  static Value fn_ceil(const std::vector<Value> &args);
+  static Value fn_abs(const std::vector<Value> &args);
+  static Value fn_min(const std::vector<Value> &args);
+  static Value fn_max(const std::vector<Value> &args);
 
   // String functions
-  static ValuePtr fn_string(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_length(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_concat(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_substring(const std::vector<ValuePtr> &args);
+  static Value fn_string(const std::vector<Value> &args);
+  static Value fn_length(const std::vector<Value> &args);
+  static Value fn_concat(const std::vector<Value> &args);
+  static Value fn_substring(const std::vector<Value> &args);
 
   // List functions
-  static ValuePtr fn_list(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_head(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_tail(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_nth(const std::vector<ValuePtr> &args);
+  static Value fn_list(const std::vector<Value> &args);
+  static Value fn_head(const std::vector<Value> &args);
+  static Value fn_tail(const std::vector<Value> &args);
+  static Value fn_nth(const std::vector<Value> &args);
 
   // Control flow
-  static ValuePtr fn_if(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_cond(const std::vector<ValuePtr> &args);
+  static Value fn_if(const std::vector<Value> &args);
+  static Value fn_cond(const std::vector<Value> &args);
 
   // I/O
-  static ValuePtr fn_print(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_input(const std::vector<ValuePtr> &args);
+  static Value fn_print(const std::vector<Value> &args);
+  static Value fn_input(const std::vector<Value> &args);
 
   // Utility
-  static ValuePtr fn_random(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_type(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_int(const std::vector<ValuePtr> &args);
-  static ValuePtr fn_float(const std::vector<ValuePtr> &args);
+  static Value fn_random(const std::vector<Value> &args);
+  static Value fn_type(const std::vector<Value> &args);
+  static Value fn_int(const std::vector<Value> &args);
+  static Value fn_float(const std::vector<Value> &args);
 };
 
 // ================= Environment =================
+// A user-defined function: compiled (chunk) or, when defined by the
+// Evaluator, a body evaluated in a child of `closure`. The closure is weak,
+// since the scope usually holds the function; once that scope is gone the
+// body sees only the globals.
 struct Function {
   std::vector<std::string> params;
   ASTNodePtr body;
-  EnvironmentPtr closure;
+  std::weak_ptr<Environment> closure;
+  ChunkPtr chunk;
 };
 
+// Variables of one scope, each in a numbered slot. Compiled code addresses
+// globals by slot; names are only looked up when compiling and by the
+// Evaluator. Slots are never removed, so a slot number stays valid.
 struct Environment {
-  std::map<std::string, ValuePtr> variables;
   EnvironmentPtr parent;
 
   explicit Environment(EnvironmentPtr p = nullptr) : parent(p) {}
 
-  ValuePtr get(const std::string &name);
-  void set(const std::string &name, const ValuePtr &value);
-  bool exists(const std::string &name) const;
+  // Slot of `name` in this scope, adding an unset one if there is none.
+  size_t slot(const std::string &name);
+  Value &at(size_t slot) { return slots[slot]; }
+  const std::string &name(size_t slot) const { return names[slot]; }
+
+  // The value of `name` here or in a parent scope; nullptr if it is not
+  // set. The pointer is valid until a new name is added to that scope.
+  const Value *get(const std::string &name) const;
+  void set(const std::string &name, Value value);
+  bool exists(const std::string &name) const { return get(name) != nullptr; }
+
+private:
+  std::vector<Value> slots;
+  std::vector<std::string> names;
+  std::unordered_map<std::string, size_t> index;
 };
 
 // ================= Evaluator =================
 class Evaluator {
 public:
   Evaluator();
-  ValuePtr eval(const ASTNodePtr &node, EnvironmentPtr env = nullptr);
+  Value eval(const ASTNodePtr &node, EnvironmentPtr env = nullptr);
   std::string error_message() const { return error_msg; }
   EnvironmentPtr get_global_env() { return global_env; }
+  // Calls any function value; sets error_message() on failure.
+  Value call(const Value &func, const std::vector<Value> &args);
 
 private:
   EnvironmentPtr global_env;
   std::string error_msg;
+  bool returning = false; // RETURN seen; unwinding to the function call
+  int depth = 0;          // user function calls in progress
 
-  ValuePtr eval_node(const ASTNodePtr &node, EnvironmentPtr env);
-  ValuePtr call_function(const ValuePtr &func,
-                         const std::vector<ValuePtr> &args, EnvironmentPtr env);
+  Value eval_node(const ASTNodePtr &node, EnvironmentPtr env);
+  Value call_function(const Value &func, const std::vector<Value> &args,
+                      EnvironmentPtr env);
 };
 
 } // namespace jls
@@ -2,15 +2,18 @@
 #include <algorithm>
 #include <cctype>
 #include <cmath>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
 #include <set>
 
+#include "../src/jq/jq_types.hpp"
 #include "jq.hpp"
+#include "libjsonval.hpp"
 
 namespace jls {
 
-using FunctionMap = std::map<std::string, ValuePtr>;
+using FunctionMap = std::map<std::string, Value>;
 
 static std::string to_lower(const std::string &s) {
   std::string out = s;
@@ -54,253 +57,487 @@ static void bind_library_to_env(const std::string &lib_name,
   }
 
   // Bind a namespaced map so calls like math/sin() work
-  auto lib_val = std::make_shared<Value>();
-  lib_val->type = ValueType::MAP;
+  Map members;
   for (const auto &kv : functions) {
-    lib_val->map[to_lower(kv.first)] = kv.second;
+    members[to_lower(kv.first)] = kv.second;
   }
-  env->set(to_lower(lib_name), lib_val);
+  env->set(to_lower(lib_name), Value(std::move(members)));
 }
 
 // Helper functions for lambda conversion
-static ValuePtr math_sin(const std::vector<ValuePtr> &args) {
+static Value math_sin(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0.0);
-  double val = (args[0]->type == ValueType::INTEGER) ? args[0]->i : args[0]->f;
-  return std::make_shared<Value>(std::sin(val));
+    return Value(0.0);
+  double val = args[0].number();
+  return Value(std::sin(val));
 }
 
-static ValuePtr math_cos(const std::vector<ValuePtr> &args) {
+static Value math_cos(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0.0);
-  double val = (args[0]->type == ValueType::INTEGER) ? args[0]->i : args[0]->f;
-  return std::make_shared<Value>(std::cos(val));
+    return Value(0.0);
+  double val = args[0].number();
+  return Value(std::cos(val));
 }
 
-static ValuePtr math_tan(const std::vector<ValuePtr> &args) {
+static Value math_tan(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0.0);
-  double val = (args[0]->type == ValueType::INTEGER) ? args[0]->i : args[0]->f;
-  return std::make_shared<Value>(std::tan(val));
+    return Value(0.0);
+  double val = args[0].number();
+  return Value(std::tan(val));
 }
 
-static ValuePtr math_ln(const std::vector<ValuePtr> &args) {
+static Value math_ln(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0.0);
-  double val = (args[0]->type == ValueType::INTEGER) ? args[0]->i : args[0]->f;
-  return std::make_shared<Value>(std::log(val));
+    return Value(0.0);
+  double val = args[0].number();
+  return Value(std::log(val));
 }
 
-static ValuePtr math_log(const std::vector<ValuePtr> &args) {
+static Value math_log(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0.0);
-  double val = (args[0]->type == ValueType::INTEGER) ? args[0]->i : args[0]->f;
-  return std::make_shared<Value>(std::log10(val));
+    return Value(0.0);
+  double val = args[0].number();
+  return Value(std::log10(val));
 }
 
-static ValuePtr math_exp(const std::vector<ValuePtr> &args) {
+static Value math_exp(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(1.0);
-  double val = (args[0]->type == ValueType::INTEGER) ? args[0]->i : args[0]->f;
-  return std::make_shared<Value>(std::exp(val));
+    return Value(1.0);
+  double val = args[0].number();
+  return Value(std::exp(val));
 }
 
-static ValuePtr math_round(const std::vector<ValuePtr> &args) {
+static Value math_round(const std::vector<Value> &args) {
   if (args.empty())
-    return std::make_shared<Value>(0.0);
-  double val = (args[0]->type == ValueType::INTEGER) ? args[0]->i : args[0]->f;
-  return std::make_shared<Value>(std::round(val));
+    return Value(0.0);
+  double val = args[0].number();
+  return Value(std::round(val));
 }
 
-static ValuePtr io_printno(const std::vector<ValuePtr> &args) {
+static Value io_printno(const std::vector<Value> &args) {
   for (const auto &arg : args) {
-    if (arg->type == ValueType::STRING) {
-      std::cout << arg->s;
-    } else if (arg->type == ValueType::INTEGER) {
-      std::cout << arg->i;
-    } else if (arg->type == ValueType::FLOAT) {
-      std::cout << arg->f;
-    } else if (arg->type == ValueType::BOOLEAN) {
-      std::cout << (arg->b ? "true" : "false");
+    if (arg.type() == ValueType::STRING) {
+      std::cout << arg.s();
+    } else if (arg.type() == ValueType::INTEGER) {
+      std::cout << arg.i();
+    } else if (arg.type() == ValueType::FLOAT) {
+      std::cout << arg.f();
+    } else if (arg.type() == ValueType::BOOLEAN) {
+      std::cout << (arg.b() ? "true" : "false");
     }
   }
-  return std::make_shared<Value>();
+  return Value();
 }
 
-static ValuePtr io_pause(const std::vector<ValuePtr> &args) {
+// Output is buffered; this writes out what is pending
+static Value io_flush(const std::vector<Value> &) {
+  std::cout.flush();
+  return Value();
+}
+
+static Value io_pause(const std::vector<Value> &args) {
   std::string prompt = "Press any key to continue...";
-  if (!args.empty() && args[0]->type == ValueType::STRING) {
-    prompt = args[0]->s;
+  if (!args.empty() && args[0].type() == ValueType::STRING) {
+    prompt = args[0].s();
   }
   std::cout << prompt;
   std::string line;
   std::getline(std::cin, line);
-  return std::make_shared<Value>();
+  return Value();
 }
 
-static ValuePtr file_read(const std::vector<ValuePtr> &args) {
-  if (args.empty() || args[0]->type != ValueType::STRING) {
-    return std::make_shared<Value>("");
+static Value file_read(const std::vector<Value> &args) {
+  if (args.empty() || args[0].type() != ValueType::STRING) {
+    return Value("");
   }
 
-  std::ifstream file(args[0]->s);
+  std::ifstream file(args[0].s());
   if (!file.is_open()) {
-    return std::make_shared<Value>("");
+    return Value("");
   }
 
   std::string content((std::istreambuf_iterator<char>(file)),
                       std::istreambuf_iterator<char>());
   file.close();
-  return std::make_shared<Value>(content);
+  return Value(content);
 }
 
-static ValuePtr file_write(const std::vector<ValuePtr> &args) {
-  if (args.size() < 2 || args[0]->type != ValueType::STRING ||
-      args[1]->type != ValueType::STRING) {
-    return std::make_shared<Value>(false);
+static Value file_write(const std::vector<Value> &args) {
+  if (args.size() < 2 || args[0].type() != ValueType::STRING ||
+      args[1].type() != ValueType::STRING) {
+    return Value(false);
   }
 
-  std::ofstream file(args[0]->s);
+  std::ofstream file(args[0].s());
   if (!file.is_open()) {
-    return std::make_shared<Value>(false);
+    return Value(false);
   }
 
-  file << args[1]->s;
+  file << args[1].s();
   file.close();
-  return std::make_shared<Value>(true);
+  return Value(true);
 }
 
-static ValuePtr file_exists(const std::vector<ValuePtr> &args) {
-  if (args.empty() || args[0]->type != ValueType::STRING) {
-    return std::make_shared<Value>(false);
+static Value file_exists(const std::vector<Value> &args) {
+  if (args.empty() || args[0].type() != ValueType::STRING) {
+    return Value(false);
   }
 
-  std::ifstream file(args[0]->s);
+  std::ifstream file(args[0].s());
   bool exists = file.good();
   file.close();
-  return std::make_shared<Value>(exists);
+  return Value(exists);
+}
+
+// ================= File handles =================
+// Scripts refer to an open file by number (file/open, file/map, file/create
+// and file/append return one). Readers hand out a line or a JSON record per
+// call and keep only the current chunk of the file in memory, so an input
+// of any size is streamed in constant memory. Writers go through a large
+// stdio buffer that is written out when full, on file/flush and on
+// file/close; files still open at exit are flushed then.
+
+static constexpr size_t kFileChunk = 1 << 16;
+
+struct FileHandle {
+  std::string path;
+  std::FILE *file = nullptr; // buffered reader or writer
+  bool writing = false;
+  MappedFile mapped; // file/map reads the mapping instead of `file`
+  bool is_mapped = false;
+  std::string buf;   // reader: bytes read from `file` but not returned yet
+  size_t pos = 0;    // start of the unread part of `buf`, or of `mapped`
+  bool eof = false;
+  long long line = 0; // lines handed out so far
+  JsonDocument doc;   // reused by file/read_record
+
+  ~FileHandle() {
+    if (file)
+      std::fclose(file);
+  }
+};
+
+static std::map<long long, std::unique_ptr<FileHandle>> open_files;
+static long long next_file = 1;
+
+static FileHandle *handle_arg(const std::vector<Value> &args, bool writing) {
+  if (args.empty() || args[0].type() != ValueType::INTEGER)
+    return nullptr;
+  auto it = open_files.find(args[0].i());
+  if (it == open_files.end() || it->second->writing != writing)
+    return nullptr;
+  return it->second.get();
+}
+
+static Value add_handle(std::unique_ptr<FileHandle> handle) {
+  long long id = next_file++;
+  open_files[id] = std::move(handle);
+  return Value(id);
+}
+
+// Next line without its line break; false at the end of the input.
+static bool next_line(FileHandle &h, std::string_view &out) {
+  if (h.is_mapped) {
+    std::string_view rest = h.mapped.view().substr(h.pos);
+    if (rest.empty())
+      return false;
+    size_t nl = rest.find('\n');
+    out = rest.substr(0, nl);
+    h.pos += nl == std::string_view::npos ? rest.size() : nl + 1;
+  } else {
+    size_t nl;
+    while ((nl = h.buf.find('\n', h.pos)) == std::string::npos && !h.eof) {
+      h.buf.erase(0, h.pos);
+      h.pos = 0;
+      size_t have = h.buf.size();
+      h.buf.resize(have + kFileChunk);
+      size_t got = std::fread(&h.buf[have], 1, kFileChunk, h.file);
+      h.buf.resize(have + got);
+      h.eof = got == 0;
+    }
+    if (nl == std::string::npos) {
+      if (h.pos == h.buf.size())
+        return false;
+      nl = h.buf.size();
+    }
+    out = std::string_view(h.buf).substr(h.pos, nl - h.pos);
+    h.pos = std::min(nl + 1, h.buf.size());
+  }
+  if (!out.empty() && out.back() == '\r')
+    out.remove_suffix(1);
+  ++h.line;
+  return true;
 }
 
-static ValuePtr jq_run(const std::vector<ValuePtr> &args) {
-  if (args.size() < 2 || args[0]->type != ValueType::STRING ||
-      args[1]->type != ValueType::STRING) {
-    return std::make_shared<Value>("[JQ ERROR] expected (filter, json_string)");
-  }
+// Strings are written as they are, anything else as JSON text
+static void append_text(std::string &out, const Value &v) {
+  if (v.type() == ValueType::STRING)
+    out += v.s();
+  else
+    jq::write_json(jq::from_jls_value(v), out);
+}
 
-  std::string output;
+static bool write_out(FileHandle &h, const std::string &text) {
+  return std::fwrite(text.data(), 1, text.size(), h.file) == text.size();
+}
+
+static Value file_open(const std::vector<Value> &args) {
+  if (args.empty() || args[0].type() != ValueType::STRING)
+    return Value();
+  auto h = std::make_unique<FileHandle>();
+  h->path = args[0].s();
+  h->file = std::fopen(h->path.c_str(), "rb");
+  if (!h->file)
+    return Value();
+  return add_handle(std::move(h));
+}
+
+static Value file_map(const std::vector<Value> &args) {
+  if (args.empty() || args[0].type() != ValueType::STRING)
+    return Value();
+  auto h = std::make_unique<FileHandle>();
+  h->path = args[0].s();
   std::string err;
-  if (!jq_engine.run(args[0]->s, args[1]->s, output, err)) {
-    return std::make_shared<Value>("[JQ ERROR] " + err);
+  if (!h->mapped.open(h->path, err))
+    return Value();
+  h->is_mapped = true;
+  return add_handle(std::move(h));
+}
+
+static Value open_writer(const std::vector<Value> &args, const char *mode) {
+  if (args.empty() || args[0].type() != ValueType::STRING)
+    return Value();
+  auto h = std::make_unique<FileHandle>();
+  h->path = args[0].s();
+  h->file = std::fopen(h->path.c_str(), mode);
+  if (!h->file)
+    return Value();
+  h->writing = true;
+  std::setvbuf(h->file, nullptr, _IOFBF, kFileChunk);
+  return add_handle(std::move(h));
+}
+
+static Value file_create(const std::vector<Value> &args) {
+  return open_writer(args, "wb");
+}
+
+static Value file_append(const std::vector<Value> &args) {
+  return open_writer(args, "ab");
+}
+
+// True once a reader has nothing left to hand out
+static Value file_eof(const std::vector<Value> &args) {
+  FileHandle *h = handle_arg(args, false);
+  if (!h)
+    return Value(true);
+  if (h->is_mapped)
+    return Value(h->pos >= h->mapped.size());
+  if (h->pos == h->buf.size() && !h->eof) {
+    h->buf.resize(kFileChunk);
+    h->buf.resize(std::fread(&h->buf[0], 1, kFileChunk, h->file));
+    h->pos = 0;
+    h->eof = h->buf.empty();
+  }
+  return Value(h->pos == h->buf.size());
+}
+
+static Value file_read_line(const std::vector<Value> &args) {
+  FileHandle *h = handle_arg(args, false);
+  std::string_view line;
+  if (!h || !next_line(*h, line))
+    return Value();
+  return Value(std::string(line));
+}
+
+// NDJSON: the next non-blank line as a value; lists and maps are built
+// from it only when read (see jq::to_jls_value).
+static Value file_read_record(const std::vector<Value> &args) {
+  FileHandle *h = handle_arg(args, false);
+  if (!h)
+    return Value();
+  std::string_view line;
+  while (next_line(*h, line)) {
+    if (line.find_first_not_of(" \t") == std::string_view::npos)
+      continue;
+    std::string err;
+    if (!parse_json_document(line, h->doc, err)) {
+      return Value("[FILE ERROR] " + h->path + ":" + std::to_string(h->line) +
+                   ": " + err);
+    }
+    return jq::to_jls_value(jq::from_json_view(h->doc.root()));
   }
+  return Value();
+}
 
-  return std::make_shared<Value>(output);
+static Value file_write_to(const std::vector<Value> &args, bool newline) {
+  FileHandle *h = handle_arg(args, true);
+  if (!h || args.size() < 2)
+    return Value(false);
+  std::string text;
+  append_text(text, args[1]);
+  if (newline)
+    text += '\n';
+  return Value(write_out(*h, text));
 }
 
-static ValuePtr jq_keys(const std::vector<ValuePtr> &args) {
-  if (args.size() < 1 || args[0]->type != ValueType::STRING) {
-    return std::make_shared<Value>("[JQ ERROR] jq/keys expected (json_string)");
+static Value file_write_text(const std::vector<Value> &args) {
+  return file_write_to(args, false);
+}
+
+static Value file_write_line(const std::vector<Value> &args) {
+  return file_write_to(args, true);
+}
+
+// NDJSON: the value as one line of compact JSON
+static Value file_write_record(const std::vector<Value> &args) {
+  FileHandle *h = handle_arg(args, true);
+  if (!h || args.size() < 2)
+    return Value(false);
+  std::string text;
+  jq::write_json(jq::from_jls_value(args[1]), text);
+  text += '\n';
+  return Value(write_out(*h, text));
+}
+
+static Value file_flush(const std::vector<Value> &args) {
+  FileHandle *h = handle_arg(args, true);
+  return Value(h && std::fflush(h->file) == 0);
+}
+
+static Value file_close(const std::vector<Value> &args) {
+  if (args.empty() || args[0].type() != ValueType::INTEGER)
+    return Value(false);
+  auto it = open_files.find(args[0].i());
+  if (it == open_files.end())
+    return Value(false);
+  bool ok = true;
+  if (it->second->file) {
+    ok = std::fclose(it->second->file) == 0;
+    it->second->file = nullptr;
+  }
+  open_files.erase(it);
+  return Value(ok);
+}
+
+// The jq functions take a document either as JSON text or as a JLS value
+// (a list or map from an earlier jq call, a number, ...). Text in gives JSON
+// text out, as it always has; a value in gives the first output as a value
+// (nil when there is none). Lists and maps coming out of jq keep the jq
+// value they were made from, so handing them back to jq costs nothing.
+static Value jq_on_value(const std::string &filter, const Value &doc) {
+  if (doc.type() == ValueType::FUNCTION || doc.type() == ValueType::LAMBDA) {
+    return Value("[JQ ERROR] a function is not a JSON document");
   }
 
-  std::vector<std::string> outputs;
+  jq::CompiledFilter compiled;
+  jq::JvValuePtr first;
   std::string err;
-  if (!jq_engine.run_streaming("keys", args[0]->s, outputs, err)) {
-    return std::make_shared<Value>("[JQ ERROR] " + err);
+  if (!jq::Engine::compile_cached(filter, compiled, err) ||
+      !compiled.run(
+          jq::from_jls_value(doc),
+          [&](const jq::JvValuePtr &out) {
+            first = out;
+            return false;
+          },
+          err)) {
+    return Value("[JQ ERROR] " + err);
   }
-
-  return std::make_shared<Value>(outputs.empty() ? "null" : outputs[0]);
+  return jq::to_jls_value(first);
 }
 
-static ValuePtr jq_values(const std::vector<ValuePtr> &args) {
-  if (args.size() < 1 || args[0]->type != ValueType::STRING) {
-    return std::make_shared<Value>(
-        "[JQ ERROR] jq/values expected (json_string)");
+// One-output helpers (keys, type, ...) on JSON text or a value
+static Value jq_helper(const char *filter, const std::vector<Value> &args) {
+  if (args.empty()) {
+    return Value(std::string("[JQ ERROR] jq/") + filter +
+                 " expected (json)");
+  }
+  if (args[0].type() != ValueType::STRING) {
+    return jq_on_value(filter, args[0]);
   }
 
   std::vector<std::string> outputs;
   std::string err;
-  if (!jq_engine.run_streaming("values", args[0]->s, outputs, err)) {
-    return std::make_shared<Value>("[JQ ERROR] " + err);
+  if (!jq_engine.run_streaming(filter, args[0].s(), outputs, err)) {
+    return Value("[JQ ERROR] " + err);
   }
 
-  return std::make_shared<Value>(outputs.empty() ? "null" : outputs[0]);
+  return Value(outputs.empty() ? "null" : outputs[0]);
 }
 
-static ValuePtr jq_type(const std::vector<ValuePtr> &args) {
-  if (args.size() < 1 || args[0]->type != ValueType::STRING) {
-    return std::make_shared<Value>("[JQ ERROR] jq/type expected (json_string)");
+static Value jq_run(const std::vector<Value> &args) {
+  if (args.size() < 2 || args[0].type() != ValueType::STRING) {
+    return Value("[JQ ERROR] expected (filter, json)");
+  }
+  if (args[1].type() != ValueType::STRING) {
+    return jq_on_value(args[0].s(), args[1]);
   }
 
-  std::vector<std::string> outputs;
+  std::string output;
   std::string err;
-  if (!jq_engine.run_streaming("type", args[0]->s, outputs, err)) {
-    return std::make_shared<Value>("[JQ ERROR] " + err);
+  if (!jq_engine.run(args[0].s(), args[1].s(), output, err)) {
+    return Value("[JQ ERROR] " + err);
   }
 
-  return std::make_shared<Value>(outputs.empty() ? "null" : outputs[0]);
+  return Value(output);
+}
+
+static Value jq_keys(const std::vector<Value> &args) {
+  return jq_helper("keys", args);
+}
+
+static Value jq_values(const std::vector<Value> &args) {
+  return jq_helper("values", args);
+}
+
+static Value jq_type(const std::vector<Value> &args) {
+  return jq_helper("type", args);
+}
+
+static Value jq_length(const std::vector<Value> &args) {
+  return jq_helper("length", args);
 }
 
-static ValuePtr jq_length(const std::vector<ValuePtr> &args) {
-  if (args.size() < 1 || args[0]->type != ValueType::STRING) {
-    return std::make_shared<Value>(
-        "[JQ ERROR] jq/length expected (json_string)");
+// JSON text -> JLS value, parsed once so later jq calls skip the text
+static Value jq_parse(const std::vector<Value> &args) {
+  if (args.empty() || args[0].type() != ValueType::STRING) {
+    return Value("[JQ ERROR] jq/parse expected (json_string)");
   }
 
-  std::vector<std::string> outputs;
+  JsonDocument doc;
   std::string err;
-  if (!jq_engine.run_streaming("length", args[0]->s, outputs, err)) {
-    return std::make_shared<Value>("[JQ ERROR] " + err);
+  if (!parse_json_document(args[0].s(), doc, err)) {
+    return Value("[JQ ERROR] " + err);
   }
+  return jq::to_jls_value(jq::from_json_view(doc.root()));
+}
 
-  return std::make_shared<Value>(outputs.empty() ? "null" : outputs[0]);
+// JLS value -> compact JSON text, or indented with a second argument
+static Value jq_json(const std::vector<Value> &args) {
+  if (args.empty()) {
+    return Value("[JQ ERROR] jq/json expected (value)");
+  }
+
+  int indent = 0;
+  if (args.size() > 1 && args[1].type() == ValueType::INTEGER) {
+    indent = static_cast<int>(args[1].i());
+  }
+  std::string out;
+  jq::write_json(jq::from_jls_value(args[0]), out, indent);
+  return Value(out);
 }
 
 static FunctionMap make_math_functions() {
   FunctionMap funcs;
 
-  auto sin_val = std::make_shared<Value>();
-  sin_val->type = ValueType::FUNCTION;
-  sin_val->native_func = math_sin;
-  funcs["sin"] = sin_val;
-
-  auto cos_val = std::make_shared<Value>();
-  cos_val->type = ValueType::FUNCTION;
-  cos_val->native_func = math_cos;
-  funcs["cos"] = cos_val;
-
-  auto tan_val = std::make_shared<Value>();
-  tan_val->type = ValueType::FUNCTION;
-  tan_val->native_func = math_tan;
-  funcs["tan"] = tan_val;
-
-  auto ln_val = std::make_shared<Value>();
-  ln_val->type = ValueType::FUNCTION;
-  ln_val->native_func = math_ln;
-  funcs["ln"] = ln_val;
-
-  auto log_val = std::make_shared<Value>();
-  log_val->type = ValueType::FUNCTION;
-  log_val->native_func = math_log;
-  funcs["log"] = log_val;
-
-  auto exp_val = std::make_shared<Value>();
-  exp_val->type = ValueType::FUNCTION;
-  exp_val->native_func = math_exp;
-  funcs["exp"] = exp_val;
-
-  auto round_val = std::make_shared<Value>();
-  round_val->type = ValueType::FUNCTION;
-  round_val->native_func = math_round;
-  funcs["round"] = round_val;
-
-  auto pi_val = std::make_shared<Value>();
-  pi_val->type = ValueType::FLOAT;
-  pi_val->f = 3.141592653589793;
-  funcs["pi"] = pi_val;
-
-  auto e_val = std::make_shared<Value>();
-  e_val->type = ValueType::FLOAT;
-  e_val->f = 2.718281828459045;
-  funcs["e"] = e_val;
+  funcs["sin"] = Value(NativeFunctionPtr(math_sin));
+  funcs["cos"] = Value(NativeFunctionPtr(math_cos));
+  funcs["tan"] = Value(NativeFunctionPtr(math_tan));
+  funcs["ln"] = Value(NativeFunctionPtr(math_ln));
+  funcs["log"] = Value(NativeFunctionPtr(math_log));
+  funcs["exp"] = Value(NativeFunctionPtr(math_exp));
+  funcs["round"] = Value(NativeFunctionPtr(math_round));
+  funcs["pi"] = Value(3.141592653589793);
+  funcs["e"] = Value(2.718281828459045);
 
   return funcs;
 }
@@ -308,15 +545,9 @@ static FunctionMap make_math_functions() {
 static FunctionMap make_io_functions() {
   FunctionMap funcs;
 
-  auto printno_val = std::make_shared<Value>();
-  printno_val->type = ValueType::FUNCTION;
-  printno_val->native_func = io_printno;
-  funcs["printno"] = printno_val;
-
-  auto pause_val = std::make_shared<Value>();
-  pause_val->type = ValueType::FUNCTION;
-  pause_val->native_func = io_pause;
-  funcs["pause"] = pause_val;
+  funcs["printno"] = Value(NativeFunctionPtr(io_printno));
+  funcs["pause"] = Value(NativeFunctionPtr(io_pause));
+  funcs["flush"] = Value(NativeFunctionPtr(io_flush));
 
   return funcs;
 }
@@ -324,20 +555,21 @@ static FunctionMap make_io_functions() {
 static FunctionMap make_file_functions() {
   FunctionMap funcs;
 
-  auto read_file_val = std::make_shared<Value>();
-  read_file_val->type = ValueType::FUNCTION;
-  read_file_val->native_func = file_read;
-  funcs["read_file"] = read_file_val;
-
-  auto write_file_val = std::make_shared<Value>();
-  write_file_val->type = ValueType::FUNCTION;
-  write_file_val->native_func = file_write;
-  funcs["write_file"] = write_file_val;
-
-  auto file_exists_val = std::make_shared<Value>();
-  file_exists_val->type = ValueType::FUNCTION;
-  file_exists_val->native_func = file_exists;
-  funcs["file_exists"] = file_exists_val;
+  funcs["read_file"] = Value(NativeFunctionPtr(file_read));
+  funcs["write_file"] = Value(NativeFunctionPtr(file_write));
+  funcs["file_exists"] = Value(NativeFunctionPtr(file_exists));
+  funcs["open"] = Value(NativeFunctionPtr(file_open));
+  funcs["map"] = Value(NativeFunctionPtr(file_map));
+  funcs["create"] = Value(NativeFunctionPtr(file_create));
+  funcs["append"] = Value(NativeFunctionPtr(file_append));
+  funcs["read_line"] = Value(NativeFunctionPtr(file_read_line));
+  funcs["read_record"] = Value(NativeFunctionPtr(file_read_record));
+  funcs["eof"] = Value(NativeFunctionPtr(file_eof));
+  funcs["write"] = Value(NativeFunctionPtr(file_write_text));
+  funcs["write_line"] = Value(NativeFunctionPtr(file_write_line));
+  funcs["write_record"] = Value(NativeFunctionPtr(file_write_record));
+  funcs["flush"] = Value(NativeFunctionPtr(file_flush));
+  funcs["close"] = Value(NativeFunctionPtr(file_close));
 
   return funcs;
 }
@@ -345,30 +577,13 @@ static FunctionMap make_file_functions() {
 static FunctionMap make_jq_functions() {
   FunctionMap funcs;
 
-  auto run_val = std::make_shared<Value>();
-  run_val->type = ValueType::FUNCTION;
-  run_val->native_func = jq_run;
-  auto keys_val = std::make_shared<Value>();
-  keys_val->type = ValueType::FUNCTION;
-  keys_val->native_func = jq_keys;
-  funcs["keys"] = keys_val;
-
-  auto values_val = std::make_shared<Value>();
-  values_val->type = ValueType::FUNCTION;
-  values_val->native_func = jq_values;
-  funcs["values"] = values_val;
-
-  auto type_val = std::make_shared<Value>();
-  type_val->type = ValueType::FUNCTION;
-  type_val->native_func = jq_type;
-  funcs["type"] = type_val;
-
-  auto length_val = std::make_shared<Value>();
-  length_val->type = ValueType::FUNCTION;
-  length_val->native_func = jq_length;
-  funcs["length"] = length_val;
-
-  funcs["run"] = run_val;
+  funcs["keys"] = Value(NativeFunctionPtr(jq_keys));
+  funcs["values"] = Value(NativeFunctionPtr(jq_values));
+  funcs["type"] = Value(NativeFunctionPtr(jq_type));
+  funcs["length"] = Value(NativeFunctionPtr(jq_length));
+  funcs["run"] = Value(NativeFunctionPtr(jq_run));
+  funcs["parse"] = Value(NativeFunctionPtr(jq_parse));
+  funcs["json"] = Value(NativeFunctionPtr(jq_json));
 
   return funcs;
 }
@@ -414,10 +629,7 @@ void LibraryLoader::register_custom_library(
     const std::map<std::string, NativeFunctionPtr> &functions) {
   FunctionMap map;
   for (const auto &kv : functions) {
-    auto fn_val = std::make_shared<Value>();
-    fn_val->type = ValueType::FUNCTION;
-    fn_val->native_func = kv.second;
-    map[kv.first] = fn_val;
+    map[kv.first] = Value(kv.second);
   }
   register_library_functions(lib_name, map);
 }
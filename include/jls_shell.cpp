@@ -81,8 +81,12 @@ bool Shell::is_incomplete_statement(const std::string &code) {
   int while_count = 0, function_count = 0;
 
   std::istringstream iss(upper_code);
-  std::string word;
+  std::string word, previous;
   while (iss >> word) {
+    bool after_end = previous == "END";
+    previous = word;
+    if (after_end)
+      continue; // END IF, END FOR, ... close a single block
     if (word == "IF")
       if_count++;
     else if (word == "FOR")
@@ -98,7 +102,7 @@ bool Shell::is_incomplete_statement(const std::string &code) {
   }
 
   // Check if blocks are balanced
-  int total_opens = if_count + while_count + function_count;
+  int total_opens = if_count + for_count + while_count + function_count;
   int total_closes = end_count + next_count;
 
   return total_opens > total_closes;
@@ -189,56 +193,76 @@ void Shell::execute_code(const std::string &code) {
 
     if (!parser.error_message().empty()) {
       std::cerr << "Parse Error: " << parser.error_message() << "\n";
+      failed = true;
       return;
     }
 
-    // Evaluate
-    auto result = evaluator.eval(ast);
+    // Compile and run on the VM; trees the compiler does not handle fall
+    // back to the tree-walking evaluator
+    Value result;
+    std::string error;
+    Compiler compiler(evaluator.get_global_env());
+    if (auto chunk = compiler.compile(ast)) {
+      if (vm.execute(chunk))
+        result = vm.get_result();
+      else
+        error = vm.error_message();
+    } else {
+      result = evaluator.eval(ast);
+      error = evaluator.error_message();
+    }
 
-    if (!evaluator.error_message().empty()) {
-      std::cerr << "[STAT ERROR]: " << evaluator.error_message() << "\n";
+    if (!error.empty()) {
+      std::cerr << "[STAT ERROR]: " << error << "\n";
+      failed = true;
       return;
     }
+    if (!interactive)
+      return;
 
     // Print result only for expressions, not for statements that already print
     // Don't print results from PRINT, IF, FOR, WHILE, FUNCTION_DEF
+    auto last = ast;
+    if (last && last->type == NodeType::BLOCK && !last->children.empty())
+      last = last->children.back();
     bool should_print_result = true;
-    if (ast &&
-        (ast->type == NodeType::PRINT || ast->type == NodeType::IF_STMT ||
-         ast->type == NodeType::FOR_LOOP || ast->type == NodeType::WHILE_LOOP ||
-         ast->type == NodeType::FUNCTION_DEF)) {
+    if (last &&
+        (last->type == NodeType::PRINT || last->type == NodeType::IF_STMT ||
+         last->type == NodeType::FOR_LOOP ||
+         last->type == NodeType::WHILE_LOOP ||
+         last->type == NodeType::FUNCTION_DEF)) {
       should_print_result = false;
     }
 
-    if (should_print_result && result && result->type != ValueType::NIL &&
-        result->type != ValueType::FUNCTION) {
-      switch (result->type) {
+    if (should_print_result && result.type() != ValueType::NIL &&
+        result.type() != ValueType::FUNCTION) {
+      switch (result.type()) {
       case ValueType::BOOLEAN:
-        std::cout << (result->b ? "true" : "false") << "\n";
+        std::cout << (result.b() ? "true" : "false") << "\n";
         break;
       case ValueType::INTEGER:
-        std::cout << result->i << "\n";
+        std::cout << result.i() << "\n";
         break;
       case ValueType::FLOAT:
-        std::cout << result->f << "\n";
+        std::cout << result.f() << "\n";
         break;
       case ValueType::STRING:
-        std::cout << result->s << "\n";
+        std::cout << result.s() << "\n";
         break;
       case ValueType::LIST: {
         std::cout << "[";
-        for (size_t i = 0; i < result->list.size(); ++i) {
+        for (size_t i = 0; i < result.list().size(); ++i) {
           if (i > 0)
             std::cout << ", ";
-          auto &item = result->list[i];
-          if (item->type == ValueType::STRING) {
-            std::cout << "\"" << item->s << "\"";
-          } else if (item->type == ValueType::INTEGER) {
-            std::cout << item->i;
-          } else if (item->type == ValueType::FLOAT) {
-            std::cout << item->f;
-          } else if (item->type == ValueType::BOOLEAN) {
-            std::cout << (item->b ? "true" : "false");
+          auto &item = result.list()[i];
+          if (item.type() == ValueType::STRING) {
+            std::cout << "\"" << item.s() << "\"";
+          } else if (item.type() == ValueType::INTEGER) {
+            std::cout << item.i();
+          } else if (item.type() == ValueType::FLOAT) {
+            std::cout << item.f();
+          } else if (item.type() == ValueType::BOOLEAN) {
+            std::cout << (item.b() ? "true" : "false");
           }
         }
         std::cout << "]\n";
@@ -251,6 +275,7 @@ void Shell::execute_code(const std::string &code) {
     }
   } catch (const std::exception &e) {
     std::cerr << "Error: " << e.what() << "\n";
+    failed = true;
   }
 }
 
@@ -295,9 +320,11 @@ void Shell::execute_manage_command(const std::string &arg) {
   }
 
   if (LibraryLoader::load_library(libname, evaluator.get_global_env())) {
-    std::cout << "Library '" << libname << "' loaded successfully.\n";
+    if (interactive)
+      std::cout << "Library '" << libname << "' loaded successfully.\n";
   } else {
     std::cerr << "Error: Unknown library '" << libname << "'\n";
+    failed = true;
     auto libs = LibraryLoader::get_available_libraries();
     std::cout << "Available libraries: ";
     for (size_t i = 0; i < libs.size(); ++i) {
@@ -309,6 +336,46 @@ void Shell::execute_manage_command(const std::string &arg) {
   }
 }
 
+void Shell::submit_line(const std::string &line) {
+  // Trim whitespace
+  std::string trimmed = line;
+  trimmed.erase(0, trimmed.find_first_not_of(" \t\n\r"));
+  trimmed.erase(trimmed.find_last_not_of(" \t\n\r") + 1);
+
+  // Handle line continuation
+  if (!trimmed.empty() && trimmed.back() == '\\') {
+    // Remove backslash and add to buffer
+    trimmed.pop_back();
+    multiline_buffer.push_back(trimmed);
+    return;
+  }
+
+  // Add current line to buffer
+  if (!trimmed.empty() || !multiline_buffer.empty()) {
+    multiline_buffer.push_back(trimmed);
+  }
+
+  // Check if we have a complete statement. Lines are joined with newlines
+  // so the parser can tell where a statement ends.
+  std::string full_code;
+  for (const auto &l : multiline_buffer) {
+    full_code += l + "\n";
+  }
+
+  if (!full_code.empty() && is_incomplete_statement(full_code)) {
+    // Continue collecting lines
+    return;
+  }
+
+  // Execute complete statement
+  if (!full_code.empty()) {
+    process_command(full_code);
+  }
+
+  // Clear buffer
+  multiline_buffer.clear();
+}
+
 void Shell::run() {
   print_welcome();
 
@@ -328,43 +395,45 @@ void Shell::run() {
       break;
     }
 
-    // Trim whitespace
-    std::string trimmed = line;
-    trimmed.erase(0, trimmed.find_first_not_of(" \t\n\r"));
-    trimmed.erase(trimmed.find_last_not_of(" \t\n\r") + 1);
-
-    // Handle line continuation
-    if (!trimmed.empty() && trimmed.back() == '\\') {
-      // Remove backslash and add to buffer
-      trimmed.pop_back();
-      multiline_buffer.push_back(trimmed);
-      continue;
-    }
+    submit_line(line);
+  }
+}
 
-    // Add current line to buffer
-    if (!trimmed.empty() || !multiline_buffer.empty()) {
-      multiline_buffer.push_back(trimmed);
-    }
+int Shell::run_script(const std::string &path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    std::cerr << "Error: Cannot open script '" << path << "'\n";
+    return 1;
+  }
 
-    // Check if we have a complete statement
+  interactive = false;
+  std::string line;
+  size_t line_no = 0;
+  size_t statement_line = 1;
+  while (!failed && std::getline(file, line)) {
+    ++line_no;
+    if (multiline_buffer.empty())
+      statement_line = line_no;
+    submit_line(line);
+  }
+
+  // An unterminated block at the end of the file still runs
+  if (!failed && !multiline_buffer.empty()) {
     std::string full_code;
     for (const auto &l : multiline_buffer) {
-      full_code += l + " ";
+      full_code += l + "\n";
     }
-
-    if (!full_code.empty() && is_incomplete_statement(full_code)) {
-      // Continue collecting lines
-      continue;
-    }
-
-    // Execute complete statement
-    if (!full_code.empty()) {
-      process_command(full_code);
-    }
-
-    // Clear buffer
     multiline_buffer.clear();
+    process_command(full_code);
+  }
+
+  std::cout.flush();
+  if (failed) {
+    std::cerr << path << ":" << statement_line
+              << ": script stopped after an error\n";
+    return 1;
   }
+  return 0;
 }
 
 } // namespace jls
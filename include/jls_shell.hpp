@@ -13,15 +13,24 @@ class Shell {
 public:
   Shell();
   void run();
+  // Runs a script file statement by statement, as if typed into the shell
+  // but without echoing results. Stops at the first error; returns the
+  // process exit code.
+  int run_script(const std::string &path);
 
 private:
-  Evaluator evaluator;
+  Evaluator evaluator; // owns the global environment; fallback interpreter
+  VM vm{&evaluator};
   std::string prompt = "jls> ";
   std::string continuation_prompt = "...> ";
   std::vector<std::string> multiline_buffer;
+  bool interactive = true;
+  bool failed = false; // a statement reported an error
 
   void print_welcome();
   void print_help();
+  // Buffers a line and runs the statement once it is complete.
+  void submit_line(const std::string &line);
   void process_command(const std::string &line);
   void execute_code(const std::string &code);
   void execute_tree_command(const std::string &arg);
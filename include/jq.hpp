@@ -1,12 +1,17 @@
 #ifndef BVALD_JQ_HPP
 #define BVALD_JQ_HPP
 
+#include <cstdio>
 #include <functional>
+#include <iosfwd>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // Forward declarations
+class JsonView;
+
 namespace jq {
 struct ASTNode;
 struct Program;
@@ -17,7 +22,71 @@ class Builtins;
 
 namespace jq {
 
+// Output callbacks receive each result as soon as the filter produces it,
+// so nothing is held back until the run ends. Returning false stops the run
+// early; the run still succeeds. JSON text handed to an OutputCallback is
+// only valid during the call.
+using OutputCallback = std::function<bool(std::string_view json)>;
+using ValueCallback = std::function<bool(const JvValuePtr &value)>;
+
+// A compiled filter, ready to run against any number of inputs. The program
+// is immutable, so copies are cheap (they share it) and one handle may be run
+// from several threads at once. A default-constructed handle is empty.
+class CompiledFilter {
+public:
+  CompiledFilter() = default;
+
+  explicit operator bool() const { return program_ != nullptr; }
+  const std::string &filter() const { return filter_; }
+
+  // Run against JSON text and collect every output as JSON text. Filters
+  // that are a plain path (.a.b[0]) read the text on demand: siblings are
+  // skimmed unparsed and only the target is parsed. Every object on the path
+  // is skimmed to its end, as the last duplicate key wins, so there is no
+  // early stop at the target field; skimmed values are not fully checked.
+  // Trailing text, or a step into a container of the wrong kind, falls back
+  // to the regular parse and its error.
+  bool run(std::string_view json_in, std::vector<std::string> &json_outputs,
+           std::string &err) const;
+
+  // Same, streaming each output to a callback, or to `out` one per line
+  bool run(std::string_view json_in, const OutputCallback &on_output,
+           std::string &err) const;
+  bool run(std::string_view json_in, FILE *out, std::string &err) const;
+
+  // Run against an already parsed value
+  bool run(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+           std::string &err) const;
+
+  // Run directly over a parsed JsonDocument; only the outputs are copied
+  bool run(const JsonView &input, std::vector<JvValuePtr> &outputs,
+           std::string &err) const;
+
+  // Value-level streaming forms of the two above
+  bool run(const JvValuePtr &input, const ValueCallback &on_output,
+           std::string &err) const;
+  bool run(const JsonView &input, const ValueCallback &on_output,
+           std::string &err) const;
+
+  // Print the optimized bytecode and constant pool (see print_program)
+  void disassemble(std::ostream &out) const;
+
+private:
+  friend class Engine;
+  std::shared_ptr<const Program> program_;
+  std::string filter_;
+  bool path_only_ = false; // only identity/field/index steps
+};
+
 // Streaming JSON query engine with full bytecode compilation and execution.
+// run() and run_streaming() keep no state in the Engine, so one instance
+// (or any number of them) may serve many threads at once; only the
+// two-argument compile() stores its result in the instance.
+//
+// Filters are a subset of jq: there are no path expressions, so path(f),
+// del(f) and the assignment operators (=, |=, +=, ...) are rejected, as are
+// destructuring (. as [$a, $b]) and string interpolation. See Docs.md for
+// the builtins.
 class Engine {
 public:
   Engine();
@@ -26,16 +95,32 @@ public:
   // Compile a jq filter into an AST and bytecode
   bool compile(const std::string &filter, std::string &err);
 
+  // Compile a jq filter into a reusable handle
+  bool compile(const std::string &filter, CompiledFilter &out,
+               std::string &err);
+
+  // Like compile(), but served from a process-wide LRU of recently used
+  // filters; run() and run_streaming() go through it.
+  static bool compile_cached(const std::string &filter, CompiledFilter &out,
+                             std::string &err);
+
   // Run a compiled filter against JSON text (returns first output for
   // compatibility)
   bool run(const std::string &filter, const std::string &json_in,
-           std::string &json_out, std::string &err);
+           std::string &json_out, std::string &err) const;
 
   // Run filter and collect all outputs
   bool run_streaming(const std::string &filter, const std::string &json_in,
-                     std::vector<std::string> &json_outputs, std::string &err);
+                     std::vector<std::string> &json_outputs,
+                     std::string &err) const;
+
+  // Run filter, handing each output to the callback as it is produced
+  bool run_streaming(const std::string &filter, const std::string &json_in,
+                     const OutputCallback &on_output, std::string &err) const;
 
-  // Register a custom builtin function
+  // Register a custom builtin function. Filters compiled earlier keep the
+  // builtins they were compiled against; the LRU is dropped so cached
+  // filters pick the new one up.
   static void register_builtin(
       const std::string &name,
       const std::function<bool(const JvValuePtr &, std::vector<JvValuePtr> &,
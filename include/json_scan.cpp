@@ -0,0 +1,494 @@
+#include "json_scan.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JSON_SCAN_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define JSON_SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+// ================= Byte classes =================
+
+enum : unsigned char {
+  CLS_QUOTE = 1,
+  CLS_BACKSLASH = 2,
+  CLS_WS = 4, // same set as the scalar parser's is_json_ws
+  CLS_OP = 8, // { } [ ] : ,
+  CLS_CTRL = 16
+};
+
+static constexpr std::array<unsigned char, 256> make_class_table() {
+  std::array<unsigned char, 256> t{};
+  for (int c = 0; c < 0x20; ++c)
+    t[c] = CLS_CTRL;
+  for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'})
+    t[c] |= CLS_WS;
+  for (unsigned char c : {'{', '}', '[', ']', ':', ','})
+    t[c] = CLS_OP;
+  t['"'] = CLS_QUOTE;
+  t['\\'] = CLS_BACKSLASH;
+  return t;
+}
+
+static constexpr std::array<unsigned char, 256> kClass = make_class_table();
+
+// One bit per byte of a 64-byte block.
+struct BlockMasks {
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t ws;
+  uint64_t op;
+  uint64_t ctrl;
+};
+
+using ClassifyFn = void (*)(const unsigned char *, BlockMasks &);
+
+[[maybe_unused]] static void classify_scalar(const unsigned char *p, BlockMasks &m) {
+  m = {};
+  for (int k = 0; k < 64; ++k) {
+    uint64_t c = kClass[p[k]];
+    m.quote |= (c & 1) << k;
+    m.backslash |= ((c >> 1) & 1) << k;
+    m.ws |= ((c >> 2) & 1) << k;
+    m.op |= ((c >> 3) & 1) << k;
+    m.ctrl |= ((c >> 4) & 1) << k;
+  }
+}
+
+#if JSON_SCAN_X86
+static inline uint64_t sse2_bits(__m128i x) {
+  return static_cast<uint16_t>(_mm_movemask_epi8(x));
+}
+
+// SSE2 is part of the x86-64 baseline, so this path needs no runtime check.
+static void classify_sse2(const unsigned char *p, BlockMasks &m) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i lbrace = _mm_set1_epi8('{'); // also matches '[' after | 0x20
+  const __m128i rbrace = _mm_set1_epi8('}'); // also matches ']' after | 0x20
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i four = _mm_set1_epi8(4);
+  const __m128i ctrl_max = _mm_set1_epi8(0x1F);
+  m = {};
+  for (int k = 0; k < 4; ++k) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * k));
+    __m128i folded = _mm_or_si128(v, case_bit);
+    // '\t'..'\r' are contiguous: (c - '\t') <= 4 as an unsigned byte
+    __m128i d = _mm_sub_epi8(v, tab);
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+                              _mm_cmpeq_epi8(_mm_min_epu8(d, four), d));
+    __m128i op = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(folded, lbrace),
+                     _mm_cmpeq_epi8(folded, rbrace)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma)));
+    __m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl_max), v);
+    int shift = 16 * k;
+    m.quote |= sse2_bits(_mm_cmpeq_epi8(v, quote)) << shift;
+    m.backslash |= sse2_bits(_mm_cmpeq_epi8(v, backslash)) << shift;
+    m.ws |= sse2_bits(ws) << shift;
+    m.op |= sse2_bits(op) << shift;
+    m.ctrl |= sse2_bits(ctrl) << shift;
+  }
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define JSON_SCAN_AVX2 1
+__attribute__((target("avx2"))) static inline uint64_t avx2_bits(__m256i x) {
+  return static_cast<uint32_t>(_mm256_movemask_epi8(x));
+}
+
+__attribute__((target("avx2"))) static void
+classify_avx2(const unsigned char *p, BlockMasks &m) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i colon = _mm256_set1_epi8(':');
+  const __m256i comma = _mm256_set1_epi8(',');
+  const __m256i lbrace = _mm256_set1_epi8('{');
+  const __m256i rbrace = _mm256_set1_epi8('}');
+  const __m256i case_bit = _mm256_set1_epi8(0x20);
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i four = _mm256_set1_epi8(4);
+  const __m256i ctrl_max = _mm256_set1_epi8(0x1F);
+  m = {};
+  for (int k = 0; k < 2; ++k) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32 * k));
+    __m256i folded = _mm256_or_si256(v, case_bit);
+    __m256i d = _mm256_sub_epi8(v, tab);
+    __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                 _mm256_cmpeq_epi8(_mm256_min_epu8(d, four), d));
+    __m256i op = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(folded, lbrace),
+                        _mm256_cmpeq_epi8(folded, rbrace)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, colon),
+                        _mm256_cmpeq_epi8(v, comma)));
+    __m256i ctrl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl_max), v);
+    int shift = 32 * k;
+    m.quote |= avx2_bits(_mm256_cmpeq_epi8(v, quote)) << shift;
+    m.backslash |= avx2_bits(_mm256_cmpeq_epi8(v, backslash)) << shift;
+    m.ws |= avx2_bits(ws) << shift;
+    m.op |= avx2_bits(op) << shift;
+    m.ctrl |= avx2_bits(ctrl) << shift;
+  }
+}
+#endif
+#endif // JSON_SCAN_X86
+
+#if JSON_SCAN_NEON
+// Packs four 16-lane comparison results into one 64-bit mask.
+static inline uint64_t neon_bits(uint8x16_t a, uint8x16_t b, uint8x16_t c,
+                                 uint8x16_t d) {
+  const uint8x16_t weight = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+                             0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+  uint8x16_t s0 = vpaddq_u8(vandq_u8(a, weight), vandq_u8(b, weight));
+  uint8x16_t s1 = vpaddq_u8(vandq_u8(c, weight), vandq_u8(d, weight));
+  s0 = vpaddq_u8(s0, s1);
+  s0 = vpaddq_u8(s0, s0);
+  return vgetq_lane_u64(vreinterpretq_u64_u8(s0), 0);
+}
+
+static void classify_neon(const unsigned char *p, BlockMasks &m) {
+  uint8x16_t q[4], b[4], w[4], o[4], c[4];
+  for (int k = 0; k < 4; ++k) {
+    uint8x16_t v = vld1q_u8(p + 16 * k);
+    uint8x16_t folded = vorrq_u8(v, vdupq_n_u8(0x20));
+    q[k] = vceqq_u8(v, vdupq_n_u8('"'));
+    b[k] = vceqq_u8(v, vdupq_n_u8('\\'));
+    w[k] = vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')),
+                    vcleq_u8(vsubq_u8(v, vdupq_n_u8('\t')), vdupq_n_u8(4)));
+    o[k] = vorrq_u8(vorrq_u8(vceqq_u8(folded, vdupq_n_u8('{')),
+                             vceqq_u8(folded, vdupq_n_u8('}'))),
+                    vorrq_u8(vceqq_u8(v, vdupq_n_u8(':')),
+                             vceqq_u8(v, vdupq_n_u8(','))));
+    c[k] = vcleq_u8(v, vdupq_n_u8(0x1F));
+  }
+  m.quote = neon_bits(q[0], q[1], q[2], q[3]);
+  m.backslash = neon_bits(b[0], b[1], b[2], b[3]);
+  m.ws = neon_bits(w[0], w[1], w[2], w[3]);
+  m.op = neon_bits(o[0], o[1], o[2], o[3]);
+  m.ctrl = neon_bits(c[0], c[1], c[2], c[3]);
+}
+#endif
+
+static ClassifyFn pick_classifier() {
+#if JSON_SCAN_AVX2
+  if (__builtin_cpu_supports("avx2"))
+    return classify_avx2;
+#endif
+#if JSON_SCAN_X86
+  return classify_sse2;
+#elif JSON_SCAN_NEON
+  return classify_neon;
+#else
+  return classify_scalar;
+#endif
+}
+
+// Bit i of the result is the XOR of bits 0..i of x, i.e. "inside a quoted
+// region" when x holds the unescaped quote positions.
+static inline uint64_t prefix_xor(uint64_t x) {
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+static inline bool is_hex(unsigned char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+         (c >= 'A' && c <= 'F');
+}
+
+// Check the characters following each unescaped backslash. Escapes are rare,
+// so this walks the set bits one at a time.
+static bool check_escapes(const unsigned char *s, size_t n, size_t block,
+                          uint64_t escaped) {
+  while (escaped) {
+    size_t at = block + static_cast<size_t>(std::countr_zero(escaped));
+    escaped &= escaped - 1;
+    if (at >= n)
+      return false;
+    switch (s[at]) {
+    case '"':
+    case '\\':
+    case '/':
+    case 'b':
+    case 'f':
+    case 'n':
+    case 'r':
+    case 't':
+      break;
+    case 'u':
+      if (n - at <= 4 || !is_hex(s[at + 1]) || !is_hex(s[at + 2]) ||
+          !is_hex(s[at + 3]) || !is_hex(s[at + 4]))
+        return false;
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+// Carried between blocks by stage 1.
+struct ScanState {
+  uint64_t prev_escaped = 0;   // first byte of the next block is escaped
+  uint64_t prev_in_string = 0; // all ones while a string spans blocks
+  uint64_t prev_scalar = 0;    // last byte of the block was inside an atom
+};
+
+// Stage 1 for the 64-byte block at `block`: returns the token-start bitmask
+// in `tokens`, or false if the block contains invalid string contents.
+static inline bool scan_block(const unsigned char *s, size_t n, size_t block,
+                              ClassifyFn classify, ScanState &st,
+                              uint64_t &tokens) {
+  const unsigned char *p = s + block;
+  unsigned char tail[64];
+  if (n - block < 64) {
+    // pad the final block with whitespace, which produces no tokens
+    std::memset(tail, ' ', sizeof tail);
+    std::memcpy(tail, p, n - block);
+    p = tail;
+  }
+  BlockMasks m;
+  classify(p, m);
+
+  // Bytes preceded by an odd run of backslashes.
+  uint64_t escaped = 0;
+  if (m.backslash | st.prev_escaped) {
+    escaped = st.prev_escaped;
+    uint64_t bs = m.backslash & ~st.prev_escaped;
+    st.prev_escaped = 0;
+    while (bs) {
+      int b = std::countr_zero(bs);
+      if (b == 63) {
+        st.prev_escaped = 1;
+        break;
+      }
+      uint64_t next = uint64_t(2) << b;
+      escaped |= next;
+      bs &= ~(next | (uint64_t(1) << b));
+    }
+  }
+
+  uint64_t quote = m.quote & ~escaped;
+  uint64_t in_string = prefix_xor(quote) ^ st.prev_in_string;
+  st.prev_in_string =
+      static_cast<uint64_t>(static_cast<int64_t>(in_string) >> 63);
+
+  // Control characters are never allowed inside strings.
+  if (m.ctrl & in_string & ~quote)
+    return false;
+  if (escaped && !check_escapes(s, n, block, escaped))
+    return false;
+
+  uint64_t outside = ~in_string;
+  uint64_t scalar = outside & ~(m.op | m.ws | m.quote);
+  uint64_t scalar_start = scalar & ~((scalar << 1) | st.prev_scalar);
+  st.prev_scalar = scalar >> 63;
+
+  tokens = (m.op & outside) | (quote & in_string) | scalar_start;
+  return true;
+}
+
+static ClassifyFn classifier() {
+  static const ClassifyFn classify = pick_classifier();
+  return classify;
+}
+
+bool json_structural_index(std::string_view text, std::vector<uint32_t> &out) {
+  out.clear();
+  if (text.size() > UINT32_MAX)
+    return false;
+  const unsigned char *s = reinterpret_cast<const unsigned char *>(text.data());
+  const size_t n = text.size();
+  ClassifyFn classify = classifier();
+  ScanState st;
+  for (size_t block = 0; block < n; block += 64) {
+    uint64_t tokens;
+    if (!scan_block(s, n, block, classify, st, tokens))
+      return false;
+    size_t base = out.size();
+    out.resize(base + static_cast<size_t>(std::popcount(tokens)));
+    while (tokens) {
+      out[base++] = static_cast<uint32_t>(block + std::countr_zero(tokens));
+      tokens &= tokens - 1;
+    }
+  }
+  return st.prev_in_string == 0;
+}
+
+// Validate the number or literal starting at p; it must run up to the next
+// whitespace, structural character or quote.
+static bool check_atom(const unsigned char *s, size_t n, size_t p) {
+  size_t i = p;
+  auto digits = [&]() {
+    size_t start = i;
+    while (i < n && s[i] >= '0' && s[i] <= '9')
+      ++i;
+    return i != start;
+  };
+  switch (s[i]) {
+  case 't':
+    if (n - i < 4 || std::memcmp(s + i, "true", 4) != 0)
+      return false;
+    i += 4;
+    break;
+  case 'f':
+    if (n - i < 5 || std::memcmp(s + i, "false", 5) != 0)
+      return false;
+    i += 5;
+    break;
+  case 'n':
+    if (n - i < 4 || std::memcmp(s + i, "null", 4) != 0)
+      return false;
+    i += 4;
+    break;
+  default:
+    if (s[i] == '-')
+      ++i;
+    if (i < n && s[i] == '0')
+      ++i;
+    else if (i >= n || s[i] < '1' || s[i] > '9' || !digits())
+      return false;
+    if (i < n && s[i] == '.') {
+      ++i;
+      if (!digits())
+        return false;
+    }
+    if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+      ++i;
+      if (i < n && (s[i] == '+' || s[i] == '-'))
+        ++i;
+      if (!digits())
+        return false;
+    }
+    break;
+  }
+  return i == n || (kClass[s[i]] & (CLS_WS | CLS_OP | CLS_QUOTE)) != 0;
+}
+
+// Stage 2: grammar checker fed one token start at a time, so it can consume
+// the index in batches while stage 1 is still running.
+class GrammarChecker {
+public:
+  GrammarChecker(const unsigned char *s, size_t n) : s(s), n(n) {}
+
+  bool feed(size_t pos) {
+    char c = static_cast<char>(s[pos]);
+    switch (state) {
+    case FIRST_KEY:
+      if (c == '}')
+        return close();
+      [[fallthrough]];
+    case KEY:
+      if (c != '"')
+        return false;
+      state = COLON;
+      return true;
+    case COLON:
+      if (c != ':')
+        return false;
+      state = VALUE;
+      return true;
+    case FIRST_VALUE:
+      if (c == ']')
+        return close();
+      [[fallthrough]];
+    case VALUE:
+      switch (c) {
+      case '{':
+        stack.push_back('{');
+        state = FIRST_KEY;
+        return true;
+      case '[':
+        stack.push_back('[');
+        state = FIRST_VALUE;
+        return true;
+      case '"': // contents were checked in stage 1
+        state = AFTER_VALUE;
+        return true;
+      case '}':
+      case ']':
+      case ',':
+      case ':':
+        return false;
+      default:
+        state = AFTER_VALUE;
+        return check_atom(s, n, pos);
+      }
+    case AFTER_VALUE:
+      if (stack.empty())
+        return false; // trailing data
+      if (c == ',') {
+        state = stack.back() == '{' ? KEY : VALUE;
+        return true;
+      }
+      if (c != (stack.back() == '{' ? '}' : ']'))
+        return false;
+      return close();
+    }
+    return false;
+  }
+
+  bool finish() const { return state == AFTER_VALUE && stack.empty(); }
+
+private:
+  enum State { VALUE, FIRST_KEY, KEY, COLON, FIRST_VALUE, AFTER_VALUE };
+
+  const unsigned char *s;
+  size_t n;
+  State state = VALUE;
+  std::vector<char> stack; // '{' or '[' per open container
+
+  bool close() {
+    stack.pop_back();
+    state = AFTER_VALUE;
+    return true;
+  }
+};
+
+bool json_validate_fast(std::string_view text) {
+  if (text.size() > UINT32_MAX)
+    return false;
+  const unsigned char *s = reinterpret_cast<const unsigned char *>(text.data());
+  const size_t n = text.size();
+  ClassifyFn classify = classifier();
+  ScanState st;
+  GrammarChecker grammar(s, n);
+
+  // Index a batch of blocks, then walk it; keeps the index in cache and its
+  // size independent of the input.
+  constexpr size_t BATCH_BLOCKS = 256;
+  std::vector<uint32_t> idx(BATCH_BLOCKS * 64);
+  for (size_t batch = 0; batch < n; batch += BATCH_BLOCKS * 64) {
+    size_t end = std::min(n, batch + BATCH_BLOCKS * 64);
+    size_t count = 0;
+    for (size_t block = batch; block < end; block += 64) {
+      uint64_t tokens;
+      if (!scan_block(s, n, block, classify, st, tokens))
+        return false;
+      while (tokens) {
+        idx[count++] = static_cast<uint32_t>(block + std::countr_zero(tokens));
+        tokens &= tokens - 1;
+      }
+    }
+    for (size_t k = 0; k < count; ++k)
+      if (!grammar.feed(idx[k]))
+        return false;
+  }
+  return st.prev_in_string == 0 && grammar.finish();
+}
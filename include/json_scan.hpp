@@ -0,0 +1,33 @@
+#ifndef JSON_SCAN_HPP
+#define JSON_SCAN_HPP
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Vectorized structural scanner used as the fast path of validate_json.
+//
+// Stage 1 classifies the input 64 bytes at a time (AVX2 or SSE2 on x86-64,
+// NEON on AArch64, a table-driven scalar loop elsewhere) into quote,
+// backslash, whitespace, structural and control-character bitmasks, resolves
+// escapes and string regions, and records the offset of every token start:
+// the structural characters {}[]:, outside strings, opening quotes, and the
+// first byte of each number/literal. String contents (control characters and
+// escape sequences) are fully checked in this stage.
+//
+// Stage 2 walks that index with an iterative grammar checker, so nesting
+// depth is limited only by memory.
+//
+// Both stages only answer valid/invalid. Callers that need a message re-run
+// the exact scalar parser, which reports the same positions as before.
+
+// Stage 1. Returns false when the input is certainly invalid (bad string
+// contents, unterminated string) or too large to index with 32-bit offsets.
+bool json_structural_index(std::string_view s, std::vector<uint32_t> &out);
+
+// Stage 1 + stage 2. Returns true only for documents the scalar parser
+// accepts; false means "invalid, or not decidable here" and the caller should
+// fall back to the scalar parser.
+bool json_validate_fast(std::string_view s);
+
+#endif // JSON_SCAN_HPP
@@ -1,19 +1,38 @@
 #include "libjsonval.hpp"
+#include "json_scan.hpp"
+#include "metrics.hpp"
+#include "thread_pool.hpp"
 
 #include <algorithm>
 #include <cctype>
+#include <charconv>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <filesystem>
 #include <memory>
+#include <optional>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
 #ifdef _WIN32
 #include <direct.h> // _mkdir
 #include <io.h>     // _access
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define NOGDI
+#include <windows.h> // CreateFileMapping / MapViewOfFile
 #else
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #endif
+#ifdef USE_CURL
+#include <curl/curl.h>
+#endif
 
 static bool dir_exists(const std::string &path) {
 #ifdef _WIN32
@@ -22,41 +41,72 @@ static bool dir_exists(const std::string &path) {
   return access(path.c_str(), F_OK) == 0;
 #endif
 }
+
 #include "../src/jq/jq_types.hpp"
 #include "jq.hpp"
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <list>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
 #include <vector>
 
 const std::string VERSION =
     "0.2.1"; // i was to lazy to make a git repo by 0.1.0
 
 // ================= Helper Functions for Error Messages =================
-// Calculate Levenshtein distance for typo suggestions
-static size_t levenshtein_distance(const std::string &a, const std::string &b) {
-  size_t m = a.size();
-  size_t n = b.size();
-  std::vector<std::vector<size_t>> dp(m + 1, std::vector<size_t>(n + 1));
-
-  for (size_t i = 0; i <= m; ++i)
-    dp[i][0] = i;
-  for (size_t j = 0; j <= n; ++j)
-    dp[0][j] = j;
+// Levenshtein distance for typo suggestions, capped: anything above `limit`
+// is reported as limit + 1. Only the diagonal band |i - j| <= limit can stay
+// under the cap, so two rows of that band on the stack are enough and no
+// memory is allocated.
+static constexpr size_t kMaxEditLimit = 8;
 
+static size_t levenshtein_distance(std::string_view a, std::string_view b,
+                                   size_t limit) {
+  limit = std::min(limit, kMaxEditLimit);
+  const size_t cap = limit + 1;
+  const size_t m = a.size(), n = b.size();
+  if ((m > n ? m - n : n - m) > limit)
+    return cap;
+  // row[d] holds dp[i][i + d - limit], i.e. the band around the diagonal
+  size_t rows[2][2 * kMaxEditLimit + 1];
+  size_t *prev = rows[0], *cur = rows[1];
+  const size_t width = 2 * limit + 1;
+  for (size_t d = 0; d < width; ++d)
+    prev[d] = d >= limit ? d - limit : cap; // dp[0][j] = j
   for (size_t i = 1; i <= m; ++i) {
-    for (size_t j = 1; j <= n; ++j) {
-      if (a[i - 1] == b[j - 1]) {
-        dp[i][j] = dp[i - 1][j - 1];
+    size_t row_min = cap;
+    for (size_t d = 0; d < width; ++d) {
+      // column j = i + d - limit
+      if (i + d < limit || i + d - limit > n) {
+        cur[d] = cap;
+        continue;
+      }
+      size_t j = i + d - limit;
+      size_t v;
+      if (j == 0) {
+        v = i;
       } else {
-        dp[i][j] = 1 + std::min({dp[i - 1][j], dp[i][j - 1], dp[i - 1][j - 1]});
+        v = prev[d] + (a[i - 1] != b[j - 1]);                // substitute
+        if (d + 1 < width)
+          v = std::min(v, prev[d + 1] + 1);                  // delete
+        if (d > 0)
+          v = std::min(v, cur[d - 1] + 1);                   // insert
       }
+      cur[d] = std::min(v, cap);
+      row_min = std::min(row_min, cur[d]);
     }
+    if (row_min >= cap)
+      return cap; // every path already exceeds the limit
+    std::swap(prev, cur);
   }
-  return dp[m][n];
+  return prev[n + limit - m];
 }
 
 // Find closest match from a list of candidates
@@ -69,71 +119,354 @@ find_closest_match(const std::string &typo,
   size_t min_dist = max_distance + 1;
   std::string best_match;
   for (const auto &candidate : candidates) {
-    size_t dist = levenshtein_distance(typo, candidate);
+    // anything no better than the best so far is not worth finishing
+    size_t dist = levenshtein_distance(typo, candidate, min_dist - 1);
     if (dist < min_dist) {
       min_dist = dist;
       best_match = candidate;
+      if (min_dist == 0)
+        break;
     }
   }
   return (min_dist <= max_distance) ? best_match : "";
 }
 
-struct JsonParser {
-  const std::string &s;
+// ================= JSON Parser Core =================
+// One recursive-descent parser serves both validate_json and parse_json_dom.
+// The grammar lives in JsonParser; what happens with each parsed value is
+// decided by a sink policy, so validation pays nothing for tree building and
+// the DOM gets the full strict grammar check in the same single pass.
+//
+// A sink provides:
+//   Node        - cheap handle threaded through the recursion
+//   wants_text  - true if the sink needs decoded string contents
+//   null / boolean / number / string (Node, value)
+//   begin_object(Node), member(Node, key) -> Node, end_object(Node, count)
+//   begin_array(Node), element(Node) -> Node, end_array(Node, count)
+
+// Validate-only sink: every hook is a no-op and compiles away.
+struct NullSink {
+  struct Node {};
+  static constexpr bool wants_text = false;
+
+  void null(Node) {}
+  void boolean(Node, bool) {}
+  void number(Node, std::string_view) {}
+  void string(Node, std::string_view) {}
+  void begin_object(Node) {}
+  Node member(Node, std::string_view) { return {}; }
+  void end_object(Node, size_t) {}
+  void begin_array(Node) {}
+  Node element(Node) { return {}; }
+  void end_array(Node, size_t) {}
+};
+
+static double parse_number_text(std::string_view text) {
+  double v = 0.0;
+  auto res = std::from_chars(text.data(), text.data() + text.size(), v);
+  if (res.ec == std::errc::result_out_of_range) {
+    // from_chars leaves v untouched on overflow; strtod yields +-inf / 0
+    std::string tmp(text);
+    v = std::strtod(tmp.c_str(), nullptr);
+  }
+  return v;
+}
+
+// DOM sink: builds the JsonValue tree in place, children are constructed
+// directly in their parent's container.
+struct DomSink {
+  using Node = JsonValue *;
+  static constexpr bool wants_text = true;
+
+  void null(Node n) { n->t = JsonValue::T_NULL; }
+  void boolean(Node n, bool v) {
+    n->t = JsonValue::T_BOOL;
+    n->b = v;
+  }
+  void number(Node n, std::string_view text) {
+    n->t = JsonValue::T_NUMBER;
+    n->n = parse_number_text(text);
+  }
+  void string(Node n, std::string_view v) {
+    n->t = JsonValue::T_STRING;
+    n->s.assign(v.data(), v.size());
+  }
+  void begin_object(Node n) { n->t = JsonValue::T_OBJECT; }
+  Node member(Node n, std::string_view key) {
+    JsonValue &slot = n->o[std::string(key)];
+    slot = JsonValue(); // duplicate keys: last one wins
+    return &slot;
+  }
+  void end_object(Node, size_t) {}
+  void begin_array(Node n) { n->t = JsonValue::T_ARRAY; }
+  Node element(Node n) {
+    n->a.emplace_back();
+    return &n->a.back();
+  }
+  void end_array(Node, size_t) {}
+};
+
+// Tape entry layout used by JsonDocument: tag in the top byte, payload below.
+//   'n' 't' 'f'  literals
+//   'd'          number; the following entry holds the IEEE-754 bits
+//   '"'          string; payload = arena offset of its uint32 length prefix
+//   '{' '['      container start; payload = index one past the matching end
+//                entry (low 32 bits) | child count (next 24 bits, saturated)
+//   '}' ']'      container end; payload = index of the start entry
+// Object members are a key string entry followed by the value.
+static constexpr int TAPE_TAG_SHIFT = 56;
+static constexpr uint64_t TAPE_PAYLOAD_MASK = (uint64_t(1) << 56) - 1;
+static constexpr uint64_t TAPE_COUNT_MAX = 0xFFFFFF;
+
+static inline char tape_tag(uint64_t e) {
+  return static_cast<char>(e >> TAPE_TAG_SHIFT);
+}
+static inline uint64_t tape_payload(uint64_t e) { return e & TAPE_PAYLOAD_MASK; }
+
+// Tape sink: appends to a JsonDocument. Containers are patched with their
+// end index and child count when they close.
+struct TapeSink {
+  struct Node {};
+  static constexpr bool wants_text = true;
+
+  JsonDocument &doc;
+  std::vector<size_t> open; // start entries of unclosed containers
+  bool overflow = false;    // offsets no longer fit the entry layout
+
+  explicit TapeSink(JsonDocument &d) : doc(d) {}
+  size_t entries() const { return doc.tape_.size(); }
+
+  void push(char tag, uint64_t payload) {
+    doc.tape_.push_back(
+        (static_cast<uint64_t>(static_cast<unsigned char>(tag))
+         << TAPE_TAG_SHIFT) |
+        payload);
+  }
+  void null(Node) { push('n', 0); }
+  void boolean(Node, bool v) { push(v ? 't' : 'f', 0); }
+  void number(Node, std::string_view text) {
+    double v = parse_number_text(text);
+    uint64_t bits;
+    std::memcpy(&bits, &v, sizeof bits);
+    push('d', 0);
+    doc.tape_.push_back(bits);
+  }
+  void string(Node, std::string_view v) {
+    size_t off = doc.strings_.size();
+    if (v.size() > UINT32_MAX || off > TAPE_PAYLOAD_MASK)
+      overflow = true;
+    uint32_t len = static_cast<uint32_t>(v.size());
+    doc.strings_.resize(off + sizeof len + v.size());
+    std::memcpy(&doc.strings_[off], &len, sizeof len);
+    std::memcpy(&doc.strings_[off + sizeof len], v.data(), v.size());
+    push('"', off);
+  }
+  void begin_container(char tag) {
+    open.push_back(doc.tape_.size());
+    push(tag, 0);
+  }
+  void end_container(char open_tag, char close_tag, size_t count) {
+    size_t start = open.back();
+    open.pop_back();
+    push(close_tag, start);
+    size_t end = doc.tape_.size();
+    if (end > UINT32_MAX)
+      overflow = true;
+    uint64_t n = std::min<uint64_t>(count, TAPE_COUNT_MAX);
+    doc.tape_[start] =
+        (static_cast<uint64_t>(static_cast<unsigned char>(open_tag))
+         << TAPE_TAG_SHIFT) |
+        (n << 32) | static_cast<uint32_t>(end);
+  }
+  void begin_object(Node) { begin_container('{'); }
+  Node member(Node, std::string_view key) {
+    string({}, key);
+    return {};
+  }
+  void end_object(Node, size_t count) { end_container('{', '}', count); }
+  void begin_array(Node) { begin_container('['); }
+  Node element(Node) { return {}; }
+  void end_array(Node, size_t count) { end_container('[', ']', count); }
+};
+
+// Failure kinds recorded by JsonParser. The parser only keeps a code and the
+// byte offset; describe_parse_error() turns them into text when reporting.
+enum class JsonParseError {
+  NONE,
+  UNEXPECTED_END,
+  UNEXPECTED_CHAR,
+  EXPECTED_OBJECT,
+  EXPECTED_COLON,
+  EXPECTED_OBJECT_SEP,
+  EXPECTED_ARRAY,
+  EXPECTED_ARRAY_SEP,
+  EXPECTED_STRING,
+  UNTERMINATED_ESCAPE,
+  INVALID_UNICODE_ESCAPE,
+  INVALID_ESCAPE,
+  CONTROL_CHARACTER,
+  UNTERMINATED_STRING,
+  INVALID_NUMBER,
+  INVALID_FRACTION,
+  INVALID_EXPONENT,
+  INVALID_LITERAL,
+  TRAILING_DATA
+};
+
+// Whitespace accepted between tokens (the std::isspace set in the "C" locale,
+// which earlier versions of the parser used).
+static inline bool is_json_ws(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' ||
+         c == '\f';
+}
+
+// 1-based line/column of a byte offset. Only computed on the error path.
+static void offset_to_line_column(std::string_view s, size_t pos, size_t &line,
+                                  size_t &column) {
+  pos = std::min(pos, s.size());
+  line = 1 + static_cast<size_t>(std::count(s.begin(), s.begin() + pos, '\n'));
+  size_t nl = pos == 0 ? std::string_view::npos : s.rfind('\n', pos - 1);
+  column = nl == std::string_view::npos ? pos + 1 : pos - nl;
+}
+
+// `ch` is the offending character for UNEXPECTED_CHAR and INVALID_ESCAPE.
+static std::string format_parse_error(JsonParseError e, char ch, size_t line,
+                                      size_t column) {
+  std::string msg;
+  switch (e) {
+  case JsonParseError::NONE:
+    return "";
+  case JsonParseError::TRAILING_DATA:
+    return "trailing data after JSON value";
+  case JsonParseError::UNEXPECTED_END:
+    msg = "unexpected end of input";
+    break;
+  case JsonParseError::UNEXPECTED_CHAR:
+    msg = std::string("unexpected character '") + ch + "'";
+    break;
+  case JsonParseError::EXPECTED_OBJECT:
+    msg = "expected '{'";
+    break;
+  case JsonParseError::EXPECTED_COLON:
+    msg = "expected ':' after object key";
+    break;
+  case JsonParseError::EXPECTED_OBJECT_SEP:
+    msg = "expected ',' or '}' in object";
+    break;
+  case JsonParseError::EXPECTED_ARRAY:
+    msg = "expected '['";
+    break;
+  case JsonParseError::EXPECTED_ARRAY_SEP:
+    msg = "expected ',' or ']' in array";
+    break;
+  case JsonParseError::EXPECTED_STRING:
+    msg = "expected '\"'";
+    break;
+  case JsonParseError::UNTERMINATED_ESCAPE:
+    msg = "unterminated escape in string";
+    break;
+  case JsonParseError::INVALID_UNICODE_ESCAPE:
+    msg = "invalid unicode escape in string";
+    break;
+  case JsonParseError::INVALID_ESCAPE:
+    msg = std::string("invalid escape: ") + ch;
+    break;
+  case JsonParseError::CONTROL_CHARACTER:
+    msg = "control character in string";
+    break;
+  case JsonParseError::UNTERMINATED_STRING:
+    msg = "unterminated string";
+    break;
+  case JsonParseError::INVALID_NUMBER:
+    msg = "invalid number";
+    break;
+  case JsonParseError::INVALID_FRACTION:
+    msg = "invalid fractional part in number";
+    break;
+  case JsonParseError::INVALID_EXPONENT:
+    msg = "invalid exponent in number";
+    break;
+  case JsonParseError::INVALID_LITERAL:
+    msg = "invalid literal";
+    break;
+  }
+  return msg + " at line " + std::to_string(line) + ", column " +
+         std::to_string(column);
+}
+
+static std::string describe_parse_error(std::string_view s, JsonParseError e,
+                                        size_t pos) {
+  char ch = 0;
+  if (e == JsonParseError::UNEXPECTED_CHAR && pos < s.size())
+    ch = s[pos];
+  else if (e == JsonParseError::INVALID_ESCAPE && pos > 0)
+    ch = s[pos - 1];
+  size_t line = 1, column = 1;
+  offset_to_line_column(s, pos, line, column);
+  return format_parse_error(e, ch, line, column);
+}
+
+template <typename Sink> struct JsonParser {
+  using Node = typename Sink::Node;
+
+  std::string_view s;
+  Sink &sink;
   size_t i = 0;
-  std::string err;
-  size_t line = 1;
-  size_t column = 1;
+  // Only the failure kind and byte offset are recorded while parsing; the
+  // message (with line/column) is built by error_message() on demand.
+  JsonParseError error = JsonParseError::NONE;
+  size_t error_pos = 0;
+  std::string text; // decoded string scratch, reused across strings
+
+  JsonParser(std::string_view str, Sink &k) : s(str), sink(k), i(0) {}
+
+  bool fail(JsonParseError e) {
+    error = e;
+    error_pos = i;
+    return false;
+  }
 
-  JsonParser(const std::string &str) : s(str), i(0), line(1), column(1) {}
+  std::string error_message() const {
+    return describe_parse_error(s, error, error_pos);
+  }
 
   void skip_ws() {
-    while (i < s.size() && std::isspace(static_cast<unsigned char>(s[i]))) {
-      if (s[i] == '\n') {
-        ++line;
-        column = 1;
-      } else {
-        ++column;
-      }
+    while (i < s.size() && is_json_ws(s[i]))
       ++i;
-    }
   }
 
-  bool parse_value() {
+  bool parse_value(Node out) {
     skip_ws();
-    if (i >= s.size()) {
-      err = "unexpected end of input at line " + std::to_string(line) +
-            ", column " + std::to_string(column);
-      return false;
-    }
+    if (i >= s.size())
+      return fail(JsonParseError::UNEXPECTED_END);
     char c = s[i];
     if (c == '{')
-      return parse_object();
+      return parse_object(out);
     if (c == '[')
-      return parse_array();
-    if (c == '"')
-      return parse_string();
+      return parse_array(out);
+    if (c == '"') {
+      if (!parse_string())
+        return false;
+      sink.string(out, text);
+      return true;
+    }
     if (c == '-' || (c >= '0' && c <= '9'))
-      return parse_number();
+      return parse_number(out);
     if (c == 't' || c == 'f' || c == 'n')
-      return parse_literal();
-    err = std::string("unexpected character '") + c + "' at line " +
-          std::to_string(line) + ", column " + std::to_string(column);
-    return false;
+      return parse_literal(out);
+    return fail(JsonParseError::UNEXPECTED_CHAR);
   }
 
-  bool parse_object() {
-    if (s[i] != '{') {
-      err = "expected '{' at line " + std::to_string(line) + ", column " +
-            std::to_string(column);
-      return false;
-    }
-    ++column;
+  bool parse_object(Node out) {
+    if (s[i] != '{')
+      return fail(JsonParseError::EXPECTED_OBJECT);
     ++i;
+    sink.begin_object(out);
+    size_t count = 0;
     skip_ws();
     if (i < s.size() && s[i] == '}') {
-      ++column;
       ++i;
+      sink.end_object(out, count);
       return true;
     }
     while (true) {
@@ -141,118 +474,171 @@ struct JsonParser {
       if (!parse_string())
         return false;
       skip_ws();
-      if (i >= s.size() || s[i] != ':') {
-        err = "expected ':' after object key at line " + std::to_string(line) +
-              ", column " + std::to_string(column);
-        return false;
-      }
-      ++column;
+      if (i >= s.size() || s[i] != ':')
+        return fail(JsonParseError::EXPECTED_COLON);
       ++i;
-      if (!parse_value())
+      if (!parse_value(sink.member(out, text)))
         return false;
+      ++count;
       skip_ws();
       if (i < s.size() && s[i] == ',') {
-        ++column;
         ++i;
         continue;
       }
       if (i < s.size() && s[i] == '}') {
-        ++column;
         ++i;
+        sink.end_object(out, count);
         return true;
       }
-      err = "expected ',' or '}' in object at line " + std::to_string(line) +
-            ", column " + std::to_string(column);
-      return false;
+      return fail(JsonParseError::EXPECTED_OBJECT_SEP);
     }
   }
 
-  bool parse_array() {
-    if (s[i] != '[') {
-      err = "expected '[' at line " + std::to_string(line) + ", column " +
-            std::to_string(column);
-      return false;
-    }
-    ++column;
+  bool parse_array(Node out) {
+    if (s[i] != '[')
+      return fail(JsonParseError::EXPECTED_ARRAY);
     ++i;
+    sink.begin_array(out);
+    size_t count = 0;
     skip_ws();
     if (i < s.size() && s[i] == ']') {
-      ++column;
       ++i;
+      sink.end_array(out, count);
       return true;
     }
     while (true) {
-      if (!parse_value())
+      if (!parse_value(sink.element(out)))
         return false;
+      ++count;
       skip_ws();
       if (i < s.size() && s[i] == ',') {
-        ++column;
         ++i;
         continue;
       }
       if (i < s.size() && s[i] == ']') {
-        ++column;
         ++i;
+        sink.end_array(out, count);
         return true;
       }
-      err = "expected ',' or ']' in array at line " + std::to_string(line) +
-            ", column " + std::to_string(column);
-      return false;
+      return fail(JsonParseError::EXPECTED_ARRAY_SEP);
     }
   }
 
+  // Scan a string starting at the opening quote. When the sink wants text,
+  // the decoded contents are left in `text`.
   bool parse_string() {
-    if (s[i] != '"') {
-      err = "expected '\"' at line " + std::to_string(line) + ", column " +
-            std::to_string(column);
-      return false;
-    }
-    ++column;
+    if (i >= s.size() || s[i] != '"')
+      return fail(JsonParseError::EXPECTED_STRING);
     ++i;
+    if constexpr (Sink::wants_text)
+      text.clear();
     while (i < s.size()) {
-      char c = s[i++];
-      if (c == '\n') {
-        ++line;
-        column = 1;
-      } else {
-        ++column;
+      // copy runs of plain characters in one go
+      size_t run = i;
+      while (run < s.size() && s[run] != '"' && s[run] != '\\' &&
+             static_cast<unsigned char>(s[run]) >= 0x20)
+        ++run;
+      if (run != i) {
+        if constexpr (Sink::wants_text)
+          text.append(s.data() + i, run - i);
+        i = run;
+        if (i >= s.size())
+          break;
       }
+      char c = s[i++];
       if (c == '"')
         return true;
       if (c == '\\') {
-        if (i >= s.size()) {
-          err = "unterminated escape in string at line " +
-                std::to_string(line) + ", column " + std::to_string(column);
-          return false;
-        }
+        if (i >= s.size())
+          return fail(JsonParseError::UNTERMINATED_ESCAPE);
         char e = s[i++];
-        ++column;
         if (e == 'u') {
-          for (int k = 0; k < 4; ++k) {
-            if (i >= s.size() || !is_hex(s[i++])) {
-              err = "invalid unicode escape in string at line " +
-                    std::to_string(line) + ", column " + std::to_string(column);
-              return false;
+          unsigned cp = 0;
+          if (!parse_hex4(cp))
+            return false;
+          if constexpr (Sink::wants_text) {
+            // combine surrogate pairs; lone surrogates become U+FFFD
+            if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < s.size() &&
+                s[i] == '\\' && s[i + 1] == 'u') {
+              i += 2;
+              unsigned lo = 0;
+              if (!parse_hex4(lo))
+                return false;
+              if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+              } else {
+                append_utf8(0xFFFD);
+                cp = lo;
+              }
             }
-            ++column;
+            if (cp >= 0xD800 && cp <= 0xDFFF)
+              cp = 0xFFFD;
+            append_utf8(cp);
           }
         } else {
-          if (e != '"' && e != '\\' && e != '/' && e != 'b' && e != 'f' &&
-              e != 'n' && e != 'r' && e != 't') {
-            err = std::string("invalid escape: ") + e + " at line " +
-                  std::to_string(line) + ", column " + std::to_string(column);
-            return false;
+          char decoded;
+          switch (e) {
+          case '"':
+          case '\\':
+          case '/':
+            decoded = e;
+            break;
+          case 'b':
+            decoded = '\b';
+            break;
+          case 'f':
+            decoded = '\f';
+            break;
+          case 'n':
+            decoded = '\n';
+            break;
+          case 'r':
+            decoded = '\r';
+            break;
+          case 't':
+            decoded = '\t';
+            break;
+          default:
+            return fail(JsonParseError::INVALID_ESCAPE);
           }
+          if constexpr (Sink::wants_text)
+            text.push_back(decoded);
         }
-      } else if (static_cast<unsigned char>(c) < 0x20) {
-        err = "control character in string at line " + std::to_string(line) +
-              ", column " + std::to_string(column);
-        return false;
+      } else {
+        return fail(JsonParseError::CONTROL_CHARACTER);
       }
     }
-    err = "unterminated string at line " + std::to_string(line) + ", column " +
-          std::to_string(column);
-    return false;
+    return fail(JsonParseError::UNTERMINATED_STRING);
+  }
+
+  bool parse_hex4(unsigned &cp) {
+    for (int k = 0; k < 4; ++k) {
+      if (i >= s.size() || !is_hex(s[i]))
+        return fail(JsonParseError::INVALID_UNICODE_ESCAPE);
+      char h = s[i++];
+      cp = (cp << 4) | static_cast<unsigned>(h <= '9'   ? h - '0'
+                                             : h <= 'F' ? h - 'A' + 10
+                                                        : h - 'a' + 10);
+    }
+    return true;
+  }
+
+  void append_utf8(unsigned cp) {
+    if (cp < 0x80) {
+      text.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+      text.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+      text.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+      text.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+      text.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+      text.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else {
+      text.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+      text.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+      text.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+      text.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
   }
 
   static bool is_hex(char c) {
@@ -260,441 +646,407 @@ struct JsonParser {
            (c >= 'A' && c <= 'F');
   }
 
-  bool parse_number() {
+  bool parse_number(Node out) {
     size_t start = i;
-    if (s[i] == '-') {
-      ++column;
+    if (s[i] == '-')
       ++i;
-    }
-    if (i >= s.size()) {
-      err = "invalid number at line " + std::to_string(line) + ", column " +
-            std::to_string(column);
-      return false;
-    }
+    if (i >= s.size())
+      return fail(JsonParseError::INVALID_NUMBER);
     if (s[i] == '0') {
-      ++column;
       ++i;
     } else if (s[i] >= '1' && s[i] <= '9') {
       while (i < s.size() && isdigit(static_cast<unsigned char>(s[i]))) {
-        ++column;
         ++i;
       }
     } else {
-      err = "invalid number at line " + std::to_string(line) + ", column " +
-            std::to_string(column);
-      return false;
+      return fail(JsonParseError::INVALID_NUMBER);
     }
     if (i < s.size() && s[i] == '.') {
-      ++column;
       ++i;
-      if (i >= s.size() || !isdigit(static_cast<unsigned char>(s[i]))) {
-        err = "invalid fractional part in number at line " +
-              std::to_string(line) + ", column " + std::to_string(column);
-        return false;
-      }
+      if (i >= s.size() || !isdigit(static_cast<unsigned char>(s[i])))
+        return fail(JsonParseError::INVALID_FRACTION);
       while (i < s.size() && isdigit(static_cast<unsigned char>(s[i]))) {
-        ++column;
         ++i;
       }
     }
     if (i < s.size() && (s[i] == 'e' || s[i] == 'E')) {
-      ++column;
       ++i;
-      if (i < s.size() && (s[i] == '+' || s[i] == '-')) {
-        ++column;
+      if (i < s.size() && (s[i] == '+' || s[i] == '-'))
         ++i;
-      }
-      if (i >= s.size() || !isdigit(static_cast<unsigned char>(s[i]))) {
-        err = "invalid exponent in number at line " + std::to_string(line) +
-              ", column " + std::to_string(column);
-        return false;
-      }
+      if (i >= s.size() || !isdigit(static_cast<unsigned char>(s[i])))
+        return fail(JsonParseError::INVALID_EXPONENT);
       while (i < s.size() && isdigit(static_cast<unsigned char>(s[i]))) {
-        ++column;
         ++i;
       }
     }
-    return i > start;
+    sink.number(out, s.substr(start, i - start));
+    return true;
   }
 
-  bool parse_literal() {
+  bool parse_literal(Node out) {
     if (s.compare(i, 4, "true") == 0) {
       i += 4;
-      column += 4;
+      sink.boolean(out, true);
       return true;
     }
     if (s.compare(i, 5, "false") == 0) {
       i += 5;
-      column += 5;
+      sink.boolean(out, false);
       return true;
     }
     if (s.compare(i, 4, "null") == 0) {
       i += 4;
-      column += 4;
+      sink.null(out);
       return true;
     }
-    err = "invalid literal at line " + std::to_string(line) + ", column " +
-          std::to_string(column);
-    return false;
+    return fail(JsonParseError::INVALID_LITERAL);
   }
-};
-
-// Simple JSON DOM parser (builds JsonValue tree)
-struct JsonDOMParser {
-  const std::string &s;
-  size_t i = 0;
-  std::string err;
-  size_t line = 1;
-  size_t column = 1;
-
-  JsonDOMParser(const std::string &str) : s(str), i(0), line(1), column(1) {}
 
-  void skip_ws() {
-    while (i < s.size() && std::isspace(static_cast<unsigned char>(s[i]))) {
-      if (s[i] == '\n') {
-        ++line;
-        column = 1;
-      } else {
-        ++column;
-      }
-      ++i;
-    }
-  }
-  bool parse_value(JsonValue &out) {
-    skip_ws();
-    if (i >= s.size()) {
-      err = "unexpected end of input at line " + std::to_string(line) +
-            ", column " + std::to_string(column);
-      return false;
-    }
-    char c = s[i];
-    if (c == '{')
-      return parse_object(out);
-    if (c == '[')
-      return parse_array(out);
-    if (c == '"')
-      return parse_string(out);
-    if (c == 't' || c == 'f' || c == 'n')
-      return parse_literal(out);
-    if (c == '-' || (c >= '0' && c <= '9'))
-      return parse_number(out);
-    err = std::string("unexpected character '") + c + "' at line " +
-          std::to_string(line) + ", column " + std::to_string(column);
-    return false;
-  }
-  bool parse_object(JsonValue &out) {
-    if (s[i] != '{') {
-      err = "expected '{' at line " + std::to_string(line) + ", column " +
-            std::to_string(column);
+  // Parse exactly one JSON value spanning the whole input.
+  bool parse_document(Node out) {
+    if (!parse_value(out))
       return false;
-    }
-    ++column;
-    ++i;
-    skip_ws();
-    out.t = JsonValue::T_OBJECT;
-    if (i < s.size() && s[i] == '}') {
-      ++column;
-      ++i;
-      return true;
-    }
-    while (true) {
-      skip_ws();
-      JsonValue keyv;
-      if (!parse_string(keyv))
-        return false;
-      skip_ws();
-      if (i >= s.size() || s[i] != ':') {
-        err = "expected ':' after object key at line " + std::to_string(line) +
-              ", column " + std::to_string(column);
-        return false;
-      }
-      ++column;
-      ++i;
-      skip_ws();
-      JsonValue val;
-      if (!parse_value(val))
-        return false;
-      out.o[keyv.s] = val;
-      skip_ws();
-      if (i < s.size() && s[i] == ',') {
-        ++column;
-        ++i;
-        continue;
-      }
-      if (i < s.size() && s[i] == '}') {
-        ++column;
-        ++i;
-        break;
-      }
-      err = "expected ',' or '}' in object at line " + std::to_string(line) +
-            ", column " + std::to_string(column);
-      return false;
-    }
-    return true;
-  }
-  bool parse_array(JsonValue &out) {
-    if (s[i] != '[') {
-      err = "expected '[' at line " + std::to_string(line) + ", column " +
-            std::to_string(column);
-      return false;
-    }
-    ++column;
-    ++i;
     skip_ws();
-    out.t = JsonValue::T_ARRAY;
-    if (i < s.size() && s[i] == ']') {
-      ++column;
-      ++i;
-      return true;
-    }
-    while (true) {
-      skip_ws();
-      JsonValue elem;
-      if (!parse_value(elem))
-        return false;
-      out.a.push_back(elem);
-      skip_ws();
-      if (i < s.size() && s[i] == ',') {
-        ++column;
-        ++i;
-        continue;
-      }
-      if (i < s.size() && s[i] == ']') {
-        ++column;
-        ++i;
-        break;
-      }
-      err = "expected ',' or ']' in array at line " + std::to_string(line) +
-            ", column " + std::to_string(column);
-      return false;
-    }
-    return true;
-  }
-  bool parse_string(JsonValue &out) {
-    if (s[i] != '"') {
-      err = "expected '\"' at line " + std::to_string(line) + ", column " +
-            std::to_string(column);
-      return false;
-    }
-    size_t j = i + 1;
-    size_t temp_line = line;
-    size_t temp_column = column + 1;
-    std::string collected;
-    while (j < s.size()) {
-      char c = s[j];
-      if (c == '\n') {
-        ++temp_line;
-        temp_column = 1;
-      } else {
-        ++temp_column;
-      }
-      if (c == '\\') {
-        if (j + 1 < s.size()) {
-          collected += s[j + 1];
-          j += 2;
-          if (s[j - 1] == '\n') {
-            ++temp_line;
-            temp_column = 1;
-          } else {
-            ++temp_column;
-          }
-          continue;
-        }
-        err = "unfinished escape in string at line " +
-              std::to_string(temp_line) + ", column " +
-              std::to_string(temp_column);
-        return false;
-      }
-      if (c == '"') {
-        line = temp_line;
-        column = temp_column;
-        break;
-      }
-      collected += c;
-      ++j;
-    }
-    if (j >= s.size()) {
-      err = "unterminated string at line " + std::to_string(temp_line) +
-            ", column " + std::to_string(temp_column);
-      return false;
-    }
-    out.t = JsonValue::T_STRING;
-    out.s = collected;
-    i = j + 1;
+    if (i != s.size())
+      return fail(JsonParseError::TRAILING_DATA);
     return true;
   }
-  bool parse_number(JsonValue &out) {
-    size_t j = i;
-    if (s[j] == '-')
-      ++j;
-    while (j < s.size() && isdigit((unsigned char)s[j]))
-      ++j;
-    if (j < s.size() && s[j] == '.') {
-      ++j;
-      while (j < s.size() && isdigit((unsigned char)s[j]))
-        ++j;
-    }
-    std::string t = s.substr(i, j - i);
-    if (!t.empty()) {
-      char *endp = nullptr;
-      out.n = std::strtod(t.c_str(), &endp);
-      // if endp == t.c_str(), conversion failed; keep n as 0
-    }
-    out.t = JsonValue::T_NUMBER;
-    column += (j - i);
-    i = j;
-    return true;
+};
+
+// Tree nodes under (and including) `v` and the heap bytes they hold, for
+// the metrics.
+static void measure_dom(const JsonValue &v, uint64_t &nodes, uint64_t &bytes) {
+  ++nodes;
+  bytes += sizeof(JsonValue) + v.s.capacity() +
+           v.a.capacity() * sizeof(JsonValue);
+  for (const auto &e : v.a)
+    measure_dom(e, nodes, bytes);
+  for (const auto &m : v.o) {
+    bytes += m.first.capacity();
+    measure_dom(m.second, nodes, bytes);
   }
-  bool parse_literal(JsonValue &out) {
-    if (s.compare(i, 4, "true") == 0) {
-      out.t = JsonValue::T_BOOL;
-      out.b = true;
-      i += 4;
-      column += 4;
-      return true;
-    }
-    if (s.compare(i, 5, "false") == 0) {
-      out.t = JsonValue::T_BOOL;
-      out.b = false;
-      i += 5;
-      column += 5;
-      return true;
-    }
-    if (s.compare(i, 4, "null") == 0) {
-      out.t = JsonValue::T_NULL;
-      i += 4;
-      column += 4;
-      return true;
-    }
-    err = "invalid literal at line " + std::to_string(line) + ", column " +
-          std::to_string(column);
+}
+
+bool parse_json_dom(std::string_view text, JsonValue &out, std::string &err) {
+  metrics::Timer timer(metrics::PARSE, text.size());
+  out = JsonValue();
+  DomSink sink;
+  JsonParser<DomSink> p(text, sink);
+  if (!p.parse_document(&out)) {
+    err = p.error_message();
     return false;
   }
-};
+  if (metrics::enabled()) {
+    uint64_t nodes = 0, bytes = 0;
+    measure_dom(out, nodes, bytes);
+    metrics::note_dom(nodes, bytes);
+  }
+  return true;
+}
 
-bool parse_json_dom(const std::string &text, JsonValue &out, std::string &err) {
-  JsonDOMParser p(text);
-  if (!p.parse_value(out)) {
-    err = p.err;
+bool parse_json_document(std::string_view text, JsonDocument &out,
+                         std::string &err) {
+  metrics::Timer timer(metrics::PARSE, text.size());
+  out.clear();
+  TapeSink sink(out);
+  JsonParser<TapeSink> p(text, sink);
+  if (!p.parse_document({})) {
+    err = p.error_message();
+    out.clear();
     return false;
   }
-  p.skip_ws();
-  if (p.i != text.size()) {
-    err = "trailing data after JSON value";
+  if (sink.overflow) {
+    err = "document too large for JsonDocument";
+    out.clear();
     return false;
   }
+  if (metrics::enabled())
+    metrics::note_dom(sink.entries(), out.memory_usage());
   return true;
 }
 
-// Print JSON as a tree structure
-void print_json_tree(const JsonValue &val, const std::string &prefix,
-                     bool is_last) {
-  std::cout << prefix;
-  std::cout << (is_last ? "└── " : "├── ");
+void JsonDocument::clear() {
+  tape_.clear();
+  strings_.clear();
+}
 
-  switch (val.t) {
+size_t JsonDocument::memory_usage() const {
+  return tape_.capacity() * sizeof(uint64_t) + strings_.capacity();
+}
+
+// Index of the entry following the value that starts at `pos`.
+static size_t tape_skip(const std::vector<uint64_t> &tape, size_t pos) {
+  uint64_t e = tape[pos];
+  switch (tape_tag(e)) {
+  case '{':
+  case '[':
+    return static_cast<uint32_t>(e);
+  case 'd':
+    return pos + 2;
+  default:
+    return pos + 1;
+  }
+}
+
+JsonValue::Type JsonView::type() const {
+  if (!doc_)
+    return JsonValue::T_NULL;
+  switch (tape_tag(doc_->tape_[pos_])) {
+  case 't':
+  case 'f':
+    return JsonValue::T_BOOL;
+  case 'd':
+    return JsonValue::T_NUMBER;
+  case '"':
+    return JsonValue::T_STRING;
+  case '{':
+    return JsonValue::T_OBJECT;
+  case '[':
+    return JsonValue::T_ARRAY;
+  default:
+    return JsonValue::T_NULL;
+  }
+}
+
+bool JsonView::as_bool() const {
+  return doc_ && tape_tag(doc_->tape_[pos_]) == 't';
+}
+
+double JsonView::as_number() const {
+  if (!doc_ || tape_tag(doc_->tape_[pos_]) != 'd')
+    return 0.0;
+  double v;
+  std::memcpy(&v, &doc_->tape_[pos_ + 1], sizeof v);
+  return v;
+}
+
+std::string_view JsonView::as_string() const {
+  if (!doc_ || tape_tag(doc_->tape_[pos_]) != '"')
+    return {};
+  size_t off = tape_payload(doc_->tape_[pos_]);
+  uint32_t len;
+  std::memcpy(&len, &doc_->strings_[off], sizeof len);
+  return std::string_view(doc_->strings_.data() + off + sizeof len, len);
+}
+
+size_t JsonView::size() const {
+  if (!doc_)
+    return 0;
+  uint64_t e = doc_->tape_[pos_];
+  char tag = tape_tag(e);
+  if (tag != '{' && tag != '[')
+    return 0;
+  size_t n = static_cast<size_t>((e >> 32) & TAPE_COUNT_MAX);
+  if (n == TAPE_COUNT_MAX) { // saturated, count the hard way
+    n = 0;
+    for (auto it = begin(); it != end(); ++it)
+      ++n;
+  }
+  return n;
+}
+
+bool JsonView::find(std::string_view key, JsonView &out) const {
+  if (type() != JsonValue::T_OBJECT)
+    return false;
+  bool found = false;
+  for (auto it = begin(); it != end(); ++it) {
+    if (it.key() == key) {
+      out = *it; // keep going: the last duplicate wins
+      found = true;
+    }
+  }
+  return found;
+}
+
+JsonView::Iterator JsonView::begin() const {
+  if (!doc_)
+    return Iterator();
+  char tag = tape_tag(doc_->tape_[pos_]);
+  if (tag != '{' && tag != '[')
+    return Iterator(doc_, pos_, false);
+  return Iterator(doc_, pos_ + 1, tag == '{');
+}
+
+JsonView::Iterator JsonView::end() const {
+  if (!doc_)
+    return Iterator();
+  uint64_t e = doc_->tape_[pos_];
+  char tag = tape_tag(e);
+  if (tag != '{' && tag != '[')
+    return Iterator(doc_, pos_, false);
+  return Iterator(doc_, static_cast<uint32_t>(e) - 1, tag == '{');
+}
+
+JsonView JsonView::Iterator::operator*() const {
+  return JsonView(doc_, object_ ? pos_ + 1 : pos_);
+}
+
+std::string_view JsonView::Iterator::key() const {
+  return object_ ? JsonView(doc_, pos_).as_string() : std::string_view();
+}
+
+JsonView::Iterator &JsonView::Iterator::operator++() {
+  pos_ = tape_skip(doc_->tape_, object_ ? pos_ + 1 : pos_);
+  return *this;
+}
+
+// Read access shared by the JsonValue tree and JsonView, so the printer and
+// the schema validator below are written once for both.
+static inline JsonValue::Type node_type(const JsonValue &v) { return v.t; }
+static inline JsonValue::Type node_type(const JsonView &v) { return v.type(); }
+static inline bool node_bool(const JsonValue &v) { return v.b; }
+static inline bool node_bool(const JsonView &v) { return v.as_bool(); }
+static inline double node_number(const JsonValue &v) { return v.n; }
+static inline double node_number(const JsonView &v) { return v.as_number(); }
+static inline std::string_view node_string(const JsonValue &v) { return v.s; }
+static inline std::string_view node_string(const JsonView &v) {
+  return v.as_string();
+}
+static inline size_t node_size(const JsonValue &v) {
+  return v.t == JsonValue::T_OBJECT ? v.o.size() : v.a.size();
+}
+static inline size_t node_size(const JsonView &v) { return v.size(); }
+
+static inline const JsonValue *find_member(const JsonValue &v,
+                                           const std::string &key) {
+  auto it = v.o.find(key);
+  return it == v.o.end() ? nullptr : &it->second;
+}
+static inline std::optional<JsonView> find_member(const JsonView &v,
+                                                  const std::string &key) {
+  JsonView out;
+  if (!v.find(key, out))
+    return std::nullopt;
+  return out;
+}
+
+// f(key, value) for each object member; stops early when f returns false.
+template <typename F> static bool for_each_member(const JsonValue &v, F &&f) {
+  for (const auto &kv : v.o)
+    if (!f(std::string_view(kv.first), kv.second))
+      return false;
+  return true;
+}
+template <typename F> static bool for_each_member(const JsonView &v, F &&f) {
+  for (auto it = v.begin(); it != v.end(); ++it)
+    if (!f(it.key(), *it))
+      return false;
+  return true;
+}
+
+// f(element) for each array element; stops early when f returns false.
+template <typename F> static bool for_each_element(const JsonValue &v, F &&f) {
+  for (const auto &e : v.a)
+    if (!f(e))
+      return false;
+  return true;
+}
+template <typename F> static bool for_each_element(const JsonView &v, F &&f) {
+  for (auto it = v.begin(); it != v.end(); ++it)
+    if (!f(*it))
+      return false;
+  return true;
+}
+
+// Prints a scalar followed by a newline; returns false for containers.
+template <typename Node> static bool print_scalar_line(const Node &v) {
+  switch (node_type(v)) {
   case JsonValue::T_NULL:
     std::cout << "null\n";
-    break;
+    return true;
   case JsonValue::T_BOOL:
-    std::cout << (val.b ? "true" : "false") << "\n";
-    break;
+    std::cout << (node_bool(v) ? "true" : "false") << "\n";
+    return true;
   case JsonValue::T_NUMBER:
-    std::cout << val.n << "\n";
-    break;
+    std::cout << node_number(v) << "\n";
+    return true;
   case JsonValue::T_STRING:
-    std::cout << "\"" << val.s << "\"\n";
-    break;
-  case JsonValue::T_OBJECT: {
+    std::cout << "\"" << node_string(v) << "\"\n";
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Print JSON as a tree structure
+template <typename Node>
+static void print_tree(const Node &val, const std::string &prefix,
+                       bool is_last) {
+  std::cout << prefix;
+  std::cout << (is_last ? "└── " : "├── ");
+
+  if (print_scalar_line(val))
+    return;
+
+  if (node_type(val) == JsonValue::T_OBJECT) {
     std::cout << "{\n";
     size_t count = 0;
-    for (const auto &kv : val.o) {
-      bool last = (++count == val.o.size());
+    const size_t total = node_size(val);
+    for_each_member(val, [&](std::string_view key, const auto &child) {
+      bool last = (++count == total);
       std::cout << (is_last ? "    " : "│   ") << prefix;
-      std::cout << (last ? "└── " : "├── ") << kv.first << ": ";
-
-      // Print inline for simple values
-      if (kv.second.t == JsonValue::T_NULL) {
-        std::cout << "null\n";
-      } else if (kv.second.t == JsonValue::T_BOOL) {
-        std::cout << (kv.second.b ? "true" : "false") << "\n";
-      } else if (kv.second.t == JsonValue::T_NUMBER) {
-        std::cout << kv.second.n << "\n";
-      } else if (kv.second.t == JsonValue::T_STRING) {
-        std::cout << "\"" << kv.second.s << "\"\n";
-      } else if (kv.second.t == JsonValue::T_OBJECT) {
-        std::string nested_prefix =
-            prefix + (is_last ? "    " : "│   ") + (last ? "    " : "│   ");
-        std::cout << "{\n";
-        size_t nested_count = 0;
-        for (const auto &nested_kv : kv.second.o) {
-          bool nested_last = (++nested_count == kv.second.o.size());
-          std::cout << nested_prefix;
-          std::cout << (nested_last ? "└── " : "├── ") << nested_kv.first
-                    << ": ";
-
-          if (nested_kv.second.t == JsonValue::T_NULL) {
-            std::cout << "null\n";
-          } else if (nested_kv.second.t == JsonValue::T_BOOL) {
-            std::cout << (nested_kv.second.b ? "true" : "false") << "\n";
-          } else if (nested_kv.second.t == JsonValue::T_NUMBER) {
-            std::cout << nested_kv.second.n << "\n";
-          } else if (nested_kv.second.t == JsonValue::T_STRING) {
-            std::cout << "\"" << nested_kv.second.s << "\"\n";
-          } else {
-            std::cout << "...\n"; // Complex nested structures
-          }
-        }
-        std::cout << nested_prefix.substr(0, nested_prefix.size() - 4);
-        std::cout << (last ? " " : "│") << "   }\n";
-      } else if (kv.second.t == JsonValue::T_ARRAY) {
-        std::string arr_prefix =
-            prefix + (is_last ? "    " : "│   ") + (last ? "    " : "│   ");
-        std::cout << "[\n";
-        size_t arr_idx = 0;
-        for (const auto &elem : kv.second.a) {
-          bool arr_last = (++arr_idx == kv.second.a.size());
-          std::cout << arr_prefix;
-          std::cout << (arr_last ? "└── " : "├── ");
-
-          if (elem.t == JsonValue::T_NULL) {
-            std::cout << "null\n";
-          } else if (elem.t == JsonValue::T_BOOL) {
-            std::cout << (elem.b ? "true" : "false") << "\n";
-          } else if (elem.t == JsonValue::T_NUMBER) {
-            std::cout << elem.n << "\n";
-          } else if (elem.t == JsonValue::T_STRING) {
-            std::cout << "\"" << elem.s << "\"\n";
-          } else {
-            std::cout << "...\n"; // Complex nested structures
-          }
-        }
-        std::cout << arr_prefix.substr(0, arr_prefix.size() - 4);
-        std::cout << (last ? " " : "│") << "   ]\n";
-      }
-    }
+      std::cout << (last ? "└── " : "├── ") << key << ": ";
+
+      // Print inline for simple values, one level for containers
+      if (print_scalar_line(child))
+        return true;
+      bool is_object = node_type(child) == JsonValue::T_OBJECT;
+      std::string nested_prefix =
+          prefix + (is_last ? "    " : "│   ") + (last ? "    " : "│   ");
+      std::cout << (is_object ? "{\n" : "[\n");
+      size_t nested_count = 0;
+      const size_t nested_total = node_size(child);
+      auto print_nested = [&](std::string_view nested_key,
+                              const auto &nested) {
+        bool nested_last = (++nested_count == nested_total);
+        std::cout << nested_prefix;
+        std::cout << (nested_last ? "└── " : "├── ");
+        if (is_object)
+          std::cout << nested_key << ": ";
+        if (!print_scalar_line(nested))
+          std::cout << "...\n"; // Complex nested structures
+        return true;
+      };
+      if (is_object)
+        for_each_member(child, print_nested);
+      else
+        for_each_element(child, [&](const auto &elem) {
+          return print_nested(std::string_view(), elem);
+        });
+      std::cout << nested_prefix.substr(0, nested_prefix.size() - 4);
+      std::cout << (last ? " " : "│") << (is_object ? "   }\n" : "   ]\n");
+      return true;
+    });
     std::cout << prefix << (is_last ? " " : "│") << "   }\n";
-    break;
-  }
-  case JsonValue::T_ARRAY: {
+  } else {
     std::cout << "[\n";
     size_t idx = 0;
-    for (const auto &elem : val.a) {
-      bool last = (++idx == val.a.size());
+    const size_t total = node_size(val);
+    for_each_element(val, [&](const auto &elem) {
+      bool last = (++idx == total);
       std::string new_prefix = prefix + (is_last ? "    " : "│   ");
-      print_json_tree(elem, new_prefix, last);
-    }
+      print_tree(elem, new_prefix, last);
+      return true;
+    });
     std::cout << prefix << (is_last ? " " : "│") << "   ]\n";
-    break;
-  }
   }
 }
 
+void print_json_tree(const JsonValue &val, const std::string &prefix,
+                     bool is_last) {
+  print_tree(val, prefix, is_last);
+}
+
+void print_json_tree(const JsonView &val, const std::string &prefix,
+                     bool is_last) {
+  print_tree(val, prefix, is_last);
+}
+
 // Minimal schema validator support: supports 'type', 'required',
-// 'properties', 'items', and 'enum'. The schema passed here is expected as
-// a parsed JSON object (JsonValue tree).
-static std::string type_name(const JsonValue &v) {
-  switch (v.t) {
+// 'properties', 'items', 'enum' and '$ref'. The schema passed here is
+// expected as a parsed JSON object (JsonValue tree).
+template <typename Node> static std::string type_name(const Node &v) {
+  switch (node_type(v)) {
   case JsonValue::T_NULL:
     return "null";
   case JsonValue::T_BOOL:
@@ -711,192 +1063,1395 @@ static std::string type_name(const JsonValue &v) {
   return "unknown";
 }
 
-// Check for typos in schema properties and suggest corrections
-static void
-suggest_property(const std::string &invalid_key,
-                 const std::map<std::string, JsonValue> &valid_props,
-                 std::string &suggestion) {
-  std::vector<std::string> candidates;
-  for (const auto &p : valid_props) {
-    candidates.push_back(p.first);
+// --- compiled schemas ---
+
+namespace {
+struct SchemaKeyHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view s) const noexcept {
+    return std::hash<std::string_view>{}(s);
   }
-  suggestion = find_closest_match(invalid_key, candidates);
-}
+};
+} // namespace
+
+struct CompiledSchema::Plan {
+  struct Node {
+    int type = -1;         // JsonValue::Type required by "type", or -1
+    std::string type_text; // the "type" string, for messages
+    bool has_required = false;
+    bool has_properties = false;
+    bool has_enum = false;
+    int32_t items = -1; // node index of "items", or -1
+    int32_t ref = -1;   // node index of the "$ref" target, or -1
+    std::string ref_text;
+
+    // Every key named by "properties" or "required" gets a slot; one pass
+    // over the data object fills the slots, then the checks below only
+    // index into them.
+    std::unordered_map<std::string, uint32_t, SchemaKeyHash, std::equal_to<>>
+        keys;
+    std::vector<std::string> key_names; // by slot
+    std::vector<int32_t> key_schema;    // node index, -1 if not a property
+    std::vector<uint32_t> required;     // slots, in schema order
+    std::vector<uint32_t> properties;   // slots, in key order
+    std::vector<std::string> property_names; // candidates for suggestions
+
+    // only strings and numbers take part in enum comparisons
+    std::unordered_set<std::string, SchemaKeyHash, std::equal_to<>>
+        enum_strings;
+    std::unordered_set<double> enum_numbers;
+  };
+  std::vector<Node> nodes; // nodes[0] is the root
+  // false when a "$ref" pulled in a schema that was not among the links; the
+  // plan then depends on more than its cache key covers
+  bool self_contained = true;
+
+  uint32_t add_key(Node &n, const std::string &key) {
+    auto it = n.keys.find(key);
+    if (it != n.keys.end())
+      return it->second;
+    uint32_t slot = static_cast<uint32_t>(n.key_names.size());
+    n.keys.emplace(key, slot);
+    n.key_names.push_back(key);
+    n.key_schema.push_back(-1);
+    return slot;
+  }
+
+  // Compile-time state. Every "$ref" target is resolved and compiled once;
+  // later refs to it, including recursive ones, reuse the same node.
+  struct Build {
+    const std::map<std::string, std::string> *links = nullptr;
+    std::map<std::string, const JsonValue *> documents; // by name and "$id"
+    std::vector<std::unique_ptr<JsonValue>> owned;      // external documents
+    std::map<std::string, int32_t> targets;             // "doc#pointer"
+    bool external = false; // a document came from get_schema_source
+    std::string err;
+  };
+
+  static void add_document(Build &b, const std::string &name,
+                           const JsonValue &root) {
+    b.documents.emplace(name, &root);
+    if (root.t == JsonValue::T_OBJECT) {
+      auto it = root.o.find("$id");
+      if (it != root.o.end() && it->second.t == JsonValue::T_STRING)
+        b.documents.emplace(it->second.s, &root);
+    }
+  }
+
+  // Another schema named by a ref: the linked schemas first (see
+  // resolve_schema_links), then anything get_schema_source can load.
+  static const JsonValue *load_document(Build &b, const std::string &name) {
+    auto it = b.documents.find(name);
+    if (it != b.documents.end())
+      return it->second;
+    std::string text;
+    if (b.links) {
+      auto lt = b.links->find(name);
+      if (lt != b.links->end())
+        text = lt->second;
+    }
+    if (text.empty()) {
+      if (!get_schema_source(name, text, b.err)) {
+        b.err = "cannot load schema '" + name + "' for $ref: " + b.err;
+        return nullptr;
+      }
+      b.external = true;
+    }
+    auto doc = std::make_unique<JsonValue>();
+    if (!parse_json_dom(text, *doc, b.err)) {
+      b.err = "cannot parse schema '" + name + "' for $ref: " + b.err;
+      return nullptr;
+    }
+    const JsonValue *root = doc.get();
+    b.owned.push_back(std::move(doc));
+    add_document(b, name, *root);
+    return root;
+  }
+
+  // RFC 6901 pointer (already percent-decoded); "" is the whole document.
+  static const JsonValue *json_pointer(const JsonValue &root,
+                                       std::string_view ptr) {
+    const JsonValue *cur = &root;
+    if (ptr.empty())
+      return cur;
+    if (ptr[0] != '/')
+      return nullptr; // plain-name fragments are not supported
+    size_t i = 1;
+    while (true) {
+      size_t end = ptr.find('/', i);
+      std::string_view raw = ptr.substr(i, end == std::string_view::npos
+                                               ? std::string_view::npos
+                                               : end - i);
+      std::string token;
+      for (size_t k = 0; k < raw.size(); ++k) {
+        if (raw[k] == '~' && k + 1 < raw.size() &&
+            (raw[k + 1] == '0' || raw[k + 1] == '1')) {
+          token += raw[k + 1] == '0' ? '~' : '/';
+          ++k;
+        } else {
+          token += raw[k];
+        }
+      }
+      if (cur->t == JsonValue::T_OBJECT) {
+        auto it = cur->o.find(token);
+        if (it == cur->o.end())
+          return nullptr;
+        cur = &it->second;
+      } else if (cur->t == JsonValue::T_ARRAY) {
+        size_t index = 0;
+        auto res = std::from_chars(token.data(), token.data() + token.size(),
+                                   index);
+        if (token.empty() || res.ec != std::errc() ||
+            res.ptr != token.data() + token.size() || index >= cur->a.size())
+          return nullptr;
+        cur = &cur->a[index];
+      } else {
+        return nullptr;
+      }
+      if (end == std::string_view::npos)
+        return cur;
+      i = end + 1;
+    }
+  }
+
+  static std::string percent_decode(std::string_view s) {
+    auto hex = [](char c) {
+      return std::isdigit((unsigned char)c) ? c - '0'
+                                            : std::tolower((unsigned char)c) -
+                                                  'a' + 10;
+    };
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+      if (s[i] == '%' && i + 2 < s.size() &&
+          std::isxdigit((unsigned char)s[i + 1]) &&
+          std::isxdigit((unsigned char)s[i + 2])) {
+        out += static_cast<char>(hex(s[i + 1]) * 16 + hex(s[i + 2]));
+        i += 2;
+      } else {
+        out += s[i];
+      }
+    }
+    return out;
+  }
+
+  int32_t resolve_ref(const std::string &ref, const std::string &doc,
+                      Build &b) {
+    size_t hash = ref.find('#');
+    std::string base = ref.substr(0, hash);
+    std::string fragment =
+        hash == std::string::npos ? "" : percent_decode(ref.substr(hash + 1));
+    std::string name = base.empty() ? doc : base;
+    const JsonValue *root = load_document(b, name);
+    if (!root)
+      return -1;
+    std::string key = name + "#" + fragment;
+    auto it = b.targets.find(key);
+    if (it != b.targets.end())
+      return it->second;
+    const JsonValue *target = json_pointer(*root, fragment);
+    if (!target) {
+      b.err = "cannot resolve $ref '" + ref + "'";
+      return -1;
+    }
+    // registered before compiling so refs back to it terminate; compile()
+    // puts the target at the next free index
+    b.targets.emplace(key, static_cast<int32_t>(nodes.size()));
+    return compile(*target, name, b);
+  }
+
+  // Returns the node index, or -1 with b.err set.
+  int32_t compile(const JsonValue &schema, const std::string &doc, Build &b) {
+    int32_t idx = static_cast<int32_t>(nodes.size());
+    nodes.emplace_back();
+    if (schema.t != JsonValue::T_OBJECT)
+      return idx; // a non-object schema constrains nothing
+
+    // as in draft-07, keywords next to "$ref" are ignored
+    auto it_ref = schema.o.find("$ref");
+    if (it_ref != schema.o.end() && it_ref->second.t == JsonValue::T_STRING) {
+      int32_t target = resolve_ref(it_ref->second.s, doc, b);
+      if (target < 0)
+        return -1;
+      nodes[idx].ref = target;
+      nodes[idx].ref_text = it_ref->second.s;
+      return idx;
+    }
 
-static bool
-validate_schema_rec(const JsonValue &data, const JsonValue &schema,
-                    const std::map<std::string, JsonValue> &resolved,
-                    std::string &err, const std::string &path = "") {
-  // type
-  if (schema.t == JsonValue::T_OBJECT) {
     auto it_type = schema.o.find("type");
     if (it_type != schema.o.end() && it_type->second.t == JsonValue::T_STRING) {
-      std::string st = it_type->second.s;
-      const char *dtype = nullptr;
-      if (st == "object")
-        dtype = "object";
-      else if (st == "array")
-        dtype = "array";
-      else if (st == "string")
-        dtype = "string";
-      else if (st == "number")
-        dtype = "number";
-      else if (st == "boolean")
-        dtype = "boolean";
-      else if (st == "null")
-        dtype = "null";
-      if (dtype) {
-        if (std::string(dtype) != type_name(data)) {
-          err = "type mismatch at '" + path + "', expected '" + st + "' got '" +
-                type_name(data) + "'";
-          return false;
+      static const std::pair<const char *, JsonValue::Type> names[] = {
+          {"object", JsonValue::T_OBJECT}, {"array", JsonValue::T_ARRAY},
+          {"string", JsonValue::T_STRING}, {"number", JsonValue::T_NUMBER},
+          {"boolean", JsonValue::T_BOOL},  {"null", JsonValue::T_NULL}};
+      for (const auto &nm : names) {
+        if (it_type->second.s == nm.first) {
+          nodes[idx].type = nm.second;
+          nodes[idx].type_text = nm.first;
         }
       }
     }
 
-    // required
     auto it_req = schema.o.find("required");
     if (it_req != schema.o.end() && it_req->second.t == JsonValue::T_ARRAY) {
-      if (data.t != JsonValue::T_OBJECT) {
-        err = "expected object at '" + path + "' for required properties";
-        return false;
-      }
-      for (const auto &rq : it_req->second.a) {
-        if (rq.t == JsonValue::T_STRING) {
-          if (data.o.find(rq.s) == data.o.end()) {
-            err = "missing required property '" + rq.s + "' at '" + path + "'";
-            return false;
-          }
-        }
-      }
+      Node &n = nodes[idx];
+      n.has_required = true;
+      for (const auto &rq : it_req->second.a)
+        if (rq.t == JsonValue::T_STRING)
+          n.required.push_back(add_key(n, rq.s));
     }
 
-    // properties
     auto it_props = schema.o.find("properties");
     if (it_props != schema.o.end() &&
         it_props->second.t == JsonValue::T_OBJECT) {
-      if (data.t != JsonValue::T_OBJECT) {
-        err = "expected object at '" + path + "' for properties";
-        return false;
-      }
+      nodes[idx].has_properties = true;
       for (const auto &p : it_props->second.o) {
-        auto it_data = data.o.find(p.first);
-        if (it_data != data.o.end()) {
-          std::string subpath = path.empty() ? p.first : (path + "." + p.first);
-          if (!validate_schema_rec(it_data->second, p.second, resolved, err,
-                                   subpath))
-            return false;
-        }
-      }
-      // Check for unknown properties in data and suggest corrections
-      for (const auto &data_prop : data.o) {
-        if (it_props->second.o.find(data_prop.first) ==
-            it_props->second.o.end()) {
-          std::string suggestion;
-          suggest_property(data_prop.first, it_props->second.o, suggestion);
-          err = "unknown property '" + data_prop.first + "' at '" + path + "'";
-          if (!suggestion.empty()) {
-            err += ". Did you mean '" + suggestion + "'?";
-          }
-          return false;
-        }
+        int32_t child = compile(p.second, doc, b); // may reallocate `nodes`
+        if (child < 0)
+          return -1;
+        Node &n = nodes[idx];
+        uint32_t slot = add_key(n, p.first);
+        n.key_schema[slot] = child;
+        n.properties.push_back(slot);
+        n.property_names.push_back(p.first);
       }
     }
 
-    // enum
     auto it_enum = schema.o.find("enum");
     if (it_enum != schema.o.end() && it_enum->second.t == JsonValue::T_ARRAY) {
-      bool match = false;
+      Node &n = nodes[idx];
+      n.has_enum = true;
       for (const auto &e : it_enum->second.a) {
-        // only compare strings and numbers for now
-        if (e.t == data.t) {
-          if (e.t == JsonValue::T_STRING && data.t == JsonValue::T_STRING &&
-              e.s == data.s)
-            match = true;
-          else if (e.t == JsonValue::T_NUMBER &&
-                   data.t == JsonValue::T_NUMBER && e.n == data.n)
-            match = true;
+        if (e.t == JsonValue::T_STRING)
+          n.enum_strings.insert(e.s);
+        else if (e.t == JsonValue::T_NUMBER)
+          n.enum_numbers.insert(e.n);
+      }
+    }
+
+    auto it_items = schema.o.find("items");
+    if (it_items != schema.o.end()) {
+      int32_t child = compile(it_items->second, doc, b);
+      if (child < 0)
+        return -1;
+      nodes[idx].items = child;
+    }
+    return idx;
+  }
+
+  // Point every ref node straight at the schema its chain ends in, so
+  // validation takes one hop. A chain that never reaches a real schema
+  // ({"$ref": "#"} at the root, A -> B -> A, ...) would never terminate.
+  bool link_refs(std::string &err) {
+    for (auto &n : nodes) {
+      if (n.ref < 0)
+        continue;
+      int32_t j = n.ref;
+      for (size_t steps = 0; nodes[j].ref >= 0; ++steps) {
+        if (steps > nodes.size()) {
+          err = "circular $ref '" + n.ref_text + "'";
+          return false;
         }
+        j = nodes[j].ref;
       }
-      if (!match) {
-        err = "enum mismatch at '" + path + "'";
-        return false;
+      n.ref = j;
+    }
+    return true;
+  }
+};
+
+// Reference to an object member collected into a slot.
+static inline const JsonValue *member_ref(const JsonValue &v) { return &v; }
+static inline std::optional<JsonView> member_ref(const JsonView &v) {
+  return v;
+}
+
+template <typename Data> struct SchemaRun {
+  using Ref = decltype(member_ref(std::declval<const Data &>()));
+  struct Segment {
+    std::string_view key;
+    size_t index; // used when key.data() is null
+  };
+
+  const CompiledSchema::Plan &plan;
+  std::string *first_error = nullptr;      // first-error mode, or
+  SchemaErrorCollector *collector = nullptr; // collect mode
+  size_t failures = 0;
+  std::vector<Segment> path;
+  std::vector<Ref> slots;                 // a stack of per-object slot ranges
+  std::vector<std::string_view> unknowns; // likewise, for unknown keys
+
+  // The path is only rendered when an error is reported.
+  std::string path_text() const {
+    std::string out;
+    for (const auto &seg : path) {
+      if (!seg.key.data()) {
+        out += "[" + std::to_string(seg.index) + "]";
+      } else {
+        if (!out.empty())
+          out += '.';
+        out += seg.key;
       }
     }
+    return out;
   }
 
-  // array items
-  if (schema.t == JsonValue::T_OBJECT) {
-    auto it_items = schema.o.find("items");
-    if (it_items != schema.o.end()) {
-      if (data.t != JsonValue::T_ARRAY) {
-        err = "expected array at '" + path + "' for items";
+  // Records an error at the current path; returns false once validation
+  // should stop.
+  bool report(std::string message) {
+    ++failures;
+    if (!collector) {
+      *first_error = std::move(message);
+      return false;
+    }
+    collector->errors.push_back({path_text(), std::move(message)});
+    if (collector->fail_fast || (collector->max_errors &&
+                                 failures >= collector->max_errors)) {
+      collector->truncated = true;
+      return false;
+    }
+    return true;
+  }
+
+  // Returns false when validation should stop; errors themselves go to
+  // report(). Checks run in the same order as always, so the first error
+  // collected is the one the single-error API returns.
+  bool run(const Data &data, int32_t idx) {
+    if (plan.nodes[idx].ref >= 0)
+      idx = plan.nodes[idx].ref; // already resolved to a non-ref node
+    const CompiledSchema::Plan::Node &n = plan.nodes[idx];
+    const JsonValue::Type data_type = node_type(data);
+    if (n.type >= 0 && n.type != data_type) {
+      // the remaining keywords would only repeat the mismatch
+      return report("type mismatch at '" + path_text() + "', expected '" +
+                    n.type_text + "' got '" + type_name(data) + "'");
+    }
+
+    if ((n.has_required || n.has_properties) &&
+        data_type != JsonValue::T_OBJECT) {
+      if (!report("expected object at '" + path_text() + "' for " +
+                  (n.has_required ? "required properties" : "properties")))
         return false;
+    } else if (n.has_required || n.has_properties) {
+      const size_t base = slots.size();
+      const size_t unknown_base = unknowns.size();
+      slots.resize(base + n.key_names.size());
+      for_each_member(data, [&](std::string_view key, const auto &child) {
+        auto it = n.keys.find(key);
+        if (it != n.keys.end())
+          slots[base + it->second] = member_ref(child); // last duplicate wins
+        if (n.has_properties &&
+            (it == n.keys.end() || n.key_schema[it->second] < 0))
+          unknowns.push_back(key);
+        return true;
+      });
+      if (unknowns.size() - unknown_base > 1) {
+        // a view walks members in document order; report unknown keys once
+        // each, in the sorted order of the JsonValue map
+        auto first = unknowns.begin() + static_cast<ptrdiff_t>(unknown_base);
+        std::sort(first, unknowns.end());
+        unknowns.erase(std::unique(first, unknowns.end()), unknowns.end());
       }
-      for (size_t i = 0; i < data.a.size(); ++i) {
-        std::string subpath = path + "[" + std::to_string(i) + "]";
-        if (!validate_schema_rec(data.a[i], it_items->second, resolved, err,
-                                 subpath))
-          return false;
+
+      bool go_on = true;
+      for (size_t k = 0; go_on && k < n.required.size(); ++k) {
+        uint32_t rq = n.required[k];
+        if (!slots[base + rq])
+          go_on = report("missing required property '" + n.key_names[rq] +
+                         "' at '" + path_text() + "'");
+      }
+      for (size_t k = 0; go_on && k < n.properties.size(); ++k) {
+        uint32_t slot = n.properties[k];
+        Ref member = slots[base + slot];
+        if (!member)
+          continue;
+        path.push_back({n.key_names[slot], 0});
+        go_on = run(*member, n.key_schema[slot]);
+        path.pop_back();
+      }
+      for (size_t k = unknown_base; go_on && k < unknowns.size(); ++k) {
+        // suggestions are only computed for errors that get reported
+        std::string name(unknowns[k]);
+        std::string suggestion = find_closest_match(name, n.property_names);
+        std::string msg = "unknown property '" + name + "' at '" +
+                          path_text() + "'";
+        if (!suggestion.empty())
+          msg += ". Did you mean '" + suggestion + "'?";
+        go_on = report(std::move(msg));
+      }
+      slots.resize(base);
+      unknowns.resize(unknown_base);
+      if (!go_on)
+        return false;
+    }
+
+    if (n.has_enum) {
+      bool match = false;
+      if (data_type == JsonValue::T_STRING)
+        match = n.enum_strings.count(node_string(data)) != 0;
+      else if (data_type == JsonValue::T_NUMBER)
+        match = n.enum_numbers.count(node_number(data)) != 0;
+      if (!match && !report("enum mismatch at '" + path_text() + "'"))
+        return false;
+    }
+
+    if (n.items >= 0) {
+      if (data_type != JsonValue::T_ARRAY)
+        return report("expected array at '" + path_text() + "' for items");
+      path.push_back({std::string_view(), 0});
+      size_t i = 0;
+      bool go_on = for_each_element(data, [&](const auto &elem) {
+        path.back().index = i++;
+        return run(elem, n.items);
+      });
+      path.pop_back();
+      if (!go_on)
+        return false;
+    }
+    return true;
+  }
+};
+
+CompiledSchema::CompiledSchema() = default;
+CompiledSchema::~CompiledSchema() = default;
+CompiledSchema::CompiledSchema(CompiledSchema &&) noexcept = default;
+CompiledSchema &CompiledSchema::operator=(CompiledSchema &&) noexcept = default;
+
+bool CompiledSchema::compile(std::string_view schema_text, std::string &err) {
+  static const std::map<std::string, std::string> no_links;
+  return compile(schema_text, no_links, err);
+}
+
+bool CompiledSchema::compile(const JsonValue &schema, std::string &err) {
+  static const std::map<std::string, std::string> no_links;
+  return compile(schema, no_links, err);
+}
+
+bool CompiledSchema::compile(std::string_view schema_text,
+                             const std::map<std::string, std::string> &links,
+                             std::string &err) {
+  JsonValue schema;
+  if (!parse_json_dom(schema_text, schema, err))
+    return false;
+  return compile(schema, links, err);
+}
+
+bool CompiledSchema::compile(const JsonValue &schema,
+                             const std::map<std::string, std::string> &links,
+                             std::string &err) {
+  metrics::Timer timer(metrics::SCHEMA_COMPILE);
+  auto plan = std::make_unique<Plan>();
+  Plan::Build b;
+  b.links = &links;
+  Plan::add_document(b, "", schema);
+  b.targets.emplace("#", 0); // "#" is the root being compiled
+  if (plan->compile(schema, "", b) < 0) {
+    err = b.err;
+    return false;
+  }
+  if (!plan->link_refs(err))
+    return false;
+  plan->self_contained = !b.external;
+  plan_ = std::move(plan);
+  return true;
+}
+
+bool CompiledSchema::empty() const { return !plan_; }
+
+// --- binary plan format ---
+// "BVSC", format version, node count, then per node: type, flags, items, ref,
+// type_text, ref_text, keys (name + schema), required slots, property slots,
+// enum strings, enum numbers. Integers are little-endian u32/i32, strings are
+// length-prefixed, numbers are IEEE doubles.
+
+static constexpr uint32_t kPlanFormatVersion = 1;
+
+namespace {
+struct PlanWriter {
+  std::string &out;
+  void u32(uint32_t v) {
+    for (int k = 0; k < 4; ++k)
+      out += static_cast<char>((v >> (8 * k)) & 0xFF);
+  }
+  void i32(int32_t v) { u32(static_cast<uint32_t>(v)); }
+  void f64(double d) {
+    uint64_t bits;
+    std::memcpy(&bits, &d, sizeof bits);
+    u32(static_cast<uint32_t>(bits));
+    u32(static_cast<uint32_t>(bits >> 32));
+  }
+  void str(std::string_view s) {
+    u32(static_cast<uint32_t>(s.size()));
+    out.append(s.data(), s.size());
+  }
+};
+
+struct PlanReader {
+  std::string_view in;
+  size_t pos = 0;
+  bool ok = true;
+  uint32_t u32() {
+    if (in.size() - pos < 4) {
+      ok = false;
+      return 0;
+    }
+    uint32_t v = 0;
+    for (int k = 0; k < 4; ++k)
+      v |= static_cast<uint32_t>(static_cast<unsigned char>(in[pos + k]))
+           << (8 * k);
+    pos += 4;
+    return v;
+  }
+  int32_t i32() { return static_cast<int32_t>(u32()); }
+  double f64() {
+    uint64_t lo = u32(), hi = u32();
+    uint64_t bits = lo | (hi << 32);
+    double d;
+    std::memcpy(&d, &bits, sizeof d);
+    return d;
+  }
+  std::string str() {
+    uint32_t n = u32();
+    if (!ok || in.size() - pos < n) {
+      ok = false;
+      return {};
+    }
+    std::string s(in.substr(pos, n));
+    pos += n;
+    return s;
+  }
+  // a count of items that take at least `min_size` bytes each; bounds the
+  // allocations a corrupt file can cause
+  uint32_t count(size_t min_size) {
+    uint32_t n = u32();
+    if (ok && n > (in.size() - pos) / min_size)
+      ok = false;
+    return ok ? n : 0;
+  }
+};
+} // namespace
+
+bool CompiledSchema::save(std::string &out, std::string &err) const {
+  if (!plan_) {
+    err = "schema not compiled";
+    return false;
+  }
+  if (!plan_->self_contained) {
+    err = "schema refers to documents outside its links";
+    return false;
+  }
+  out.clear();
+  PlanWriter w{out};
+  out += "BVSC";
+  w.u32(kPlanFormatVersion);
+  w.u32(static_cast<uint32_t>(plan_->nodes.size()));
+  for (const auto &n : plan_->nodes) {
+    w.i32(n.type);
+    w.u32((n.has_required ? 1u : 0u) | (n.has_properties ? 2u : 0u) |
+          (n.has_enum ? 4u : 0u));
+    w.i32(n.items);
+    w.i32(n.ref);
+    w.str(n.type_text);
+    w.str(n.ref_text);
+    w.u32(static_cast<uint32_t>(n.key_names.size()));
+    for (size_t k = 0; k < n.key_names.size(); ++k) {
+      w.str(n.key_names[k]);
+      w.i32(n.key_schema[k]);
+    }
+    w.u32(static_cast<uint32_t>(n.required.size()));
+    for (uint32_t slot : n.required)
+      w.u32(slot);
+    w.u32(static_cast<uint32_t>(n.properties.size()));
+    for (uint32_t slot : n.properties)
+      w.u32(slot);
+    w.u32(static_cast<uint32_t>(n.enum_strings.size()));
+    for (const auto &e : n.enum_strings)
+      w.str(e);
+    w.u32(static_cast<uint32_t>(n.enum_numbers.size()));
+    for (double e : n.enum_numbers)
+      w.f64(e);
+  }
+  return true;
+}
+
+bool CompiledSchema::load(std::string_view bytes, std::string &err) {
+  metrics::Timer timer(metrics::SCHEMA_COMPILE, bytes.size());
+  if (bytes.substr(0, 4) != "BVSC") {
+    err = "not a compiled schema";
+    return false;
+  }
+  PlanReader r{bytes, 4};
+  if (r.u32() != kPlanFormatVersion) {
+    err = "compiled schema has another format version";
+    return false;
+  }
+  auto plan = std::make_unique<Plan>();
+  plan->nodes.resize(r.count(40)); // the fixed part of a node
+  for (auto &n : plan->nodes) {
+    n.type = r.i32();
+    uint32_t flags = r.u32();
+    n.has_required = flags & 1;
+    n.has_properties = flags & 2;
+    n.has_enum = flags & 4;
+    n.items = r.i32();
+    n.ref = r.i32();
+    n.type_text = r.str();
+    n.ref_text = r.str();
+    const uint32_t keys = r.count(8);
+    for (uint32_t k = 0; k < keys; ++k) {
+      n.key_names.push_back(r.str());
+      n.key_schema.push_back(r.i32());
+      n.keys.emplace(n.key_names.back(), k);
+    }
+    const uint32_t required = r.count(4);
+    for (uint32_t k = 0; k < required; ++k)
+      n.required.push_back(r.u32());
+    const uint32_t properties = r.count(4);
+    for (uint32_t k = 0; k < properties; ++k)
+      n.properties.push_back(r.u32());
+    const uint32_t strings = r.count(4);
+    for (uint32_t k = 0; k < strings; ++k)
+      n.enum_strings.insert(r.str());
+    const uint32_t numbers = r.count(8);
+    for (uint32_t k = 0; k < numbers; ++k)
+      n.enum_numbers.insert(r.f64());
+    if (!r.ok)
+      break;
+  }
+
+  // every index must stay inside the plan, refs must already be linked
+  const int32_t size = static_cast<int32_t>(plan->nodes.size());
+  bool ok = r.ok && r.pos == bytes.size() && size > 0;
+  for (size_t i = 0; ok && i < plan->nodes.size(); ++i) {
+    auto &n = plan->nodes[i];
+    auto in_plan = [&](int32_t idx) { return idx >= 0 && idx < size; };
+    ok = n.type >= -1 && n.type <= JsonValue::T_ARRAY &&
+         (n.items == -1 || in_plan(n.items)) &&
+         (n.ref == -1 || (in_plan(n.ref) && plan->nodes[n.ref].ref == -1)) &&
+         n.keys.size() == n.key_names.size();
+    for (int32_t child : n.key_schema)
+      ok = ok && (child == -1 || in_plan(child));
+    for (uint32_t slot : n.required)
+      ok = ok && slot < n.key_names.size();
+    for (uint32_t slot : n.properties) {
+      ok = ok && slot < n.key_names.size() && n.key_schema[slot] >= 0;
+      if (ok)
+        n.property_names.push_back(n.key_names[slot]);
+    }
+  }
+  if (!ok) {
+    err = "compiled schema is malformed";
+    return false;
+  }
+  plan_ = std::move(plan);
+  return true;
+}
+
+template <typename Plan, typename Data>
+static bool run_schema(const Plan *plan, const Data &data, std::string *err,
+                       SchemaErrorCollector *collector) {
+  if (!plan) {
+    if (collector)
+      collector->errors.push_back({"", "schema not compiled"});
+    else
+      *err = "schema not compiled";
+    return false;
+  }
+  metrics::Timer timer(metrics::VALIDATE);
+  SchemaRun<Data> run{*plan, err, collector, 0, {}, {}, {}};
+  run.run(data, 0);
+  return run.failures == 0;
+}
+
+bool CompiledSchema::validate(const JsonValue &data, std::string &err) const {
+  return run_schema(plan_.get(), data, &err, nullptr);
+}
+
+bool CompiledSchema::validate(const JsonView &data, std::string &err) const {
+  return run_schema(plan_.get(), data, &err, nullptr);
+}
+
+bool CompiledSchema::validate(const JsonValue &data,
+                              SchemaErrorCollector &out) const {
+  return run_schema(plan_.get(), data, nullptr, &out);
+}
+
+bool CompiledSchema::validate(const JsonView &data,
+                              SchemaErrorCollector &out) const {
+  return run_schema(plan_.get(), data, nullptr, &out);
+}
+
+bool validate_json_with_schema(std::string_view json_text,
+                               std::string_view schema_text,
+                               std::string &err) {
+  JsonValue data;
+  if (!parse_json_dom(json_text, data, err))
+    return false;
+  return validate_json_with_schema(data, schema_text, err);
+}
+
+bool validate_json_with_schema(const JsonValue &data,
+                               std::string_view schema_text,
+                               std::string &err) {
+  CompiledSchema schema;
+  if (!schema.compile(schema_text, err))
+    return false;
+  return schema.validate(data, err);
+}
+
+bool validate_json_with_schema(const JsonView &data,
+                               std::string_view schema_text,
+                               std::string &err) {
+  CompiledSchema schema;
+  if (!schema.compile(schema_text, err))
+    return false;
+  return schema.validate(data, err);
+}
+
+bool validate_json_with_schema(const JsonView &data, const JsonValue &schema,
+                               std::string &err) {
+  CompiledSchema compiled;
+  if (!compiled.compile(schema, err))
+    return false;
+  return compiled.validate(data, err);
+}
+
+bool validate_json(std::string_view text, std::string &error_msg) {
+  metrics::Timer timer(metrics::PARSE, text.size());
+  // The vectorized scanner only answers valid/invalid; on rejection the
+  // scalar parser runs again to locate and describe the error.
+  if (json_validate_fast(text))
+    return true;
+  NullSink sink;
+  JsonParser<NullSink> p(text, sink);
+  if (!p.parse_document({})) {
+    error_msg = p.error_message();
+    return false;
+  }
+  return true;
+}
+
+// Streaming validator: a byte-at-a-time version of the JsonParser grammar.
+// Every state corresponds to a point inside one of JsonParser's functions,
+// and errors are reported at the same positions, so messages match
+// validate_json for the same input.
+struct JsonStreamValidator::State {
+  enum Mode : unsigned char {
+    VALUE,        // parse_value: skipping whitespace before a value
+    FIRST_ELEM,   // after '[': value or ']'
+    FIRST_KEY,    // after '{': key or '}'
+    KEY,          // after ',' in an object
+    COLON,        // after a key
+    OBJ_SEP,      // after a member value: ',' or '}'
+    ARR_SEP,      // after an element: ',' or ']'
+    STRING,       // inside a string
+    ESCAPE,       // after '\'
+    UNICODE,      // inside \uXXXX
+    NUM_MINUS,    // after leading '-'
+    NUM_ZERO,     // integer part is "0"
+    NUM_INT,      // integer digits
+    NUM_DOT,      // after '.'
+    NUM_FRAC,     // fraction digits
+    NUM_EXP_MARK, // after 'e' / 'E'
+    NUM_EXP_SIGN, // after the exponent sign
+    NUM_EXP,      // exponent digits
+    LITERAL,      // inside true / false / null
+    DONE,         // top-level value complete, only whitespace may follow
+    FAILED
+  };
+
+  bool ndjson;
+  RecordCallback callback;
+
+  Mode mode = VALUE;
+  std::vector<char> stack; // '{' or '[' per open container
+  bool in_key = false;     // current string is an object key
+  int hex_left = 0;
+  const char *literal = nullptr; // rest of the literal still expected
+  size_t literal_line = 0, literal_column = 0;
+
+  size_t line = 1;
+  uint64_t offset = 0;     // absolute offset of the next byte
+  uint64_t line_start = 0; // offset of the first byte of the current line
+
+  bool has_content = false; // NDJSON: current record is not blank
+  bool bad = false;         // invalid input seen
+  std::string first_error;
+  std::string record_error;
+  size_t records = 0;
+  size_t invalid = 0;
+
+  explicit State(bool nd) : ndjson(nd) {}
+
+  size_t column() const { return static_cast<size_t>(offset - line_start) + 1; }
+
+  void fail(JsonParseError e, size_t at_line, size_t at_column, char ch = 0) {
+    record_error = format_parse_error(e, ch, at_line, at_column);
+    mode = FAILED;
+  }
+  void fail_here(JsonParseError e, char ch = 0) {
+    fail(e, line, column(), ch);
+  }
+  // JsonParser reports these after consuming the offending byte.
+  void fail_after(JsonParseError e, char c) {
+    if (c == '\n')
+      fail(e, line + 1, 1, c);
+    else
+      fail(e, line, column() + 1, c);
+  }
+
+  void value_done() {
+    if (stack.empty())
+      mode = DONE;
+    else
+      mode = stack.back() == '{' ? OBJ_SEP : ARR_SEP;
+  }
+
+  void close_container() {
+    stack.pop_back();
+    value_done();
+  }
+
+  void begin_value(char c) {
+    switch (c) {
+    case '{':
+      stack.push_back('{');
+      mode = FIRST_KEY;
+      return;
+    case '[':
+      stack.push_back('[');
+      mode = FIRST_ELEM;
+      return;
+    case '"':
+      in_key = false;
+      mode = STRING;
+      return;
+    case '-':
+      mode = NUM_MINUS;
+      return;
+    case '0':
+      mode = NUM_ZERO;
+      return;
+    case 't':
+    case 'f':
+    case 'n':
+      literal = c == 't' ? "rue" : c == 'f' ? "alse" : "ull";
+      literal_line = line;
+      literal_column = column();
+      mode = LITERAL;
+      return;
+    default:
+      if (c >= '1' && c <= '9')
+        mode = NUM_INT;
+      else
+        fail_here(JsonParseError::UNEXPECTED_CHAR, c);
+    }
+  }
+
+  // Process one byte (never a record separator in NDJSON mode).
+  void step(char c) {
+    while (true) {
+      switch (mode) {
+      case VALUE:
+        if (!is_json_ws(c))
+          begin_value(c);
+        return;
+      case FIRST_ELEM:
+        if (is_json_ws(c))
+          return;
+        if (c == ']')
+          close_container();
+        else
+          begin_value(c);
+        return;
+      case FIRST_KEY:
+        if (is_json_ws(c))
+          return;
+        if (c == '}') {
+          close_container();
+          return;
+        }
+        [[fallthrough]];
+      case KEY:
+        if (is_json_ws(c))
+          return;
+        if (c != '"') {
+          fail_here(JsonParseError::EXPECTED_STRING);
+          return;
+        }
+        in_key = true;
+        mode = STRING;
+        return;
+      case COLON:
+        if (is_json_ws(c))
+          return;
+        if (c == ':')
+          mode = VALUE;
+        else
+          fail_here(JsonParseError::EXPECTED_COLON);
+        return;
+      case OBJ_SEP:
+        if (is_json_ws(c))
+          return;
+        if (c == ',')
+          mode = KEY;
+        else if (c == '}')
+          close_container();
+        else
+          fail_here(JsonParseError::EXPECTED_OBJECT_SEP);
+        return;
+      case ARR_SEP:
+        if (is_json_ws(c))
+          return;
+        if (c == ',')
+          mode = VALUE;
+        else if (c == ']')
+          close_container();
+        else
+          fail_here(JsonParseError::EXPECTED_ARRAY_SEP);
+        return;
+      case STRING:
+        if (c == '"') {
+          if (in_key)
+            mode = COLON;
+          else
+            value_done();
+        } else if (c == '\\') {
+          mode = ESCAPE;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+          fail_after(JsonParseError::CONTROL_CHARACTER, c);
+        }
+        return;
+      case ESCAPE:
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+        case 'b':
+        case 'f':
+        case 'n':
+        case 'r':
+        case 't':
+          mode = STRING;
+          break;
+        case 'u':
+          hex_left = 4;
+          mode = UNICODE;
+          break;
+        default:
+          fail_after(JsonParseError::INVALID_ESCAPE, c);
+        }
+        return;
+      case UNICODE:
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+              (c >= 'A' && c <= 'F')))
+          fail_here(JsonParseError::INVALID_UNICODE_ESCAPE);
+        else if (--hex_left == 0)
+          mode = STRING;
+        return;
+      case NUM_MINUS:
+        if (c == '0')
+          mode = NUM_ZERO;
+        else if (c >= '1' && c <= '9')
+          mode = NUM_INT;
+        else
+          fail_here(JsonParseError::INVALID_NUMBER);
+        return;
+      case NUM_ZERO:
+      case NUM_INT:
+        if (mode == NUM_INT && c >= '0' && c <= '9')
+          return;
+        if (c == '.') {
+          mode = NUM_DOT;
+          return;
+        }
+        if (c == 'e' || c == 'E') {
+          mode = NUM_EXP_MARK;
+          return;
+        }
+        value_done();
+        continue; // the number ended before this byte
+      case NUM_DOT:
+        if (c >= '0' && c <= '9')
+          mode = NUM_FRAC;
+        else
+          fail_here(JsonParseError::INVALID_FRACTION);
+        return;
+      case NUM_FRAC:
+        if (c >= '0' && c <= '9')
+          return;
+        if (c == 'e' || c == 'E') {
+          mode = NUM_EXP_MARK;
+          return;
+        }
+        value_done();
+        continue;
+      case NUM_EXP_MARK:
+        if (c == '+' || c == '-') {
+          mode = NUM_EXP_SIGN;
+          return;
+        }
+        [[fallthrough]];
+      case NUM_EXP_SIGN:
+        if (c >= '0' && c <= '9')
+          mode = NUM_EXP;
+        else
+          fail_here(JsonParseError::INVALID_EXPONENT);
+        return;
+      case NUM_EXP:
+        if (c >= '0' && c <= '9')
+          return;
+        value_done();
+        continue;
+      case LITERAL:
+        if (c != *literal) {
+          fail(JsonParseError::INVALID_LITERAL, literal_line, literal_column);
+          return;
+        }
+        if (*++literal == '\0')
+          value_done();
+        return;
+      case DONE:
+        if (!is_json_ws(c))
+          fail_here(JsonParseError::TRAILING_DATA);
+        return;
+      case FAILED:
+        return;
+      }
+    }
+  }
+
+  // End of the current document: whatever is still open is an error at the
+  // current position, as in JsonParser when it runs out of input.
+  void end_document() {
+    switch (mode) {
+    case NUM_ZERO:
+    case NUM_INT:
+    case NUM_FRAC:
+    case NUM_EXP:
+      value_done();
+      if (mode == DONE)
+        return;
+      end_document();
+      return;
+    case DONE:
+    case FAILED:
+      return;
+    case VALUE:
+    case FIRST_ELEM:
+      fail_here(JsonParseError::UNEXPECTED_END);
+      return;
+    case FIRST_KEY:
+    case KEY:
+      fail_here(JsonParseError::EXPECTED_STRING);
+      return;
+    case COLON:
+      fail_here(JsonParseError::EXPECTED_COLON);
+      return;
+    case OBJ_SEP:
+      fail_here(JsonParseError::EXPECTED_OBJECT_SEP);
+      return;
+    case ARR_SEP:
+      fail_here(JsonParseError::EXPECTED_ARRAY_SEP);
+      return;
+    case STRING:
+      fail_here(JsonParseError::UNTERMINATED_STRING);
+      return;
+    case ESCAPE:
+      fail_here(JsonParseError::UNTERMINATED_ESCAPE);
+      return;
+    case UNICODE:
+      fail_here(JsonParseError::INVALID_UNICODE_ESCAPE);
+      return;
+    case NUM_MINUS:
+      fail_here(JsonParseError::INVALID_NUMBER);
+      return;
+    case NUM_DOT:
+      fail_here(JsonParseError::INVALID_FRACTION);
+      return;
+    case NUM_EXP_MARK:
+    case NUM_EXP_SIGN:
+      fail_here(JsonParseError::INVALID_EXPONENT);
+      return;
+    case LITERAL:
+      fail(JsonParseError::INVALID_LITERAL, literal_line, literal_column);
+      return;
+    }
+  }
+
+  void start_document() {
+    mode = VALUE;
+    stack.clear();
+    record_error.clear();
+    has_content = false;
+  }
+
+  void note_error() {
+    if (!bad)
+      first_error = record_error;
+    bad = true;
+  }
+
+  // NDJSON: the newline at `offset` ends the current record.
+  void end_record() {
+    if (!has_content) {
+      start_document();
+      return;
+    }
+    end_document();
+    bool ok = mode != FAILED;
+    ++records;
+    if (!ok) {
+      ++invalid;
+      note_error();
+    }
+    if (callback)
+      callback(line, ok, record_error);
+    start_document();
+  }
+
+  void feed(const char *data, size_t len) {
+    for (size_t k = 0; k < len;) {
+      char c = data[k];
+      if (mode == STRING && c != '"' && c != '\\' &&
+          static_cast<unsigned char>(c) >= 0x20) {
+        // plain string bytes never change the state or the line count
+        size_t run = k + 1;
+        while (run < len && data[run] != '"' && data[run] != '\\' &&
+               static_cast<unsigned char>(data[run]) >= 0x20)
+          ++run;
+        offset += run - k;
+        k = run;
+        continue;
+      }
+      if (ndjson) {
+        if (c == '\n') {
+          end_record();
+        } else {
+          if (!is_json_ws(c))
+            has_content = true;
+          step(c);
+        }
+      } else if (mode != FAILED) {
+        step(c);
+        if (mode == FAILED)
+          note_error();
+      }
+      ++offset;
+      ++k;
+      if (c == '\n') {
+        ++line;
+        line_start = offset;
+      }
+    }
+  }
+};
+
+JsonStreamValidator::JsonStreamValidator(bool ndjson)
+    : st_(std::make_unique<State>(ndjson)) {}
+
+JsonStreamValidator::~JsonStreamValidator() = default;
+
+void JsonStreamValidator::on_record(RecordCallback cb) {
+  st_->callback = std::move(cb);
+}
+
+bool JsonStreamValidator::feed(const char *data, size_t len) {
+  metrics::Timer timer(metrics::PARSE, len);
+  if (!st_->ndjson && st_->mode == State::FAILED)
+    return false;
+  size_t invalid_before = st_->invalid;
+  st_->feed(data, len);
+  if (st_->ndjson)
+    return st_->invalid == invalid_before;
+  return st_->mode != State::FAILED;
+}
+
+bool JsonStreamValidator::finish() {
+  if (st_->ndjson) {
+    st_->end_record(); // last line without a trailing newline
+  } else if (st_->mode != State::FAILED) {
+    st_->end_document();
+    if (st_->mode == State::FAILED)
+      st_->note_error();
+  }
+  return !st_->bad;
+}
+
+void JsonStreamValidator::reset() {
+  auto fresh = std::make_unique<State>(st_->ndjson);
+  fresh->callback = std::move(st_->callback);
+  st_ = std::move(fresh);
+}
+
+const std::string &JsonStreamValidator::error() const {
+  return st_->first_error;
+}
+
+size_t JsonStreamValidator::records() const { return st_->records; }
+
+size_t JsonStreamValidator::invalid_records() const { return st_->invalid; }
+
+MappedFile::~MappedFile() { close(); }
+
+void MappedFile::close() {
+  if (mapped_) {
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+    CloseHandle(static_cast<HANDLE>(mapping_));
+    CloseHandle(static_cast<HANDLE>(file_));
+    mapping_ = file_ = nullptr;
+#else
+    munmap(const_cast<char *>(data_), size_);
+#endif
+  }
+  mapped_ = false;
+  buffer_.clear();
+  data_ = "";
+  size_ = 0;
+}
+
+bool MappedFile::open(const std::string &path, std::string &err) {
+  // with a mapping this times the mapping only; pages are read on first use
+  metrics::Timer timer(metrics::FILE_READ);
+  close();
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                            nullptr);
+  if (file != INVALID_HANDLE_VALUE) {
+    LARGE_INTEGER size;
+    if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &size) &&
+        size.QuadPart > 0) {
+      HANDLE mapping =
+          CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)
+                           : nullptr;
+      if (view) {
+        file_ = file;
+        mapping_ = mapping;
+        data_ = static_cast<const char *>(view);
+        size_ = static_cast<size_t>(size.QuadPart);
+        mapped_ = true;
+        timer.set_bytes(size_);
+        return true;
       }
+      if (mapping)
+        CloseHandle(mapping);
     }
+    CloseHandle(file);
   }
-
-  return true;
-}
-
-bool validate_json_with_schema(const std::string &json_text,
-                               const std::string &schema_text,
-                               std::string &err) {
-  JsonValue data;
-  if (!parse_json_dom(json_text, data, err))
-    return false;
-  JsonValue schema;
-  if (!parse_json_dom(schema_text, schema, err))
-    return false;
-  std::map<std::string, JsonValue>
-      resolved; // placeholder for future $ref handling
-  if (!validate_schema_rec(data, schema, resolved, err))
-    return false;
-  return true;
-}
-
-bool validate_json(const std::string &text, std::string &error_msg) {
-  JsonParser p(text);
-  p.skip_ws();
-  if (!p.parse_value()) {
-    error_msg = p.err;
-    return false;
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void *view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                        MAP_PRIVATE, fd, 0);
+      if (view != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+        madvise(view, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+#endif
+        ::close(fd); // the mapping keeps the file alive
+        data_ = static_cast<const char *>(view);
+        size_ = static_cast<size_t>(st.st_size);
+        mapped_ = true;
+        timer.set_bytes(size_);
+        return true;
+      }
+    }
+    ::close(fd);
   }
-  // done.
-  p.skip_ws();
-  if (p.i != text.size()) {
-    error_msg = "trailing data after JSON value";
+#endif
+  // Not mappable (pipe, empty file, special device): read it instead.
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    err = "cannot open file '" + path + "'";
     return false;
   }
+  buffer_.assign(std::istreambuf_iterator<char>(in),
+                 std::istreambuf_iterator<char>());
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+  timer.set_bytes(size_);
   return true;
 }
 
 void print_help(const char *program_name) {
-  std::cout << "Usage: " << program_name << " [options] <filename>\n"
+  std::cout << "Usage: " << program_name
+            << " [options] <filename|-> [more files, dirs, globs...]\n"
             << "Options:\n"
             << "  -h, --help     Show this help message\n"
             << "  -v, --version  Show version information\n"
             << "  -S, --shell    Start interactive JsonLambdaScript shell\n"
+            << "  -r, --run <script.jls>  Run a JsonLambdaScript file\n"
             << "  -f, --file <filename>  Specify input file\n"
             << "  -s, --schema <id|url>   Fetch a schema by id or URL and "
                "print info\n"
             << "  -us, --use-schema        Validate file using specified or "
-               "embedded $schema\n";
+               "embedded $schema\n"
+            << "  -n, --ndjson   Validate newline-delimited JSON, one record "
+               "per line\n"
+            << "  -              Read the input from stdin (streamed)\n"
+            << "  -j, --jobs <n>  Worker threads for multiple files (default: "
+               "all cores)\n"
+            << "  --unordered    Print per-file results as they complete\n"
+            << "  -E, --all-errors  Report every schema error, not just the "
+               "first\n"
+            << "  --max-errors <n>  Report at most n schema errors\n"
+            << "  --jq <filter>  Run a jq filter over the input; with -n on "
+               "every line,\n"
+            << "                 in parallel (-j, --unordered apply)\n"
+            << "  --split-array  With --jq, run the filter on each element of "
+               "a top-level\n"
+            << "                 array, in parallel\n"
+            << "  --stats[=json] Print time, bytes and cache counts per phase "
+               "to stderr\n"
+            << "  --profile[=json]  Like --stats, plus jq instruction counts "
+               "per opcode\n";
 }
 
-// Simple schema registry implementation (parsing `schemas.json` in a robust
-// way is out of scope; we accept a lightweight parser that extracts
-// `schemas[].id` and `schemas[].source` fields.)
+// Schema registry, loaded from `schemas.json`. Lookups go through hash
+// indexes by id and by source; `entries` keeps file order for listings and
+// error messages. A loaded registry is never modified: a reload builds a new
+// one and swaps the pointer, so readers holding a snapshot are unaffected.
+namespace {
+struct SchemaRegistry {
+  std::vector<SchemaEntry> entries;
+  std::unordered_map<std::string, size_t> by_id;     // first entry per id
+  std::unordered_map<std::string, size_t> by_source; // first entry per source
+  bool resolve_remote = true;
+  std::string cache_dir;
+  long long cache_max_age = 3600; // seconds before revalidating
 
-static std::vector<SchemaEntry> g_schema_registry;
-static bool g_resolve_remote = true;
-static std::string g_cache_dir;
+  const SchemaEntry *find_id(const std::string &id) const {
+    auto it = by_id.find(id);
+    return it == by_id.end() ? nullptr : &entries[it->second];
+  }
+
+  // The earliest entry whose id or source is `name`.
+  const SchemaEntry *find(const std::string &name) const {
+    auto a = by_id.find(name);
+    auto b = by_source.find(name);
+    if (a == by_id.end())
+      return b == by_source.end() ? nullptr : &entries[b->second];
+    if (b == by_source.end() || a->second < b->second)
+      return &entries[a->second];
+    return &entries[b->second];
+  }
+};
+} // namespace
+
+static std::mutex g_registry_mu;
+static std::shared_ptr<const SchemaRegistry> g_registry =
+    std::make_shared<SchemaRegistry>();
+static std::string g_registry_path; // file behind g_registry, "" if none
+static std::filesystem::file_time_type g_registry_mtime;
+static std::uintmax_t g_registry_size = 0;
+
+static std::shared_ptr<const SchemaRegistry> schema_registry() {
+  std::lock_guard<std::mutex> lock(g_registry_mu);
+  return g_registry;
+}
 
 static std::string trim_quotes(const std::string &s) {
   if (s.size() >= 2 && s.front() == '"' && s.back() == '"')
@@ -915,217 +2470,566 @@ static std::string read_file(const std::string &path, bool &ok) {
                      std::istreambuf_iterator<char>());
 }
 
-// Execute `curl` if available to fetch URL; this is a simple fallback when
-// libcurl isn't used. Uses popen (works on Windows with msys/cygwin or
-// on Windows 10/11 curl.exe present). Returns true on success.
-static bool fetch_url_with_curl_cli(const std::string &url, std::string &out) {
-  std::string cmd = "curl --fail -L -s " + url;
+// Portable detection of HTTP/HTTPS
+static bool is_http_url(const std::string &s) {
+  return (s.rfind("http://", 0) == 0) || (s.rfind("https://", 0) == 0);
+}
+
+// --- schema cache ---
+// Remote schemas are kept under cacheDirectory as <key>.json plus a
+// <key>.meta sidecar (ETag, Last-Modified, fetch time); compiled plans as
+// <key>.bvs. Keys are FNV-1a hashes, which unlike std::hash are the same on
+// every build and platform.
+
+static uint64_t fnv1a64(std::string_view s,
+                        uint64_t h = 0xcbf29ce484222325ull) {
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+static std::string hex64(uint64_t v) {
+  char buf[17];
+  std::snprintf(buf, sizeof buf, "%016llx", static_cast<unsigned long long>(v));
+  return buf;
+}
+
+static bool ensure_cache_dir(const std::string &dir) {
+  if (dir.empty())
+    return false;
+#ifdef _WIN32
+  if (!dir_exists(dir))
+    _mkdir(dir.c_str());
+#else
+  if (!dir_exists(dir))
+    mkdir(dir.c_str(), 0755);
+#endif
+  return dir_exists(dir);
+}
+
+// Replace `path` in one step so readers never see a partial file.
+static bool write_file_atomic(const std::string &path, std::string_view data) {
+  std::string tmp = path + ".tmp" +
+                    std::to_string(std::hash<std::thread::id>{}(
+                        std::this_thread::get_id()));
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out || !out.write(data.data(), data.size()))
+      return false;
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp, path, ec);
+  if (ec) {
+    std::filesystem::remove(tmp, ec);
+    return false;
+  }
+  return true;
+}
+
+struct CacheMeta {
+  std::string etag;
+  std::string last_modified;
+  long long fetched = 0; // unix time of the last fetch or revalidation
+};
+
+static std::string trim_ws(std::string_view s) {
+  size_t b = s.find_first_not_of(" \t\r\n");
+  if (b == std::string_view::npos)
+    return "";
+  size_t e = s.find_last_not_of(" \t\r\n");
+  return std::string(s.substr(b, e - b + 1));
+}
+
+static CacheMeta read_cache_meta(const std::string &path) {
+  CacheMeta meta;
+  bool ok;
+  std::string text = read_file(path, ok);
+  size_t pos = 0;
+  while (ok && pos < text.size()) {
+    size_t eol = text.find('\n', pos);
+    if (eol == std::string::npos)
+      eol = text.size();
+    std::string_view line(text.data() + pos, eol - pos);
+    size_t colon = line.find(':');
+    if (colon != std::string_view::npos) {
+      std::string_view name = line.substr(0, colon);
+      std::string value = trim_ws(line.substr(colon + 1));
+      if (name == "etag")
+        meta.etag = value;
+      else if (name == "last-modified")
+        meta.last_modified = value;
+      else if (name == "fetched")
+        meta.fetched = std::atoll(value.c_str());
+    }
+    pos = eol + 1;
+  }
+  return meta;
+}
+
+static void write_cache_meta(const std::string &path, const CacheMeta &meta) {
+  write_file_atomic(path, "etag: " + meta.etag + "\nlast-modified: " +
+                              meta.last_modified +
+                              "\nfetched: " + std::to_string(meta.fetched) +
+                              "\n");
+}
+
+static std::string shell_quote(const std::string &s) {
+#if defined(_WIN32) || defined(_WIN64)
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"')
+      out += '\\';
+    out += c;
+  }
+  return out + "\"";
+#else
+  std::string out = "'";
+  for (char c : s) {
+    if (c == '\'')
+      out += "'\\''";
+    else
+      out += c;
+  }
+  return out + "'";
+#endif
+}
+
+// One conditional GET: If-None-Match / If-Modified-Since come from `have`.
+// `status` is the HTTP status (304 = cached copy still current, 0 = no
+// response); on 200 `body` and the new validators in `got` are filled in.
+struct HttpRequest {
+  std::string url;
+  CacheMeta have;
+  int status = 0;
+  std::string body;
+  CacheMeta got;
+};
+
+// At most this many requests are in flight at once.
+static constexpr size_t kMaxParallelFetches = 8;
+
+static void parse_header_line(std::string_view line, CacheMeta &got) {
+  if (line.rfind("HTTP/", 0) == 0) {
+    got = CacheMeta(); // a new response after a redirect
+  } else if (size_t colon = line.find(':'); colon != std::string_view::npos) {
+    std::string name(line.substr(0, colon));
+    for (auto &c : name)
+      c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    if (name == "etag")
+      got.etag = trim_ws(line.substr(colon + 1));
+    else if (name == "last-modified")
+      got.last_modified = trim_ws(line.substr(colon + 1));
+  }
+}
+
+#ifdef USE_CURL
+// In-process client: all requests share one multi handle, so connections
+// (and TLS sessions) to the same host are reused, and HTTP/2 servers get
+// them multiplexed over a single connection.
+static size_t curl_body_cb(char *ptr, size_t size, size_t n, void *ud) {
+  static_cast<HttpRequest *>(ud)->body.append(ptr, size * n);
+  return size * n;
+}
+
+static size_t curl_header_cb(char *ptr, size_t size, size_t n, void *ud) {
+  parse_header_line(trim_ws(std::string_view(ptr, size * n)),
+                    static_cast<HttpRequest *>(ud)->got);
+  return size * n;
+}
+
+static void http_fetch_all(std::vector<HttpRequest *> &reqs) {
+  static std::once_flag init;
+  std::call_once(init, [] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+  CURLM *multi = curl_multi_init();
+  if (!multi)
+    return;
+  curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                    static_cast<long>(kMaxParallelFetches));
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  std::vector<std::pair<CURL *, curl_slist *>> handles;
+  for (HttpRequest *r : reqs) {
+    CURL *e = curl_easy_init();
+    if (!e)
+      continue;
+    curl_slist *headers = nullptr;
+    if (!r->have.etag.empty())
+      headers = curl_slist_append(headers,
+                                  ("If-None-Match: " + r->have.etag).c_str());
+    if (!r->have.last_modified.empty())
+      headers = curl_slist_append(
+          headers, ("If-Modified-Since: " + r->have.last_modified).c_str());
+    curl_easy_setopt(e, CURLOPT_URL, r->url.c_str());
+    curl_easy_setopt(e, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(e, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(e, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(e, CURLOPT_WRITEFUNCTION, curl_body_cb);
+    curl_easy_setopt(e, CURLOPT_WRITEDATA, r);
+    curl_easy_setopt(e, CURLOPT_HEADERFUNCTION, curl_header_cb);
+    curl_easy_setopt(e, CURLOPT_HEADERDATA, r);
+    curl_easy_setopt(e, CURLOPT_PRIVATE, r);
+    curl_multi_add_handle(multi, e);
+    handles.emplace_back(e, headers);
+  }
+  int running = 0;
+  do {
+    if (curl_multi_perform(multi, &running) != CURLM_OK)
+      break;
+    if (running)
+      curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+  } while (running);
+  int left = 0;
+  while (CURLMsg *msg = curl_multi_info_read(multi, &left)) {
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+    HttpRequest *r = nullptr;
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &r);
+    long code = 0;
+    if (msg->data.result == CURLE_OK)
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+    r->status = static_cast<int>(code);
+  }
+  for (auto &h : handles) {
+    curl_multi_remove_handle(multi, h.first);
+    curl_easy_cleanup(h.first);
+    curl_slist_free_all(h.second);
+  }
+  curl_multi_cleanup(multi);
+}
+#else
+// A new empty file in the temp directory for curl to write to. The name is
+// random and the file is created exclusively ("x"), so no other process can
+// have put a file or symlink there first, and parallel fetches of the same
+// URL get files of their own.
+static bool make_scratch_file(const char *suffix, std::string &path) {
+  static std::mutex mu;
+  static std::mt19937_64 rng{std::random_device{}()};
+  std::error_code ec;
+  std::filesystem::path dir = std::filesystem::temp_directory_path(ec);
+  const std::string prefix = (ec ? std::string(".") : dir.string()) + "/bvald-";
+  for (int attempt = 0; attempt < 16; ++attempt) {
+    uint64_t id;
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      id = rng();
+    }
+    path = prefix + hex64(id) + suffix;
+    if (FILE *f = std::fopen(path.c_str(), "wbx")) {
+      std::fclose(f);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Without libcurl every request is a `curl` process (works on Windows 10/11,
+// which ship curl.exe); they run side by side on a small pool.
+static void fetch_with_curl_cli(HttpRequest &r) {
+  std::string body_file, header_file;
+  std::error_code ec;
+  if (!make_scratch_file(".body", body_file))
+    return;
+  if (!make_scratch_file(".headers", header_file)) {
+    std::filesystem::remove(body_file, ec);
+    return;
+  }
+  std::string cmd = "curl -L -s -o " + shell_quote(body_file) + " -D " +
+                    shell_quote(header_file) + " -w \"%{http_code}\"";
+  if (!r.have.etag.empty())
+    cmd += " -H " + shell_quote("If-None-Match: " + r.have.etag);
+  if (!r.have.last_modified.empty())
+    cmd += " -H " + shell_quote("If-Modified-Since: " + r.have.last_modified);
+  cmd += " " + shell_quote(r.url);
 #if defined(_WIN32) || defined(_WIN64)
   FILE *pipe = _popen(cmd.c_str(), "r");
 #else
   FILE *pipe = popen(cmd.c_str(), "r");
 #endif
-  if (!pipe)
-    return false;
-  char buffer[4096];
-  out.clear();
-  while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-    out += buffer;
+  if (!pipe) {
+    std::filesystem::remove(body_file, ec);
+    std::filesystem::remove(header_file, ec);
+    return;
   }
+  char buffer[64];
+  std::string status;
+  while (fgets(buffer, sizeof(buffer), pipe) != nullptr)
+    status += buffer;
 #if defined(_WIN32) || defined(_WIN64)
-  int rc = _pclose(pipe);
+  _pclose(pipe);
 #else
-  int rc = pclose(pipe);
+  pclose(pipe);
 #endif
-  return (rc == 0);
+  r.status = std::atoi(status.c_str());
+
+  bool ok;
+  std::string headers = read_file(header_file, ok);
+  size_t pos = 0;
+  while (ok && pos < headers.size()) {
+    size_t eol = headers.find('\n', pos);
+    if (eol == std::string::npos)
+      eol = headers.size();
+    parse_header_line(trim_ws(std::string_view(headers).substr(pos, eol - pos)),
+                      r.got);
+    pos = eol + 1;
+  }
+  if (r.status == 200) {
+    r.body = read_file(body_file, ok);
+    if (!ok)
+      r.status = 0;
+  }
+  std::filesystem::remove(body_file, ec);
+  std::filesystem::remove(header_file, ec);
 }
 
-// Portable detection of HTTP/HTTPS
-static bool is_http_url(const std::string &s) {
-  return (s.rfind("http://", 0) == 0) || (s.rfind("https://", 0) == 0);
+static void http_fetch_all(std::vector<HttpRequest *> &reqs) {
+  if (reqs.size() == 1) {
+    fetch_with_curl_cli(*reqs[0]);
+    return;
+  }
+  ThreadPool pool(std::min(kMaxParallelFetches, reqs.size()));
+  for (HttpRequest *r : reqs)
+    pool.submit([r] { fetch_with_curl_cli(*r); });
+  pool.wait();
 }
+#endif
 
-bool init_schema_registry(const std::string &config_path, std::string &err) {
-  bool ok;
-  std::string content = read_file(config_path, ok);
-  if (!ok) {
-    err = "cannot read config file";
+// Remote texts already fetched by this process; a run asks for the same
+// schema several times (registry info, links, validation).
+static std::mutex g_remote_mu;
+static std::map<std::string, std::string> g_remote_texts;
+
+struct RemoteSchema {
+  std::string source;
+  bool ok = false;
+  std::string text;
+  std::string err;
+};
+
+// Fetch several remote schemas together. Texts this process already has and
+// cached copies younger than cacheMaxAge need no request; older copies are
+// revalidated, and a stale copy still beats no network at all. All remaining
+// requests go out at once.
+static void fetch_remote_schemas(std::vector<RemoteSchema> &items) {
+  struct Pending {
+    RemoteSchema *item;
+    std::string base; // cache path prefix, "" without a cache directory
+    bool cached = false;
+    std::string cached_body;
+    HttpRequest req;
+  };
+  const auto reg = schema_registry();
+  const bool use_cache = ensure_cache_dir(reg->cache_dir);
+  const long long now = static_cast<long long>(std::time(nullptr));
+  std::vector<Pending> pending;
+  pending.reserve(items.size());
+  for (auto &item : items) {
+    {
+      std::lock_guard<std::mutex> lock(g_remote_mu);
+      auto it = g_remote_texts.find(item.source);
+      if (it != g_remote_texts.end()) {
+        item.text = it->second;
+        item.ok = true;
+        metrics::count(metrics::SCHEMA_CACHE_HIT);
+        continue;
+      }
+    }
+    Pending p;
+    p.item = &item;
+    p.req.url = item.source;
+    const std::string key = hex64(fnv1a64(item.source));
+    if (use_cache) {
+      p.base = reg->cache_dir + "/" + key;
+      p.cached_body = read_file(p.base + ".json", p.cached);
+      if (p.cached) {
+        p.req.have = read_cache_meta(p.base + ".meta");
+        if (now - p.req.have.fetched < reg->cache_max_age) {
+          item.text = std::move(p.cached_body);
+          item.ok = true;
+          metrics::count(metrics::SCHEMA_CACHE_HIT);
+          continue;
+        }
+      }
+    }
+    pending.push_back(std::move(p));
+    metrics::count(metrics::SCHEMA_CACHE_MISS);
+  }
+
+  std::vector<HttpRequest *> reqs;
+  for (auto &p : pending)
+    reqs.push_back(&p.req);
+  if (!reqs.empty()) {
+    metrics::Timer timer(metrics::SCHEMA_FETCH);
+    http_fetch_all(reqs);
+    uint64_t fetched = 0;
+    for (const HttpRequest *r : reqs)
+      fetched += r->body.size();
+    timer.set_bytes(fetched);
+  }
+
+  for (auto &p : pending) {
+    RemoteSchema &item = *p.item;
+    if (p.req.status == 304 && p.cached) {
+      p.req.have.fetched = now;
+      write_cache_meta(p.base + ".meta", p.req.have);
+      item.text = std::move(p.cached_body);
+      item.ok = true;
+    } else if (p.req.status == 200) {
+      if (use_cache) {
+        p.req.got.fetched = now;
+        write_file_atomic(p.base + ".json", p.req.body);
+        write_cache_meta(p.base + ".meta", p.req.got);
+      }
+      item.text = std::move(p.req.body);
+      item.ok = true;
+    } else if (p.cached) {
+      item.text = std::move(p.cached_body); // offline or server error
+      item.ok = true;
+    } else {
+      item.err = p.req.status ? "failed to fetch url (HTTP " +
+                                    std::to_string(p.req.status) + ")"
+                              : "failed to fetch url";
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(g_remote_mu);
+  for (const auto &item : items)
+    if (item.ok)
+      g_remote_texts.emplace(item.source, item.text);
+}
+
+static bool fetch_remote_schema(const std::string &source, std::string &out,
+                                std::string &err) {
+  std::vector<RemoteSchema> items(1);
+  items[0].source = source;
+  fetch_remote_schemas(items);
+  if (!items[0].ok) {
+    err = items[0].err;
+    return false;
+  }
+  out = std::move(items[0].text);
+  return true;
+}
+
+static std::string view_string(const JsonView &obj, std::string_view key) {
+  JsonView v;
+  if (obj.find(key, v) && v.type() == JsonValue::T_STRING)
+    return std::string(v.as_string());
+  return std::string();
+}
+
+static bool load_schema_registry(const std::string &content,
+                                 SchemaRegistry &reg, std::string &err) {
+  JsonDocument doc;
+  std::string perr;
+  if (!parse_json_document(content, doc, perr)) {
+    err = "invalid config file: " + perr;
     return false;
   }
-  // Very small parser: find "schemas": [ ... ] then for each object look for
-  // "id" and "source"
-  size_t pos = content.find("\"schemas\"");
-  if (pos == std::string::npos) {
+  JsonView schemas;
+  if (doc.root().type() != JsonValue::T_OBJECT ||
+      !doc.root().find("schemas", schemas)) {
     err = "no schemas key";
     return false;
   }
-  pos = content.find('[', pos);
-  if (pos == std::string::npos) {
+  if (schemas.type() != JsonValue::T_ARRAY) {
     err = "malformed schemas array";
     return false;
   }
-  // Find matching closing ']' that balances nested arrays and ignores
-  // brackets inside strings
-  size_t end = std::string::npos;
-  bool in_string = false;
-  int depth = 0;
-  for (size_t k = pos; k < content.size(); ++k) {
-    char ch = content[k];
-    if (ch == '"') {
-      // toggle string state if not escaped
-      bool escaped = (k > 0 && content[k - 1] == '\\');
-      if (!escaped)
-        in_string = !in_string;
-    }
-    if (in_string)
+  reg.entries.reserve(schemas.size());
+  for (JsonView obj : schemas) {
+    if (obj.type() != JsonValue::T_OBJECT)
       continue;
-    if (ch == '[')
-      depth++;
-    else if (ch == ']') {
-      depth--;
-      if (depth == 0) {
-        end = k;
-        break;
+    SchemaEntry e;
+    e.id = view_string(obj, "id");
+    e.source = view_string(obj, "source");
+    if (e.id.empty() || e.source.empty())
+      continue;
+    e.name = view_string(obj, "name");
+    e.description = view_string(obj, "description");
+    e.schemaVersion = view_string(obj, "schemaVersion");
+    JsonView links;
+    if (obj.find("links", links) && links.type() == JsonValue::T_ARRAY) {
+      for (JsonView link : links) {
+        if (link.type() == JsonValue::T_STRING && !link.as_string().empty())
+          e.links.emplace_back(link.as_string());
       }
     }
+    const size_t index = reg.entries.size();
+    reg.by_id.emplace(e.id, index);
+    reg.by_source.emplace(e.source, index);
+    reg.entries.push_back(std::move(e));
   }
-  if (end == std::string::npos) {
-    err = "malformed schemas array (no closing bracket)";
-    return false;
+
+  // optional settings: resolveRemote, cacheMaxAge and cacheDirectory
+  JsonView settings, v;
+  if (doc.root().find("settings", settings) &&
+      settings.type() == JsonValue::T_OBJECT) {
+    if (settings.find("resolveRemote", v))
+      reg.resolve_remote = v.type() == JsonValue::T_BOOL && v.as_bool();
+    if (settings.find("cacheMaxAge", v) && v.type() == JsonValue::T_NUMBER)
+      reg.cache_max_age = static_cast<long long>(v.as_number());
+    reg.cache_dir = view_string(settings, "cacheDirectory");
   }
-  if (end == std::string::npos) {
-    err = "malformed schemas array (no closing bracket)";
+  return true;
+}
+
+bool init_schema_registry(const std::string &config_path, std::string &err) {
+  // Asking again for the same, unchanged file is a stat() and nothing more.
+  std::error_code ec;
+  const auto mtime = std::filesystem::last_write_time(config_path, ec);
+  const std::uintmax_t size =
+      ec ? 0 : std::filesystem::file_size(config_path, ec);
+  if (!ec) {
+    std::lock_guard<std::mutex> lock(g_registry_mu);
+    if (config_path == g_registry_path && mtime == g_registry_mtime &&
+        size == g_registry_size)
+      return true;
+  }
+
+  bool ok;
+  std::string content = read_file(config_path, ok);
+  if (!ok) {
+    err = "cannot read config file";
     return false;
   }
-  std::string arr = content.substr(pos + 1, end - pos - 1);
-  // std::cerr << "[init_schema_registry] schemas array excerpt: '" << arr
-  //           << "'\n";
-  // arr segment debug will be printed per-object after obj_start is found
-  // split by '},' to approximate object boundaries
-  size_t cursor = 0;
-  g_schema_registry.clear();
-  while (cursor < arr.size()) {
-    size_t obj_start = arr.find('{', cursor);
-    if (obj_start == std::string::npos)
-      break;
-    size_t obj_end = arr.find('}', obj_start);
-    // std::cerr << "[init_schema_registry] obj_start=" << obj_start
-    //           << " obj_end=" << obj_end << " cursor=" << cursor
-    //           << " arr.size=" << arr.size() << "\n";
-    // std::cerr << "[init_schema_registry] arr segment='"
-    //           << arr.substr(obj_start,
-    //           std::min<size_t>(arr.size() - obj_start, 200))
-    //           << "'\n";
-    if (obj_end == std::string::npos)
-      break;
-    std::string obj = arr.substr(obj_start + 1, obj_end - obj_start - 1);
-    // std::cerr << "[init_schema_registry] obj excerpt: '"
-    //           << obj.substr(0, std::min<size_t>(obj.size(), 200)) << "'\n";
-    cursor = obj_end + 1;
-    SchemaEntry e;
-    // find id
-    size_t id_pos = obj.find("\"id\"");
-    if (id_pos != std::string::npos) {
-      size_t col = obj.find(':', id_pos);
-      if (col != std::string::npos) {
-        size_t quote = obj.find('"', col);
-        size_t quote2 = obj.find('"', quote + 1);
-        if (quote != std::string::npos && quote2 != std::string::npos)
-          e.id = obj.substr(quote + 1, quote2 - quote - 1);
-      }
-    }
-    size_t src_pos = obj.find("\"source\"");
-    if (src_pos != std::string::npos) {
-      size_t col = obj.find(':', src_pos);
-      if (col != std::string::npos) {
-        size_t quote = obj.find('"', col);
-        size_t quote2 = obj.find('"', quote + 1);
-        if (quote != std::string::npos && quote2 != std::string::npos)
-          e.source = obj.substr(quote + 1, quote2 - quote - 1);
-      }
-    }
-    // parse optional links array
-    size_t links_pos = obj.find("\"links\"");
-    if (links_pos != std::string::npos) {
-      size_t lb = obj.find('[', links_pos);
-      if (lb != std::string::npos) {
-        size_t le = obj.find(']', lb);
-        if (le != std::string::npos) {
-          std::string links_arr = obj.substr(lb + 1, le - lb - 1);
-          size_t cur2 = 0;
-          while (cur2 < links_arr.size()) {
-            size_t q1 = links_arr.find('"', cur2);
-            if (q1 == std::string::npos)
-              break;
-            size_t q2 = links_arr.find('"', q1 + 1);
-            if (q2 == std::string::npos)
-              break;
-            std::string link = links_arr.substr(q1 + 1, q2 - q1 - 1);
-            if (!link.empty())
-              e.links.push_back(link);
-            cur2 = q2 + 1;
-            size_t nxt = links_arr.find(',', cur2);
-            if (nxt == std::string::npos)
-              break;
-            cur2 = nxt + 1;
-          }
-        }
-      }
-    }
-    if (!e.id.empty() && !e.source.empty()) {
-      g_schema_registry.push_back(e);
-    }
-  }
-  // debug: how many schemas were parsed
-  // std::cerr << "[init_schema_registry] loaded " << g_schema_registry.size()
-  // << " entries\n";
-
-  // Parse optional settings object: resolveRemote and cacheDirectory
-  size_t settings_pos = content.find("\"settings\"");
-  if (settings_pos != std::string::npos) {
-    size_t sstart = content.find('{', settings_pos);
-    if (sstart != std::string::npos) {
-      size_t send = content.find('}', sstart);
-      if (send != std::string::npos) {
-        std::string settings = content.substr(sstart + 1, send - sstart - 1);
-        size_t rr = settings.find("\"resolveRemote\"");
-        if (rr != std::string::npos) {
-          size_t col = settings.find(':', rr);
-          if (col != std::string::npos) {
-            size_t t = settings.find_first_not_of(" \t\n\r", col + 1);
-            if (t != std::string::npos) {
-              if (settings.compare(t, 4, "true") == 0)
-                g_resolve_remote = true;
-              else
-                g_resolve_remote = false;
-            }
-          }
-        }
-        size_t cachep = settings.find("\"cacheDirectory\"");
-        if (cachep != std::string::npos) {
-          size_t col = settings.find(':', cachep);
-          if (col != std::string::npos) {
-            size_t quote = settings.find('"', col);
-            size_t quote2 = settings.find('"', quote + 1);
-            if (quote != std::string::npos && quote2 != std::string::npos)
-              g_cache_dir = settings.substr(quote + 1, quote2 - quote - 1);
-          }
-        }
-      }
-    }
+  auto reg = std::make_shared<SchemaRegistry>();
+  if (!load_schema_registry(content, *reg, err))
+    return false; // the previous registry stays in place
+
+  {
+    std::lock_guard<std::mutex> lock(g_registry_mu);
+    g_registry = std::move(reg);
+    g_registry_path = ec ? std::string() : config_path;
+    g_registry_mtime = mtime;
+    g_registry_size = size;
   }
+  // the new file may point ids at different sources
+  std::lock_guard<std::mutex> lock(g_remote_mu);
+  g_remote_texts.clear();
   return true;
 }
 
-bool get_schema_source(const std::string &id_or_source, std::string &out,
-                       std::string &err) {
+bool reload_schema_registry(std::string &err) {
+  std::string path;
+  {
+    std::lock_guard<std::mutex> lock(g_registry_mu);
+    path = g_registry_path;
+  }
+  if (path.empty()) {
+    err = "no schema registry loaded";
+    return false;
+  }
+  return init_schema_registry(path, err);
+}
+
+static bool load_schema_source(const std::string &id_or_source,
+                               std::string &out, std::string &err) {
+  const auto reg = schema_registry();
   // If it's an id that exists in the registry, select its source
   std::string source = id_or_source;
-  auto it = std::find_if(
-      g_schema_registry.begin(), g_schema_registry.end(),
-      [&](const SchemaEntry &se) { return se.id == id_or_source; });
-  if (it != g_schema_registry.end()) {
-    source = it->source;
+  if (const SchemaEntry *e = reg->find_id(id_or_source)) {
+    source = e->source;
   } else {
     // If it's an absolute or relative path to a file, try to read it
     bool ok;
@@ -1140,7 +3044,7 @@ bool get_schema_source(const std::string &id_or_source, std::string &out,
     } else {
       // report available ids in registry to make debugging easier for me :)
       std::string ids;
-      for (const auto &s : g_schema_registry) {
+      for (const auto &s : reg->entries) {
         if (!ids.empty())
           ids += ", ";
         ids += s.id;
@@ -1156,45 +3060,11 @@ bool get_schema_source(const std::string &id_or_source, std::string &out,
   }
 
   if (is_http_url(source)) {
-    if (!g_resolve_remote) {
+    if (!reg->resolve_remote) {
       err = "remote fetching disabled by settings";
       return false;
     }
-    // Simple cache mechanism: store by hashed filename in g_cache_dir if set
-    std::string cache_file;
-    if (!g_cache_dir.empty()) {
-      // Try to create the directory if it does not exist.
-#ifdef _WIN32
-      if (!dir_exists(g_cache_dir))
-        _mkdir(g_cache_dir.c_str());
-#else
-      if (!dir_exists(g_cache_dir))
-        mkdir(g_cache_dir.c_str(), 0755);
-#endif
-      std::size_t h = std::hash<std::string>{}(source);
-      cache_file = g_cache_dir + "/" + std::to_string(h) + ".json";
-      bool ok;
-      std::string cached = read_file(cache_file, ok);
-      if (ok) {
-        out = cached;
-        return true;
-      }
-    }
-#ifdef USE_CURL
-    // TODO: add libcurl support : prob never cuz just.
-#endif
-    bool ok = fetch_url_with_curl_cli(source, out);
-    if (!ok) {
-      err = "failed to fetch url";
-      return false;
-    }
-    // write to cache
-    if (!cache_file.empty()) {
-      std::ofstream fout(cache_file, std::ios::binary);
-      if (fout)
-        fout << out;
-    }
-    return true;
+    return fetch_remote_schema(source, out, err);
   }
   // Otherwise treat as local file
   bool ok;
@@ -1206,9 +3076,20 @@ bool get_schema_source(const std::string &id_or_source, std::string &out,
   return true;
 }
 
+bool get_schema_source(const std::string &id_or_source, std::string &out,
+                       std::string &err) {
+  metrics::Timer timer(metrics::SCHEMA_LOAD);
+  bool ok = load_schema_source(id_or_source, out, err);
+  if (ok)
+    timer.set_bytes(out.size());
+  return ok;
+}
+
 std::vector<std::string> list_schema_ids() {
+  const auto reg = schema_registry();
   std::vector<std::string> res;
-  for (const auto &e : g_schema_registry)
+  res.reserve(reg->entries.size());
+  for (const auto &e : reg->entries)
     res.push_back(e.id);
   return res;
 }
@@ -1216,65 +3097,218 @@ std::vector<std::string> list_schema_ids() {
 // Resolve schema and links recursively into out_map. Avoid cycles using a
 // visited set.
 static bool
-resolve_schema_links_helper(const std::string &id_or_source,
+resolve_schema_links_helper(const SchemaRegistry &reg,
+                            const std::string &id_or_source,
+                            const std::string *known,
                             std::map<std::string, std::string> &out_map,
                             std::set<std::string> &visited, std::string &err) {
   if (visited.count(id_or_source))
     return true;
   visited.insert(id_or_source);
   std::string content;
-  if (!get_schema_source(id_or_source, content, err))
+  if (known)
+    content = *known;
+  else if (!get_schema_source(id_or_source, content, err))
     return false;
   // prefer id key if available
-  auto it =
-      std::find_if(g_schema_registry.begin(), g_schema_registry.end(),
-                   [&](const SchemaEntry &se) {
-                     return se.source == id_or_source || se.id == id_or_source;
-                   });
-  std::string key = id_or_source;
-  if (it != g_schema_registry.end())
-    key = it->id;
-  out_map[key] = content;
+  const SchemaEntry *e = reg.find(id_or_source);
+  out_map[e ? e->id : id_or_source] = content;
 
   // if the entry exists and has links, resolve them
-  if (it != g_schema_registry.end()) {
-    for (const auto &link : it->links) {
-      if (!resolve_schema_links_helper(link, out_map, visited, err))
+  if (e) {
+    for (const auto &link : e->links) {
+      if (!resolve_schema_links_helper(reg, link, nullptr, out_map, visited,
+                                       err))
         return false;
     }
   }
   return true;
 }
 
+// Every schema reachable through registry links. The link graph lives in
+// schemas.json, so it is known before anything is fetched.
+static void collect_linked_schemas(const SchemaRegistry &reg,
+                                   const std::string &id_or_source,
+                                   std::set<std::string> &seen,
+                                   std::vector<std::string> &out) {
+  if (!seen.insert(id_or_source).second)
+    return;
+  out.push_back(id_or_source);
+  if (const SchemaEntry *e = reg.find(id_or_source))
+    for (const auto &link : e->links)
+      collect_linked_schemas(reg, link, seen, out);
+}
+
+// `known`, when given, is the text of `id_or_source` itself.
+static bool resolve_schema_links(const std::string &id_or_source,
+                                 const std::string *known,
+                                 std::map<std::string, std::string> &out_map,
+                                 std::string &err) {
+  const auto reg = schema_registry();
+  // Fetch every remote schema in the graph concurrently first; the walk
+  // below then finds them all in memory and keeps its order and errors.
+  std::set<std::string> seen;
+  std::vector<std::string> graph;
+  collect_linked_schemas(*reg, id_or_source, seen, graph);
+  std::vector<RemoteSchema> remote;
+  for (const auto &name : graph) {
+    if (known && name == id_or_source)
+      continue;
+    const SchemaEntry *e = reg->find_id(name);
+    const std::string &source = e ? e->source : name;
+    if (is_http_url(source) && reg->resolve_remote) {
+      remote.emplace_back();
+      remote.back().source = source;
+    }
+  }
+  if (remote.size() > 1)
+    fetch_remote_schemas(remote);
+
+  std::set<std::string> visited;
+  return resolve_schema_links_helper(*reg, id_or_source, known, out_map,
+                                     visited, err);
+}
+
 bool resolve_schema_links(const std::string &id_or_source,
                           std::map<std::string, std::string> &out_map,
                           std::string &err) {
-  std::set<std::string> visited;
-  return resolve_schema_links_helper(id_or_source, out_map, visited, err);
+  return resolve_schema_links(id_or_source, nullptr, out_map, err);
+}
+
+bool resolve_schema_links(const std::string &id_or_source,
+                          const std::string &source,
+                          std::map<std::string, std::string> &out_map,
+                          std::string &err) {
+  return resolve_schema_links(id_or_source, &source, out_map, err);
+}
+
+// Compiled plans by content key, most recently used first.
+namespace {
+struct PlanCache {
+  using Entry = std::pair<uint64_t, std::shared_ptr<const CompiledSchema>>;
+  std::mutex mu;
+  std::list<Entry> lru;
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+};
+} // namespace
+
+static constexpr size_t kPlanCacheCapacity = 16;
+
+static PlanCache &plan_cache() {
+  static PlanCache cache;
+  return cache;
+}
+
+static std::shared_ptr<const CompiledSchema>
+plan_cache_insert(uint64_t key, std::shared_ptr<const CompiledSchema> plan) {
+  PlanCache &c = plan_cache();
+  std::lock_guard<std::mutex> lock(c.mu);
+  auto it = c.index.find(key);
+  if (it != c.index.end())
+    return it->second->second; // another thread got there first
+  c.lru.emplace_front(key, std::move(plan));
+  c.index[key] = c.lru.begin();
+  if (c.lru.size() > kPlanCacheCapacity) {
+    c.index.erase(c.lru.back().first);
+    c.lru.pop_back();
+  }
+  return c.lru.front().second;
+}
+
+std::shared_ptr<const CompiledSchema>
+compile_schema_cached(std::string_view schema_text,
+                      const std::map<std::string, std::string> &links,
+                      std::string &err) {
+  static const std::string_view sep("\0", 1);
+  uint64_t key = fnv1a64(schema_text);
+  for (const auto &link : links) {
+    key = fnv1a64(link.second, fnv1a64(sep, fnv1a64(link.first,
+                                                      fnv1a64(sep, key))));
+  }
+
+  {
+    PlanCache &c = plan_cache();
+    std::lock_guard<std::mutex> lock(c.mu);
+    auto it = c.index.find(key);
+    if (it != c.index.end()) {
+      c.lru.splice(c.lru.begin(), c.lru, it->second);
+      metrics::count(metrics::PLAN_CACHE_HIT);
+      return it->second->second;
+    }
+  }
+
+  const auto reg = schema_registry();
+  const std::string plan_file = ensure_cache_dir(reg->cache_dir)
+                                    ? reg->cache_dir + "/" + hex64(key) + ".bvs"
+                                    : "";
+  if (!plan_file.empty()) {
+    bool ok;
+    std::string bytes = read_file(plan_file, ok);
+    auto plan = std::make_shared<CompiledSchema>();
+    std::string lerr;
+    if (ok && plan->load(bytes, lerr)) {
+      metrics::count(metrics::PLAN_CACHE_HIT);
+      return plan_cache_insert(key, std::move(plan));
+    }
+    // missing, stale format or damaged: compile again and overwrite
+  }
+
+  metrics::count(metrics::PLAN_CACHE_MISS);
+  auto plan = std::make_shared<CompiledSchema>();
+  if (!plan->compile(schema_text, links, err))
+    return nullptr;
+  if (!plan_file.empty()) {
+    std::string bytes, serr;
+    if (plan->save(bytes, serr))
+      write_file_atomic(plan_file, bytes);
+  }
+  return plan_cache_insert(key, std::move(plan));
 }
 
 // ================= jq JSON Query Engine =================
-// Static engine instance (lazy initialized)
-static std::shared_ptr<jq::Engine> g_jq_engine;
+// Filters are compiled once and kept in jq::Engine's LRU, so applying the
+// same filter to many documents only pays for parsing the input.
 
 bool run_jq_filter(const std::string &filter, const std::string &json_in,
                    std::string &json_out, std::string &err) {
-  // Lazy initialization of jq engine
-  if (!g_jq_engine) {
-    g_jq_engine = std::make_shared<jq::Engine>();
-  }
-  return g_jq_engine->run(filter, json_in, json_out, err);
+  // only the first output is wanted, so stop as soon as there is one
+  json_out = "null";
+  return run_jq_filter_streaming(
+      filter, json_in,
+      [&json_out](std::string_view json) {
+        json_out = json;
+        return false;
+      },
+      err);
 }
 
 bool run_jq_filter_streaming(const std::string &filter,
                              const std::string &json_in,
                              std::vector<std::string> &json_outputs,
                              std::string &err) {
-  // Lazy initialization of jq engine
-  if (!g_jq_engine) {
-    g_jq_engine = std::make_shared<jq::Engine>();
-  }
-  return g_jq_engine->run_streaming(filter, json_in, json_outputs, err);
+  jq::CompiledFilter compiled;
+  if (!jq::Engine::compile_cached(filter, compiled, err))
+    return false;
+  return compiled.run(json_in, json_outputs, err);
+}
+
+bool run_jq_filter_streaming(const std::string &filter,
+                             const std::string &json_in,
+                             const JqOutputCallback &on_output,
+                             std::string &err) {
+  jq::CompiledFilter compiled;
+  if (!jq::Engine::compile_cached(filter, compiled, err))
+    return false;
+  return compiled.run(json_in, on_output, err);
+}
+
+bool run_jq_filter_streaming(const std::string &filter,
+                             const std::string &json_in, FILE *out,
+                             std::string &err) {
+  jq::CompiledFilter compiled;
+  if (!jq::Engine::compile_cached(filter, compiled, err))
+    return false;
+  return compiled.run(json_in, out, err);
 }
 
 void register_jq_builtin(
@@ -5,8 +5,10 @@
 #include <functional>
 #include <iostream>
 #include <map>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // ================= DLL Export Macro =================
@@ -37,14 +39,110 @@ struct JSONVAL_API JsonValue {
 
 // Parse JSON text into a JsonValue tree. Returns true on success, false on
 // error with details in `err`.
-JSONVAL_API bool parse_json_dom(const std::string &json_text, JsonValue &out,
+JSONVAL_API bool parse_json_dom(std::string_view json_text, JsonValue &out,
                                 std::string &err);
+inline bool parse_json_dom(const char *data, size_t len, JsonValue &out,
+                           std::string &err) {
+  return parse_json_dom(std::string_view(data, len), out, err);
+}
 
 // Print JSON as a tree structure to stdout.
 JSONVAL_API void print_json_tree(const JsonValue &val,
                                  const std::string &prefix = "",
                                  bool is_last = true);
 
+// ================= Compact DOM (tape) ===============
+// Read-only alternative to the JsonValue tree for large documents. Values are
+// stored in document order as a flat tape of tagged 64-bit entries, and all
+// strings (keys included) live in one arena, so a parsed document costs about
+// the size of its input instead of one heap node per value.
+class JsonDocument;
+
+// Handle to one value inside a JsonDocument. Cheap to copy; valid while the
+// document is alive and not re-parsed. A default-constructed view reads as
+// null.
+class JSONVAL_API JsonView {
+public:
+  class Iterator;
+
+  JsonView() = default;
+
+  JsonValue::Type type() const;
+  bool as_bool() const;                // false unless T_BOOL
+  double as_number() const;            // 0.0 unless T_NUMBER
+  std::string_view as_string() const;  // empty unless T_STRING
+  size_t size() const;                 // elements/members, 0 for scalars
+
+  // Object member lookup. With duplicate keys the last one wins, matching
+  // JsonValue::o. Returns false if this is not an object or the key is absent.
+  bool find(std::string_view key, JsonView &out) const;
+
+  // Children in document order: array elements, or object member values
+  // (Iterator::key() gives the member name).
+  Iterator begin() const;
+  Iterator end() const;
+
+private:
+  friend class JsonDocument;
+  JsonView(const JsonDocument *doc, size_t pos) : doc_(doc), pos_(pos) {}
+
+  const JsonDocument *doc_ = nullptr;
+  size_t pos_ = 0;
+};
+
+class JSONVAL_API JsonView::Iterator {
+public:
+  Iterator() = default;
+
+  JsonView operator*() const;
+  std::string_view key() const; // member name, empty for array elements
+  Iterator &operator++();
+  bool operator==(const Iterator &o) const { return pos_ == o.pos_; }
+  bool operator!=(const Iterator &o) const { return pos_ != o.pos_; }
+
+private:
+  friend class JsonView;
+  Iterator(const JsonDocument *doc, size_t pos, bool object)
+      : doc_(doc), pos_(pos), object_(object) {}
+
+  const JsonDocument *doc_ = nullptr;
+  size_t pos_ = 0;
+  bool object_ = false;
+};
+
+class JSONVAL_API JsonDocument {
+public:
+  JsonView root() const {
+    return tape_.empty() ? JsonView() : JsonView(this, 0);
+  }
+  bool empty() const { return tape_.empty(); }
+  void clear();
+  // Bytes used by the tape and the string arena.
+  size_t memory_usage() const;
+
+private:
+  friend class JsonView;
+  friend struct TapeSink;
+
+  std::vector<uint64_t> tape_;
+  std::vector<char> strings_;
+};
+
+// Parse JSON text into a JsonDocument. Accepts exactly what parse_json_dom
+// accepts and reports the same errors.
+JSONVAL_API bool parse_json_document(std::string_view json_text,
+                                     JsonDocument &out, std::string &err);
+inline bool parse_json_document(const char *data, size_t len,
+                                JsonDocument &out, std::string &err) {
+  return parse_json_document(std::string_view(data, len), out, err);
+}
+
+// Print a JsonDocument value as a tree, same layout as the JsonValue overload
+// (object members appear in document order).
+JSONVAL_API void print_json_tree(const JsonView &val,
+                                 const std::string &prefix = "",
+                                 bool is_last = true);
+
 /**
  * Validate a JSON string.
  *
@@ -52,7 +150,84 @@ JSONVAL_API void print_json_tree(const JsonValue &val,
  * @param error_msg  Output for detailed error message if validation fails
  * @return true if valid JSON, false otherwise
  */
-JSONVAL_API bool validate_json(const std::string &text, std::string &error_msg);
+JSONVAL_API bool validate_json(std::string_view text, std::string &error_msg);
+inline bool validate_json(const char *data, size_t len,
+                          std::string &error_msg) {
+  return validate_json(std::string_view(data, len), error_msg);
+}
+
+// ================= Streaming validation =============
+// Push-style incremental validator for input that is not available as one
+// buffer (pipes, sockets, unbounded NDJSON feeds). Chunks may split the input
+// anywhere, including inside strings and numbers; only the nesting stack is
+// kept between calls. Errors read exactly like validate_json's.
+//
+// In NDJSON mode every line is a separate document: blank lines are skipped
+// and each record's result goes to the record callback.
+class JSONVAL_API JsonStreamValidator {
+public:
+  // NDJSON result for one record: its 1-based line number, whether it is
+  // valid, and the error message when it is not.
+  using RecordCallback =
+      std::function<void(size_t line, bool ok, const std::string &err)>;
+
+  explicit JsonStreamValidator(bool ndjson = false);
+  ~JsonStreamValidator();
+  JsonStreamValidator(const JsonStreamValidator &) = delete;
+  JsonStreamValidator &operator=(const JsonStreamValidator &) = delete;
+
+  void on_record(RecordCallback cb);
+
+  // Consume the next chunk. Returns false once the input is known to be
+  // invalid; in NDJSON mode that only happens at the end of a bad record and
+  // feeding may continue with the next one.
+  bool feed(const char *data, size_t len);
+  bool feed(std::string_view chunk) { return feed(chunk.data(), chunk.size()); }
+
+  // Signal end of input. Returns true if the document (every record, in
+  // NDJSON mode) was valid.
+  bool finish();
+
+  // Start over with a new input, keeping the mode and callback.
+  void reset();
+
+  const std::string &error() const; // first error seen
+  size_t records() const;           // NDJSON records seen (blank lines aside)
+  size_t invalid_records() const;
+
+private:
+  struct State;
+  std::unique_ptr<State> st_;
+};
+
+// ================= File input =======================
+// Read-only contents of a whole file. Regular files are memory-mapped
+// (mmap / MapViewOfFile) so they are never copied onto the heap; other inputs
+// such as pipes are read into memory instead.
+class JSONVAL_API MappedFile {
+public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool open(const std::string &path, std::string &err);
+  void close();
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+  std::string_view view() const { return std::string_view(data_, size_); }
+
+private:
+  const char *data_ = "";
+  size_t size_ = 0;
+  bool mapped_ = false;
+  std::string buffer_; // used when the input cannot be mapped
+#ifdef _WIN32
+  void *file_ = nullptr;    // HANDLE
+  void *mapping_ = nullptr; // HANDLE
+#endif
+};
 
 /**
  * Print usage information.
@@ -72,10 +247,16 @@ struct JSONVAL_API SchemaEntry {
 };
 
 // Initialize schema registry from a `schemas.json` file.
-// Returns true on success.
+// Returns true on success. Calling it again for the same file only re-reads it
+// if its modification time or size changed; on failure the previously loaded
+// registry stays in effect.
 JSONVAL_API bool init_schema_registry(const std::string &config_path,
                                       std::string &err);
 
+// Re-check the file last loaded by init_schema_registry and reload it if it
+// changed. Meant for long-running processes.
+JSONVAL_API bool reload_schema_registry(std::string &err);
+
 // Get schema source content by id or source string (id|url|path).
 // Returns true on success.
 JSONVAL_API bool get_schema_source(const std::string &id_or_source,
@@ -86,18 +267,117 @@ JSONVAL_API bool
 resolve_schema_links(const std::string &id_or_source,
                      std::map<std::string, std::string> &out_map,
                      std::string &err);
+// Same, for a schema whose own text `source` the caller already loaded with
+// get_schema_source; only the linked schemas are read.
+JSONVAL_API bool
+resolve_schema_links(const std::string &id_or_source,
+                     const std::string &source,
+                     std::map<std::string, std::string> &out_map,
+                     std::string &err);
 
 // Return list of known schema ids.
 JSONVAL_API std::vector<std::string> list_schema_ids();
 
 /**
  * Validate JSON using minimal JSON Schema subset:
- * supports: type, properties, required, items, enum.
+ * supports: type, properties, required, items, enum, $ref.
  */
-JSONVAL_API bool validate_json_with_schema(const std::string &json_text,
-                                           const std::string &schema_text,
+JSONVAL_API bool validate_json_with_schema(std::string_view json_text,
+                                           std::string_view schema_text,
+                                           std::string &err);
+
+// Same as above for a document that has already been parsed, so callers that
+// need the DOM anyway (e.g. to read "$schema") scan the input only once.
+JSONVAL_API bool validate_json_with_schema(const JsonValue &data,
+                                           std::string_view schema_text,
+                                           std::string &err);
+JSONVAL_API bool validate_json_with_schema(const JsonView &data,
+                                           std::string_view schema_text,
                                            std::string &err);
 
+// Validate against a schema that is already parsed. The schema is only read,
+// so one parsed schema can be shared by several threads validating
+// different documents.
+JSONVAL_API bool validate_json_with_schema(const JsonView &data,
+                                           const JsonValue &schema,
+                                           std::string &err);
+
+// One schema violation. `message` is the text validate_json_with_schema
+// would return for it; `path` is the data location ("a.b[2]", "" = root).
+struct JSONVAL_API SchemaError {
+  std::string path;
+  std::string message;
+};
+
+// Collect-all-errors output for CompiledSchema::validate. By default every
+// violation is collected; `max_errors` caps the list and `fail_fast` stops at
+// the first one. `truncated` is set when validation stopped at the cap, so
+// more errors may remain.
+struct JSONVAL_API SchemaErrorCollector {
+  size_t max_errors = 0; // 0: no limit
+  bool fail_fast = false;
+  std::vector<SchemaError> errors;
+  bool truncated = false;
+};
+
+// A schema (same subset as above) compiled once into flat nodes: the expected
+// type, required keys and properties in one hashed key table per object, and
+// enum values in hash sets. Reuse it for many documents; validate() is const
+// and safe to call from several threads at once. Errors read exactly like
+// validate_json_with_schema's.
+class JSONVAL_API CompiledSchema {
+public:
+  CompiledSchema();
+  ~CompiledSchema();
+  CompiledSchema(CompiledSchema &&) noexcept;
+  CompiledSchema &operator=(CompiledSchema &&) noexcept;
+  CompiledSchema(const CompiledSchema &) = delete;
+  CompiledSchema &operator=(const CompiledSchema &) = delete;
+
+  // "$ref" may point into the schema itself ("#/definitions/x") or into
+  // another schema ("address#/properties/zip"). Other schemas are looked up
+  // in `links` (id -> text, as filled by resolve_schema_links) and otherwise
+  // loaded with get_schema_source. Each target is compiled once; recursive
+  // refs are fine, refs that only lead to each other are an error.
+  bool compile(std::string_view schema_text, std::string &err);
+  bool compile(const JsonValue &schema, std::string &err);
+  bool compile(std::string_view schema_text,
+               const std::map<std::string, std::string> &links,
+               std::string &err);
+  bool compile(const JsonValue &schema,
+               const std::map<std::string, std::string> &links,
+               std::string &err);
+  bool empty() const; // nothing compiled yet
+
+  // Binary form of the compiled plan, for on-disk caches. save() refuses
+  // plans that loaded a "$ref" target outside the given links; load()
+  // rejects other format versions and malformed data.
+  bool save(std::string &out, std::string &err) const;
+  bool load(std::string_view bytes, std::string &err);
+
+  // Stops at the first error.
+  bool validate(const JsonValue &data, std::string &err) const;
+  bool validate(const JsonView &data, std::string &err) const;
+  // Collects errors as configured in `out`, in the order the single-error
+  // form checks them. Returns true if there were none.
+  bool validate(const JsonValue &data, SchemaErrorCollector &out) const;
+  bool validate(const JsonView &data, SchemaErrorCollector &out) const;
+
+private:
+  struct Plan;
+  template <typename Data> friend struct SchemaRun;
+  std::unique_ptr<Plan> plan_;
+};
+
+// Compile `schema_text` with its linked schemas, or reuse an earlier result.
+// Plans are keyed by a stable hash of those texts and kept in an in-process
+// LRU and, when the registry sets a cacheDirectory, as binary files there,
+// so later runs skip parsing and compiling the schema. Thread-safe.
+JSONVAL_API std::shared_ptr<const CompiledSchema>
+compile_schema_cached(std::string_view schema_text,
+                      const std::map<std::string, std::string> &links,
+                      std::string &err);
+
 // ================= jq JSON Query Engine ==================
 
 // Forward declarations for jq components
@@ -152,6 +432,9 @@ using JqValuePtr = jq::JvValuePtr;
  * @param err      Error message if execution fails
  * @return true on success, false on error
  *
+ * Compiled filters are cached by filter text, so repeating a filter only
+ * costs the run. To hold on to one explicitly, see jq::CompiledFilter.
+ *
  * Example:
  *   std::string output, error;
  *   if (run_jq_filter(".name", R"({"name": "Alice"})", output, error)) {
@@ -185,6 +468,33 @@ JSONVAL_API bool run_jq_filter_streaming(const std::string &filter,
                                          std::vector<std::string> &json_outputs,
                                          std::string &err);
 
+/**
+ * Compile and run a jq filter, handing each output to a callback as soon as
+ * it is produced instead of collecting them, so `.[]` over a huge array
+ * never holds more than one output at a time. The text passed to the
+ * callback is only valid during the call; return false to stop early (the
+ * run still succeeds).
+ *
+ * Example:
+ *   run_jq_filter_streaming(".[]", big_array, [](std::string_view out) {
+ *     std::cout << out << '\n';
+ *     return true;
+ *   }, error);
+ */
+using JqOutputCallback = jq::OutputCallback;
+JSONVAL_API bool run_jq_filter_streaming(const std::string &filter,
+                                         const std::string &json_in,
+                                         const JqOutputCallback &on_output,
+                                         std::string &err);
+
+/**
+ * Same, writing each output to `out` followed by a newline. Fails with
+ * "Failed to write jq output" if a write does.
+ */
+JSONVAL_API bool run_jq_filter_streaming(const std::string &filter,
+                                         const std::string &json_in,
+                                         FILE *out, std::string &err);
+
 /**
  * Register a custom jq builtin function.
  *
@@ -213,4 +523,55 @@ JSONVAL_API void register_jq_builtin(
     const std::function<bool(const std::string &, std::vector<std::string> &,
                              std::string &)> &fn);
 
+// ================= Metrics ==========================
+// Opt-in counters and timers for every phase of a run, for finding where a
+// slow request spent its time. Collection is off by default; while off each
+// probe costs one relaxed atomic load and a branch. Totals are process-wide
+// and thread-safe.
+//
+// Times are exclusive: a phase running inside another (the parse inside a
+// schema compile, the HTTP fetch inside a schema load) is charged only to
+// itself, so the phase times add up to the instrumented total.
+
+struct JSONVAL_API JsonvalPhaseMetrics {
+  const char *name = ""; // file_read, parse, schema_load, schema_fetch,
+                         // schema_compile, validate, jq_compile, jq_execute,
+                         // serialize
+  uint64_t calls = 0;
+  uint64_t nanos = 0;
+  uint64_t bytes = 0; // input (or, for serialize, output) bytes
+};
+
+struct JSONVAL_API JsonvalMetrics {
+  std::vector<JsonvalPhaseMetrics> phases; // always every phase, in order
+
+  uint64_t schema_cache_hits = 0; // remote schemas without a request
+  uint64_t schema_cache_misses = 0;
+  uint64_t plan_cache_hits = 0; // compile_schema_cached, memory or disk
+  uint64_t plan_cache_misses = 0;
+  uint64_t jq_cache_hits = 0; // compiled filters reused by text
+  uint64_t jq_cache_misses = 0;
+
+  // DOM entries built by parse_json_dom (tree nodes) and
+  // parse_json_document (tape entries), and the largest single document.
+  uint64_t nodes_allocated = 0;
+  uint64_t peak_dom_nodes = 0;
+  uint64_t peak_dom_bytes = 0;
+
+  // jq instructions executed per opcode, most frequent first; opcodes
+  // that never ran are left out.
+  std::vector<std::pair<std::string, uint64_t>> jq_opcodes;
+
+  // Aligned table for people; `with_opcodes` appends the opcode counts.
+  std::string to_text(bool with_opcodes = false) const;
+  // One JSON object with the same content (opcodes always included).
+  std::string to_json() const;
+};
+
+JSONVAL_API void enable_jsonval_metrics(bool on);
+JSONVAL_API bool jsonval_metrics_enabled();
+// Totals since the process started or the last reset.
+JSONVAL_API JsonvalMetrics get_jsonval_metrics();
+JSONVAL_API void reset_jsonval_metrics();
+
 #endif // LIBJSONVAL_HPP
@@ -0,0 +1,226 @@
+#include "metrics.hpp"
+#include "../src/jq/jq_bytecode.hpp"
+#include "libjsonval.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+namespace metrics {
+
+std::atomic<bool> g_enabled{false};
+
+namespace {
+
+struct PhaseTotals {
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> nanos{0};
+  std::atomic<uint64_t> bytes{0};
+};
+
+const char *const kPhaseNames[PHASE_COUNT] = {
+    "file_read",      "parse",    "schema_load", "schema_fetch",
+    "schema_compile", "validate", "jq_compile",  "jq_execute",
+    "serialize"};
+
+PhaseTotals g_phases[PHASE_COUNT];
+std::atomic<uint64_t> g_counters[COUNTER_COUNT];
+std::atomic<uint64_t> g_nodes{0};
+std::atomic<uint64_t> g_peak_nodes{0};
+std::atomic<uint64_t> g_peak_bytes{0};
+std::atomic<uint64_t> g_opcodes[jq::kOpCodeCount];
+
+thread_local Timer *t_current = nullptr; // innermost running timer
+
+uint64_t now_ns() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+void raise_to(std::atomic<uint64_t> &peak, uint64_t v) {
+  uint64_t cur = peak.load(std::memory_order_relaxed);
+  while (cur < v &&
+         !peak.compare_exchange_weak(cur, v, std::memory_order_relaxed))
+    ;
+}
+
+} // namespace
+
+void add_counter(Counter c, uint64_t n) {
+  g_counters[c].fetch_add(n, std::memory_order_relaxed);
+}
+
+void note_dom(uint64_t nodes, uint64_t bytes) {
+  g_nodes.fetch_add(nodes, std::memory_order_relaxed);
+  raise_to(g_peak_nodes, nodes);
+  raise_to(g_peak_bytes, bytes);
+}
+
+void add_opcodes(const uint64_t *counts, size_t n) {
+  n = std::min(n, jq::kOpCodeCount);
+  for (size_t i = 0; i < n; ++i)
+    if (counts[i])
+      g_opcodes[i].fetch_add(counts[i], std::memory_order_relaxed);
+}
+
+void Timer::start() {
+  begin_ = now_ns();
+  outer_ = t_current;
+  if (outer_)
+    outer_->spent_ += begin_ - outer_->begin_;
+  t_current = this;
+}
+
+void Timer::stop() {
+  const uint64_t end = now_ns();
+  spent_ += end - begin_;
+  PhaseTotals &p = g_phases[phase_];
+  p.calls.fetch_add(1, std::memory_order_relaxed);
+  p.nanos.fetch_add(spent_, std::memory_order_relaxed);
+  p.bytes.fetch_add(bytes_, std::memory_order_relaxed);
+  t_current = outer_;
+  if (outer_)
+    outer_->begin_ = end;
+}
+
+} // namespace metrics
+
+void enable_jsonval_metrics(bool on) {
+  metrics::g_enabled.store(on, std::memory_order_relaxed);
+}
+
+bool jsonval_metrics_enabled() { return metrics::enabled(); }
+
+JsonvalMetrics get_jsonval_metrics() {
+  using namespace metrics;
+  auto get = [](const std::atomic<uint64_t> &a) {
+    return a.load(std::memory_order_relaxed);
+  };
+  JsonvalMetrics m;
+  for (size_t i = 0; i < PHASE_COUNT; ++i) {
+    JsonvalPhaseMetrics p;
+    p.name = kPhaseNames[i];
+    p.calls = get(g_phases[i].calls);
+    p.nanos = get(g_phases[i].nanos);
+    p.bytes = get(g_phases[i].bytes);
+    m.phases.push_back(p);
+  }
+  m.schema_cache_hits = get(g_counters[SCHEMA_CACHE_HIT]);
+  m.schema_cache_misses = get(g_counters[SCHEMA_CACHE_MISS]);
+  m.plan_cache_hits = get(g_counters[PLAN_CACHE_HIT]);
+  m.plan_cache_misses = get(g_counters[PLAN_CACHE_MISS]);
+  m.jq_cache_hits = get(g_counters[JQ_CACHE_HIT]);
+  m.jq_cache_misses = get(g_counters[JQ_CACHE_MISS]);
+  m.nodes_allocated = get(g_nodes);
+  m.peak_dom_nodes = get(g_peak_nodes);
+  m.peak_dom_bytes = get(g_peak_bytes);
+  for (size_t i = 0; i < jq::kOpCodeCount; ++i) {
+    if (uint64_t n = get(g_opcodes[i]))
+      m.jq_opcodes.emplace_back(jq::opcode_name(static_cast<jq::OpCode>(i)),
+                                n);
+  }
+  std::stable_sort(
+      m.jq_opcodes.begin(), m.jq_opcodes.end(),
+      [](const auto &a, const auto &b) { return a.second > b.second; });
+  return m;
+}
+
+void reset_jsonval_metrics() {
+  using namespace metrics;
+  for (auto &p : g_phases) {
+    p.calls.store(0, std::memory_order_relaxed);
+    p.nanos.store(0, std::memory_order_relaxed);
+    p.bytes.store(0, std::memory_order_relaxed);
+  }
+  for (auto &c : g_counters)
+    c.store(0, std::memory_order_relaxed);
+  g_nodes.store(0, std::memory_order_relaxed);
+  g_peak_nodes.store(0, std::memory_order_relaxed);
+  g_peak_bytes.store(0, std::memory_order_relaxed);
+  for (auto &o : g_opcodes)
+    o.store(0, std::memory_order_relaxed);
+}
+
+std::string JsonvalMetrics::to_text(bool with_opcodes) const {
+  std::string out;
+  char line[160];
+  std::snprintf(line, sizeof line, "%-16s %10s %12s %14s %10s\n", "phase",
+                "calls", "time ms", "bytes", "MB/s");
+  out += line;
+  uint64_t total = 0;
+  for (const auto &p : phases) {
+    total += p.nanos;
+    double ms = p.nanos / 1e6;
+    if (p.bytes && p.nanos)
+      std::snprintf(line, sizeof line, "%-16s %10llu %12.3f %14llu %10.1f\n",
+                    p.name, static_cast<unsigned long long>(p.calls), ms,
+                    static_cast<unsigned long long>(p.bytes),
+                    p.bytes / 1e6 / (p.nanos / 1e9));
+    else
+      std::snprintf(line, sizeof line, "%-16s %10llu %12.3f %14llu %10s\n",
+                    p.name, static_cast<unsigned long long>(p.calls), ms,
+                    static_cast<unsigned long long>(p.bytes), "-");
+    out += line;
+  }
+  std::snprintf(line, sizeof line, "%-16s %10s %12.3f\n", "total", "",
+                total / 1e6);
+  out += line;
+  std::snprintf(line, sizeof line,
+                "caches: schema %llu hit / %llu miss, plan %llu hit / %llu "
+                "miss, jq %llu hit / %llu miss\n",
+                static_cast<unsigned long long>(schema_cache_hits),
+                static_cast<unsigned long long>(schema_cache_misses),
+                static_cast<unsigned long long>(plan_cache_hits),
+                static_cast<unsigned long long>(plan_cache_misses),
+                static_cast<unsigned long long>(jq_cache_hits),
+                static_cast<unsigned long long>(jq_cache_misses));
+  out += line;
+  std::snprintf(line, sizeof line,
+                "dom: %llu nodes allocated, peak %llu nodes / %llu bytes\n",
+                static_cast<unsigned long long>(nodes_allocated),
+                static_cast<unsigned long long>(peak_dom_nodes),
+                static_cast<unsigned long long>(peak_dom_bytes));
+  out += line;
+  if (with_opcodes && !jq_opcodes.empty()) {
+    out += "jq opcodes:\n";
+    for (const auto &op : jq_opcodes) {
+      std::snprintf(line, sizeof line, "  %-16s %14llu\n", op.first.c_str(),
+                    static_cast<unsigned long long>(op.second));
+      out += line;
+    }
+  }
+  return out;
+}
+
+std::string JsonvalMetrics::to_json() const {
+  auto num = [](uint64_t v) { return std::to_string(v); };
+  std::string out = "{\"phases\":{";
+  for (size_t i = 0; i < phases.size(); ++i) {
+    const auto &p = phases[i];
+    if (i)
+      out += ',';
+    out += '"';
+    out += p.name;
+    out += "\":{\"calls\":" + num(p.calls) + ",\"nanos\":" + num(p.nanos) +
+           ",\"bytes\":" + num(p.bytes) + '}';
+  }
+  out += "},\"caches\":{\"schema\":{\"hits\":" + num(schema_cache_hits) +
+         ",\"misses\":" + num(schema_cache_misses) +
+         "},\"plan\":{\"hits\":" + num(plan_cache_hits) +
+         ",\"misses\":" + num(plan_cache_misses) +
+         "},\"jq\":{\"hits\":" + num(jq_cache_hits) +
+         ",\"misses\":" + num(jq_cache_misses) + "}}";
+  out += ",\"dom\":{\"nodes_allocated\":" + num(nodes_allocated) +
+         ",\"peak_nodes\":" + num(peak_dom_nodes) +
+         ",\"peak_bytes\":" + num(peak_dom_bytes) + '}';
+  out += ",\"jq_opcodes\":{";
+  for (size_t i = 0; i < jq_opcodes.size(); ++i) {
+    if (i)
+      out += ',';
+    out += '"' + jq_opcodes[i].first + "\":" + num(jq_opcodes[i].second);
+  }
+  out += "}}";
+  return out;
+}
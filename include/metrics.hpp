@@ -0,0 +1,91 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Probes behind get_jsonval_metrics() (see libjsonval.hpp).
+//
+// Everything here is process-wide and thread-safe. Collection is off until
+// enable_jsonval_metrics(true); while it is off a probe is one relaxed
+// atomic load and a branch, so they can sit on hot paths.
+namespace metrics {
+
+// Phases, in the order get_jsonval_metrics() reports them.
+enum Phase : uint8_t {
+  FILE_READ,      // MappedFile::open
+  PARSE,          // JSON text to a DOM, or validation without one
+  SCHEMA_LOAD,    // get_schema_source, network time excluded
+  SCHEMA_FETCH,   // HTTP requests for remote schemas
+  SCHEMA_COMPILE, // building or loading a CompiledSchema
+  VALIDATE,       // running a CompiledSchema
+  JQ_COMPILE,     // lexing, parsing and compiling a filter
+  JQ_EXECUTE,     // running a compiled filter
+  SERIALIZE,      // JvValue to JSON text
+  PHASE_COUNT
+};
+
+enum Counter : uint8_t {
+  SCHEMA_CACHE_HIT,  // remote schema served from memory or the cache dir
+  SCHEMA_CACHE_MISS, // remote schema that needed a request
+  PLAN_CACHE_HIT,    // compile_schema_cached found a plan
+  PLAN_CACHE_MISS,
+  JQ_CACHE_HIT, // Engine::compile_cached found the filter
+  JQ_CACHE_MISS,
+  COUNTER_COUNT
+};
+
+extern std::atomic<bool> g_enabled;
+
+inline bool enabled() { return g_enabled.load(std::memory_order_relaxed); }
+
+void add_counter(Counter c, uint64_t n);
+
+inline void count(Counter c, uint64_t n = 1) {
+  if (enabled())
+    add_counter(c, n);
+}
+
+// One parsed document: `nodes` DOM entries (tree nodes or tape entries)
+// taking `bytes`. Adds to the node count and raises the peak DOM size.
+void note_dom(uint64_t nodes, uint64_t bytes);
+
+// Instructions a jq run executed, indexed by jq::OpCode.
+void add_opcodes(const uint64_t *counts, size_t n);
+
+// Times one phase on the calling thread. A timer started while another is
+// running pauses it, so every phase is charged only its own time: a parse
+// inside a schema compile counts as parse, not as both.
+class Timer {
+public:
+  explicit Timer(Phase phase, uint64_t bytes = 0)
+      : phase_(phase), on_(enabled()), bytes_(bytes) {
+    if (on_)
+      start();
+  }
+  ~Timer() {
+    if (on_)
+      stop();
+  }
+  Timer(const Timer &) = delete;
+  Timer &operator=(const Timer &) = delete;
+
+  // Bytes the phase processed, when only known at the end.
+  void set_bytes(uint64_t n) { bytes_ = n; }
+
+private:
+  void start();
+  void stop();
+
+  Phase phase_;
+  bool on_;
+  uint64_t bytes_;
+  Timer *outer_ = nullptr; // the timer this one paused
+  uint64_t begin_ = 0;     // when this timer last resumed, in ns
+  uint64_t spent_ = 0;     // ns accumulated before the last pause
+};
+
+} // namespace metrics
+
+#endif // METRICS_HPP
@@ -0,0 +1,87 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size worker pool. Tasks run in submission order on whichever worker
+// is free; wait() blocks until every submitted task has finished. The
+// destructor drains the queue before joining.
+class ThreadPool {
+public:
+  // threads == 0 picks std::thread::hardware_concurrency().
+  explicit ThreadPool(size_t threads = 0) {
+    if (threads == 0)
+      threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+      threads = 1;
+    workers_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i)
+      workers_.emplace_back([this] { work(); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stopping_ = true;
+    }
+    ready_.notify_all();
+    for (auto &t : workers_)
+      t.join();
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  size_t size() const { return workers_.size(); }
+
+  void submit(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      tasks_.push_back(std::move(task));
+      ++pending_;
+    }
+    ready_.notify_one();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mu_);
+    idle_.wait(lock, [this] { return pending_ == 0; });
+  }
+
+private:
+  void work() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        ready_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+        if (tasks_.empty())
+          return; // stopping and drained
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (--pending_ == 0)
+          idle_.notify_all();
+      }
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mu_;
+  std::condition_variable ready_;
+  std::condition_variable idle_;
+  size_t pending_ = 0;
+  bool stopping_ = false;
+};
+
+#endif // THREAD_POOL_HPP
@@ -1,16 +1,655 @@
 #include "./include/jls_shell.hpp"
 #include "./include/libjsonval.hpp"
+#include "./include/thread_pool.hpp"
 
-int main(int argc, char *argv[]) {
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// Validate `content` (or stdin when `from_stdin`) with the incremental
+// validator. In NDJSON mode every bad record is reported.
+static int validate_streamed(bool from_stdin, std::string_view content,
+                             bool ndjson) {
+  JsonStreamValidator validator(ndjson);
+  validator.on_record([](size_t line, bool ok, const std::string &err) {
+    if (!ok)
+      std::cerr << "Invalid JSON (record at line " << line << "): " << err
+                << "\n";
+  });
+  if (from_stdin) {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    std::vector<char> buf(1 << 16);
+    size_t got;
+    while ((got = std::fread(buf.data(), 1, buf.size(), stdin)) > 0) {
+      if (!validator.feed(buf.data(), got) && !ndjson)
+        break; // the document is already known to be invalid
+    }
+  } else {
+    validator.feed(content);
+  }
+  bool ok = validator.finish();
+  if (ndjson) {
+    if (ok) {
+      std::cout << "OK: " << validator.records() << " valid records\n";
+      return 0;
+    }
+    std::cerr << validator.invalid_records() << " of " << validator.records()
+              << " records invalid\n";
+    return 2;
+  }
+  if (ok) {
+    std::cout << "OK: valid JSON\n";
+    return 0;
+  }
+  std::cerr << "Invalid JSON: " << validator.error() << "\n";
+  return 2;
+}
+
+// --- multi-file mode -------------------------------------------------------
+
+namespace fs = std::filesystem;
+
+// '*' matches any run of characters, '?' any single character.
+static bool wildcard_match(std::string_view pat, std::string_view name) {
+  size_t p = 0, n = 0, star = std::string_view::npos, mark = 0;
+  while (n < name.size()) {
+    if (p < pat.size() && (pat[p] == '?' || pat[p] == name[n])) {
+      ++p;
+      ++n;
+    } else if (p < pat.size() && pat[p] == '*') {
+      star = p++;
+      mark = n;
+    } else if (star != std::string_view::npos) {
+      p = star + 1;
+      n = ++mark;
+    } else {
+      return false;
+    }
+  }
+  while (p < pat.size() && pat[p] == '*')
+    ++p;
+  return p == pat.size();
+}
+
+static bool is_json_input(const fs::path &p, bool ndjson) {
+  std::string ext = p.extension().string();
+  return ext == ".json" || (ndjson && (ext == ".ndjson" || ext == ".jsonl"));
+}
+
+// Expand one command-line input into file names: directories are walked
+// recursively for *.json (plus *.ndjson / *.jsonl in NDJSON mode), and
+// wildcards in the last path component are matched against that directory
+// (shells on Windows leave globs to the program). Results are sorted so the
+// output order is stable.
+static bool expand_input(const std::string &arg, bool ndjson,
+                         std::vector<std::string> &out, std::string &err) {
+  std::error_code ec;
+  fs::path path(arg);
+  if (fs::is_directory(path, ec)) {
+    std::vector<std::string> found;
+    for (fs::recursive_directory_iterator it(path, ec), end; !ec && it != end;
+         it.increment(ec)) {
+      if (it->is_regular_file(ec) && is_json_input(it->path(), ndjson))
+        found.push_back(it->path().string());
+    }
+    if (ec) {
+      err = "cannot read directory '" + arg + "': " + ec.message();
+      return false;
+    }
+    std::sort(found.begin(), found.end());
+    out.insert(out.end(), found.begin(), found.end());
+    return true;
+  }
+  std::string pattern = path.filename().string();
+  if (pattern.find_first_of("*?") == std::string::npos) {
+    out.push_back(arg);
+    return true;
+  }
+  fs::path dir = path.parent_path();
+  std::vector<std::string> found;
+  for (fs::directory_iterator it(dir.empty() ? fs::path(".") : dir, ec), end;
+       !ec && it != end; it.increment(ec)) {
+    if (it->is_regular_file(ec) &&
+        wildcard_match(pattern, it->path().filename().string()))
+      found.push_back(dir.empty() ? it->path().filename().string()
+                                  : (dir / it->path().filename()).string());
+  }
+  if (found.empty()) {
+    err = "no files match '" + arg + "'";
+    return false;
+  }
+  std::sort(found.begin(), found.end());
+  out.insert(out.end(), found.begin(), found.end());
+  return true;
+}
+
+// Compiled schemas keyed by id/url. Each schema is fetched and compiled once,
+// the first time a worker asks for it; afterwards workers only read it. The
+// lock only guards the table: the first caller for an id loads it unlocked,
+// and other callers for that id wait on its future.
+class SchemaCache {
+public:
+  std::shared_ptr<const CompiledSchema> get(const std::string &id,
+                                       std::string &err) {
+    std::promise<Entry> loading;
+    std::shared_future<Entry> entry;
+    bool first = false;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      auto it = entries_.find(id);
+      if (it == entries_.end()) {
+        it = entries_.emplace(id, loading.get_future().share()).first;
+        first = true;
+      }
+      entry = it->second;
+    }
+    if (first)
+      loading.set_value(load(id));
+    const Entry &e = entry.get();
+    if (!e.schema)
+      err = e.error;
+    return e.schema;
+  }
+
+private:
+  struct Entry {
+    std::shared_ptr<const CompiledSchema> schema;
+    std::string error;
+  };
+
+  static Entry load(const std::string &id) {
+    Entry e;
+    std::string source;
+    std::map<std::string, std::string> links;
+    if (!get_schema_source(id, source, e.error)) {
+      e.error = "cannot load schema: " + e.error;
+    } else if (!resolve_schema_links(id, source, links, e.error)) {
+      e.error = "cannot load linked schema: " + e.error;
+    } else {
+      e.schema = compile_schema_cached(source, links, e.error);
+      if (!e.schema)
+        e.error = "cannot compile schema: " + e.error;
+    }
+    return e;
+  }
+
+  std::mutex mu_;
+  std::map<std::string, std::shared_future<Entry>> entries_;
+};
+
+// Validates `data`, adding one "Schema validation failed: ..." line per
+// reported error: just the first, or with `all_errors` up to `max_errors`
+// (0: all of them).
+static bool check_schema(const CompiledSchema &schema, const JsonView &data,
+                         bool all_errors, size_t max_errors,
+                         std::vector<std::string> &lines) {
+  if (!all_errors) {
+    std::string err;
+    if (schema.validate(data, err))
+      return true;
+    lines.push_back("Schema validation failed: " + err);
+    return false;
+  }
+  SchemaErrorCollector errors;
+  errors.max_errors = max_errors;
+  if (schema.validate(data, errors))
+    return true;
+  for (const auto &e : errors.errors)
+    lines.push_back("Schema validation failed: " + e.message);
+  if (errors.truncated)
+    lines.push_back("stopped after " + std::to_string(errors.errors.size()) +
+                    " errors");
+  return false;
+}
+
+struct BatchOptions {
+  bool use_schema = false;
+  bool ndjson = false;
+  bool all_errors = false;
+  size_t max_errors = 0;
+  std::string schema_arg;
+};
+
+// status: 0 valid, 1 unreadable (or no usable schema), 2 invalid
+struct FileResult {
+  int status = 0;
+  std::string message; // one or more lines
+};
+
+static FileResult validate_one(const std::string &name,
+                               const BatchOptions &opts, SchemaCache &schemas) {
+  FileResult r;
+  MappedFile input;
+  if (!input.open(name, r.message)) {
+    r.status = 1;
+    return r;
+  }
+  std::string_view content = input.view();
+  if (opts.use_schema) {
+    JsonDocument data;
+    if (!parse_json_document(content, data, r.message)) {
+      r.status = 2;
+      r.message = "Schema validation failed: " + r.message;
+      return r;
+    }
+    std::string selected_schema = opts.schema_arg;
+    JsonView declared;
+    if (selected_schema.empty() && data.root().find("$schema", declared) &&
+        declared.type() == JsonValue::T_STRING)
+      selected_schema = std::string(declared.as_string());
+    if (selected_schema.empty()) {
+      r.status = 1;
+      r.message = "no schema specified (use -s or include $schema in file)";
+      return r;
+    }
+    auto schema = schemas.get(selected_schema, r.message);
+    if (!schema) {
+      r.status = 1;
+      return r;
+    }
+    std::vector<std::string> lines;
+    if (!check_schema(*schema, data.root(), opts.all_errors, opts.max_errors,
+                      lines)) {
+      r.status = 2;
+      r.message.clear();
+      for (const auto &line : lines)
+        r.message += (r.message.empty() ? "" : "\n") + line;
+    }
+    return r;
+  }
+  if (opts.ndjson) {
+    JsonStreamValidator validator(true);
+    size_t first_line = 0;
+    std::string first_err;
+    validator.on_record([&](size_t line, bool ok, const std::string &err) {
+      if (!ok && first_line == 0) {
+        first_line = line;
+        first_err = err;
+      }
+    });
+    validator.feed(content);
+    if (!validator.finish()) {
+      r.status = 2;
+      r.message = "Invalid JSON: " + std::to_string(validator.invalid_records()) +
+                  " of " + std::to_string(validator.records()) +
+                  " records invalid (first at line " +
+                  std::to_string(first_line) + "): " + first_err;
+    }
+    return r;
+  }
+  if (!validate_json(content, r.message)) {
+    r.status = 2;
+    r.message = "Invalid JSON: " + r.message;
+  }
+  return r;
+}
+
+static void print_result(const std::string &name, const FileResult &r) {
+  if (r.status == 0) {
+    std::cout << "OK: " << name << "\n";
+    return;
+  }
+  size_t start = 0;
+  while (start <= r.message.size()) {
+    size_t end = r.message.find('\n', start);
+    if (end == std::string::npos)
+      end = r.message.size();
+    std::cerr << (r.status == 1 ? "Error: " : "") << name << ": "
+              << std::string_view(r.message).substr(start, end - start)
+              << "\n";
+    start = end + 1;
+  }
+}
+
+// Validate `files` on `jobs` workers. Results are printed in input order
+// (each as soon as it and everything before it is done) or, with
+// `unordered`, as each file completes. Returns the worst status seen.
+static int validate_batch(const std::vector<std::string> &files,
+                          const BatchOptions &opts, size_t jobs,
+                          bool unordered) {
+  SchemaCache schemas;
+  std::vector<std::optional<FileResult>> results(files.size());
+  std::mutex mu;
+  std::condition_variable done;
+  size_t valid = 0, invalid = 0, failed = 0;
+  auto tally = [&](const FileResult &r) {
+    (r.status == 0 ? valid : r.status == 2 ? invalid : failed)++;
+  };
+  {
+    ThreadPool pool(std::min(jobs, files.size()));
+    for (size_t i = 0; i < files.size(); ++i) {
+      pool.submit([&, i] {
+        FileResult r = validate_one(files[i], opts, schemas);
+        std::lock_guard<std::mutex> lock(mu);
+        if (unordered) {
+          print_result(files[i], r);
+          tally(r);
+        } else {
+          results[i] = std::move(r);
+          done.notify_one();
+        }
+      });
+    }
+    if (!unordered) {
+      for (size_t next = 0; next < files.size(); ++next) {
+        std::unique_lock<std::mutex> lock(mu);
+        done.wait(lock, [&] { return results[next].has_value(); });
+        print_result(files[next], *results[next]);
+        tally(*results[next]);
+        results[next].reset();
+      }
+    }
+    pool.wait();
+  }
+  std::cout << files.size() << " files: " << valid << " valid, " << invalid
+            << " invalid";
+  if (failed)
+    std::cout << ", " << failed << " errors";
+  std::cout << "\n";
+  return failed ? 1 : invalid ? 2 : 0;
+}
+
+// --- jq batch mode ---------------------------------------------------------
+
+// Outputs of one chunk of records, one JSON text per line, plus one line per
+// record the filter failed on.
+struct JqChunkResult {
+  std::string out;
+  std::string errors;
+  size_t failed = 0;
+};
+
+// Runs chunks of records on a worker pool and writes their results to
+// stdout/stderr: in submission order (each chunk as soon as it and every
+// chunk before it are done) or, with `unordered`, as each chunk completes.
+// submit() blocks while too many chunks are waiting to be written, so
+// memory stays bounded however far ahead the reader gets.
+class JqBatch {
+public:
+  JqBatch(size_t jobs, bool unordered) : pool_(jobs), unordered_(unordered) {
+    limit_ = pool_.size() * 4;
+  }
+
+  void submit(std::function<JqChunkResult()> work) {
+    size_t seq;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      room_.wait(lock, [this] { return queued_ < limit_; });
+      ++queued_;
+      seq = next_seq_++;
+    }
+    pool_.submit([this, seq, work = std::move(work)] {
+      JqChunkResult r = work();
+      std::lock_guard<std::mutex> lock(mu_);
+      if (unordered_) {
+        emit(r);
+        --queued_;
+      } else {
+        pending_.emplace(seq, std::move(r));
+        for (auto it = pending_.find(next_out_); it != pending_.end();
+             it = pending_.find(++next_out_)) {
+          emit(it->second);
+          pending_.erase(it);
+          --queued_;
+        }
+      }
+      room_.notify_one();
+    });
+  }
+
+  // Waits for every chunk; returns the number of failed records.
+  size_t finish() {
+    pool_.wait();
+    return failed_;
+  }
+
+  size_t workers() const { return pool_.size(); }
+
+private:
+  void emit(const JqChunkResult &r) {
+    std::fwrite(r.out.data(), 1, r.out.size(), stdout);
+    std::fwrite(r.errors.data(), 1, r.errors.size(), stderr);
+    failed_ += r.failed;
+  }
+
+  ThreadPool pool_;
+  bool unordered_;
+  std::mutex mu_;
+  std::condition_variable room_;
+  std::map<size_t, JqChunkResult> pending_; // done, waiting for earlier ones
+  size_t limit_ = 0;
+  size_t queued_ = 0; // submitted and not yet written
+  size_t next_seq_ = 0;
+  size_t next_out_ = 0;
+  size_t failed_ = 0;
+};
+
+// NDJSON chunks hold whole lines and are cut at the first newline past this
+// many bytes.
+static constexpr size_t kJqChunkBytes = 64 * 1024;
+
+// Run `filter` on every non-blank line of `text`, whose first line is line
+// `first_line` of the input.
+static JqChunkResult run_jq_lines(const jq::CompiledFilter &filter,
+                                  std::string_view text, size_t first_line) {
+  JqChunkResult r;
+  std::string err;
+  auto collect = [&r](std::string_view json) {
+    r.out.append(json);
+    r.out += '\n';
+    return true;
+  };
+  size_t line = first_line;
+  for (size_t pos = 0; pos < text.size(); ++line) {
+    size_t end = text.find('\n', pos);
+    if (end == std::string_view::npos)
+      end = text.size();
+    std::string_view rec = text.substr(pos, end - pos);
+    pos = end + 1;
+    if (!rec.empty() && rec.back() == '\r')
+      rec.remove_suffix(1);
+    if (rec.find_first_not_of(" \t") == std::string_view::npos)
+      continue;
+    if (!filter.run(rec, collect, err)) {
+      r.errors += "jq error (record at line " + std::to_string(line) +
+                  "): " + err + "\n";
+      ++r.failed;
+    }
+  }
+  return r;
+}
+
+// Elements [begin, end) of a parsed top-level array
+static JqChunkResult run_jq_elements(const jq::CompiledFilter &filter,
+                                     const std::vector<JsonView> &elements,
+                                     size_t begin, size_t end) {
+  JqChunkResult r;
+  std::string err;
+  auto collect = [&r](const jq::JvValuePtr &v) {
+    jq::write_json(v, r.out);
+    r.out += '\n';
+    return true;
+  };
+  for (size_t i = begin; i < end; ++i) {
+    if (!filter.run(elements[i], collect, err)) {
+      r.errors +=
+          "jq error (element " + std::to_string(i) + "): " + err + "\n";
+      ++r.failed;
+    }
+  }
+  return r;
+}
+
+static bool read_all_stdin(std::string &out) {
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  std::vector<char> buf(1 << 16);
+  size_t got;
+  while ((got = std::fread(buf.data(), 1, buf.size(), stdin)) > 0)
+    out.append(buf.data(), got);
+  return !std::ferror(stdin);
+}
+
+// Feed NDJSON from stdin to `batch` chunk by chunk, without holding more
+// than the chunks in flight.
+static bool submit_stdin_lines(JqBatch &batch,
+                               const jq::CompiledFilter &filter) {
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  std::string carry;
+  std::vector<char> buf(1 << 16);
+  size_t line = 1;
+  auto submit = [&](std::string text) {
+    size_t first = line;
+    line += std::count(text.begin(), text.end(), '\n');
+    batch.submit([&filter, text = std::move(text), first] {
+      return run_jq_lines(filter, text, first);
+    });
+  };
+  size_t got;
+  while ((got = std::fread(buf.data(), 1, buf.size(), stdin)) > 0) {
+    carry.append(buf.data(), got);
+    if (carry.size() < kJqChunkBytes)
+      continue;
+    size_t cut = carry.rfind('\n');
+    if (cut == std::string::npos)
+      continue; // one very long record; keep reading
+    std::string rest = carry.substr(cut + 1);
+    carry.resize(cut + 1);
+    submit(std::move(carry));
+    carry = std::move(rest);
+  }
+  if (!carry.empty())
+    submit(std::move(carry));
+  return !std::ferror(stdin);
+}
+
+// --jq: run `filter_text` over the input. With `ndjson` every line is an
+// input and with `split_array` every element of the top-level array; both
+// are cut into chunks and run on `jobs` workers. Otherwise the whole input
+// is one document. Outputs go to stdout, one per line.
+static int run_jq_batch(const std::string &filter_text,
+                        const std::string &filename, bool from_stdin,
+                        bool ndjson, bool split_array, size_t jobs,
+                        bool unordered) {
+  jq::CompiledFilter filter;
+  std::string err;
+  if (!jq::Engine::compile_cached(filter_text, filter, err)) {
+    std::cerr << "Error: " << err << "\n";
+    return 1;
+  }
+  MappedFile input;
+  std::string buffered; // stdin, when it has to be read whole
+  std::string_view content;
+  if (!from_stdin) {
+    if (!input.open(filename, err)) {
+      std::cerr << "Error: " << err << "\n";
+      return 1;
+    }
+    content = input.view();
+  } else if (!ndjson) {
+    if (!read_all_stdin(buffered)) {
+      std::cerr << "Error: cannot read stdin\n";
+      return 1;
+    }
+    content = buffered;
+  }
+
+  int status = 0;
+  if (ndjson) {
+    JqBatch batch(jobs, unordered);
+    if (from_stdin) {
+      if (!submit_stdin_lines(batch, filter)) {
+        std::cerr << "Error: cannot read stdin\n";
+        status = 1;
+      }
+    } else {
+      size_t line = 1;
+      for (size_t pos = 0; pos < content.size();) {
+        size_t end = content.find('\n', std::min(pos + kJqChunkBytes,
+                                                 content.size()));
+        end = end == std::string_view::npos ? content.size() : end + 1;
+        std::string_view text = content.substr(pos, end - pos);
+        size_t first = line;
+        line += std::count(text.begin(), text.end(), '\n');
+        batch.submit(
+            [&filter, text, first] { return run_jq_lines(filter, text, first); });
+        pos = end;
+      }
+    }
+    if (batch.finish() && !status)
+      status = 2;
+  } else if (split_array) {
+    JsonDocument doc;
+    if (!parse_json_document(content, doc, err)) {
+      std::cerr << "Invalid JSON: " << err << "\n";
+      return 2;
+    }
+    if (doc.root().type() != JsonValue::T_ARRAY) {
+      std::cerr << "Error: --split-array needs a top-level array\n";
+      return 1;
+    }
+    std::vector<JsonView> elements;
+    elements.reserve(doc.root().size());
+    for (auto it = doc.root().begin(); it != doc.root().end(); ++it)
+      elements.push_back(*it);
+    JqBatch batch(jobs, unordered);
+    // several chunks per worker so a slow one does not hold the others up
+    size_t per = std::clamp<size_t>(elements.size() / (batch.workers() * 8), 1,
+                                    4096);
+    for (size_t i = 0; i < elements.size(); i += per) {
+      size_t end = std::min(i + per, elements.size());
+      batch.submit([&filter, &elements, i, end] {
+        return run_jq_elements(filter, elements, i, end);
+      });
+    }
+    if (batch.finish())
+      status = 2;
+  } else if (!filter.run(content, stdout, err)) {
+    std::cerr << "jq error: " << err << "\n";
+    status = 2;
+  }
+  if (std::fflush(stdout) != 0 || std::ferror(stdout)) {
+    std::cerr << "Error: Failed to write jq output\n";
+    return 1;
+  }
+  return status;
+}
+
+static int run(int argc, char *argv[]) {
   if (argc == 1) {
     print_help(argv[0]);
     return 0;
   }
 
   std::string filename;
+  std::vector<std::string> inputs;
   std::string schema_arg;
   bool use_schema = false;
   bool shell_mode = false;
+  std::string script_path;
+  bool from_stdin = false;
+  bool ndjson = false;
+  bool unordered = false;
+  bool all_errors = false;
+  size_t max_errors = 0;
+  size_t jobs = 0; // 0: one per hardware thread
+  std::optional<std::string> jq_filter;
+  bool split_array = false;
   for (int i = 1; i < argc; ++i) {
     std::string arg = argv[i];
     if (arg == "-h" || arg == "--help") {
@@ -30,9 +669,18 @@ int main(int argc, char *argv[]) {
 #endif
       continue;
     }
+    if (arg == "-r" || arg == "--run") {
+      if (i + 1 < argc) {
+        script_path = argv[++i];
+      } else {
+        std::cerr << "Error: --run requires a script file\n";
+        return 1;
+      }
+      continue;
+    }
     if (arg == "-f" || arg == "--file") {
       if (i + 1 < argc) {
-        filename = argv[++i];
+        inputs.push_back(argv[++i]);
       } else {
         std::cerr << "Error: -f requires a filename\n";
         return 1;
@@ -52,10 +700,63 @@ int main(int argc, char *argv[]) {
       use_schema = true;
       continue;
     }
-    // treat first non-option as filename
-    if (filename.empty() && !arg.empty() && arg[0] != '-') {
-      filename = arg;
+    if (arg == "-n" || arg == "--ndjson") {
+      ndjson = true;
+      continue;
+    }
+    if (arg == "-j" || arg == "--jobs") {
+      if (i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+        jobs = static_cast<size_t>(std::atoi(argv[++i]));
+      } else {
+        std::cerr << "Error: -j requires a positive number of jobs\n";
+        return 1;
+      }
+      continue;
+    }
+    if (arg == "-E" || arg == "--all-errors") {
+      all_errors = true;
+      continue;
+    }
+    if (arg == "--max-errors") {
+      if (i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+        all_errors = true;
+        max_errors = static_cast<size_t>(std::atoi(argv[++i]));
+      } else {
+        std::cerr << "Error: --max-errors requires a positive number\n";
+        return 1;
+      }
+      continue;
+    }
+    if (arg == "--unordered") {
+      unordered = true;
+      continue;
     }
+    if (arg == "--jq") {
+      if (i + 1 < argc) {
+        jq_filter = argv[++i];
+      } else {
+        std::cerr << "Error: --jq requires a filter\n";
+        return 1;
+      }
+      continue;
+    }
+    if (arg == "--split-array") {
+      split_array = true;
+      continue;
+    }
+    if (arg == "-") {
+      from_stdin = true;
+      continue;
+    }
+    // every other non-option is an input file, directory or glob
+    if (!arg.empty() && arg[0] != '-') {
+      inputs.push_back(arg);
+    }
+  }
+
+  if (!script_path.empty()) {
+    jls::Shell shell;
+    return shell.run_script(script_path);
   }
 
   // Handle shell mode
@@ -65,24 +766,85 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
+  if (jq_filter) {
+    if (!from_stdin && inputs.size() != 1) {
+      std::cerr << "Error: --jq takes exactly one input file or '-'\n";
+      return 1;
+    }
+    return run_jq_batch(*jq_filter, from_stdin ? "" : inputs[0], from_stdin,
+                        ndjson, split_array, jobs, unordered);
+  }
+
+  if (from_stdin) {
+    if (use_schema || !schema_arg.empty()) {
+      std::cerr << "Error: schema validation needs a file, not stdin\n";
+      return 1;
+    }
+    return validate_streamed(true, {}, ndjson);
+  }
+
+  // A single plain file keeps the classic one-document output; several
+  // inputs, a directory or a glob switch to the per-file batch report.
+  std::error_code fs_ec;
+  if (inputs.size() > 1 ||
+      (inputs.size() == 1 &&
+       (fs::is_directory(inputs[0], fs_ec) ||
+        fs::path(inputs[0]).filename().string().find_first_of("*?") !=
+            std::string::npos))) {
+    std::vector<std::string> files;
+    int status = 0;
+    for (const auto &in : inputs) {
+      std::string eerr;
+      if (!expand_input(in, ndjson, files, eerr)) {
+        std::cerr << "Error: " << eerr << "\n";
+        status = 1;
+      }
+    }
+    if (files.empty()) {
+      std::cerr << "Error: no input files\n";
+      return 1;
+    }
+    BatchOptions opts;
+    opts.use_schema = use_schema;
+    opts.ndjson = ndjson;
+    opts.all_errors = all_errors;
+    opts.max_errors = max_errors;
+    opts.schema_arg = schema_arg;
+    if (use_schema) {
+      // loaded once here; workers only read the registry
+      std::string cerr;
+      if (!init_schema_registry("schemas.json", cerr)) { /* ignore */
+      }
+    }
+    int rc = validate_batch(files, opts, jobs, unordered);
+    return status ? status : rc;
+  }
+  if (!inputs.empty())
+    filename = inputs[0];
+
   if (filename.empty() && schema_arg.empty()) {
     std::cerr << "Error: missing filename\n";
     print_help(argv[0]);
     return 1;
   }
 
-  std::string content;
+  // the input is memory-mapped rather than copied; `content` views it
+  MappedFile input;
+  std::string_view content;
   if (!filename.empty()) {
-    std::ifstream in(filename, std::ios::binary);
-    if (!in) {
-      std::cerr << "Error: cannot open file '" << filename << "'\n";
+    std::string ferr;
+    if (!input.open(filename, ferr)) {
+      std::cerr << "Error: " << ferr << "\n";
       return 1;
     }
-    content.assign((std::istreambuf_iterator<char>(in)),
-                   std::istreambuf_iterator<char>());
+    content = input.view();
   }
 
   std::string error;
+  // -s schema text and its linked schemas, loaded once for both blocks below
+  std::string schema_content;
+  std::map<std::string, std::string> resolved;
+  bool schema_loaded = false;
   // If a schema argument is provided, attempt to fetch it and print some info
   if (!schema_arg.empty()) {
     std::string cerr;
@@ -90,12 +852,11 @@ int main(int argc, char *argv[]) {
       std::cerr << "Warning: unable to load schemas.json: " << cerr << "\n";
     }
     // schema registry initialized
-    std::string schema_content;
     if (get_schema_source(schema_arg, schema_content, cerr)) {
+      schema_loaded = true;
       std::cout << "Fetched schema (length=" << schema_content.size() << ")\n";
       // try resolve linked schemas as well
-      std::map<std::string, std::string> resolved;
-      if (resolve_schema_links(schema_arg, resolved, cerr)) {
+      if (resolve_schema_links(schema_arg, schema_content, resolved, cerr)) {
         std::cout << "Resolved " << resolved.size() << " linked schemas\n";
       }
       if (filename.empty())
@@ -116,43 +877,54 @@ int main(int argc, char *argv[]) {
     std::string cerr;
     if (!init_schema_registry("schemas.json", cerr)) { /* ignore */
     }
-    std::string schema_content;
-    std::string selected_schema = schema_arg;
-    // if no schema provided, try find "$schema" in the file content
-    if (selected_schema.empty()) {
-      // quick detection: look for "\"$schema\"\s*:\s*\"(url or id)\""
-      size_t pos = content.find("\"$schema\"");
-      if (pos != std::string::npos) {
-        size_t col = content.find(':', pos);
-        if (col != std::string::npos) {
-          size_t q1 = content.find('"', col);
-          size_t q2 = content.find('"', q1 + 1);
-          if (q1 != std::string::npos && q2 != std::string::npos)
-            selected_schema = content.substr(q1 + 1, q2 - q1 - 1);
-        }
-      }
+    // parse the document once into the compact DOM; it serves both the
+    // "$schema" lookup and the validation below
+    JsonDocument data;
+    std::string verr;
+    if (!parse_json_document(content, data, verr)) {
+      std::cerr << "Schema validation failed: " << verr << "\n";
+      return 2;
     }
+    std::string selected_schema = schema_arg;
+    // if no schema provided, use the document's top-level "$schema"
+    JsonView declared;
+    if (selected_schema.empty() && data.root().find("$schema", declared) &&
+        declared.type() == JsonValue::T_STRING)
+      selected_schema = std::string(declared.as_string());
     if (selected_schema.empty()) {
       std::cerr
           << "Error: no schema specified (use -s or include $schema in file)\n";
       return 1;
     }
-    if (!get_schema_source(selected_schema, schema_content, cerr)) {
-      std::cerr << "Error: cannot load schema: " << cerr << "\n";
-      return 1;
+    if (!schema_loaded) {
+      if (!get_schema_source(selected_schema, schema_content, cerr)) {
+        std::cerr << "Error: cannot load schema: " << cerr << "\n";
+        return 1;
+      }
+      // linked schemas serve cross-schema "$ref"s
+      if (!resolve_schema_links(selected_schema, schema_content, resolved,
+                                cerr)) {
+        std::cerr << "Error: cannot load linked schema: " << cerr << "\n";
+        return 1;
+      }
     }
-    // optionally resolve linked schemas; not used yet
-    std::map<std::string, std::string> resolved;
-    resolve_schema_links(selected_schema, resolved, cerr);
 
-    std::string verr;
-    if (!validate_json_with_schema(content, schema_content, verr)) {
+    auto schema = compile_schema_cached(schema_content, resolved, verr);
+    if (!schema) {
       std::cerr << "Schema validation failed: " << verr << "\n";
       return 2;
     }
+    std::vector<std::string> lines;
+    if (!check_schema(*schema, data.root(), all_errors, max_errors, lines)) {
+      for (const auto &line : lines)
+        std::cerr << line << "\n";
+      return 2;
+    }
     std::cout << "OK: valid against schema\n";
     return 0;
   }
+  if (ndjson)
+    return validate_streamed(false, content, true);
   bool ok = validate_json(content, error);
   if (ok) {
     std::cout << "OK: valid JSON\n";
@@ -161,4 +933,29 @@ int main(int argc, char *argv[]) {
     std::cerr << "Invalid JSON: " << error << "\n";
     return 2;
   }
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[]) {
+  // --stats / --profile wrap the whole run so every exit path reports
+  bool stats = false, profile = false, stats_json = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--stats" || arg == "--stats=json" || arg == "--profile" ||
+        arg == "--profile=json") {
+      stats = true;
+      profile = profile || arg.starts_with("--profile");
+      stats_json = stats_json || arg.ends_with("=json");
+    }
+  }
+  if (!stats)
+    return run(argc, argv);
+  enable_jsonval_metrics(true);
+  int rc = run(argc, argv);
+  std::fflush(stdout);
+  JsonvalMetrics m = get_jsonval_metrics();
+  if (stats_json)
+    std::cerr << m.to_json() << "\n";
+  else
+    std::cerr << m.to_text(profile);
+  return rc;
+}
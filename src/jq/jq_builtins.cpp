@@ -1,59 +1,173 @@
 #include "jq_builtins.hpp"
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
 
 namespace jq {
 
-std::map<std::string, BuiltinFunc> Builtins::registry_;
-bool Builtins::initialized_ = false;
+static std::string arity_key(const std::string &name, int arity) {
+  return name + "/" + std::to_string(arity);
+}
+
+struct Builtins::Table {
+  std::unordered_map<std::string, BuiltinPtr> entries; // "name/arity"
+  uint64_t generation = 0;
+};
 
-void Builtins::init_builtins() {
-  if (initialized_)
-    return;
-  initialized_ = true;
+static void insert(std::unordered_map<std::string, BuiltinPtr> &entries,
+                   Builtin b) {
+  std::string key = arity_key(b.name, b.arity);
+  entries[key] = std::make_shared<const Builtin>(std::move(b));
+}
+
+static std::unordered_map<std::string, BuiltinPtr> standard_builtins() {
+  std::unordered_map<std::string, BuiltinPtr> t;
+  auto unary = [&t](const char *name, BuiltinFunc fn) {
+    insert(t, Builtin{name, 0, std::move(fn), nullptr, nullptr});
+  };
+  auto nary = [&t](const char *name, int arity, BuiltinFuncN fn) {
+    insert(t, Builtin{name, arity, nullptr, std::move(fn), nullptr});
+  };
+  auto in_place = [&t](const char *name, BuiltinFunc fn,
+                       BuiltinFuncOwned owned) {
+    insert(t, Builtin{name, 0, std::move(fn), nullptr, std::move(owned)});
+  };
+
+  unary("keys", builtins::keys_builtin);
+  unary("values", builtins::values_builtin);
+  unary("type", builtins::type_builtin);
+  unary("length", builtins::length_builtin);
+  unary("empty", builtins::empty_builtin);
+  in_place("reverse", builtins::reverse_builtin, builtins::reverse_owned);
+  in_place("sort", builtins::sort_builtin, builtins::sort_owned);
+  unary("to_entries", builtins::to_entries_builtin);
+  unary("not", builtins::not_builtin);
+  unary("error", builtins::error_builtin);
+  unary("tostring", builtins::tostring_builtin);
+  unary("tojson", builtins::tojson_builtin);
+  unary("fromjson", builtins::fromjson_builtin);
+  unary("tonumber", builtins::tonumber_builtin);
+  unary("ascii_downcase", builtins::ascii_downcase_builtin);
+  unary("ascii_upcase", builtins::ascii_upcase_builtin);
+  unary("floor", builtins::floor_builtin);
+  unary("sqrt", builtins::sqrt_builtin);
+  unary("min", builtins::min_builtin);
+  unary("max", builtins::max_builtin);
+  in_place("unique", builtins::unique_builtin, builtins::unique_owned);
+  unary("flatten", builtins::flatten_builtin);
+  unary("paths", builtins::paths_builtin);
+
+  nary("error", 1, builtins::error1_builtin);
+  nary("has", 1, builtins::has_builtin);
+  nary("range", 1, builtins::range_builtin);
+  nary("range", 2, builtins::range_builtin);
+  nary("startswith", 1, builtins::startswith_builtin);
+  nary("endswith", 1, builtins::endswith_builtin);
+  nary("ltrimstr", 1, builtins::ltrimstr_builtin);
+  nary("rtrimstr", 1, builtins::rtrimstr_builtin);
+  nary("split", 1, builtins::split_builtin);
+  nary("join", 1, builtins::join_builtin);
+  nary("flatten", 1, builtins::flatten1_builtin);
+  nary("getpath", 1, builtins::getpath_builtin);
+  nary("_sort_by_impl", 1, builtins::sort_by_impl_builtin);
+  nary("_group_by_impl", 1, builtins::group_by_impl_builtin);
+  nary("_min_by_impl", 1, builtins::min_by_impl_builtin);
+  nary("_max_by_impl", 1, builtins::max_by_impl_builtin);
+  return t;
+}
+
+// Published tables are never freed, so a reader can keep using the pointer
+// it loaded while a registration replaces it. Registrations are rare and a
+// table only holds pointers to the builtins, so the old ones cost little.
+struct Builtins::Registry {
+  std::mutex writers; // serializes registrations; readers never take it
+  std::atomic<const Table *> current;
+};
+
+Builtins::Registry &Builtins::registry() {
+  // built on first use, which C++ makes thread-safe
+  static Registry r{{}, new Builtins::Table{standard_builtins(), 0}};
+  return r;
+}
+
+const Builtins::Table *Builtins::snapshot() {
+  return registry().current.load(std::memory_order_acquire);
+}
 
-  register_builtin("keys", builtins::keys_builtin);
-  register_builtin("values", builtins::values_builtin);
-  register_builtin("type", builtins::type_builtin);
-  register_builtin("length", builtins::length_builtin);
-  register_builtin("empty", builtins::empty_builtin);
-  register_builtin("reverse", builtins::reverse_builtin);
-  register_builtin("sort", builtins::sort_builtin);
-  register_builtin("to_entries", builtins::to_entries_builtin);
+void Builtins::add(Builtin builtin) {
+  Registry &r = registry();
+  std::lock_guard<std::mutex> lock(r.writers);
+  auto *next = new Table(*r.current.load(std::memory_order_relaxed));
+  insert(next->entries, std::move(builtin));
+  ++next->generation;
+  r.current.store(next, std::memory_order_release);
 }
 
 void Builtins::register_builtin(const std::string &name,
                                 const BuiltinFunc &fn) {
-  init_builtins();
-  registry_[name] = fn;
+  add(Builtin{name, 0, fn, nullptr, nullptr});
 }
 
+void Builtins::register_builtin(const std::string &name, int arity,
+                                const BuiltinFuncN &fn) {
+  add(Builtin{name, arity, nullptr, fn, nullptr});
+}
+
+BuiltinPtr Builtins::find(const std::string &name, int arity) {
+  const Table *table = snapshot();
+  auto it = table->entries.find(arity_key(name, arity));
+  return it == table->entries.end() ? nullptr : it->second;
+}
+
+uint64_t Builtins::generation() { return snapshot()->generation; }
+
 bool Builtins::has_builtin(const std::string &name) {
-  init_builtins();
-  return registry_.count(name) > 0;
+  return find(name, 0) != nullptr;
+}
+
+bool Builtins::has_builtin(const std::string &name, int arity) {
+  return find(name, arity) != nullptr;
 }
 
 BuiltinFunc Builtins::get_builtin(const std::string &name) {
-  init_builtins();
-  auto it = registry_.find(name);
-  if (it != registry_.end())
-    return it->second;
-  return nullptr;
+  BuiltinPtr b = find(name, 0);
+  return b ? b->fn : nullptr;
 }
 
 bool Builtins::call_builtin(const std::string &name, const JvValuePtr &input,
                             std::vector<JvValuePtr> &outputs,
                             std::string &err) {
-  init_builtins();
-  auto fn = get_builtin(name);
-  if (!fn) {
-    err = "Unknown builtin: " + name;
+  return call_builtin(name, input, {}, outputs, err);
+}
+
+bool Builtins::call_builtin(const std::string &name, const JvValuePtr &input,
+                            const std::vector<JvValuePtr> &args,
+                            std::vector<JvValuePtr> &outputs,
+                            std::string &err) {
+  int arity = static_cast<int>(args.size());
+  BuiltinPtr b = find(name, arity);
+  if (!b) {
+    err = "Unknown builtin: " + (arity == 0 ? name : arity_key(name, arity));
     return false;
   }
-  return fn(input, outputs, err);
+  return b->call(input, args, outputs, err);
 }
 
 namespace builtins {
 
+// An object key as a string value. Small objects mostly repeat a handful of
+// keys whose shared values (Key::value()) stay in cache; in large ones most
+// keys are seen once, and a fresh string is cheaper than touching a cold
+// shared value per member.
+static JvValuePtr key_string(const JvObject &object, const Key &key) {
+  constexpr size_t kSharedKeyMax = 64;
+  return object.size() <= kSharedKeyMax ? key.value()
+                                        : JvValue::string(key.str());
+}
+
 bool keys_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
                   std::string &err) {
   if (!input) {
@@ -63,13 +177,13 @@ bool keys_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
 
   auto result = JvValue::array();
   if (input->is_object()) {
-    for (const auto &kv : input->o) {
-      result->array_push(JvValue::string(kv.first));
-    }
+    result->a.reserve(input->o.size());
+    for (const auto &kv : input->o)
+      result->a.push_back(key_string(input->o, kv.first));
   } else if (input->is_array()) {
-    for (size_t i = 0; i < input->a.size(); ++i) {
-      result->array_push(JvValue::number(static_cast<double>(i)));
-    }
+    result->a.reserve(input->a.size());
+    for (size_t i = 0; i < input->a.size(); ++i)
+      result->a.push_back(JvValue::number(static_cast<double>(i)));
   } else {
     err = "keys: input must be object or array";
     return false;
@@ -103,7 +217,7 @@ bool values_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
 }
 
 bool type_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
-                  std::string &err) {
+                  std::string &) {
   std::string type_name;
   if (!input || input->is_null()) {
     type_name = "null";
@@ -125,15 +239,24 @@ bool type_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
   return true;
 }
 
+size_t utf8_length(std::string_view s) {
+  // every byte that is not a continuation byte starts a codepoint
+  size_t n = 0;
+  for (unsigned char c : s)
+    n += (c & 0xC0) != 0x80;
+  return n;
+}
+
 bool length_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
-                    std::string &err) {
+                    std::string &) {
   if (!input) {
     outputs.push_back(JvValue::number(0));
     return true;
   }
 
   if (input->is_string()) {
-    outputs.push_back(JvValue::number(static_cast<double>(input->s.size())));
+    outputs.push_back(
+        JvValue::number(static_cast<double>(utf8_length(input->s))));
   } else if (input->is_array()) {
     outputs.push_back(JvValue::number(static_cast<double>(input->a.size())));
   } else if (input->is_object()) {
@@ -147,89 +270,112 @@ bool length_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
   return true;
 }
 
-bool map_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
-                 std::string &err) {
-  err = "map: not yet implemented (requires filter argument support)";
-  return false;
-}
-
-bool select_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
-                    std::string &err) {
-  err = "select: not yet implemented (requires filter argument support)";
-  return false;
-}
-
-bool empty_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
-                   std::string &err) {
+bool empty_builtin(const JvValuePtr &, std::vector<JvValuePtr> &,
+                   std::string &) {
   // empty produces no output
   return true;
 }
 
 bool reverse_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
                      std::string &err) {
+  JvValuePtr shared = input; // never the only reference: reverses a copy
+  return reverse_owned(shared, outputs, err);
+}
+
+bool reverse_owned(JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                   std::string &err) {
   if (!input) {
     outputs.push_back(JvValue::null());
     return true;
   }
-
-  if (input->is_string()) {
-    std::string rev = input->s;
-    std::reverse(rev.begin(), rev.end());
-    outputs.push_back(JvValue::string(rev));
-  } else if (input->is_array()) {
-    auto arr = JvValue::array();
-    for (auto it = input->a.rbegin(); it != input->a.rend(); ++it) {
-      arr->array_push(*it);
-    }
-    outputs.push_back(arr);
-  } else {
+  if (!input->is_string() && !input->is_array()) {
     err = "reverse: input must be string or array";
     return false;
   }
 
+  if (input.use_count() == 1) {
+    if (input->is_string())
+      std::reverse(input->s.begin(), input->s.end());
+    else
+      std::reverse(input->a.begin(), input->a.end());
+    outputs.push_back(std::move(input));
+  } else if (input->is_string()) {
+    outputs.push_back(
+        JvValue::string(std::string(input->s.rbegin(), input->s.rend())));
+  } else {
+    auto arr = JvValue::array();
+    arr->a.assign(input->a.rbegin(), input->a.rend());
+    outputs.push_back(arr);
+  }
   return true;
 }
 
+// Sort `elems` in jq's order (compare_values), stably. Arrays of only
+// numbers or only strings are sorted on (key, position) pairs, so the
+// comparisons touch no JvValue and the elements are moved once at the end.
+static void sort_values(std::vector<JvValuePtr> &elems) {
+  bool numbers = true, strings = true;
+  for (const auto &e : elems) {
+    numbers = numbers && e && e->is_number();
+    strings = strings && e && e->is_string();
+    if (!numbers && !strings)
+      break;
+  }
+  auto permute = [&elems](const auto &order) {
+    std::vector<JvValuePtr> sorted;
+    sorted.reserve(elems.size());
+    for (const auto &entry : order)
+      sorted.push_back(std::move(elems[entry.second]));
+    elems.swap(sorted);
+  };
+  if (numbers) {
+    std::vector<std::pair<double, size_t>> order;
+    order.reserve(elems.size());
+    for (size_t i = 0; i < elems.size(); ++i)
+      order.emplace_back(elems[i]->n, i);
+    std::stable_sort(order.begin(), order.end(),
+                     [](const auto &a, const auto &b) {
+                       return a.first < b.first;
+                     });
+    permute(order);
+  } else if (strings) {
+    // equal strings are interchangeable, so stability does not matter
+    std::vector<std::pair<std::string_view, size_t>> order;
+    order.reserve(elems.size());
+    for (size_t i = 0; i < elems.size(); ++i)
+      order.emplace_back(elems[i]->s, i);
+    std::sort(order.begin(), order.end(), [](const auto &a, const auto &b) {
+      return a.first < b.first;
+    });
+    permute(order);
+  } else {
+    std::stable_sort(elems.begin(), elems.end(),
+                     [](const JvValuePtr &a, const JvValuePtr &b) {
+                       return compare_values(a, b) < 0;
+                     });
+  }
+}
+
 bool sort_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
                   std::string &err) {
+  JvValuePtr shared = input;
+  return sort_owned(shared, outputs, err);
+}
+
+bool sort_owned(JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                std::string &err) {
   if (!input || !input->is_array()) {
     err = "sort: input must be array";
     return false;
   }
-
-  auto sorted = JvValue::array();
-  std::vector<JvValuePtr> elems = input->a;
-
-  std::sort(elems.begin(), elems.end(),
-            [](const JvValuePtr &a, const JvValuePtr &b) -> bool {
-              // Simple comparison: numbers < strings < others
-              if (a->is_number() && b->is_number())
-                return a->n < b->n;
-              if (a->is_string() && b->is_string())
-                return a->s < b->s;
-              // Mixed types: use type order
-              auto type_order = [](const JvValuePtr &v) -> int {
-                if (v->is_null())
-                  return 0;
-                if (v->is_bool())
-                  return 1;
-                if (v->is_number())
-                  return 2;
-                if (v->is_string())
-                  return 3;
-                if (v->is_array())
-                  return 4;
-                if (v->is_object())
-                  return 5;
-                return 6;
-              };
-              return type_order(a) < type_order(b);
-            });
-
-  for (const auto &elem : elems) {
-    sorted->array_push(elem);
+  if (input.use_count() == 1) {
+    sort_values(input->a);
+    outputs.push_back(std::move(input));
+    return true;
   }
-
+  auto sorted = JvValue::array();
+  sorted->a = input->a;
+  sort_values(sorted->a);
   outputs.push_back(sorted);
   return true;
 }
@@ -241,18 +387,545 @@ bool to_entries_builtin(const JvValuePtr &input,
     return false;
   }
 
+  static const Key key_name("key"), value_name("value");
   auto result = JvValue::array();
+  result->a.reserve(input->o.size());
   for (const auto &kv : input->o) {
     auto entry = JvValue::object();
-    entry->object_set("key", JvValue::string(kv.first));
-    entry->object_set("value", kv.second);
-    result->array_push(entry);
+    entry->o.set(key_name, key_string(input->o, kv.first));
+    entry->o.set(value_name, kv.second);
+    result->a.push_back(std::move(entry));
+  }
+
+  outputs.push_back(result);
+  return true;
+}
+
+bool not_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                 std::string &) {
+  outputs.push_back(JvValue::boolean(!is_truthy(input)));
+  return true;
+}
+
+static thread_local JvValuePtr t_error_value;
+static thread_local std::string t_error_text;
+
+void set_error_value(const JvValuePtr &value, const std::string &err) {
+  t_error_value = value;
+  t_error_text = err;
+}
+
+JvValuePtr take_error_value(const std::string &err) {
+  if (!t_error_value)
+    return nullptr;
+  JvValuePtr value = std::move(t_error_value);
+  t_error_value = nullptr;
+  return t_error_text == err ? value : nullptr;
+}
+
+bool error_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &,
+                   std::string &err) {
+  err = input && input->is_string() ? input->s
+                                    : (input ? input->to_string() : "null");
+  set_error_value(input ? input : JvValue::null(), err);
+  return false;
+}
+
+bool tostring_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                      std::string &) {
+  if (input && input->is_string()) {
+    outputs.push_back(input);
+  } else {
+    outputs.push_back(JvValue::string(input ? input->to_string() : "null"));
+  }
+  return true;
+}
+
+bool tojson_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                    std::string &) {
+  outputs.push_back(JvValue::string(input ? input->to_string() : "null"));
+  return true;
+}
+
+bool fromjson_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                      std::string &err) {
+  if (!input || !input->is_string()) {
+    err = describe_value(input) + " cannot be parsed as JSON";
+    return false;
+  }
+  std::string perr;
+  auto value = JvValue::from_string(input->s, perr);
+  if (!perr.empty()) {
+    err = perr + " (while parsing '" + input->s + "')";
+    return false;
+  }
+  outputs.push_back(value);
+  return true;
+}
+
+bool tonumber_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                      std::string &err) {
+  if (input && input->is_number()) {
+    outputs.push_back(input);
+    return true;
+  }
+  if (input && input->is_string() && !input->s.empty()) {
+    char *end = nullptr;
+    double n = std::strtod(input->s.c_str(), &end);
+    if (end == input->s.c_str() + input->s.size()) {
+      outputs.push_back(JvValue::number(n));
+      return true;
+    }
+    err = "Cannot parse '" + input->s + "' as JSON";
+    return false;
+  }
+  err = describe_value(input) + " cannot be parsed as a number";
+  return false;
+}
+
+static bool change_case(const JvValuePtr &input,
+                        std::vector<JvValuePtr> &outputs, std::string &err,
+                        const char *name, bool upper) {
+  if (!input || !input->is_string()) {
+    err = std::string(name) + " input must be a string";
+    return false;
+  }
+  std::string out = input->s;
+  for (char &c : out) {
+    if (upper && c >= 'a' && c <= 'z')
+      c = static_cast<char>(c - 'a' + 'A');
+    else if (!upper && c >= 'A' && c <= 'Z')
+      c = static_cast<char>(c - 'A' + 'a');
+  }
+  outputs.push_back(JvValue::string(out));
+  return true;
+}
+
+bool ascii_downcase_builtin(const JvValuePtr &input,
+                            std::vector<JvValuePtr> &outputs,
+                            std::string &err) {
+  return change_case(input, outputs, err, "ascii_downcase", false);
+}
+
+bool ascii_upcase_builtin(const JvValuePtr &input,
+                          std::vector<JvValuePtr> &outputs, std::string &err) {
+  return change_case(input, outputs, err, "ascii_upcase", true);
+}
+
+bool floor_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                   std::string &err) {
+  if (!input || !input->is_number()) {
+    err = describe_value(input) + " number required";
+    return false;
+  }
+  outputs.push_back(JvValue::number(std::floor(input->n)));
+  return true;
+}
+
+bool sqrt_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                  std::string &err) {
+  if (!input || !input->is_number()) {
+    err = describe_value(input) + " number required";
+    return false;
+  }
+  outputs.push_back(JvValue::number(std::sqrt(input->n)));
+  return true;
+}
+
+static bool extreme(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                    std::string &err, const char *name, int sign) {
+  if (!input || !input->is_array()) {
+    err = describe_value(input) + " cannot be " + name + "imized";
+    return false;
+  }
+  JvValuePtr best;
+  for (const auto &elem : input->a) {
+    // On ties min keeps the first element and max the last, as in jq.
+    if (!best || compare_values(elem, best) * sign > 0 ||
+        (sign > 0 && compare_values(elem, best) == 0))
+      best = elem;
+  }
+  outputs.push_back(best ? best : JvValue::null());
+  return true;
+}
+
+bool min_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                 std::string &err) {
+  return extreme(input, outputs, err, "min", -1);
+}
+
+bool max_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                 std::string &err) {
+  return extreme(input, outputs, err, "max", 1);
+}
+
+bool unique_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                    std::string &err) {
+  JvValuePtr shared = input;
+  return unique_owned(shared, outputs, err);
+}
+
+bool unique_owned(JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                  std::string &err) {
+  if (!input || !input->is_array()) {
+    err = describe_value(input) + " cannot be sorted, as it is not an array";
+    return false;
+  }
+  JvValuePtr result;
+  if (input.use_count() == 1) {
+    result = std::move(input);
+  } else {
+    result = JvValue::array();
+    result->a = input->a;
+  }
+  auto &elems = result->a;
+  sort_values(elems);
+  elems.erase(std::unique(elems.begin(), elems.end(), values_equal),
+              elems.end());
+  outputs.push_back(std::move(result));
+  return true;
+}
+
+static void collect_paths(const JvValuePtr &value, const JvValuePtr &prefix,
+                          std::vector<JvValuePtr> &outputs) {
+  auto visit = [&](JvValuePtr step, const JvValuePtr &child) {
+    auto path = std::make_shared<JvValue>(*prefix);
+    path->array_push(std::move(step));
+    outputs.push_back(path);
+    collect_paths(child, path, outputs);
+  };
+  if (value->is_array()) {
+    for (size_t i = 0; i < value->a.size(); ++i)
+      visit(JvValue::number(static_cast<double>(i)), value->a[i]);
+  } else if (value->is_object()) {
+    for (const auto &kv : value->o)
+      visit(key_string(value->o, kv.first), kv.second);
+  }
+}
+
+bool paths_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                   std::string &) {
+  if (input)
+    collect_paths(input, JvValue::array(), outputs);
+  return true;
+}
+
+static void flatten_into(const JvValuePtr &array, double depth,
+                         JvValuePtr &out) {
+  for (const auto &elem : array->a) {
+    if (elem->is_array() && depth > 0)
+      flatten_into(elem, depth - 1, out);
+    else
+      out->array_push(elem);
+  }
+}
+
+static bool flatten_depth(const JvValuePtr &input, double depth,
+                          std::vector<JvValuePtr> &outputs, std::string &err) {
+  if (!input || !input->is_array()) {
+    err = "Cannot flatten " + describe_value(input);
+    return false;
+  }
+  if (depth < 0) {
+    err = "flatten depth must not be negative";
+    return false;
+  }
+  auto result = JvValue::array();
+  flatten_into(input, depth, result);
+  outputs.push_back(result);
+  return true;
+}
+
+bool flatten_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                     std::string &err) {
+  return flatten_depth(input, 1e9, outputs, err);
+}
+
+bool flatten1_builtin(const JvValuePtr &input,
+                      const std::vector<JvValuePtr> &args,
+                      std::vector<JvValuePtr> &outputs, std::string &err) {
+  if (!args[0]->is_number()) {
+    err = "flatten depth must not be negative";
+    return false;
+  }
+  return flatten_depth(input, args[0]->n, outputs, err);
+}
+
+bool error1_builtin(const JvValuePtr &,
+                    const std::vector<JvValuePtr> &args,
+                    std::vector<JvValuePtr> &outputs, std::string &err) {
+  return error_builtin(args[0], outputs, err);
+}
+
+bool has_builtin(const JvValuePtr &input, const std::vector<JvValuePtr> &args,
+                 std::vector<JvValuePtr> &outputs, std::string &err) {
+  const JvValuePtr &key = args[0];
+  if (input && input->is_object() && key->is_string()) {
+    outputs.push_back(JvValue::boolean(input->o.find(key->s) != nullptr));
+  } else if (input && input->is_array() && key->is_number()) {
+    outputs.push_back(JvValue::boolean(
+        key->n >= 0 && key->n < static_cast<double>(input->a.size())));
+  } else {
+    err = std::string("Cannot check whether ") + type_name(input) +
+          " has a " + type_name(key) + " key";
+    return false;
+  }
+  return true;
+}
+
+bool range_builtin(const JvValuePtr &,
+                   const std::vector<JvValuePtr> &args,
+                   std::vector<JvValuePtr> &outputs, std::string &err) {
+  for (const auto &arg : args) {
+    if (!arg->is_number()) {
+      err = "Range bounds must be numeric";
+      return false;
+    }
+  }
+  double from = args.size() == 2 ? args[0]->n : 0;
+  double to = args.back()->n;
+  for (double i = from; i < to; ++i)
+    outputs.push_back(JvValue::number(i));
+  return true;
+}
+
+bool getpath_builtin(const JvValuePtr &input,
+                     const std::vector<JvValuePtr> &args,
+                     std::vector<JvValuePtr> &outputs, std::string &err) {
+  if (!args[0]->is_array()) {
+    err = "Path must be specified as an array";
+    return false;
+  }
+  JvValuePtr value = input ? input : JvValue::null();
+  for (const auto &step : args[0]->a) {
+    if (value->is_null())
+      break;
+    if (value->is_object() && step->is_string()) {
+      const JvValuePtr *member = value->o.find(step->s);
+      value = member ? *member : JvValue::null();
+    } else if (value->is_array() && step->is_number()) {
+      double i = std::floor(step->n);
+      if (i < 0)
+        i += static_cast<double>(value->a.size());
+      value = i >= 0 && i < static_cast<double>(value->a.size())
+                  ? value->a[static_cast<size_t>(i)]
+                  : JvValue::null();
+    } else {
+      err = std::string("Cannot index ") + type_name(value) + " with " +
+            type_name(step);
+      return false;
+    }
+  }
+  outputs.push_back(value);
+  return true;
+}
+
+// The *_by builtins get the input array and, as their argument, the key of
+// each element (map([f]) in the prelude). Returns the element positions in
+// the stable order of their keys.
+static bool order_by_keys(const JvValuePtr &input, const JvValuePtr &keys,
+                          const char *name, std::vector<size_t> &order,
+                          std::string &err) {
+  if (!input || !input->is_array()) {
+    err = describe_value(input) + " cannot be sorted, as it is not an array";
+    return false;
+  }
+  if (!keys->is_array() || keys->a.size() != input->a.size()) {
+    err = std::string(name) + ": keys do not match the input";
+    return false;
+  }
+  order.resize(input->a.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&keys](size_t a, size_t b) {
+    return compare_values(keys->a[a], keys->a[b]) < 0;
+  });
+  return true;
+}
+
+bool sort_by_impl_builtin(const JvValuePtr &input,
+                          const std::vector<JvValuePtr> &args,
+                          std::vector<JvValuePtr> &outputs, std::string &err) {
+  std::vector<size_t> order;
+  if (!order_by_keys(input, args[0], "sort_by", order, err))
+    return false;
+  auto result = JvValue::array();
+  result->a.reserve(order.size());
+  for (size_t i : order)
+    result->a.push_back(input->a[i]);
+  outputs.push_back(result);
+  return true;
+}
+
+bool group_by_impl_builtin(const JvValuePtr &input,
+                           const std::vector<JvValuePtr> &args,
+                           std::vector<JvValuePtr> &outputs,
+                           std::string &err) {
+  std::vector<size_t> order;
+  if (!order_by_keys(input, args[0], "group_by", order, err))
+    return false;
+  const auto &keys = args[0]->a;
+  auto result = JvValue::array();
+  for (size_t n = 0; n < order.size(); ++n) {
+    if (n == 0 || !values_equal(keys[order[n]], keys[order[n - 1]]))
+      result->a.push_back(JvValue::array());
+    result->a.back()->a.push_back(input->a[order[n]]);
   }
+  outputs.push_back(result);
+  return true;
+}
 
+static bool extreme_by(const JvValuePtr &input, const JvValuePtr &keys,
+                       std::vector<JvValuePtr> &outputs, std::string &err,
+                       const char *name, int sign) {
+  if (!input || !input->is_array()) {
+    err = describe_value(input) + " cannot be " + name + "imized";
+    return false;
+  }
+  if (!keys->is_array() || keys->a.size() != input->a.size()) {
+    err = std::string(name) + "_by: keys do not match the input";
+    return false;
+  }
+  size_t best = input->a.size();
+  for (size_t i = 0; i < input->a.size(); ++i) {
+    // ties as in extreme(): min keeps the first element, max the last
+    int c = best == input->a.size() ? sign
+                                     : compare_values(keys->a[i], keys->a[best]);
+    if (c * sign > 0 || (sign > 0 && c == 0))
+      best = i;
+  }
+  outputs.push_back(best < input->a.size() ? input->a[best]
+                                           : JvValue::null());
+  return true;
+}
+
+bool min_by_impl_builtin(const JvValuePtr &input,
+                         const std::vector<JvValuePtr> &args,
+                         std::vector<JvValuePtr> &outputs, std::string &err) {
+  return extreme_by(input, args[0], outputs, err, "min", -1);
+}
+
+bool max_by_impl_builtin(const JvValuePtr &input,
+                         const std::vector<JvValuePtr> &args,
+                         std::vector<JvValuePtr> &outputs, std::string &err) {
+  return extreme_by(input, args[0], outputs, err, "max", 1);
+}
+
+static bool string_args(const JvValuePtr &input, const JvValuePtr &arg) {
+  return input && input->is_string() && arg->is_string();
+}
+
+static bool has_prefix(const std::string &s, const std::string &p) {
+  return s.size() >= p.size() && s.compare(0, p.size(), p) == 0;
+}
+
+static bool has_suffix(const std::string &s, const std::string &p) {
+  return s.size() >= p.size() &&
+         s.compare(s.size() - p.size(), p.size(), p) == 0;
+}
+
+bool startswith_builtin(const JvValuePtr &input,
+                        const std::vector<JvValuePtr> &args,
+                        std::vector<JvValuePtr> &outputs, std::string &err) {
+  if (!string_args(input, args[0])) {
+    err = "startswith() requires string inputs";
+    return false;
+  }
+  outputs.push_back(JvValue::boolean(has_prefix(input->s, args[0]->s)));
+  return true;
+}
+
+bool endswith_builtin(const JvValuePtr &input,
+                      const std::vector<JvValuePtr> &args,
+                      std::vector<JvValuePtr> &outputs, std::string &err) {
+  if (!string_args(input, args[0])) {
+    err = "endswith() requires string inputs";
+    return false;
+  }
+  outputs.push_back(JvValue::boolean(has_suffix(input->s, args[0]->s)));
+  return true;
+}
+
+bool ltrimstr_builtin(const JvValuePtr &input,
+                      const std::vector<JvValuePtr> &args,
+                      std::vector<JvValuePtr> &outputs, std::string &) {
+  if (string_args(input, args[0]) && has_prefix(input->s, args[0]->s)) {
+    outputs.push_back(JvValue::string(input->s.substr(args[0]->s.size())));
+  } else {
+    outputs.push_back(input);
+  }
+  return true;
+}
+
+bool rtrimstr_builtin(const JvValuePtr &input,
+                      const std::vector<JvValuePtr> &args,
+                      std::vector<JvValuePtr> &outputs, std::string &) {
+  if (string_args(input, args[0]) && has_suffix(input->s, args[0]->s)) {
+    outputs.push_back(JvValue::string(
+        input->s.substr(0, input->s.size() - args[0]->s.size())));
+  } else {
+    outputs.push_back(input);
+  }
+  return true;
+}
+
+bool split_builtin(const JvValuePtr &input,
+                   const std::vector<JvValuePtr> &args,
+                   std::vector<JvValuePtr> &outputs, std::string &err) {
+  if (!string_args(input, args[0])) {
+    err = "split input and separator must be strings";
+    return false;
+  }
+  const std::string &s = input->s;
+  const std::string &sep = args[0]->s;
+  auto result = JvValue::array();
+  if (sep.empty()) {
+    for (char c : s)
+      result->array_push(JvValue::string(std::string(1, c)));
+  } else if (!s.empty()) {
+    size_t start = 0;
+    while (true) {
+      size_t at = s.find(sep, start);
+      if (at == std::string::npos) {
+        result->array_push(JvValue::string(s.substr(start)));
+        break;
+      }
+      result->array_push(JvValue::string(s.substr(start, at - start)));
+      start = at + sep.size();
+    }
+  }
   outputs.push_back(result);
   return true;
 }
 
+bool join_builtin(const JvValuePtr &input, const std::vector<JvValuePtr> &args,
+                  std::vector<JvValuePtr> &outputs, std::string &err) {
+  if (!input || !input->is_array()) {
+    err = "Cannot iterate over " + std::string(type_name(input));
+    return false;
+  }
+  if (!args[0]->is_string()) {
+    err = "join separator must be a string";
+    return false;
+  }
+  std::string out;
+  for (size_t i = 0; i < input->a.size(); ++i) {
+    const auto &elem = input->a[i];
+    if (i > 0)
+      out += args[0]->s;
+    if (elem->is_string()) {
+      out += elem->s;
+    } else if (elem->is_number() || elem->is_bool()) {
+      write_json(elem, out);
+    } else if (!elem->is_null()) {
+      err = "Cannot join with " + std::string(type_name(elem));
+      return false;
+    }
+  }
+  outputs.push_back(JvValue::string(out));
+  return true;
+}
+
 } // namespace builtins
 
 } // namespace jq
@@ -2,9 +2,11 @@
 #define JQ_BUILTINS_HPP
 
 #include "jq_types.hpp"
+#include <cstdint>
 #include <functional>
-#include <map>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace jq {
@@ -13,25 +15,77 @@ namespace jq {
 using BuiltinFunc = std::function<bool(
     const JvValuePtr &, std::vector<JvValuePtr> &, std::string &)>;
 
+// Builtin taking arguments. Each argument is one output of the argument
+// filter; the executor calls it once per combination.
+using BuiltinFuncN = std::function<bool(
+    const JvValuePtr &, const std::vector<JvValuePtr> &,
+    std::vector<JvValuePtr> &, std::string &)>;
+
+// Arity-0 builtin that may consume its input: when the caller holds the
+// only reference (input.use_count() == 1) it may modify the value in place
+// or move it into its output instead of building a copy.
+using BuiltinFuncOwned = std::function<bool(
+    JvValuePtr &, std::vector<JvValuePtr> &, std::string &)>;
+
+// One registered builtin. Compiled programs hold on to the builtins they
+// call, so registering a name again does not change programs compiled
+// before.
+struct Builtin {
+  std::string name;
+  int arity = 0;
+  BuiltinFunc fn;    // arity 0
+  BuiltinFuncN fn_n; // arity > 0
+  BuiltinFuncOwned fn_owned; // optional in-place form of fn
+
+  bool call(const JvValuePtr &input, const std::vector<JvValuePtr> &args,
+            std::vector<JvValuePtr> &outputs, std::string &err) const {
+    return arity == 0 ? fn(input, outputs, err)
+                      : fn_n(input, args, outputs, err);
+  }
+
+  // Same, with `input` handed over: the executor passes a value it no
+  // longer holds itself, so fn_owned can reuse it when nothing else does.
+  bool call_owned(JvValuePtr &input, const std::vector<JvValuePtr> &args,
+                  std::vector<JvValuePtr> &outputs, std::string &err) const {
+    if (fn_owned)
+      return fn_owned(input, outputs, err);
+    return call(input, args, outputs, err);
+  }
+};
+using BuiltinPtr = std::shared_ptr<const Builtin>;
+
+// The builtin table is an immutable snapshot. Lookups read the current one
+// without taking a lock; a registration copies it, adds the entry and
+// publishes the copy, so threads running filters never wait on it.
 class Builtins {
 public:
   // Register a builtin function
   static void register_builtin(const std::string &name, const BuiltinFunc &fn);
+  static void register_builtin(const std::string &name, int arity,
+                               const BuiltinFuncN &fn);
 
   // Look up a builtin by name
   static bool has_builtin(const std::string &name);
+  static bool has_builtin(const std::string &name, int arity);
   static BuiltinFunc get_builtin(const std::string &name);
+  static BuiltinPtr find(const std::string &name, int arity); // or nullptr
+
+  // Bumped by every registration, for caches of compiled programs
+  static uint64_t generation();
 
   // Call a builtin
   static bool call_builtin(const std::string &name, const JvValuePtr &input,
                            std::vector<JvValuePtr> &outputs, std::string &err);
+  static bool call_builtin(const std::string &name, const JvValuePtr &input,
+                           const std::vector<JvValuePtr> &args,
+                           std::vector<JvValuePtr> &outputs, std::string &err);
 
 private:
-  static std::map<std::string, BuiltinFunc> registry_;
-  static bool initialized_;
-
-  // Initialize standard builtins
-  static void init_builtins();
+  struct Table;
+  struct Registry;
+  static Registry &registry();
+  static const Table *snapshot();
+  static void add(Builtin builtin);
 };
 
 // Builtin implementations
@@ -49,17 +103,11 @@ bool values_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
 bool type_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
                   std::string &err);
 
-// length: returns length of string/array/object
-bool length_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
-                    std::string &err);
-
-// map(f): apply filter to each array element (simplified: needs filter
-// argument)
-bool map_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
-                 std::string &err);
+// Codepoints in UTF-8 text, the unit of string length and slicing.
+size_t utf8_length(std::string_view s);
 
-// select(f): filter based on condition (simplified: needs filter argument)
-bool select_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+// length: returns length of string/array/object; strings count codepoints
+bool length_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
                     std::string &err);
 
 // empty: produces no output
@@ -70,14 +118,125 @@ bool empty_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
 bool reverse_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
                      std::string &err);
 
-// sort: sort array
+// sort: sort array in jq's order; all-number and all-string arrays take a
+// fast path that compares unboxed keys
 bool sort_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
                   std::string &err);
 
+// In-place forms of sort, reverse and unique (see BuiltinFuncOwned)
+bool sort_owned(JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                std::string &err);
+bool reverse_owned(JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                   std::string &err);
+bool unique_owned(JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                  std::string &err);
+
 // to_entries: convert object to [key,value] array
 bool to_entries_builtin(const JvValuePtr &input,
                         std::vector<JvValuePtr> &outputs, std::string &err);
 
+// not: logical negation of the input
+bool not_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                 std::string &err);
+
+// error: raise the input as an error
+bool error_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                   std::string &err);
+
+// error/0 and error/1 fail with a value, not just a message: `err` gets its
+// text, and the value itself is left here for the executor so `catch` sees
+// it unchanged. take_error_value() returns it only if `err` is still the
+// text it was raised with, and clears it either way.
+void set_error_value(const JvValuePtr &value, const std::string &err);
+JvValuePtr take_error_value(const std::string &err);
+
+// tostring / tojson / fromjson / tonumber: conversions
+bool tostring_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                      std::string &err);
+bool tojson_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                    std::string &err);
+bool fromjson_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                      std::string &err);
+bool tonumber_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                      std::string &err);
+
+// ascii_downcase / ascii_upcase: change the case of ASCII letters
+bool ascii_downcase_builtin(const JvValuePtr &input,
+                            std::vector<JvValuePtr> &outputs,
+                            std::string &err);
+bool ascii_upcase_builtin(const JvValuePtr &input,
+                          std::vector<JvValuePtr> &outputs, std::string &err);
+
+// floor / sqrt: math on numbers
+bool floor_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                   std::string &err);
+bool sqrt_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                  std::string &err);
+
+// min / max / unique / flatten: array reductions
+bool min_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                 std::string &err);
+bool max_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                 std::string &err);
+bool unique_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                    std::string &err);
+bool flatten_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                     std::string &err);
+
+// paths: every path into the input, parents before their children
+bool paths_builtin(const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
+                   std::string &err);
+
+// Builtins with arguments: error(msg), has(key), range(n), range(from; to),
+// startswith(s), endswith(s), ltrimstr(s), rtrimstr(s), split(sep),
+// join(sep), flatten(depth), getpath(path)
+bool error1_builtin(const JvValuePtr &input,
+                    const std::vector<JvValuePtr> &args,
+                    std::vector<JvValuePtr> &outputs, std::string &err);
+bool has_builtin(const JvValuePtr &input, const std::vector<JvValuePtr> &args,
+                 std::vector<JvValuePtr> &outputs, std::string &err);
+bool range_builtin(const JvValuePtr &input,
+                   const std::vector<JvValuePtr> &args,
+                   std::vector<JvValuePtr> &outputs, std::string &err);
+bool startswith_builtin(const JvValuePtr &input,
+                        const std::vector<JvValuePtr> &args,
+                        std::vector<JvValuePtr> &outputs, std::string &err);
+bool endswith_builtin(const JvValuePtr &input,
+                      const std::vector<JvValuePtr> &args,
+                      std::vector<JvValuePtr> &outputs, std::string &err);
+bool ltrimstr_builtin(const JvValuePtr &input,
+                      const std::vector<JvValuePtr> &args,
+                      std::vector<JvValuePtr> &outputs, std::string &err);
+bool rtrimstr_builtin(const JvValuePtr &input,
+                      const std::vector<JvValuePtr> &args,
+                      std::vector<JvValuePtr> &outputs, std::string &err);
+bool split_builtin(const JvValuePtr &input,
+                   const std::vector<JvValuePtr> &args,
+                   std::vector<JvValuePtr> &outputs, std::string &err);
+bool join_builtin(const JvValuePtr &input, const std::vector<JvValuePtr> &args,
+                  std::vector<JvValuePtr> &outputs, std::string &err);
+bool flatten1_builtin(const JvValuePtr &input,
+                      const std::vector<JvValuePtr> &args,
+                      std::vector<JvValuePtr> &outputs, std::string &err);
+bool getpath_builtin(const JvValuePtr &input,
+                     const std::vector<JvValuePtr> &args,
+                     std::vector<JvValuePtr> &outputs, std::string &err);
+
+// Cores of sort_by(f), group_by(f), min_by(f) and max_by(f): the argument
+// holds the key of each input element, as computed by map([f])
+bool sort_by_impl_builtin(const JvValuePtr &input,
+                          const std::vector<JvValuePtr> &args,
+                          std::vector<JvValuePtr> &outputs, std::string &err);
+bool group_by_impl_builtin(const JvValuePtr &input,
+                           const std::vector<JvValuePtr> &args,
+                           std::vector<JvValuePtr> &outputs, std::string &err);
+bool min_by_impl_builtin(const JvValuePtr &input,
+                         const std::vector<JvValuePtr> &args,
+                         std::vector<JvValuePtr> &outputs, std::string &err);
+bool max_by_impl_builtin(const JvValuePtr &input,
+                         const std::vector<JvValuePtr> &args,
+                         std::vector<JvValuePtr> &outputs, std::string &err);
+
 } // namespace builtins
 
 } // namespace jq
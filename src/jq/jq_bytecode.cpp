@@ -1,8 +1,31 @@
 #include "jq_bytecode.hpp"
+#include "jq_builtins.hpp"
 #include <iostream>
 
 namespace jq {
 
+static const char *const kBinOpNames[] = {"+",  "-",  "*", "/",  "%", "==",
+                                          "!=", "<", "<=", ">", ">="};
+
+static const char *const kOpCodeNames[] = {
+    "NOP",           "LOAD_IDENTITY", "GET_FIELD",     "GET_INDEX_NUM",
+    "GET_INDEX_STR", "ITERATE",       "ADD_CONST",     "LENGTH",
+    "BUILTIN_CALL",  "LOAD_CONST",    "PUSH_CONST",    "DUP",
+    "PICK",          "POP",           "SWAP",          "JUMP",
+    "JUMP_IF_FALSE", "FORK",          "BACKTRACK",     "TRY_BEGIN",
+    "TRY_END",       "LABEL",         "BREAK",         "STORE_VAR",
+    "LOAD_VAR",      "PUSH_VAR",      "COLLECT_BEGIN", "APPEND",
+    "OBJECT_INSERT", "INDEX",         "SLICE",         "BINOP",
+    "GET_PATH",      "BINOP_CONST",   "CALL_JQ",       "CLOSURE_REF",
+    "CLOSURE_PARAM", "CALL_CLOSURE",  "RET"};
+static_assert(sizeof(kOpCodeNames) / sizeof(kOpCodeNames[0]) == kOpCodeCount,
+              "kOpCodeNames must list every OpCode");
+
+const char *opcode_name(OpCode op) {
+  size_t i = static_cast<size_t>(op);
+  return i < kOpCodeCount ? kOpCodeNames[i] : "UNKNOWN";
+}
+
 // Pretty-print a single instruction for debugging
 std::string instruction_to_string(const Instruction &ins,
                                   const ConstantPool &pool) {
@@ -46,10 +69,123 @@ std::string instruction_to_string(const Instruction &ins,
     break;
   case OpCode::BUILTIN_CALL:
     result = "BUILTIN_CALL";
-    if (ins.a >= 0 && static_cast<size_t>(ins.a) < pool.strings.size()) {
-      result += " \"" + pool.strings[ins.a] + "\"";
+    if (ins.a >= 0 && static_cast<size_t>(ins.a) < pool.builtins.size() &&
+        pool.builtins[ins.a]) {
+      result += " \"" + pool.builtins[ins.a]->name + "\"";
+    }
+    if (ins.b > 0)
+      result += "/" + std::to_string(ins.b);
+    break;
+  case OpCode::LOAD_CONST:
+  case OpCode::PUSH_CONST:
+    result = ins.op == OpCode::LOAD_CONST ? "LOAD_CONST" : "PUSH_CONST";
+    if (ins.a >= 0 && static_cast<size_t>(ins.a) < pool.values.size()) {
+      result += " " + pool.values[ins.a]->to_string();
+    }
+    break;
+  case OpCode::DUP:
+    result = "DUP";
+    break;
+  case OpCode::PICK:
+    result = "PICK " + std::to_string(ins.a);
+    break;
+  case OpCode::POP:
+    result = "POP";
+    break;
+  case OpCode::SWAP:
+    result = "SWAP";
+    break;
+  case OpCode::JUMP:
+    result = "JUMP " + std::to_string(ins.a);
+    break;
+  case OpCode::JUMP_IF_FALSE:
+    result = "JUMP_IF_FALSE " + std::to_string(ins.a);
+    break;
+  case OpCode::FORK:
+    result = "FORK " + std::to_string(ins.a);
+    break;
+  case OpCode::BACKTRACK:
+    result = "BACKTRACK";
+    break;
+  case OpCode::TRY_BEGIN:
+    result = "TRY_BEGIN " + std::to_string(ins.a);
+    break;
+  case OpCode::TRY_END:
+    result = "TRY_END";
+    break;
+  case OpCode::LABEL:
+    result = "LABEL " + std::to_string(ins.a);
+    break;
+  case OpCode::BREAK:
+    result = "BREAK " + std::to_string(ins.a) + " ^" + std::to_string(ins.b);
+    break;
+  case OpCode::STORE_VAR:
+  case OpCode::LOAD_VAR:
+  case OpCode::PUSH_VAR:
+    result = ins.op == OpCode::STORE_VAR  ? "STORE_VAR"
+             : ins.op == OpCode::LOAD_VAR ? "LOAD_VAR"
+                                          : "PUSH_VAR";
+    result += " " + std::to_string(ins.a) + " ^" + std::to_string(ins.b);
+    break;
+  case OpCode::COLLECT_BEGIN:
+    result = "COLLECT_BEGIN " + std::to_string(ins.a);
+    break;
+  case OpCode::APPEND:
+    result = "APPEND " + std::to_string(ins.a);
+    break;
+  case OpCode::OBJECT_INSERT:
+    result = "OBJECT_INSERT";
+    break;
+  case OpCode::INDEX:
+    result = "INDEX";
+    break;
+  case OpCode::SLICE:
+    result = "SLICE";
+    break;
+  case OpCode::BINOP: {
+    result = "BINOP";
+    if (ins.a >= 0 && ins.a < 11)
+      result += std::string(" ") + kBinOpNames[ins.a];
+    break;
+  }
+  case OpCode::GET_PATH:
+    result = "GET_PATH ";
+    if (ins.a >= 0 && static_cast<size_t>(ins.a) < pool.paths.size()) {
+      for (const auto &step : pool.paths[ins.a]) {
+        if (step.op == OpCode::GET_INDEX_NUM)
+          result += "[" + std::to_string(static_cast<long long>(
+                              pool.numbers[step.a])) + "]";
+        else
+          result += ".\"" + pool.strings[step.a] + "\"";
+      }
     }
     break;
+  case OpCode::BINOP_CONST: {
+    result = "BINOP_CONST";
+    if (ins.a >= 0 && ins.a < 11)
+      result += std::string(" ") + kBinOpNames[ins.a];
+    if (ins.b >= 0 && static_cast<size_t>(ins.b) < pool.values.size())
+      result += " " + pool.values[ins.b]->to_string();
+    break;
+  }
+  case OpCode::CALL_JQ:
+    result = "CALL_JQ f" + std::to_string(ins.a) + " ^" +
+             std::to_string(ins.b);
+    break;
+  case OpCode::CLOSURE_REF:
+    result = "  CLOSURE_REF f" + std::to_string(ins.a);
+    break;
+  case OpCode::CLOSURE_PARAM:
+    result = "  CLOSURE_PARAM " + std::to_string(ins.a) + " ^" +
+             std::to_string(ins.b);
+    break;
+  case OpCode::CALL_CLOSURE:
+    result = "CALL_CLOSURE " + std::to_string(ins.a) + " ^" +
+             std::to_string(ins.b);
+    break;
+  case OpCode::RET:
+    result = "RET";
+    break;
   default:
     result = "UNKNOWN";
     break;
@@ -72,8 +208,31 @@ void print_program(const Program &prog, std::ostream &out) {
     out << "    [" << i << "] " << prog.pool.numbers[i] << "\n";
   }
 
+  if (!prog.pool.values.empty()) {
+    out << "  Values:\n";
+    for (size_t i = 0; i < prog.pool.values.size(); ++i) {
+      out << "    [" << i << "] " << prog.pool.values[i]->to_string() << "\n";
+    }
+  }
+
+  if (!prog.pool.paths.empty()) {
+    out << "  Paths:\n";
+    for (size_t i = 0; i < prog.pool.paths.size(); ++i) {
+      out << "    [" << i << "]";
+      for (const auto &step : prog.pool.paths[i])
+        out << " " << instruction_to_string(step, prog.pool);
+      out << "\n";
+    }
+  }
+
   out << "\nInstructions:\n";
   for (size_t i = 0; i < prog.code.size(); ++i) {
+    for (size_t f = 0; f < prog.functions.size(); ++f) {
+      const auto &fn = prog.functions[f];
+      if (fn.entry == i && (f > 0 || i > 0))
+        out << " f" << f << " " << fn.name << " (params " << fn.nparams
+            << ", locals " << fn.nlocals << "):\n";
+    }
     out << "  [" << i << "] " << instruction_to_string(prog.code[i], prog.pool)
         << "\n";
   }
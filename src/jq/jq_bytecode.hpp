@@ -1,14 +1,25 @@
 #ifndef JQ_BYTECODE_HPP
 #define JQ_BYTECODE_HPP
 
+#include "jq_types.hpp"
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace jq {
 
+struct Builtin;
+
 // Canonical jq opcodes (subset). Extend as needed.
+//
+// The VM is a generator machine in the style of jq's own: every filter maps
+// the value on top of the stack to its output, and a filter with several
+// outputs leaves a fork point behind for each further one. When a value
+// reaches the end of the program it is emitted and the machine backtracks
+// to the most recent fork point for the next one.
 enum class OpCode : uint16_t {
   NOP = 0,
   LOAD_IDENTITY,
@@ -18,53 +29,206 @@ enum class OpCode : uint16_t {
   ITERATE,
   ADD_CONST,
   LENGTH,
-  BUILTIN_CALL,
+  BUILTIN_CALL, // a = pool builtin, b = argument count; args are on the stack
+
+  // stack
+  LOAD_CONST, // replace top with pool.values[a]
+  PUSH_CONST, // push pool.values[a]
+  DUP,
+  PICK, // push a copy of the value `a` entries below the top
+  POP,
+  SWAP,
+
+  // control flow
+  JUMP,          // to a
+  JUMP_IF_FALSE, // pop; jump to a if false or null
+  FORK,          // continue here, later resume at a with the same state
+  BACKTRACK,     // resume the most recent fork point
+  TRY_BEGIN,     // errors until TRY_END resume at a with the message on top
+  TRY_END,
+  LABEL, // variable a := a new label; BREAK to it cuts what it started
+  BREAK, // drop fork points back to the label in variable a, b scopes up,
+         // then backtrack
+
+  // variables: a = local slot, b = number of scopes up
+  STORE_VAR, // pop into the variable
+  LOAD_VAR,  // replace top with the variable
+  PUSH_VAR,  // push the variable
+
+  // constructors and operators
+  COLLECT_BEGIN, // variable a := []
+  APPEND,        // pop onto the array in variable a, then backtrack
+  OBJECT_INSERT, // pop value, key, object; push object + {key: value}
+  INDEX,         // pop index, base; push base[index]
+  SLICE,         // pop start, base, end; push base[start:end]
+  BINOP,         // pop lhs, rhs; push lhs <a> rhs (see BinOp)
+
+  // superinstructions, only produced by optimize_program()
+  GET_PATH,    // field/index steps pool.paths[a], one after another
+  BINOP_CONST, // replace top with top <a> pool.values[b]
+
+  // calls
+  CALL_JQ,       // call function a, defined b scopes up; followed by one
+                 // CLOSURE_REF / CLOSURE_PARAM per parameter
+  CLOSURE_REF,   // argument: function a closed over the caller's scope
+  CLOSURE_PARAM, // argument: the caller's own parameter a, b scopes up
+  CALL_CLOSURE,  // call parameter a of the function b scopes up
+  RET,
 };
 
+// Number of opcodes, for tables indexed by OpCode.
+constexpr size_t kOpCodeCount = static_cast<size_t>(OpCode::RET) + 1;
+
+enum class BinOp : int32_t { ADD, SUB, MUL, DIV, MOD, EQ, NE, LT, LE, GT, GE };
+
 struct Instruction {
   OpCode op = OpCode::NOP;
   int32_t a = -1; // general operand (e.g., pool index)
   int32_t b = -1; // optional operand
 };
 
+// Strings, numbers and scalar literals are stored once however often a
+// program uses them.
 struct ConstantPool {
   std::vector<std::string> strings;
+  std::vector<Key> keys; // strings[i] as an object key, interned once here
   std::vector<double> numbers;
+  std::vector<JvValuePtr> values; // literals; never modified once compiled
+  // builtins resolved when the program was compiled
+  std::vector<std::shared_ptr<const Builtin>> builtins;
+  // GET_PATH steps: GET_FIELD, GET_INDEX_STR and GET_INDEX_NUM instructions
+  std::vector<std::vector<Instruction>> paths;
 
   int add_string(const std::string &s) {
-    strings.push_back(s);
-    return static_cast<int>(strings.size() - 1);
+    auto [it, added] =
+        string_index_.emplace(s, static_cast<int>(strings.size()));
+    if (added) {
+      strings.push_back(s);
+      keys.emplace_back(s);
+    }
+    return it->second;
   }
   int add_number(double v) {
-    numbers.push_back(v);
-    return static_cast<int>(numbers.size() - 1);
+    uint64_t bits; // by bit pattern, so 0 and -0 stay apart
+    std::memcpy(&bits, &v, sizeof bits);
+    auto [it, added] =
+        number_index_.emplace(bits, static_cast<int>(numbers.size()));
+    if (added)
+      numbers.push_back(v);
+    return it->second;
   }
+  int add_value(const JvValuePtr &v) {
+    std::string key;
+    if (v->is_null()) {
+      key = "n";
+    } else if (v->is_bool()) {
+      key = v->b ? "t" : "f";
+    } else if (v->is_number()) {
+      key = "#";
+      key.append(reinterpret_cast<const char *>(&v->n), sizeof v->n);
+    } else if (v->is_string()) {
+      key = "s" + v->s;
+    }
+    if (!key.empty()) {
+      auto it = value_index_.find(key);
+      if (it != value_index_.end())
+        return it->second;
+      value_index_.emplace(std::move(key), static_cast<int>(values.size()));
+    }
+    values.push_back(v);
+    return static_cast<int>(values.size() - 1);
+  }
+  int add_builtin(const std::shared_ptr<const Builtin> &b) {
+    for (size_t i = 0; i < builtins.size(); ++i) {
+      if (builtins[i] == b)
+        return static_cast<int>(i);
+    }
+    builtins.push_back(b);
+    return static_cast<int>(builtins.size() - 1);
+  }
+  int add_path(std::vector<Instruction> steps) {
+    paths.push_back(std::move(steps));
+    return static_cast<int>(paths.size() - 1);
+  }
+
+  void clear() { *this = ConstantPool(); }
+
+private:
+  std::unordered_map<std::string, int> string_index_;
+  std::unordered_map<uint64_t, int> number_index_;
+  std::unordered_map<std::string, int> value_index_; // scalars only
+};
+
+// A compiled function body. Function 0 is the main program; the rest are
+// `def`s and closure arguments.
+struct Function {
+  size_t entry = 0;    // first instruction
+  int32_t nlocals = 0; // variable slots in its frame
+  int32_t nparams = 0; // closure parameters
+  std::string name;    // for the disassembly
 };
 
 struct Program {
   std::vector<Instruction> code;
   ConstantPool pool;
+  std::vector<Function> functions; // empty: straight-line code, no locals
 
   bool validate(std::string &err) const {
+    auto bad = [&](const char *what, size_t i) {
+      err = std::string("Invalid ") + what + " in instruction at pc=" +
+            std::to_string(i);
+      return false;
+    };
+    auto in = [](int32_t v, size_t n) {
+      return v >= 0 && static_cast<size_t>(v) < n;
+    };
     for (size_t i = 0; i < code.size(); ++i) {
       const auto &ins = code[i];
       switch (ins.op) {
       case OpCode::GET_FIELD:
       case OpCode::GET_INDEX_STR:
-        if (ins.a < 0 || static_cast<size_t>(ins.a) >= pool.strings.size()) {
-          err = "Invalid string pool index in instruction at pc=" +
-                std::to_string(i);
-          return false;
-        }
+        if (!in(ins.a, pool.strings.size()))
+          return bad("string pool index", i);
+        break;
+      case OpCode::BUILTIN_CALL:
+        if (!in(ins.a, pool.builtins.size()) || !pool.builtins[ins.a])
+          return bad("builtin pool index", i);
         break;
       case OpCode::GET_INDEX_NUM:
       case OpCode::ADD_CONST:
-        if (ins.a < 0 || static_cast<size_t>(ins.a) >= pool.numbers.size()) {
-          err = "Invalid number pool index in instruction at pc=" +
-                std::to_string(i);
-          return false;
+        if (!in(ins.a, pool.numbers.size()))
+          return bad("number pool index", i);
+        break;
+      case OpCode::LOAD_CONST:
+      case OpCode::PUSH_CONST:
+        if (!in(ins.a, pool.values.size()))
+          return bad("value pool index", i);
+        break;
+      case OpCode::BINOP_CONST:
+        if (!in(ins.b, pool.values.size()))
+          return bad("value pool index", i);
+        break;
+      case OpCode::GET_PATH:
+        if (!in(ins.a, pool.paths.size()))
+          return bad("path pool index", i);
+        for (const auto &step : pool.paths[ins.a]) {
+          bool num = step.op == OpCode::GET_INDEX_NUM;
+          if (!in(step.a, num ? pool.numbers.size() : pool.strings.size()))
+            return bad("path step", i);
         }
         break;
+      case OpCode::JUMP:
+      case OpCode::JUMP_IF_FALSE:
+      case OpCode::FORK:
+      case OpCode::TRY_BEGIN:
+        if (!in(ins.a, code.size() + 1))
+          return bad("jump target", i);
+        break;
+      case OpCode::CALL_JQ:
+      case OpCode::CLOSURE_REF:
+        if (!in(ins.a, functions.size()))
+          return bad("function index", i);
+        break;
       default:
         break;
       }
@@ -74,10 +238,11 @@ struct Program {
 };
 
 // Bytecode debugging and utility functions
+const char *opcode_name(OpCode op);
 std::string instruction_to_string(const Instruction &ins,
                                   const ConstantPool &pool);
 void print_program(const Program &prog, std::ostream &out = std::cout);
 
 } // namespace jq
 
-#endif // JQ_BYTECODE_HPP
\ No newline at end of file
+#endif // JQ_BYTECODE_HPP
@@ -1,24 +1,186 @@
 #include "jq_compiler.hpp"
-#include "jq_bytecode.hpp"
-#include "jq_parser.hpp"
+#include "jq_builtins.hpp"
+#include "jq_executor.hpp"
+#include "jq_lexer.hpp"
+
+#include <mutex>
 
 namespace jq {
 
+// Lexical scope of one function: what names mean while compiling its body.
+// Variables live in the frame of the function that binds them; `levels`
+// operands count how many scopes up that is.
+struct Compiler::Scope {
+  Scope *parent = nullptr;
+  int32_t func = 0;
+  std::vector<std::string> params; // closure parameters, without the $
+  std::vector<std::pair<std::string, int32_t>> vars; // $name -> slot
+  std::vector<std::pair<std::string, int32_t>> defs; // name/arity -> function
+};
+
+// Builtins written in jq itself. Compiled into a program only when it uses
+// them.
+static const char *kPrelude = R"(
+def map(f): [.[] | f];
+def select(f): if f then . else empty end;
+def recurse(f): def r: ., (f | r); r;
+def recurse: recurse(.[]?);
+def add: reduce .[] as $x (null; . + $x);
+def any: reduce .[] as $x (false; . or $x);
+def all: reduce .[] as $x (true; . and $x);
+def any(f): reduce (.[] | f) as $x (false; . or $x);
+def all(f): reduce (.[] | f) as $x (true; . and $x);
+def first: .[0];
+def last: .[-1];
+def first(f): label $out | f | ., break $out;
+def last(f): reduce f as $x (null; $x);
+def limit($n; f): if $n > 0 then label $out
+                    | foreach f as $item (0; . + 1;
+                        $item, if . >= $n then break $out else empty end)
+                  elif $n == 0 then empty else f end;
+def isempty(g): first((g | false), true);
+def keys_unsorted: keys;
+def sort_by(f): _sort_by_impl(map([f]));
+def group_by(f): _group_by_impl(map([f]));
+def unique_by(f): [group_by(f)[] | .[0]];
+def min_by(f): _min_by_impl(map([f]));
+def max_by(f): _max_by_impl(map([f]));
+def paths(node_filter): . as $dot | paths
+                        | select(. as $p | $dot | getpath($p) | node_filter);
+def leaf_paths: paths(scalars);
+def in(xs): . as $x | xs | has($x);
+def from_entries: map({(.key // .k // .name // .Name // .K // .Key
+                        | if type == "string" then . else tojson end):
+                       (if has("value") then .value else .v end)})
+                  | add + {} // {};
+def with_entries(f): to_entries | map(f) | from_entries;
+def map_values(f): if type == "array" then map(f)
+                   else reduce to_entries[] as $e ({};
+                          . + {($e.key): ($e.value | f)}) end;
+def walk(f): . as $in
+  | if type == "object" then
+      reduce keys[] as $key ({}; . + {($key): ($in[$key] | walk(f))}) | f
+    elif type == "array" then map(walk(f)) | f
+    else f end;
+def nulls: select(. == null);
+def booleans: select(type == "boolean");
+def numbers: select(type == "number");
+def strings: select(type == "string");
+def arrays: select(type == "array");
+def objects: select(type == "object");
+def iterables: select(type | . == "array" or . == "object");
+def scalars: select(type | . != "array" and . != "object");
+.
+)";
+
+static std::string arity_key(const std::string &name, size_t arity) {
+  return name + "/" + std::to_string(arity);
+}
+
+// The prelude's definitions by name/arity, parsed once per process.
+static const std::map<std::string, ASTNodePtr> &prelude_defs() {
+  static std::map<std::string, ASTNodePtr> defs;
+  static std::once_flag once;
+  std::call_once(once, [] {
+    Lexer lexer(kPrelude);
+    Parser parser(lexer.tokenize());
+    ASTNodePtr node = parser.parse();
+    while (node && node->type == NodeType::FUNCTION_DEF) {
+      defs[arity_key(node->name, node->params.size())] = node;
+      node = node->children.size() > 1 ? node->children[1] : nullptr;
+    }
+  });
+  return defs;
+}
+
+static bool is_jump(OpCode op) {
+  return op == OpCode::JUMP || op == OpCode::JUMP_IF_FALSE ||
+         op == OpCode::FORK || op == OpCode::TRY_BEGIN;
+}
+
 Compiler::Compiler() = default;
 
 bool Compiler::compile(const ASTNodePtr &ast, Program &program,
                        std::string &err) {
   program.code.clear();
-  program.pool.strings.clear();
-  program.pool.numbers.clear();
+  program.pool.clear();
+  program.functions.clear();
+  prog_ = &program;
+  bodies_.clear();
+  prelude_.clear();
+
+  Scope root;
+  Scope prelude_root; // prelude bodies see builtins but no user definitions
+  prelude_scope_ = &prelude_root;
+  root.func = new_function("main", 0);
 
-  if (!emit_node(ast, program, err))
+  if (!emit_node(ast, root, err))
     return false;
+  emit(root, OpCode::RET);
 
+  // Lay the bodies out one after another, main first.
+  for (const Body &body : bodies_) {
+    Function fn;
+    fn.entry = program.code.size();
+    fn.nlocals = body.nlocals;
+    fn.nparams = body.nparams;
+    fn.name = body.name;
+    for (Instruction ins : body.code) {
+      if (is_jump(ins.op))
+        ins.a += static_cast<int32_t>(fn.entry);
+      program.code.push_back(ins);
+    }
+    program.functions.push_back(fn);
+  }
+  prog_ = nullptr;
+  prelude_scope_ = nullptr;
+
+  if (optimize_)
+    optimize_program(program);
   return program.validate(err);
 }
 
-bool Compiler::emit_node(const ASTNodePtr &node, Program &prog,
+size_t Compiler::emit(Scope &scope, OpCode op, int32_t a, int32_t b) {
+  auto &code = bodies_[static_cast<size_t>(scope.func)].code;
+  code.push_back({op, a, b});
+  return code.size() - 1;
+}
+
+size_t Compiler::here(const Scope &scope) const {
+  return bodies_[static_cast<size_t>(scope.func)].code.size();
+}
+
+void Compiler::patch(Scope &scope, size_t at, size_t target) {
+  bodies_[static_cast<size_t>(scope.func)].code[at].a =
+      static_cast<int32_t>(target);
+}
+
+int32_t Compiler::new_local(Scope &scope) {
+  return bodies_[static_cast<size_t>(scope.func)].nlocals++;
+}
+
+int32_t Compiler::new_function(const std::string &name, int32_t nparams) {
+  Body body;
+  body.name = name;
+  body.nparams = nparams;
+  bodies_.push_back(std::move(body));
+  return static_cast<int32_t>(bodies_.size() - 1);
+}
+
+static bool binop_for(const std::string &op, BinOp &out) {
+  static const std::map<std::string, BinOp> ops = {
+      {"+", BinOp::ADD}, {"-", BinOp::SUB}, {"*", BinOp::MUL},
+      {"/", BinOp::DIV}, {"%", BinOp::MOD}, {"==", BinOp::EQ},
+      {"!=", BinOp::NE}, {"<", BinOp::LT},  {"<=", BinOp::LE},
+      {">", BinOp::GT},  {">=", BinOp::GE}};
+  auto it = ops.find(op);
+  if (it == ops.end())
+    return false;
+  out = it->second;
+  return true;
+}
+
+bool Compiler::emit_node(const ASTNodePtr &node, Scope &scope,
                          std::string &err) {
   if (!node) {
     err = "Null AST node";
@@ -26,12 +188,18 @@ bool Compiler::emit_node(const ASTNodePtr &node, Program &prog,
   }
 
   switch (node->type) {
+  case NodeType::LITERAL: {
+    int vid = prog_->pool.add_value(node->literal ? node->literal
+                                                  : JvValue::null());
+    emit(scope, OpCode::LOAD_CONST, vid);
+    return true;
+  }
   case NodeType::IDENTITY:
-    prog.code.push_back({OpCode::LOAD_IDENTITY, -1, -1});
+    emit(scope, OpCode::LOAD_IDENTITY);
     return true;
   case NodeType::FIELD: {
-    int sid = prog.pool.add_string(node->name);
-    prog.code.push_back({OpCode::GET_FIELD, sid, -1});
+    int sid = prog_->pool.add_string(node->name);
+    emit(scope, OpCode::GET_FIELD, sid);
     return true;
   }
   case NodeType::INDEX: {
@@ -40,60 +208,664 @@ bool Compiler::emit_node(const ASTNodePtr &node, Program &prog,
       return false;
     }
     auto idx = node->children[0];
-    if (idx->type == NodeType::LITERAL && idx->literal) {
+    ASTNodePtr base = node->children.size() > 1 ? node->children[1] : nullptr;
+    if (idx->type == NodeType::LITERAL && idx->literal &&
+        (idx->literal->is_number() || idx->literal->is_string())) {
+      if (base && !emit_node(base, scope, err))
+        return false;
       if (idx->literal->is_number()) {
-        int nid = prog.pool.add_number(idx->literal->n);
-        prog.code.push_back({OpCode::GET_INDEX_NUM, nid, -1});
-        return true;
-      }
-      if (idx->literal->is_string()) {
-        int sid = prog.pool.add_string(idx->literal->s);
-        prog.code.push_back({OpCode::GET_INDEX_STR, sid, -1});
-        return true;
+        int nid = prog_->pool.add_number(idx->literal->n);
+        emit(scope, OpCode::GET_INDEX_NUM, nid);
+      } else {
+        int sid = prog_->pool.add_string(idx->literal->s);
+        emit(scope, OpCode::GET_INDEX_STR, sid);
       }
+      return true;
     }
-    err = "Unsupported index expression";
-    return false;
+    // base and index both read the input: DUP base SWAP index INDEX
+    emit(scope, OpCode::DUP);
+    if (base) {
+      if (!emit_node(base, scope, err))
+        return false;
+      emit(scope, OpCode::SWAP);
+    }
+    if (!emit_node(idx, scope, err))
+      return false;
+    emit(scope, OpCode::INDEX);
+    return true;
+  }
+  case NodeType::SLICE: {
+    if (node->children.size() < 2) {
+      err = "Slice node missing bounds";
+      return false;
+    }
+    emit(scope, OpCode::DUP);
+    if (!emit_node(node->children[1], scope, err))
+      return false;
+    emit(scope, OpCode::SWAP);
+    emit(scope, OpCode::DUP);
+    if (node->children.size() > 2) {
+      if (!emit_node(node->children[2], scope, err))
+        return false;
+      emit(scope, OpCode::SWAP);
+    }
+    if (!emit_node(node->children[0], scope, err))
+      return false;
+    emit(scope, OpCode::SLICE);
+    return true;
   }
   case NodeType::ITERATOR:
-    prog.code.push_back({OpCode::ITERATE, -1, -1});
+    emit(scope, OpCode::ITERATE);
     return true;
+  case NodeType::RECURSIVE: {
+    auto call = std::make_shared<ASTNode>(NodeType::FUNCTION_CALL);
+    call->name = "recurse";
+    return emit_call(call, scope, err);
+  }
   case NodeType::PIPE: {
     if (node->children.size() != 2) {
       err = "Pipe expects 2 children";
       return false;
     }
-    if (!emit_node(node->children[0], prog, err))
+    if (!emit_node(node->children[0], scope, err))
       return false;
-    return emit_node(node->children[1], prog, err);
+    return emit_node(node->children[1], scope, err);
+  }
+  case NodeType::COMMA: {
+    // FORK next; a; JUMP end; next: b ...
+    std::vector<size_t> to_end;
+    for (size_t i = 0; i < node->children.size(); ++i) {
+      size_t fork = 0;
+      bool last = i + 1 == node->children.size();
+      if (!last)
+        fork = emit(scope, OpCode::FORK);
+      if (!emit_node(node->children[i], scope, err))
+        return false;
+      if (!last) {
+        to_end.push_back(emit(scope, OpCode::JUMP));
+        patch(scope, fork, here(scope));
+      }
+    }
+    for (size_t at : to_end)
+      patch(scope, at, here(scope));
+    return true;
   }
   case NodeType::BINARY_OP: {
-    if (node->op == "+" && node->children.size() == 2) {
-      // compile left then add const if right is number literal
-      if (!emit_node(node->children[0], prog, err))
+    if (node->children.size() != 2) {
+      err = "Binary op expects 2 children";
+      return false;
+    }
+    const auto &lhs = node->children[0];
+    const auto &rhs = node->children[1];
+    if (node->op == "and" || node->op == "or") {
+      // a and b: false unless both are true; b only runs when it matters
+      int t = prog_->pool.add_value(JvValue::boolean(true));
+      int f = prog_->pool.add_value(JvValue::boolean(false));
+      bool is_and = node->op == "and";
+      emit(scope, OpCode::DUP);
+      if (!emit_node(lhs, scope, err))
         return false;
-      auto rhs = node->children[1];
-      if (rhs && rhs->type == NodeType::LITERAL && rhs->literal &&
-          rhs->literal->is_number()) {
-        int nid = prog.pool.add_number(rhs->literal->n);
-        prog.code.push_back({OpCode::ADD_CONST, nid, -1});
-        return true;
+      size_t skip = emit(scope, OpCode::JUMP_IF_FALSE);
+      size_t short_circuit = 0;
+      if (!is_and) {
+        emit(scope, OpCode::LOAD_CONST, t);
+        short_circuit = emit(scope, OpCode::JUMP);
+        patch(scope, skip, here(scope));
       }
+      emit(scope, OpCode::DUP);
+      if (!emit_node(rhs, scope, err))
+        return false;
+      size_t second = emit(scope, OpCode::JUMP_IF_FALSE);
+      emit(scope, OpCode::LOAD_CONST, t);
+      size_t done = emit(scope, OpCode::JUMP);
+      if (is_and)
+        patch(scope, skip, here(scope));
+      patch(scope, second, here(scope));
+      emit(scope, OpCode::LOAD_CONST, f);
+      patch(scope, done, here(scope));
+      if (!is_and)
+        patch(scope, short_circuit, here(scope));
+      return true;
     }
-    err = "Unsupported binary op";
-    return false;
+    BinOp op;
+    if (!binop_for(node->op, op)) {
+      err = "Unsupported binary op: " + node->op;
+      return false;
+    }
+    // rhs first so that lhs varies fastest, as in jq
+    emit(scope, OpCode::DUP);
+    if (!emit_node(rhs, scope, err))
+      return false;
+    emit(scope, OpCode::SWAP);
+    if (!emit_node(lhs, scope, err))
+      return false;
+    emit(scope, OpCode::BINOP, static_cast<int32_t>(op));
+    return true;
   }
-  case NodeType::FUNCTION_CALL: {
-    // Emit opcodes for any receiver/arguments, then emit builtin call
-    // For now, builtins are 0-arg and operate on current value
-    int sid = prog.pool.add_string(node->name);
-    prog.code.push_back({OpCode::BUILTIN_CALL, sid, -1});
+  case NodeType::UNARY_OP: {
+    if (node->op != "-" || node->children.size() != 1) {
+      err = "Unsupported unary op: " + node->op;
+      return false;
+    }
+    if (!emit_node(node->children[0], scope, err))
+      return false;
+    emit(scope, OpCode::PUSH_CONST,
+         prog_->pool.add_value(JvValue::number(0)));
+    emit(scope, OpCode::BINOP, static_cast<int32_t>(BinOp::SUB));
+    return true;
+  }
+  case NodeType::CONDITIONAL: {
+    emit(scope, OpCode::DUP);
+    if (!emit_node(node->condition, scope, err))
+      return false;
+    size_t to_else = emit(scope, OpCode::JUMP_IF_FALSE);
+    if (!emit_node(node->then_branch, scope, err))
+      return false;
+    size_t to_end = emit(scope, OpCode::JUMP);
+    patch(scope, to_else, here(scope));
+    if (node->else_branch && !emit_node(node->else_branch, scope, err))
+      return false;
+    patch(scope, to_end, here(scope));
     return true;
   }
+  case NodeType::TRY: {
+    if (node->children.empty()) {
+      err = "Try node missing body";
+      return false;
+    }
+    size_t begin = emit(scope, OpCode::TRY_BEGIN);
+    if (!emit_node(node->children[0], scope, err))
+      return false;
+    emit(scope, OpCode::TRY_END);
+    size_t to_end = emit(scope, OpCode::JUMP);
+    patch(scope, begin, here(scope));
+    if (node->children.size() > 1) {
+      if (!emit_node(node->children[1], scope, err))
+        return false;
+    } else {
+      emit(scope, OpCode::BACKTRACK);
+    }
+    patch(scope, to_end, here(scope));
+    return true;
+  }
+  case NodeType::ALTERNATIVE: {
+    // a // b: the truthy outputs of a, errors suppressed; b if there were
+    // none. `flag` records whether a produced anything.
+    if (node->children.size() != 2) {
+      err = "Alternative expects 2 children";
+      return false;
+    }
+    int t = prog_->pool.add_value(JvValue::boolean(true));
+    int f = prog_->pool.add_value(JvValue::boolean(false));
+    int32_t flag = new_local(scope);
+    emit(scope, OpCode::DUP);
+    emit(scope, OpCode::LOAD_CONST, f);
+    emit(scope, OpCode::STORE_VAR, flag, 0);
+    size_t fork = emit(scope, OpCode::FORK);
+    size_t begin = emit(scope, OpCode::TRY_BEGIN);
+    if (!emit_node(node->children[0], scope, err))
+      return false;
+    emit(scope, OpCode::TRY_END);
+    emit(scope, OpCode::DUP);
+    size_t falsy = emit(scope, OpCode::JUMP_IF_FALSE);
+    emit(scope, OpCode::DUP);
+    emit(scope, OpCode::LOAD_CONST, t);
+    emit(scope, OpCode::STORE_VAR, flag, 0);
+    size_t to_end = emit(scope, OpCode::JUMP);
+    patch(scope, falsy, here(scope));
+    patch(scope, begin, here(scope));
+    emit(scope, OpCode::BACKTRACK);
+    patch(scope, fork, here(scope));
+    emit(scope, OpCode::PUSH_VAR, flag, 0);
+    size_t run_b = emit(scope, OpCode::JUMP_IF_FALSE);
+    emit(scope, OpCode::BACKTRACK);
+    patch(scope, run_b, here(scope));
+    if (!emit_node(node->children[1], scope, err))
+      return false;
+    patch(scope, to_end, here(scope));
+    return true;
+  }
+  case NodeType::ARRAY: {
+    if (node->children.empty()) {
+      emit(scope, OpCode::LOAD_CONST,
+           prog_->pool.add_value(JvValue::array()));
+      return true;
+    }
+    int32_t slot = new_local(scope);
+    emit(scope, OpCode::COLLECT_BEGIN, slot);
+    size_t fork = emit(scope, OpCode::FORK);
+    if (!emit_node(node->children[0], scope, err))
+      return false;
+    emit(scope, OpCode::APPEND, slot);
+    patch(scope, fork, here(scope));
+    emit(scope, OpCode::LOAD_VAR, slot, 0);
+    return true;
+  }
+  case NodeType::OBJECT: {
+    emit(scope, OpCode::DUP);
+    emit(scope, OpCode::LOAD_CONST, prog_->pool.add_value(JvValue::object()));
+    for (size_t i = 0; i + 1 < node->children.size(); i += 2) {
+      emit(scope, OpCode::PICK, 1);
+      if (!emit_node(node->children[i], scope, err))
+        return false;
+      emit(scope, OpCode::PICK, 2);
+      if (!emit_node(node->children[i + 1], scope, err))
+        return false;
+      emit(scope, OpCode::OBJECT_INSERT);
+    }
+    emit(scope, OpCode::SWAP);
+    emit(scope, OpCode::POP);
+    return true;
+  }
+  case NodeType::VARIABLE: {
+    int32_t levels = 0;
+    for (Scope *s = &scope; s; s = s->parent, ++levels) {
+      for (auto it = s->vars.rbegin(); it != s->vars.rend(); ++it) {
+        if (it->first == node->name) {
+          emit(scope, OpCode::LOAD_VAR, it->second, levels);
+          return true;
+        }
+      }
+    }
+    err = "$" + node->name + " is not defined";
+    return false;
+  }
+  case NodeType::BINDING: {
+    if (node->children.size() != 2) {
+      err = "Binding expects 2 children";
+      return false;
+    }
+    int32_t slot = new_local(scope);
+    emit(scope, OpCode::DUP);
+    if (!emit_node(node->children[0], scope, err))
+      return false;
+    emit(scope, OpCode::STORE_VAR, slot, 0);
+    scope.vars.emplace_back(node->name, slot);
+    bool ok = emit_node(node->children[1], scope, err);
+    scope.vars.pop_back();
+    return ok;
+  }
+  case NodeType::REDUCE:
+  case NodeType::FOREACH: {
+    if (node->children.size() < 3) {
+      err = "reduce/foreach expects a source, an init and an update";
+      return false;
+    }
+    int32_t acc = new_local(scope);
+    int32_t var = new_local(scope);
+    emit(scope, OpCode::DUP);
+    if (!emit_node(node->children[1], scope, err))
+      return false;
+    emit(scope, OpCode::STORE_VAR, acc, 0);
+    size_t fork = 0;
+    if (node->type == NodeType::REDUCE)
+      fork = emit(scope, OpCode::FORK);
+    if (!emit_node(node->children[0], scope, err))
+      return false;
+    emit(scope, OpCode::STORE_VAR, var, 0);
+    emit(scope, OpCode::PUSH_VAR, acc, 0);
+    scope.vars.emplace_back(node->name, var);
+    bool ok = emit_node(node->children[2], scope, err);
+    if (ok && node->type == NodeType::REDUCE) {
+      emit(scope, OpCode::STORE_VAR, acc, 0);
+      emit(scope, OpCode::BACKTRACK);
+      patch(scope, fork, here(scope));
+      emit(scope, OpCode::LOAD_VAR, acc, 0);
+    } else if (ok) {
+      emit(scope, OpCode::DUP);
+      emit(scope, OpCode::STORE_VAR, acc, 0);
+      if (node->children.size() > 3)
+        ok = emit_node(node->children[3], scope, err);
+    }
+    scope.vars.pop_back();
+    return ok;
+  }
+  case NodeType::LABEL: {
+    // Labels live with the variables; the '*' keeps them apart from $names.
+    int32_t slot = new_local(scope);
+    emit(scope, OpCode::LABEL, slot);
+    scope.vars.emplace_back("*" + node->name, slot);
+    bool ok = emit_node(node->children[0], scope, err);
+    scope.vars.pop_back();
+    return ok;
+  }
+  case NodeType::BREAK: {
+    int32_t levels = 0;
+    for (Scope *s = &scope; s; s = s->parent, ++levels) {
+      for (auto it = s->vars.rbegin(); it != s->vars.rend(); ++it) {
+        if (it->first == "*" + node->name) {
+          emit(scope, OpCode::BREAK, it->second, levels);
+          return true;
+        }
+      }
+    }
+    err = "$*label-" + node->name + " is not defined";
+    return false;
+  }
+  case NodeType::FUNCTION_DEF: {
+    if (node->children.size() != 2) {
+      err = "Definition of " + node->name + " has no body";
+      return false;
+    }
+    int32_t func =
+        new_function(node->name, static_cast<int32_t>(node->params.size()));
+    scope.defs.emplace_back(arity_key(node->name, node->params.size()), func);
+    bool ok = emit_function(func, node, scope, err) &&
+              emit_node(node->children[1], scope, err);
+    scope.defs.pop_back();
+    return ok;
+  }
+  case NodeType::FUNCTION_CALL:
+    return emit_call(node, scope, err);
   default:
     err = "Unsupported AST node type";
     return false;
   }
 }
 
+// Body of a `def`. A $name parameter is a filter parameter bound to a
+// variable for each of its outputs: def f($a): body is def f(a): a as $a |
+// body.
+bool Compiler::emit_function(int32_t func, const ASTNodePtr &def,
+                             Scope &parent, std::string &err) {
+  Scope inner;
+  inner.parent = &parent;
+  inner.func = func;
+  for (const auto &param : def->params)
+    inner.params.push_back(param[0] == '$' ? param.substr(1) : param);
+
+  for (size_t i = 0; i < def->params.size(); ++i) {
+    if (def->params[i][0] != '$')
+      continue;
+    int32_t slot = new_local(inner);
+    emit(inner, OpCode::DUP);
+    emit(inner, OpCode::CALL_CLOSURE, static_cast<int32_t>(i), 0);
+    emit(inner, OpCode::STORE_VAR, slot, 0);
+    inner.vars.emplace_back(inner.params[i], slot);
+  }
+
+  if (!emit_node(def->children[0], inner, err))
+    return false;
+  emit(inner, OpCode::RET);
+  return true;
+}
+
+bool Compiler::prelude_function(const std::string &key, int32_t &func,
+                                std::string &err) {
+  auto done = prelude_.find(key);
+  if (done != prelude_.end()) {
+    func = done->second;
+    return true;
+  }
+  const auto &defs = prelude_defs();
+  auto it = defs.find(key);
+  if (it == defs.end())
+    return false;
+
+  const ASTNodePtr &def = it->second;
+  func = new_function(def->name, static_cast<int32_t>(def->params.size()));
+  prelude_[key] = func;
+  return emit_function(func, def, *prelude_scope_, err);
+}
+
+// Names resolve to the innermost definition or filter parameter, then to
+// native builtins, then to the prelude.
+bool Compiler::emit_call(const ASTNodePtr &node, Scope &scope,
+                         std::string &err) {
+  const size_t argc = node->children.size();
+  const std::string key = arity_key(node->name, argc);
+
+  int32_t levels = 0;
+  for (Scope *s = &scope; s; s = s->parent, ++levels) {
+    for (auto it = s->defs.rbegin(); it != s->defs.rend(); ++it) {
+      if (it->first == key)
+        return emit_jq_call(it->second, levels, node, scope, err);
+    }
+    if (argc == 0) {
+      for (size_t i = 0; i < s->params.size(); ++i) {
+        if (s->params[i] == node->name) {
+          emit(scope, OpCode::CALL_CLOSURE, static_cast<int32_t>(i), levels);
+          return true;
+        }
+      }
+    }
+  }
+
+  if (BuiltinPtr builtin = Builtins::find(node->name, static_cast<int>(argc))) {
+    if (argc == 0 && node->name == "length") {
+      emit(scope, OpCode::LENGTH);
+      return true;
+    }
+    if (argc == 0 && node->name == "empty") {
+      emit(scope, OpCode::BACKTRACK);
+      return true;
+    }
+    // Every argument reads the input: DUP arg0, PICK 1 arg1, PICK 2 arg2...
+    for (size_t i = 0; i < argc; ++i) {
+      emit(scope, i == 0 ? OpCode::DUP : OpCode::PICK,
+           i == 0 ? -1 : static_cast<int32_t>(i));
+      if (!emit_node(node->children[i], scope, err))
+        return false;
+    }
+    int bid = prog_->pool.add_builtin(builtin);
+    emit(scope, OpCode::BUILTIN_CALL, bid, static_cast<int32_t>(argc));
+    return true;
+  }
+
+  int32_t func = -1;
+  if (!prelude_function(key, func, err)) {
+    if (err.empty())
+      err = key + " is not defined";
+    return false;
+  }
+  // Prelude functions are defined in the outermost scope.
+  levels = 0;
+  for (Scope *s = scope.parent; s; s = s->parent)
+    ++levels;
+  return emit_jq_call(func, levels, node, scope, err);
+}
+
+// CALL_JQ followed by one closure per argument. An argument that is itself
+// a bare filter parameter is passed through instead of wrapped again.
+bool Compiler::emit_jq_call(int32_t func, int32_t levels,
+                            const ASTNodePtr &node, Scope &scope,
+                            std::string &err) {
+  std::vector<Instruction> args;
+  for (const auto &arg : node->children) {
+    bool passed = false;
+    if (arg->type == NodeType::FUNCTION_CALL && arg->children.empty()) {
+      const std::string key = arity_key(arg->name, 0);
+      int32_t up = 0;
+      for (Scope *s = &scope; s && !passed; s = s->parent, ++up) {
+        bool shadowed = false;
+        for (const auto &def : s->defs)
+          shadowed = shadowed || def.first == key;
+        if (shadowed)
+          break;
+        for (size_t i = 0; i < s->params.size(); ++i) {
+          if (s->params[i] == arg->name) {
+            args.push_back(
+                {OpCode::CLOSURE_PARAM, static_cast<int32_t>(i), up});
+            passed = true;
+            break;
+          }
+        }
+      }
+    }
+    if (passed)
+      continue;
+
+    int32_t closure = new_function("<closure>", 0);
+    Scope inner;
+    inner.parent = &scope;
+    inner.func = closure;
+    if (!emit_node(arg, inner, err))
+      return false;
+    emit(inner, OpCode::RET);
+    args.push_back({OpCode::CLOSURE_REF, closure, -1});
+  }
+
+  emit(scope, OpCode::CALL_JQ, func, levels);
+  for (const auto &ins : args)
+    emit(scope, ins.op, ins.a, ins.b);
+  return true;
+}
+
+// ---- Peephole optimization ----
+
+static bool is_path_step(OpCode op) {
+  return op == OpCode::GET_FIELD || op == OpCode::GET_INDEX_STR ||
+         op == OpCode::GET_INDEX_NUM || op == OpCode::GET_PATH;
+}
+
+// One output for one input, no failure, no stack effect: these can stand in
+// for the left operand of an operator whose right operand is a constant.
+static bool is_simple_operand(OpCode op) {
+  return is_path_step(op) || op == OpCode::LOAD_VAR || op == OpCode::LENGTH;
+}
+
+// One rewrite sweep over the whole program.
+static bool peephole(Program &prog) {
+  const std::vector<Instruction> &code = prog.code;
+  ConstantPool &pool = prog.pool;
+  const size_t n = code.size();
+
+  // a pattern may start at a jump target but must not run through one
+  std::vector<bool> target(n + 1, false);
+  for (const Function &fn : prog.functions)
+    target[fn.entry] = true;
+  for (const Instruction &ins : code) {
+    if (is_jump(ins.op))
+      target[static_cast<size_t>(ins.a)] = true;
+  }
+  auto match = [&](size_t i, std::initializer_list<OpCode> ops) {
+    if (i + ops.size() > n)
+      return false;
+    size_t k = 0;
+    for (OpCode op : ops) {
+      if (code[i + k].op != op || (k > 0 && target[i + k]))
+        return false;
+      ++k;
+    }
+    return true;
+  };
+  // length of the run of simple operands starting at `i`
+  auto simple_run = [&](size_t i) {
+    size_t end = i;
+    while (end < n && is_simple_operand(code[end].op) && !target[end])
+      ++end;
+    return static_cast<int32_t>(end - i);
+  };
+  // LOAD_CONST of a number or string, usable as GET_INDEX_NUM/STR
+  auto constant_key = [&](const Instruction &load) {
+    const JvValuePtr &v = pool.values[static_cast<size_t>(load.a)];
+    return v->is_number() || v->is_string();
+  };
+  auto index_step = [&](const Instruction &load) -> Instruction {
+    const JvValuePtr &v = pool.values[static_cast<size_t>(load.a)];
+    if (v->is_number())
+      return {OpCode::GET_INDEX_NUM, pool.add_number(v->n), -1};
+    return {OpCode::GET_INDEX_STR, pool.add_string(v->s), -1};
+  };
+  auto fold = [&](const Instruction &op, int32_t lhs, int32_t rhs,
+                  int32_t &out) {
+    JvValuePtr value;
+    std::string err; // failing operations are left for run time
+    if (!apply_binop(static_cast<BinOp>(op.a),
+                     pool.values[static_cast<size_t>(lhs)],
+                     pool.values[static_cast<size_t>(rhs)], value, err))
+      return false;
+    out = pool.add_value(value);
+    return true;
+  };
+
+  std::vector<Instruction> out;
+  out.reserve(n);
+  std::vector<size_t> moved(n + 1); // old index -> new index
+  bool changed = false;
+  for (size_t i = 0; i < n;) {
+    moved[i] = out.size();
+    size_t used = 1;
+    int32_t k = 0;
+    const Instruction &ins = code[i];
+    if (ins.op == OpCode::NOP || ins.op == OpCode::LOAD_IDENTITY) {
+      // nothing to emit
+    } else if (match(i, {OpCode::DUP, OpCode::LOAD_CONST, OpCode::SWAP,
+                         OpCode::LOAD_CONST, OpCode::BINOP}) &&
+               fold(code[i + 4], code[i + 3].a, code[i + 1].a, k)) {
+      out.push_back({OpCode::LOAD_CONST, k, -1}); // c1 op c2
+      used = 5;
+    } else if (match(i, {OpCode::LOAD_CONST, OpCode::PUSH_CONST,
+                         OpCode::BINOP}) &&
+               fold(code[i + 2], code[i + 1].a, ins.a, k)) {
+      out.push_back({OpCode::LOAD_CONST, k, -1}); // -c
+      used = 3;
+    } else if (match(i, {OpCode::DUP, OpCode::LOAD_CONST, OpCode::SWAP}) &&
+               (k = simple_run(i + 3)) >= 0 &&
+               match(i + 3 + k, {OpCode::BINOP}) && !target[i + 3 + k]) {
+      // x op c, where x is zero or more simple steps
+      out.insert(out.end(), code.begin() + i + 3, code.begin() + i + 3 + k);
+      out.push_back({OpCode::BINOP_CONST, code[i + 3 + k].a, code[i + 1].a});
+      used = 4 + k;
+    } else if (match(i, {OpCode::DUP, OpCode::LOAD_CONST, OpCode::INDEX}) &&
+               constant_key(code[i + 1])) {
+      out.push_back(index_step(code[i + 1])); // .[-1], .["a" + "b"]
+      used = 3;
+    } else if (match(i, {OpCode::DUP}) && i + 4 < n &&
+               is_simple_operand(code[i + 1].op) && !target[i + 1] &&
+               match(i + 2, {OpCode::SWAP, OpCode::LOAD_CONST, OpCode::INDEX}) &&
+               !target[i + 2] && constant_key(code[i + 3])) {
+      out.push_back(code[i + 1]); // $x[-1]
+      out.push_back(index_step(code[i + 3]));
+      used = 5;
+    } else if (is_path_step(ins.op)) {
+      size_t end = i + 1;
+      while (end < n && is_path_step(code[end].op) && !target[end])
+        ++end;
+      if (end - i > 1) {
+        std::vector<Instruction> steps;
+        for (size_t j = i; j < end; ++j) {
+          if (code[j].op == OpCode::GET_PATH) {
+            const auto &inner = pool.paths[static_cast<size_t>(code[j].a)];
+            steps.insert(steps.end(), inner.begin(), inner.end());
+          } else {
+            steps.push_back(code[j]);
+          }
+        }
+        out.push_back({OpCode::GET_PATH, pool.add_path(std::move(steps)), -1});
+        used = end - i;
+      } else {
+        out.push_back(ins);
+      }
+    } else {
+      out.push_back(ins);
+    }
+    if (used > 1 || out.size() == moved[i])
+      changed = true;
+    for (size_t j = 1; j < used; ++j)
+      moved[i + j] = out.size(); // never a target
+    i += used;
+  }
+  moved[n] = out.size();
+  if (!changed)
+    return false;
+
+  for (Instruction &ins : out) {
+    if (is_jump(ins.op))
+      ins.a = static_cast<int32_t>(moved[static_cast<size_t>(ins.a)]);
+  }
+  for (Function &fn : prog.functions)
+    fn.entry = moved[fn.entry];
+  prog.code = std::move(out);
+  return true;
+}
+
+bool optimize_program(Program &program) {
+  // each sweep can expose new patterns (a folded index fuses into a path)
+  bool changed = false;
+  for (int pass = 0; pass < 8 && peephole(program); ++pass)
+    changed = true;
+  return changed;
+}
+
 } // namespace jq
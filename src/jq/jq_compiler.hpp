@@ -1,22 +1,66 @@
 #ifndef JQ_COMPILER_HPP
 #define JQ_COMPILER_HPP
 
+#include "jq_bytecode.hpp"
 #include "jq_parser.hpp"
+#include <map>
 #include <string>
+#include <vector>
 
 namespace jq {
 
-struct Program;
-
+// Compiles an AST into a Program. Every `def`, every filter passed as an
+// argument and every jq-defined builtin (map, select, ...) becomes a
+// function of its own; native builtins are called by name.
 class Compiler {
 public:
   Compiler();
   bool compile(const ASTNodePtr &ast, Program &program, std::string &err);
 
+  // compile() finishes with optimize_program() unless this is turned off
+  void set_optimize(bool on) { optimize_ = on; }
+
 private:
-  bool emit_node(const ASTNodePtr &node, Program &program, std::string &err);
+  struct Scope;
+
+  // Code of one function while it is being compiled. Jump targets are
+  // relative to the body until compile() lays the bodies out.
+  struct Body {
+    std::vector<Instruction> code;
+    int32_t nlocals = 0;
+    int32_t nparams = 0;
+    std::string name;
+  };
+
+  Program *prog_ = nullptr;
+  std::vector<Body> bodies_;
+  std::map<std::string, int32_t> prelude_; // "name/arity" -> function
+  Scope *prelude_scope_ = nullptr;
+  bool optimize_ = true;
+
+  bool emit_node(const ASTNodePtr &node, Scope &scope, std::string &err);
+  bool emit_call(const ASTNodePtr &node, Scope &scope, std::string &err);
+  bool emit_jq_call(int32_t func, int32_t levels, const ASTNodePtr &node,
+                    Scope &scope, std::string &err);
+  bool emit_function(int32_t func, const ASTNodePtr &def, Scope &parent,
+                     std::string &err);
+  bool prelude_function(const std::string &key, int32_t &func,
+                        std::string &err);
+
+  size_t emit(Scope &scope, OpCode op, int32_t a = -1, int32_t b = -1);
+  size_t here(const Scope &scope) const;
+  void patch(Scope &scope, size_t at, size_t target);
+  int32_t new_local(Scope &scope);
+  int32_t new_function(const std::string &name, int32_t nparams);
 };
 
+// Peephole pass over a compiled program. Folds operators on constants,
+// drops identity steps, turns `. op constant` into BINOP_CONST, `.[k]` with a
+// computed constant k into a direct index, and runs of field/index steps into
+// one GET_PATH. Jump targets and function entries are kept valid. Returns
+// whether anything changed.
+bool optimize_program(Program &program);
+
 } // namespace jq
 
-#endif // JQ_COMPILER_HPP
\ No newline at end of file
+#endif // JQ_COMPILER_HPP
@@ -1,5 +1,6 @@
 #include "../../include/jq.hpp"
 #include "../../include/libjsonval.hpp"
+#include "../../include/metrics.hpp"
 #include "jq_builtins.hpp"
 #include "jq_bytecode.hpp"
 #include "jq_compiler.hpp"
@@ -8,11 +9,21 @@
 #include "jq_parser.hpp"
 #include "jq_types.hpp"
 
-namespace jq {
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 
-Engine::Engine() = default;
+namespace jq {
 
-bool Engine::compile(const std::string &filter, std::string &err) {
+// Lex, parse and compile `filter`. Builtins are resolved against the
+// current table, so later registrations do not affect the program.
+static bool compile_program(const std::string &filter, ASTNodePtr &ast,
+                            std::shared_ptr<Program> &program,
+                            std::string &err) {
+  metrics::Timer timer(metrics::JQ_COMPILE, filter.size());
   if (filter.empty()) {
     err = "jq filter cannot be empty";
     return false;
@@ -25,20 +36,20 @@ bool Engine::compile(const std::string &filter, std::string &err) {
 
     // Parse tokens into AST
     Parser parser(tokens);
-    ast_ = parser.parse();
+    ast = parser.parse();
 
-    if (!ast_) {
-      err = "Failed to parse jq filter";
+    if (!ast) {
+      err = "Failed to parse jq filter: " + parser.error();
       return false;
     }
 
     // Compile AST to bytecode Program using Compiler
     auto prog_ptr = std::make_shared<Program>();
     Compiler cc;
-    if (!cc.compile(ast_, *prog_ptr, err)) {
+    if (!cc.compile(ast, *prog_ptr, err)) {
       return false;
     }
-    program_ = prog_ptr;
+    program = prog_ptr;
 
     return true;
   } catch (const std::exception &e) {
@@ -47,41 +58,508 @@ bool Engine::compile(const std::string &filter, std::string &err) {
   }
 }
 
-bool Engine::run(const std::string &filter, const std::string &json_in,
-                 std::string &json_out, std::string &err) {
-  std::vector<std::string> outputs;
-  if (!run_streaming(filter, json_in, outputs, err)) {
+Engine::Engine() = default;
+
+bool Engine::compile(const std::string &filter, std::string &err) {
+  return compile_program(filter, ast_, program_, err);
+}
+
+bool Engine::compile(const std::string &filter, CompiledFilter &out,
+                     std::string &err) {
+  ASTNodePtr ast;
+  std::shared_ptr<Program> program;
+  if (!compile_program(filter, ast, program, err))
     return false;
+  out.path_only_ =
+      program->functions.size() <= 1 &&
+      std::all_of(program->code.begin(), program->code.end(),
+                  [](const Instruction &ins) {
+                    return ins.op == OpCode::LOAD_IDENTITY ||
+                           ins.op == OpCode::GET_PATH ||
+                           ins.op == OpCode::GET_FIELD ||
+                           ins.op == OpCode::GET_INDEX_STR ||
+                           ins.op == OpCode::GET_INDEX_NUM ||
+                           ins.op == OpCode::RET;
+                  });
+  out.program_ = std::move(program);
+  out.filter_ = filter;
+  return true;
+}
+
+// Compiled filters by filter text, most recently used first.
+namespace {
+struct FilterCache {
+  using Entry = std::pair<std::string, CompiledFilter>;
+  std::mutex mu;
+  std::list<Entry> lru;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index;
+  uint64_t generation = 0; // Builtins::generation() the entries were built at
+};
+} // namespace
+
+static constexpr size_t kFilterCacheCapacity = 64;
+
+static FilterCache &filter_cache() {
+  static FilterCache cache;
+  return cache;
+}
+
+bool Engine::compile_cached(const std::string &filter, CompiledFilter &out,
+                            std::string &err) {
+  FilterCache &c = filter_cache();
+  const uint64_t generation = Builtins::generation();
+  {
+    std::lock_guard<std::mutex> lock(c.mu);
+    if (c.generation != generation) {
+      // a builtin was registered since: programs may resolve differently
+      c.lru.clear();
+      c.index.clear();
+      c.generation = generation;
+    }
+    auto it = c.index.find(filter);
+    if (it != c.index.end()) {
+      c.lru.splice(c.lru.begin(), c.lru, it->second);
+      out = it->second->second;
+      metrics::count(metrics::JQ_CACHE_HIT);
+      return true;
+    }
   }
-  json_out = outputs.empty() ? "null" : outputs[0];
+  metrics::count(metrics::JQ_CACHE_MISS);
+
+  // compile outside the lock; a concurrent miss on the same text just
+  // compiles it twice
+  Engine engine;
+  CompiledFilter compiled;
+  if (!engine.compile(filter, compiled, err))
+    return false;
+
+  std::lock_guard<std::mutex> lock(c.mu);
+  auto it = c.index.find(filter);
+  if (it == c.index.end() && c.generation == generation) {
+    c.lru.emplace_front(filter, compiled);
+    c.index.emplace(filter, c.lru.begin());
+    if (c.lru.size() > kFilterCacheCapacity) {
+      c.index.erase(c.lru.back().first);
+      c.lru.pop_back();
+    }
+  }
+  out = std::move(compiled);
   return true;
 }
 
-bool Engine::run_streaming(const std::string &filter,
-                           const std::string &json_in,
-                           std::vector<std::string> &json_outputs,
-                           std::string &err) {
-  if (!compile(filter, err)) {
+void CompiledFilter::disassemble(std::ostream &out) const {
+  if (program_)
+    print_program(*program_, out);
+}
+
+bool CompiledFilter::run(const JvValuePtr &input,
+                         std::vector<JvValuePtr> &outputs,
+                         std::string &err) const {
+  if (!program_) {
+    err = "jq filter not compiled";
     return false;
   }
+  Executor executor;
+  return executor.execute(*program_, input, outputs, err);
+}
 
-  auto jv = JvValue::from_string(json_in, err);
-  if (!jv) {
-    err = "Invalid JSON input";
+bool CompiledFilter::run(const JsonView &input,
+                         std::vector<JvValuePtr> &outputs,
+                         std::string &err) const {
+  if (!program_) {
+    err = "jq filter not compiled";
+    return false;
+  }
+  Executor executor;
+  return executor.execute(*program_, input, outputs, err);
+}
+
+bool CompiledFilter::run(const JvValuePtr &input,
+                         const ValueCallback &on_output,
+                         std::string &err) const {
+  if (!program_) {
+    err = "jq filter not compiled";
     return false;
   }
+  Executor executor;
+  return executor.execute(*program_, input, on_output, err);
+}
 
+bool CompiledFilter::run(const JsonView &input, const ValueCallback &on_output,
+                         std::string &err) const {
+  if (!program_) {
+    err = "jq filter not compiled";
+    return false;
+  }
   Executor executor;
-  std::vector<JvValuePtr> outputs;
-  if (!executor.execute(*program_, jv, outputs, err)) {
+  return executor.execute(*program_, input, on_output, err);
+}
+
+// ---- On-demand path extraction ----
+// A path program only ever looks at one value per level, so instead of
+// parsing the whole input we walk the raw text: step into the wanted member
+// or element, hop over everything before it, and parse just the target.
+// Anything unexpected on the way (malformed text, escaped keys) gives up and
+// the caller takes the regular path, which also produces the error message.
+
+namespace {
+enum class PathScan { FOUND, MISSING, FALLBACK };
+}
+
+static size_t skip_ws(std::string_view s, size_t pos) {
+  while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' ||
+                            s[pos] == '\n' || s[pos] == '\r'))
+    ++pos;
+  return pos;
+}
+
+// `pos` is at an opening quote; returns the index past the closing one, or
+// npos if the string is unterminated.
+static size_t skip_string(std::string_view s, size_t pos) {
+  ++pos;
+  while (true) {
+    const void *q = std::memchr(s.data() + pos, '"', s.size() - pos);
+    if (!q)
+      return std::string_view::npos;
+    size_t end = static_cast<const char *>(q) - s.data();
+    size_t backslashes = 0;
+    while (end - backslashes > pos && s[end - backslashes - 1] == '\\')
+      ++backslashes;
+    if (backslashes % 2 == 0)
+      return end + 1;
+    pos = end + 1;
+  }
+}
+
+// Index past the value starting at `pos`, or npos if it is not well-formed
+// enough to skip. Containers are matched by depth; strings inside them are
+// jumped over so their brackets don't count.
+static size_t skip_value(std::string_view s, size_t pos) {
+  if (pos >= s.size())
+    return std::string_view::npos;
+  char c = s[pos];
+  if (c == '"')
+    return skip_string(s, pos);
+  if (c == '{' || c == '[') {
+    size_t depth = 0;
+    while (pos < s.size()) {
+      c = s[pos];
+      if (c == '"') {
+        pos = skip_string(s, pos);
+        if (pos == std::string_view::npos)
+          return pos;
+        continue;
+      }
+      if (c == '{' || c == '[') {
+        ++depth;
+      } else if (c == '}' || c == ']') {
+        if (--depth == 0)
+          return pos + 1;
+      }
+      ++pos;
+    }
+    return std::string_view::npos;
+  }
+  // number or literal: runs up to the next delimiter
+  size_t start = pos;
+  while (pos < s.size() && s[pos] != ',' && s[pos] != '}' && s[pos] != ']' &&
+         s[pos] != ' ' && s[pos] != '\t' && s[pos] != '\n' && s[pos] != '\r')
+    ++pos;
+  return pos > start ? pos : std::string_view::npos;
+}
+
+// Narrow [pos, end) to the member `key` of the object at `pos`. The whole
+// object is skimmed either way; `close` is set to the index past its '}'.
+static PathScan scan_member(std::string_view s, size_t &pos,
+                            const std::string &key, size_t &close) {
+  pos = skip_ws(s, pos + 1);
+  if (pos < s.size() && s[pos] == '}') {
+    close = pos + 1;
+    return PathScan::MISSING;
+  }
+  // with duplicate keys the last one wins, so a match only ends the scan
+  // once the object does
+  size_t found = std::string_view::npos;
+  while (pos < s.size() && s[pos] == '"') {
+    size_t key_end = skip_string(s, pos);
+    if (key_end == std::string_view::npos)
+      return PathScan::FALLBACK;
+    std::string_view name = s.substr(pos + 1, key_end - pos - 2);
+    if (name.find('\\') != std::string_view::npos)
+      return PathScan::FALLBACK; // escaped key, compare it decoded
+    pos = skip_ws(s, key_end);
+    if (pos >= s.size() || s[pos] != ':')
+      return PathScan::FALLBACK;
+    pos = skip_ws(s, pos + 1);
+    if (name == key)
+      found = pos;
+    pos = skip_value(s, pos);
+    if (pos == std::string_view::npos)
+      return PathScan::FALLBACK;
+    pos = skip_ws(s, pos);
+    if (pos < s.size() && s[pos] == '}') {
+      close = pos + 1;
+      if (found == std::string_view::npos)
+        return PathScan::MISSING;
+      pos = found;
+      return PathScan::FOUND;
+    }
+    if (pos >= s.size() || s[pos] != ',')
+      return PathScan::FALLBACK;
+    pos = skip_ws(s, pos + 1);
+  }
+  return PathScan::FALLBACK;
+}
+
+// Narrow to element `index` of the array at `pos`. When there is no such
+// element `pos` is left past the closing ']'.
+static PathScan scan_element(std::string_view s, size_t &pos, size_t index) {
+  pos = skip_ws(s, pos + 1);
+  if (pos < s.size() && s[pos] == ']') {
+    ++pos;
+    return PathScan::MISSING;
+  }
+  for (size_t i = 0;; ++i) {
+    if (i == index)
+      return pos < s.size() ? PathScan::FOUND : PathScan::FALLBACK;
+    pos = skip_value(s, pos);
+    if (pos == std::string_view::npos)
+      return PathScan::FALLBACK;
+    pos = skip_ws(s, pos);
+    if (pos < s.size() && s[pos] == ']') {
+      ++pos;
+      return PathScan::MISSING;
+    }
+    if (pos >= s.size() || s[pos] != ',')
+      return PathScan::FALLBACK;
+    pos = skip_ws(s, pos + 1);
+  }
+}
+
+static bool scalar_is_valid(std::string_view s, size_t pos) {
+  size_t end = skip_value(s, pos);
+  if (end == std::string_view::npos)
+    return false;
+  JsonDocument doc;
+  std::string err;
+  return parse_json_document(s.substr(pos, end - pos), doc, err);
+}
+
+// The text after the scanned part: skim to the end of the `open`
+// containers still around `pos`, then allow nothing but whitespace.
+static bool scan_rest(std::string_view s, size_t pos, size_t open) {
+  while (open > 0 && pos < s.size()) {
+    char c = s[pos];
+    if (c == '"') {
+      pos = skip_string(s, pos);
+      if (pos == std::string_view::npos)
+        return false;
+      continue;
+    }
+    if (c == '{' || c == '[')
+      ++open;
+    else if (c == '}' || c == ']')
+      --open;
+    ++pos;
+  }
+  return open == 0 && skip_ws(s, pos) == s.size();
+}
+
+// Follow a path program through `text`; on FOUND, [begin, end) is the target
+// value's text. Either result also requires the rest of the document to skim
+// cleanly, so trailing text after the top-level value falls back too.
+static PathScan scan_path(const Program &prog, std::string_view text,
+                          size_t &begin, size_t &end) {
+  size_t pos = skip_ws(text, 0);
+  size_t depth = 0;                      // containers entered so far
+  size_t rest = std::string_view::npos;  // skimmed up to here, if set...
+  size_t rest_open = 0;                  // ...with this many still open
+  auto step = [&](const Instruction &ins) {
+    if (pos >= text.size())
+      return PathScan::FALLBACK;
+    const char want = ins.op == OpCode::GET_INDEX_NUM ? '[' : '{';
+    if (text[pos] != want) {
+      // indexing the wrong kind of value gives null; a container would have
+      // to be checked in full, which is what the regular parse does
+      if (text[pos] == '{' || text[pos] == '[' ||
+          !scalar_is_valid(text, pos))
+        return PathScan::FALLBACK;
+      if (rest == std::string_view::npos) {
+        rest = skip_value(text, pos);
+        rest_open = depth;
+      }
+      return PathScan::MISSING;
+    }
+    PathScan r;
+    if (ins.op == OpCode::GET_INDEX_NUM) {
+      double idx = std::floor(prog.pool.numbers[static_cast<size_t>(ins.a)]);
+      if (!(idx >= 0)) // counts from the end, so it needs the length
+        return PathScan::FALLBACK;
+      // every element takes at least one character, so a bigger index is
+      // just as missing
+      idx = std::min(idx, static_cast<double>(text.size()));
+      r = scan_element(text, pos, static_cast<size_t>(idx));
+      if (r == PathScan::MISSING && rest == std::string_view::npos) {
+        rest = pos;
+        rest_open = depth;
+      }
+    } else {
+      size_t close = 0;
+      r = scan_member(text, pos, prog.pool.strings[static_cast<size_t>(ins.a)],
+                      close);
+      // the object was skimmed to its end, which covers every later step
+      if (r != PathScan::FALLBACK && rest == std::string_view::npos) {
+        rest = close;
+        rest_open = depth;
+      }
+    }
+    ++depth;
+    return r;
+  };
+  auto finish = [&](PathScan r) {
+    if (r == PathScan::FALLBACK || rest == std::string_view::npos ||
+        !scan_rest(text, rest, rest_open))
+      return PathScan::FALLBACK;
+    return r;
+  };
+  for (const auto &ins : prog.code) {
+    if (ins.op == OpCode::LOAD_IDENTITY || ins.op == OpCode::RET)
+      continue;
+    if (ins.op == OpCode::GET_PATH) {
+      for (const auto &part : prog.pool.paths[static_cast<size_t>(ins.a)]) {
+        PathScan r = step(part);
+        if (r != PathScan::FOUND)
+          return finish(r);
+      }
+      continue;
+    }
+    PathScan r = step(ins);
+    if (r != PathScan::FOUND)
+      return finish(r);
+  }
+  begin = pos;
+  end = skip_value(text, pos);
+  if (end == std::string_view::npos)
+    return PathScan::FALLBACK;
+  if (rest == std::string_view::npos) {
+    rest = end;
+    rest_open = depth;
+  }
+  return finish(PathScan::FOUND);
+}
+
+bool CompiledFilter::run(std::string_view json_in,
+                         const OutputCallback &on_output,
+                         std::string &err) const {
+  if (!program_) {
+    err = "jq filter not compiled";
+    return false;
+  }
+  if (path_only_) {
+    // the scan stands in for the executor, so it is charged as execution
+    metrics::Timer timer(metrics::JQ_EXECUTE);
+    size_t begin = 0, end = 0;
+    PathScan r = scan_path(*program_, json_in, begin, end);
+    JsonDocument target;
+    std::string perr;
+    if (r == PathScan::MISSING) {
+      on_output("null");
+      return true;
+    }
+    if (r == PathScan::FOUND &&
+        parse_json_document(json_in.substr(begin, end - begin), target,
+                            perr)) {
+      on_output(from_json_view(target.root())->to_string());
+      return true;
+    }
+  }
+
+  // the input is parsed once into a tape and read in place
+  JsonDocument doc;
+  if (!parse_json_document(json_in, doc, err)) {
+    err = "Invalid JSON input";
     return false;
   }
 
+  // every output is written into the same buffer
+  std::string text;
+  return run(
+      doc.root(),
+      [&on_output, &text](const JvValuePtr &out) {
+        text.clear();
+        write_json(out, text);
+        return on_output(text);
+      },
+      err);
+}
+
+bool CompiledFilter::run(std::string_view json_in,
+                         std::vector<std::string> &json_outputs,
+                         std::string &err) const {
   json_outputs.clear();
-  for (const auto &out : outputs) {
-    json_outputs.push_back(out ? out->to_string() : "null");
+  return run(
+      json_in,
+      [&json_outputs](std::string_view json) {
+        json_outputs.emplace_back(json);
+        return true;
+      },
+      err);
+}
+
+bool CompiledFilter::run(std::string_view json_in, FILE *out,
+                         std::string &err) const {
+  bool write_failed = false;
+  bool ok = run(
+      json_in,
+      [out, &write_failed](std::string_view json) {
+        if (std::fwrite(json.data(), 1, json.size(), out) != json.size() ||
+            std::fputc('\n', out) == EOF) {
+          write_failed = true;
+          return false;
+        }
+        return true;
+      },
+      err);
+  if (ok && write_failed) {
+    err = "Failed to write jq output";
+    return false;
   }
-  return true;
+  return ok;
+}
+
+bool Engine::run(const std::string &filter, const std::string &json_in,
+                 std::string &json_out, std::string &err) const {
+  // only the first output is wanted, so stop as soon as there is one
+  json_out = "null";
+  return run_streaming(
+      filter, json_in,
+      [&json_out](std::string_view json) {
+        json_out = json;
+        return false;
+      },
+      err);
+}
+
+bool Engine::run_streaming(const std::string &filter,
+                           const std::string &json_in,
+                           std::vector<std::string> &json_outputs,
+                           std::string &err) const {
+  CompiledFilter compiled;
+  if (!compile_cached(filter, compiled, err)) {
+    return false;
+  }
+  return compiled.run(json_in, json_outputs, err);
+}
+
+bool Engine::run_streaming(const std::string &filter,
+                           const std::string &json_in,
+                           const OutputCallback &on_output,
+                           std::string &err) const {
+  CompiledFilter compiled;
+  if (!compile_cached(filter, compiled, err)) {
+    return false;
+  }
+  return compiled.run(json_in, on_output, err);
 }
 
 void Engine::register_builtin(
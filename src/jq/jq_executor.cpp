@@ -1,124 +1,947 @@
 #include "jq_executor.hpp"
+#include "../../include/libjsonval.hpp"
+#include "../../include/metrics.hpp"
 #include "jq_builtins.hpp"
 
+#include <cmath>
+#include <string_view>
+#include <unordered_set>
+
 namespace jq {
 
+// While `value` is unset the executor is still looking at the input document
+// through `view`; it only copies a subtree out when something needs a
+// JvValue.
+struct Executor::Slot {
+  JsonView view;
+  JvValuePtr value;
+
+  bool borrowed() const { return !value; }
+
+  JvValuePtr get() const {
+    if (value)
+      return value;
+    return from_json_view(view);
+  }
+
+  bool truthy() const {
+    if (value)
+      return is_truthy(value);
+    switch (view.type()) {
+    case JsonValue::T_NULL:
+      return false;
+    case JsonValue::T_BOOL:
+      return view.as_bool();
+    default:
+      return true;
+    }
+  }
+};
+
+// Deep enough for every real filter; keeps runaway recursion from exhausting
+// memory instead of just failing.
+static constexpr size_t kMaxCallDepth = 10000;
+
+struct Executor::Machine {
+  struct Frame;
+  using FramePtr = std::shared_ptr<Frame>;
+
+  // A filter argument: the function to run and the frame it was written in.
+  struct Closure {
+    int32_t func = -1;
+    FramePtr env;
+  };
+
+  // One call of a function. Frames are shared, not copied, by the fork
+  // points taken inside them, so variable updates (reduce, [...]) survive
+  // backtracking.
+  struct Frame {
+    FramePtr env;    // frame of the enclosing definition
+    FramePtr caller; // where RET continues
+    size_t ret_pc = 0;
+    std::vector<Closure> params;
+    std::vector<Slot> locals;
+    size_t depth = 0;
+  };
+
+  enum class Fork : uint8_t {
+    RESUME, // continue at pc
+    TRY,    // error handler at pc; skipped by backtracking
+    ARRAY,  // next element of `array`
+    LIST,   // next value of `list`
+    VIEW,   // next element of a document array
+    LABEL,  // target of BREAK, label number `next`; skipped by backtracking
+  };
+
+  struct ForkPoint {
+    Fork kind = Fork::RESUME;
+    size_t pc = 0;
+    std::vector<Slot> stack;
+    FramePtr frame;
+    size_t try_depth = 0;
+
+    JvValuePtr array;
+    std::vector<JvValuePtr> list;
+    size_t next = 0;
+    JsonView::Iterator it, end;
+  };
+
+  enum class Step { NEXT, BACK, FAIL, STOP };
+
+  const Program &prog;
+  const OutputSink &sink;
+  std::vector<Slot> stack;
+  std::vector<ForkPoint> forks;
+  FramePtr frame;
+  size_t pc = 0;
+  size_t try_depth = 0; // try blocks open on the current path
+  size_t labels = 0;    // LABELs run so far, numbering them
+
+  Machine(const Program &p, const OutputSink &s) : prog(p), sink(s) {}
+
+  bool exec(std::string &err);
+  template <bool kCountOps> bool exec_steps(std::string &err, uint64_t *ops);
+  Step step(std::string &err);
+  Step ret();
+  Step call(int32_t func, FramePtr env, std::string &err);
+  Step iterate(std::string &err);
+  void path_step(Slot &current, const Instruction &ins) const;
+
+  ForkPoint &fork(Fork kind, size_t at) {
+    forks.emplace_back();
+    ForkPoint &f = forks.back();
+    f.kind = kind;
+    f.pc = at;
+    f.stack = stack;
+    f.frame = frame;
+    f.try_depth = try_depth;
+    return f;
+  }
+
+  bool backtrack();
+  void resume(ForkPoint &f, Slot top, bool last);
+  bool raise(const std::string &msg, const JvValuePtr &value);
+
+  const FramePtr &up(int32_t levels) const {
+    const FramePtr *f = &frame;
+    for (int32_t i = 0; i < levels && (*f)->env; ++i)
+      f = &(*f)->env;
+    return *f;
+  }
+};
+
 bool Executor::execute(const Program &prog, const JvValuePtr &input,
                        std::vector<JvValuePtr> &outputs, std::string &err) {
   outputs.clear();
-  return exec_range(prog, 0, prog.code.size(), input, outputs, err);
+  return execute(
+      prog, input,
+      [&outputs](const JvValuePtr &out) {
+        outputs.push_back(out);
+        return true;
+      },
+      err);
 }
 
-bool Executor::exec_range(const Program &prog, size_t start, size_t end,
-                          const JvValuePtr &input,
-                          std::vector<JvValuePtr> &outputs, std::string &err) {
-  JvValuePtr current = input;
+bool Executor::execute(const Program &prog, const JsonView &input,
+                       std::vector<JvValuePtr> &outputs, std::string &err) {
+  outputs.clear();
+  return execute(
+      prog, input,
+      [&outputs](const JvValuePtr &out) {
+        outputs.push_back(out);
+        return true;
+      },
+      err);
+}
 
-  for (size_t i = start; i < end; ++i) {
-    const auto &ins = prog.code[i];
+bool Executor::execute(const Program &prog, const JvValuePtr &input,
+                       const OutputSink &sink, std::string &err) {
+  Slot start;
+  start.value = input ? input : JvValue::null();
+  return run(prog, start, sink, err);
+}
 
-    switch (ins.op) {
-    case OpCode::LOAD_IDENTITY:
-      // Keep current value
-      break;
+bool Executor::execute(const Program &prog, const JsonView &input,
+                       const OutputSink &sink, std::string &err) {
+  Slot start;
+  start.view = input;
+  return run(prog, start, sink, err);
+}
 
-    case OpCode::GET_FIELD: {
-      if (!current || !current->is_object()) {
-        current = JvValue::null();
-      } else {
-        const auto &key = prog.pool.strings[static_cast<size_t>(ins.a)];
-        current = current->object_get(key);
+bool Executor::run(const Program &prog, const Slot &input,
+                   const OutputSink &sink, std::string &err) {
+  Machine m(prog, sink);
+  m.frame = std::make_shared<Machine::Frame>();
+  if (!prog.functions.empty()) {
+    m.pc = prog.functions[0].entry;
+    m.frame->locals.resize(static_cast<size_t>(prog.functions[0].nlocals));
+  }
+  m.stack.push_back(input);
+  return m.exec(err);
+}
+
+bool Executor::Machine::exec(std::string &err) {
+  metrics::Timer timer(metrics::JQ_EXECUTE);
+  if (!metrics::enabled())
+    return exec_steps<false>(err, nullptr);
+  uint64_t ops[kOpCodeCount] = {};
+  bool ok = exec_steps<true>(err, ops);
+  metrics::add_opcodes(ops, kOpCodeCount);
+  return ok;
+}
+
+// The run loop. With kCountOps it also counts the instructions executed per
+// opcode into `ops`; the plain instantiation has no trace of that.
+template <bool kCountOps>
+bool Executor::Machine::exec_steps(std::string &err, uint64_t *ops) {
+  std::string error;
+  while (true) {
+    if (kCountOps && pc < prog.code.size())
+      ++ops[static_cast<size_t>(prog.code[pc].op)];
+    switch (step(error)) {
+    case Step::NEXT:
+      break;
+    case Step::STOP:
+      return true;
+    case Step::BACK:
+      if (!backtrack())
+        return true;
+      break;
+    case Step::FAIL:
+      if (!raise(error, builtins::take_error_value(error))) {
+        err = error;
+        return false;
       }
+      error.clear();
       break;
     }
+  }
+}
 
-    case OpCode::GET_INDEX_STR: {
-      if (!current || !current->is_object()) {
-        current = JvValue::null();
-      } else {
-        const auto &key = prog.pool.strings[static_cast<size_t>(ins.a)];
-        current = current->object_get(key);
-      }
+// Resume the most recent fork point. Try handlers are dropped on the way:
+// backtracking out of a try body is not an error.
+bool Executor::Machine::backtrack() {
+  while (!forks.empty()) {
+    ForkPoint &f = forks.back();
+    switch (f.kind) {
+    case Fork::RESUME:
+      pc = f.pc;
+      frame = std::move(f.frame);
+      try_depth = f.try_depth;
+      stack = std::move(f.stack);
+      forks.pop_back();
+      return true;
+    case Fork::TRY:
+    case Fork::LABEL:
+      forks.pop_back();
       break;
+    case Fork::ARRAY: {
+      Slot top;
+      top.value = f.array->a[f.next++];
+      resume(f, std::move(top), f.next >= f.array->a.size());
+      return true;
+    }
+    case Fork::LIST: {
+      Slot top;
+      top.value = f.list[f.next++];
+      resume(f, std::move(top), f.next >= f.list.size());
+      return true;
+    }
+    case Fork::VIEW: {
+      Slot top;
+      top.view = *f.it;
+      ++f.it;
+      resume(f, std::move(top), f.it == f.end);
+      return true;
     }
+    }
+  }
+  return false;
+}
+
+// Continue an iteration fork point with its next value on top of the saved
+// stack; the last value consumes the fork point.
+void Executor::Machine::resume(ForkPoint &f, Slot top, bool last) {
+  pc = f.pc;
+  frame = f.frame;
+  try_depth = f.try_depth;
+  if (last) {
+    stack = std::move(f.stack);
+    forks.pop_back();
+  } else {
+    stack = f.stack;
+  }
+  stack.back() = std::move(top);
+}
+
+// Unwind to the innermost try block still open on the current path and
+// run its handler with the error as input: `value` when the error carried
+// one (error/1), else the message. Everything forked since is abandoned.
+bool Executor::Machine::raise(const std::string &msg,
+                              const JvValuePtr &value) {
+  while (!forks.empty()) {
+    ForkPoint &f = forks.back();
+    if (f.kind == Fork::TRY && f.try_depth < try_depth) {
+      pc = f.pc;
+      frame = std::move(f.frame);
+      try_depth = f.try_depth;
+      stack = std::move(f.stack);
+      forks.pop_back();
+      Slot top;
+      top.value = value ? value : JvValue::string(msg);
+      if (stack.empty())
+        stack.push_back(std::move(top));
+      else
+        stack.back() = std::move(top);
+      return true;
+    }
+    forks.pop_back();
+  }
+  return false;
+}
 
-    case OpCode::GET_INDEX_NUM: {
-      if (!current || !current->is_array()) {
-        current = JvValue::null();
+Executor::Machine::Step Executor::Machine::ret() {
+  if (frame->caller) {
+    FramePtr caller = frame->caller;
+    pc = frame->ret_pc;
+    frame = std::move(caller);
+    return Step::NEXT;
+  }
+  // End of the main function: one output.
+  if (!sink(stack.back().get()))
+    return Step::STOP;
+  return Step::BACK;
+}
+
+Executor::Machine::Step Executor::Machine::call(int32_t func, FramePtr env,
+                                                std::string &err) {
+  if (frame->depth >= kMaxCallDepth) {
+    err = "Maximum call depth exceeded";
+    return Step::FAIL;
+  }
+  const Function &fn = prog.functions[static_cast<size_t>(func)];
+  auto callee = std::make_shared<Frame>();
+  callee->env = std::move(env);
+  callee->caller = frame;
+  callee->depth = frame->depth + 1;
+  callee->locals.resize(static_cast<size_t>(fn.nlocals));
+
+  // CALL_JQ is followed by its closure arguments.
+  size_t at = pc + 1;
+  if (prog.code[pc].op == OpCode::CALL_JQ) {
+    for (int32_t i = 0; i < fn.nparams; ++i, ++at) {
+      const Instruction &arg = prog.code[at];
+      if (arg.op == OpCode::CLOSURE_REF) {
+        callee->params.push_back({arg.a, frame});
       } else {
-        double idx = prog.pool.numbers[static_cast<size_t>(ins.a)];
-        size_t i = static_cast<size_t>(idx);
-        current = current->array_index(i);
+        callee->params.push_back(
+            up(arg.b)->params[static_cast<size_t>(arg.a)]);
       }
-      break;
     }
+  }
+  callee->ret_pc = at;
+  frame = std::move(callee);
+  pc = fn.entry;
+  return Step::NEXT;
+}
+
+static JsonView view_index(const JsonView &array, size_t i) {
+  for (const JsonView &elem : array) {
+    if (i-- == 0)
+      return elem;
+  }
+  return JsonView();
+}
+
+// Member count as JvValue::o sees it, i.e. with duplicate keys folded.
+static size_t view_object_size(const JsonView &obj) {
+  std::unordered_set<std::string_view> keys;
+  for (auto it = obj.begin(); it != obj.end(); ++it)
+    keys.insert(it.key());
+  return keys.size();
+}
+
+// Array element by number: negative indices count from the end, fractions
+// round down. Anything but an array reads as null.
+static JvValuePtr array_at(const JvValuePtr &array, double idx) {
+  if (!array->is_array())
+    return JvValue::null();
+  idx = std::floor(idx);
+  if (idx < 0)
+    idx += static_cast<double>(array->a.size());
+  if (!(idx >= 0 && idx < static_cast<double>(array->a.size())))
+    return JvValue::null(); // also NaN
+  return array->a[static_cast<size_t>(idx)];
+}
+
+static JsonView view_at(const JsonView &array, double idx) {
+  if (array.type() != JsonValue::T_ARRAY)
+    return JsonView();
+  idx = std::floor(idx);
+  const double n = static_cast<double>(array.size());
+  if (idx < 0)
+    idx += n;
+  if (!(idx >= 0 && idx < n))
+    return JsonView(); // also NaN
+  return view_index(array, static_cast<size_t>(idx));
+}
+
+// Slice bounds as jq computes them: null means the whole range, negative
+// counts from the end, the start rounds down and the end up.
+static void slice_bounds(const JvValuePtr &from, const JvValuePtr &to,
+                         size_t len, size_t &start, size_t &end) {
+  double n = static_cast<double>(len);
+  double s = from->is_number() ? std::floor(from->n) : 0;
+  double e = to->is_number() ? std::ceil(to->n) : n;
+  if (s < 0)
+    s += n;
+  if (e < 0)
+    e += n;
+  s = std::min(std::max(s, 0.0), n);
+  e = std::min(std::max(e, s), n);
+  start = static_cast<size_t>(s);
+  end = static_cast<size_t>(e);
+}
+
+// Byte offset of codepoint `index` in UTF-8 text, or s.size() past the end.
+static size_t utf8_offset(std::string_view s, size_t index) {
+  for (size_t i = 0; i < s.size(); ++i) {
+    if ((static_cast<unsigned char>(s[i]) & 0xC0) != 0x80 && index-- == 0)
+      return i;
+  }
+  return s.size();
+}
+
+static JvValuePtr deep_merge(const JvValuePtr &a, const JvValuePtr &b) {
+  auto out = std::make_shared<JvValue>(*a);
+  for (const auto &kv : b->o) {
+    const JvValuePtr *mine = out->o.find(kv.first);
+    if (mine && (*mine)->is_object() && kv.second->is_object())
+      out->o.set(kv.first, deep_merge(*mine, kv.second));
+    else
+      out->o.set(kv.first, kv.second);
+  }
+  return out;
+}
+
+static bool binop_error(const char *what, const JvValuePtr &l,
+                        const JvValuePtr &r, std::string &err) {
+  err = describe_value(l) + " and " + describe_value(r) + " cannot be " + what;
+  return false;
+}
 
-    case OpCode::ITERATE: {
-      // Expand array into multiple outputs
-      if (!current || !current->is_array()) {
-        // Non-arrays pass through as single output
-        outputs.push_back(current ? current : JvValue::null());
+// lhs <op> rhs with jq's semantics for each type pairing.
+bool apply_binop(BinOp op, const JvValuePtr &l, const JvValuePtr &r,
+                 JvValuePtr &out, std::string &err) {
+  switch (op) {
+  case BinOp::ADD:
+    if (l->is_null()) {
+      out = r;
+    } else if (r->is_null()) {
+      out = l;
+    } else if (l->is_number() && r->is_number()) {
+      out = JvValue::number(l->n + r->n);
+    } else if (l->is_string() && r->is_string()) {
+      out = JvValue::string(l->s + r->s);
+    } else if (l->is_array() && r->is_array()) {
+      out = std::make_shared<JvValue>(*l);
+      out->a.insert(out->a.end(), r->a.begin(), r->a.end());
+    } else if (l->is_object() && r->is_object()) {
+      out = std::make_shared<JvValue>(*l);
+      out->o.merge(r->o);
+    } else {
+      return binop_error("added", l, r, err);
+    }
+    return true;
+  case BinOp::SUB:
+    if (l->is_number() && r->is_number()) {
+      out = JvValue::number(l->n - r->n);
+    } else if (l->is_array() && r->is_array()) {
+      out = JvValue::array();
+      for (const auto &elem : l->a) {
+        bool drop = false;
+        for (const auto &other : r->a)
+          drop = drop || values_equal(elem, other);
+        if (!drop)
+          out->array_push(elem);
+      }
+    } else {
+      return binop_error("subtracted", l, r, err);
+    }
+    return true;
+  case BinOp::MUL:
+    if (l->is_number() && r->is_number()) {
+      out = JvValue::number(l->n * r->n);
+    } else if ((l->is_string() && r->is_number()) ||
+               (l->is_number() && r->is_string())) {
+      const JvValuePtr &str = l->is_string() ? l : r;
+      double times = l->is_string() ? r->n : l->n;
+      if (times <= 0) {
+        out = JvValue::null();
       } else {
-        // Array iterates each element
-        for (const auto &elem : current->a) {
-          outputs.push_back(elem);
-        }
+        std::string repeated;
+        for (double i = 0; i < std::max(1.0, std::floor(times)); ++i)
+          repeated += str->s;
+        out = JvValue::string(repeated);
       }
-      return true;
+    } else if (l->is_object() && r->is_object()) {
+      out = deep_merge(l, r);
+    } else {
+      return binop_error("multiplied", l, r, err);
+    }
+    return true;
+  case BinOp::DIV:
+    if (l->is_number() && r->is_number()) {
+      if (r->n == 0)
+        return binop_error("divided because the divisor is zero", l, r, err);
+      out = JvValue::number(l->n / r->n);
+    } else if (l->is_string() && r->is_string()) {
+      std::vector<JvValuePtr> parts;
+      if (!Builtins::call_builtin("split", l, {r}, parts, err))
+        return false;
+      out = parts.empty() ? JvValue::array() : parts[0];
+    } else {
+      return binop_error("divided", l, r, err);
     }
+    return true;
+  case BinOp::MOD: {
+    if (!l->is_number() || !r->is_number())
+      return binop_error("divided", l, r, err);
+    long long a = static_cast<long long>(l->n);
+    long long b = static_cast<long long>(r->n);
+    if (b == 0)
+      return binop_error("divided because the divisor is zero", l, r, err);
+    out = JvValue::number(b == -1 ? 0.0 : static_cast<double>(a % b));
+    return true;
+  }
+  case BinOp::EQ:
+    out = JvValue::boolean(values_equal(l, r));
+    return true;
+  case BinOp::NE:
+    out = JvValue::boolean(!values_equal(l, r));
+    return true;
+  case BinOp::LT:
+    out = JvValue::boolean(compare_values(l, r) < 0);
+    return true;
+  case BinOp::LE:
+    out = JvValue::boolean(compare_values(l, r) <= 0);
+    return true;
+  case BinOp::GT:
+    out = JvValue::boolean(compare_values(l, r) > 0);
+    return true;
+  case BinOp::GE:
+    out = JvValue::boolean(compare_values(l, r) >= 0);
+    return true;
+  }
+  err = "Unknown binary operator";
+  return false;
+}
 
-    case OpCode::ADD_CONST: {
-      if (!current || !current->is_number()) {
-        current = JvValue::null();
-      } else {
-        double k = prog.pool.numbers[static_cast<size_t>(ins.a)];
-        current = JvValue::number(current->n + k);
+// .[] on the top of the stack: the first element replaces it, a fork point
+// yields the rest. Document arrays are walked in place.
+Executor::Machine::Step Executor::Machine::iterate(std::string &err) {
+  Slot &top = stack.back();
+  if (top.borrowed() && top.view.type() == JsonValue::T_ARRAY) {
+    JsonView array = top.view;
+    auto it = array.begin(), end = array.end();
+    if (it == end)
+      return Step::BACK;
+    JsonView first = *it;
+    if (++it != end) {
+      ForkPoint &f = fork(Fork::VIEW, pc + 1);
+      f.it = it;
+      f.end = end;
+    }
+    stack.back().view = first;
+    ++pc;
+    return Step::NEXT;
+  }
+
+  JvValuePtr value = top.get();
+  if (value->is_array()) {
+    if (value->a.empty())
+      return Step::BACK;
+    if (value->a.size() > 1) {
+      ForkPoint &f = fork(Fork::ARRAY, pc + 1);
+      f.array = value;
+      f.next = 1;
+    }
+    stack.back().value = value->a[0];
+  } else if (value->is_object()) {
+    if (value->o.empty())
+      return Step::BACK;
+    std::vector<JvValuePtr> members;
+    members.reserve(value->o.size());
+    for (const auto &kv : value->o)
+      members.push_back(kv.second);
+    if (members.size() > 1) {
+      ForkPoint &f = fork(Fork::LIST, pc + 1);
+      f.list = members;
+      f.next = 1;
+    }
+    stack.back().value = members[0];
+  } else {
+    err = std::string("Cannot iterate over ") + type_name(value);
+    return Step::FAIL;
+  }
+  ++pc;
+  return Step::NEXT;
+}
+
+// .name, ."name" or .[n] on `current`; the wrong kind of value gives null
+void Executor::Machine::path_step(Slot &current,
+                                  const Instruction &ins) const {
+  if (ins.op == OpCode::GET_INDEX_NUM) {
+    double idx = prog.pool.numbers[static_cast<size_t>(ins.a)];
+    if (current.borrowed())
+      current.view = view_at(current.view, idx);
+    else
+      current.value = array_at(current.value, idx);
+    return;
+  }
+  const auto &key = prog.pool.keys[static_cast<size_t>(ins.a)];
+  if (current.borrowed()) {
+    JsonView member;
+    if (!current.view.find(key.str(), member))
+      member = JsonView(); // not an object, or no such key: null
+    current.view = member;
+  } else if (!current.value->is_object()) {
+    current.value = JvValue::null();
+  } else {
+    current.value = current.value->object_get(key);
+  }
+}
+
+Executor::Machine::Step Executor::Machine::step(std::string &err) {
+  // Straight-line programs without a function table just end.
+  if (pc >= prog.code.size())
+    return ret();
+
+  const Instruction &ins = prog.code[pc];
+  switch (ins.op) {
+  case OpCode::NOP:
+  case OpCode::LOAD_IDENTITY:
+    // Keep current value
+    break;
+
+  case OpCode::GET_FIELD:
+  case OpCode::GET_INDEX_STR:
+  case OpCode::GET_INDEX_NUM:
+    path_step(stack.back(), ins);
+    break;
+
+  case OpCode::GET_PATH: {
+    Slot &current = stack.back();
+    for (const Instruction &step : prog.pool.paths[static_cast<size_t>(ins.a)])
+      path_step(current, step);
+    break;
+  }
+
+  case OpCode::ITERATE:
+    return iterate(err);
+
+  case OpCode::ADD_CONST: {
+    double k = prog.pool.numbers[static_cast<size_t>(ins.a)];
+    Slot &current = stack.back();
+    if (current.borrowed() ? current.view.type() != JsonValue::T_NUMBER
+                           : !current.value->is_number()) {
+      current.value = JvValue::null();
+    } else {
+      double n =
+          current.borrowed() ? current.view.as_number() : current.value->n;
+      current.value = JvValue::number(n + k);
+    }
+    break;
+  }
+
+  case OpCode::LENGTH: {
+    Slot &current = stack.back();
+    size_t len = 0;
+    if (current.borrowed()) {
+      switch (current.view.type()) {
+      case JsonValue::T_STRING:
+        len = builtins::utf8_length(current.view.as_string());
+        break;
+      case JsonValue::T_ARRAY:
+        len = current.view.size();
+        break;
+      case JsonValue::T_OBJECT:
+        len = view_object_size(current.view);
+        break;
+      default:
+        break;
       }
-      break;
+    } else if (current.value->is_string()) {
+      len = builtins::utf8_length(current.value->s);
+    } else if (current.value->is_array()) {
+      len = current.value->a.size();
+    } else if (current.value->is_object()) {
+      len = current.value->o.size();
+    }
+    current.value = JvValue::number(static_cast<double>(len));
+    break;
+  }
+
+  case OpCode::BUILTIN_CALL: {
+    // ins.a holds the pool index of the builtin, resolved at compile time,
+    // ins.b the argument count; the arguments sit above the input
+    const Builtin &builtin = *prog.pool.builtins[static_cast<size_t>(ins.a)];
+    size_t argc = ins.b > 0 ? static_cast<size_t>(ins.b) : 0;
+    std::vector<JvValuePtr> args(argc);
+    for (size_t i = argc; i-- > 0;) {
+      args[i] = stack.back().get();
+      stack.pop_back();
+    }
+    // the input leaves its slot, so a value nothing else refers to can be
+    // reused in place by the builtin
+    Slot &top = stack.back();
+    JvValuePtr input =
+        top.borrowed() ? from_json_view(top.view) : std::move(top.value);
+    std::vector<JvValuePtr> results;
+    if (!builtin.call_owned(input, args, results, err))
+      return Step::FAIL;
+    if (results.empty())
+      return Step::BACK;
+    if (results.size() > 1) {
+      ForkPoint &f = fork(Fork::LIST, pc + 1);
+      f.list = results;
+      f.next = 1;
+    }
+    stack.back().value = results[0] ? results[0] : JvValue::null();
+    break;
+  }
+
+  case OpCode::LOAD_CONST:
+    stack.back() = Slot{JsonView(),
+                        prog.pool.values[static_cast<size_t>(ins.a)]};
+    break;
+
+  case OpCode::PUSH_CONST:
+    stack.push_back(
+        Slot{JsonView(), prog.pool.values[static_cast<size_t>(ins.a)]});
+    break;
+
+  case OpCode::DUP:
+    stack.push_back(stack.back());
+    break;
+
+  case OpCode::PICK:
+    stack.push_back(stack[stack.size() - 1 - static_cast<size_t>(ins.a)]);
+    break;
+
+  case OpCode::POP:
+    stack.pop_back();
+    break;
+
+  case OpCode::SWAP:
+    std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+    break;
+
+  case OpCode::JUMP:
+    pc = static_cast<size_t>(ins.a);
+    return Step::NEXT;
+
+  case OpCode::JUMP_IF_FALSE: {
+    bool truthy = stack.back().truthy();
+    stack.pop_back();
+    pc = truthy ? pc + 1 : static_cast<size_t>(ins.a);
+    return Step::NEXT;
+  }
+
+  case OpCode::FORK:
+    fork(Fork::RESUME, static_cast<size_t>(ins.a));
+    break;
+
+  case OpCode::BACKTRACK:
+    return Step::BACK;
+
+  case OpCode::TRY_BEGIN:
+    fork(Fork::TRY, static_cast<size_t>(ins.a));
+    ++try_depth;
+    break;
+
+  case OpCode::TRY_END:
+    --try_depth;
+    break;
+
+  case OpCode::LABEL: {
+    forks.emplace_back();
+    forks.back().kind = Fork::LABEL;
+    forks.back().next = ++labels;
+    frame->locals[static_cast<size_t>(ins.a)] =
+        Slot{JsonView(), JvValue::number(static_cast<double>(labels))};
+    break;
+  }
+
+  case OpCode::BREAK: {
+    // Everything the label's body left to try is dropped, so the label
+    // produces no more outputs.
+    const Slot &var = up(ins.b)->locals[static_cast<size_t>(ins.a)];
+    size_t label = var.value ? static_cast<size_t>(var.value->n) : 0;
+    size_t at = forks.size();
+    while (at > 0 && !(forks[at - 1].kind == Fork::LABEL &&
+                       forks[at - 1].next == label))
+      --at;
+    if (at == 0) {
+      err = "break: label is no longer active";
+      return Step::FAIL;
     }
+    forks.resize(at - 1);
+    return Step::BACK;
+  }
+
+  case OpCode::STORE_VAR:
+    up(ins.b)->locals[static_cast<size_t>(ins.a)] = std::move(stack.back());
+    stack.pop_back();
+    break;
+
+  case OpCode::LOAD_VAR:
+    stack.back() = up(ins.b)->locals[static_cast<size_t>(ins.a)];
+    break;
+
+  case OpCode::PUSH_VAR:
+    stack.push_back(up(ins.b)->locals[static_cast<size_t>(ins.a)]);
+    break;
+
+  case OpCode::COLLECT_BEGIN:
+    frame->locals[static_cast<size_t>(ins.a)] = Slot{JsonView(),
+                                                     JvValue::array()};
+    break;
 
-    case OpCode::LENGTH: {
-      if (!current) {
-        current = JvValue::number(0);
-      } else if (current->is_string()) {
-        current = JvValue::number(static_cast<double>(current->s.size()));
-      } else if (current->is_array()) {
-        current = JvValue::number(static_cast<double>(current->a.size()));
-      } else if (current->is_object()) {
-        current = JvValue::number(static_cast<double>(current->o.size()));
+  case OpCode::APPEND: {
+    JvValuePtr &array = frame->locals[static_cast<size_t>(ins.a)].value;
+    if (array.use_count() > 1)
+      array = std::make_shared<JvValue>(*array);
+    array->a.push_back(stack.back().get());
+    stack.pop_back();
+    return Step::BACK;
+  }
+
+  case OpCode::OBJECT_INSERT: {
+    JvValuePtr value = stack.back().get();
+    stack.pop_back();
+    JvValuePtr key = stack.back().get();
+    stack.pop_back();
+    if (!key->is_string()) {
+      err = "Object keys must be strings";
+      return Step::FAIL;
+    }
+    Slot &obj = stack.back();
+    if (obj.borrowed())
+      obj.value = obj.get();
+    if (obj.value.use_count() > 1)
+      obj.value = std::make_shared<JvValue>(*obj.value);
+    obj.value->o.set(key->s, value);
+    break;
+  }
+
+  case OpCode::INDEX: {
+    JvValuePtr idx = stack.back().get();
+    stack.pop_back();
+    Slot &base = stack.back();
+    if (idx->is_string()) {
+      if (base.borrowed()) {
+        JsonView member;
+        if (!base.view.find(idx->s, member))
+          member = JsonView();
+        base.view = member;
       } else {
-        current = JvValue::number(0);
+        base.value = base.value->object_get(idx->s);
       }
-      break;
+    } else if (idx->is_number()) {
+      if (base.borrowed())
+        base.view = view_at(base.view, idx->n);
+      else
+        base.value = array_at(base.value, idx->n);
+    } else {
+      base = Slot{JsonView(), JvValue::null()};
     }
+    break;
+  }
 
-    case OpCode::BUILTIN_CALL: {
-      // ins.a holds string pool index of builtin name
-      const auto &name = prog.pool.strings[static_cast<size_t>(ins.a)];
-      std::vector<JvValuePtr> builtin_outputs;
-      if (!Builtins::call_builtin(name, current, builtin_outputs, err)) {
-        return false;
+  case OpCode::SLICE: {
+    JvValuePtr from = stack.back().get();
+    stack.pop_back();
+    Slot base = std::move(stack.back());
+    stack.pop_back();
+    JvValuePtr to = stack.back().get();
+    JvValuePtr out;
+    if (base.borrowed() && base.view.type() == JsonValue::T_ARRAY) {
+      size_t start, end;
+      slice_bounds(from, to, base.view.size(), start, end);
+      out = JvValue::array();
+      size_t i = 0;
+      for (const JsonView &elem : base.view) {
+        if (i >= end)
+          break;
+        if (i++ >= start)
+          out->array_push(from_json_view(elem));
       }
-      // Replace current with first output if any; add rest to outputs
-      if (!builtin_outputs.empty()) {
-        current = builtin_outputs[0];
-        for (size_t j = 1; j < builtin_outputs.size(); ++j) {
-          outputs.push_back(builtin_outputs[j]);
-        }
+    } else {
+      JvValuePtr value = base.get();
+      size_t start, end;
+      if (value->is_null()) {
+        out = value;
+      } else if (value->is_array()) {
+        slice_bounds(from, to, value->a.size(), start, end);
+        out = JvValue::array();
+        out->a.assign(value->a.begin() + static_cast<ptrdiff_t>(start),
+                      value->a.begin() + static_cast<ptrdiff_t>(end));
+      } else if (value->is_string()) {
+        // jq indexes strings by codepoint, not by byte
+        std::string_view text = value->s;
+        slice_bounds(from, to, builtins::utf8_length(text), start, end);
+        size_t begin = utf8_offset(text, start);
+        size_t stop = begin + utf8_offset(text.substr(begin), end - start);
+        out = JvValue::string(std::string(text.substr(begin, stop - begin)));
       } else {
-        current = JvValue::null();
+        err = std::string("Cannot index ") + type_name(value) +
+              " with object";
+        return Step::FAIL;
       }
-      break;
     }
+    stack.back() = Slot{JsonView(), out};
+    break;
+  }
 
-    default:
-      err = "Unknown opcode";
-      return false;
-    }
+  case OpCode::BINOP: {
+    JvValuePtr lhs = stack.back().get();
+    stack.pop_back();
+    JvValuePtr rhs = stack.back().get();
+    JvValuePtr out;
+    if (!apply_binop(static_cast<BinOp>(ins.a), lhs, rhs, out, err))
+      return Step::FAIL;
+    stack.back() = Slot{JsonView(), out};
+    break;
+  }
+
+  case OpCode::BINOP_CONST: {
+    JvValuePtr out;
+    if (!apply_binop(static_cast<BinOp>(ins.a), stack.back().get(),
+                     prog.pool.values[static_cast<size_t>(ins.b)], out, err))
+      return Step::FAIL;
+    stack.back() = Slot{JsonView(), out};
+    break;
+  }
+
+  case OpCode::CALL_JQ:
+    return call(ins.a, up(ins.b), err);
+
+  case OpCode::CALL_CLOSURE: {
+    const Closure &c = up(ins.b)->params[static_cast<size_t>(ins.a)];
+    return call(c.func, c.env, err);
+  }
+
+  case OpCode::RET:
+    return ret();
+
+  default:
+    err = "Unknown opcode";
+    return Step::FAIL;
   }
 
-  outputs.push_back(current ? current : JvValue::null());
-  return true;
+  ++pc;
+  return Step::NEXT;
 }
 
 } // namespace jq
@@ -3,6 +3,7 @@
 
 #include "jq_bytecode.hpp"
 #include "jq_types.hpp"
+#include <functional>
 #include <vector>
 
 namespace jq {
@@ -10,18 +11,43 @@ namespace jq {
 // Stream-based executor: a single filter can yield multiple outputs.
 class Executor {
 public:
+  // Receives each output as soon as it is produced; returning false stops
+  // the run early (which still counts as success).
+  using OutputSink = std::function<bool(const JvValuePtr &)>;
+
   // Execute program against input and collect outputs.
   // Returns true if execution succeeds; outputs holds result values.
   bool execute(const Program &prog, const JvValuePtr &input,
                std::vector<JvValuePtr> &outputs, std::string &err);
 
+  // Same, but reading the input in place from a parsed JsonDocument. Only
+  // the values the program outputs (or hands to a builtin) are copied into
+  // JvValues; the document must outlive the call.
+  bool execute(const Program &prog, const JsonView &input,
+               std::vector<JvValuePtr> &outputs, std::string &err);
+
+  // Same, handing each output to `sink` instead of collecting them.
+  bool execute(const Program &prog, const JvValuePtr &input,
+               const OutputSink &sink, std::string &err);
+  bool execute(const Program &prog, const JsonView &input,
+               const OutputSink &sink, std::string &err);
+
 private:
-  // Helper to execute a range of instructions with a given current value.
-  bool exec_range(const Program &prog, size_t start, size_t end,
-                  const JvValuePtr &input, std::vector<JvValuePtr> &outputs,
-                  std::string &err);
+  // Stack entry: a view into the input document, or a JvValue.
+  struct Slot;
+  // Registers, stack, frames and fork points of one run.
+  struct Machine;
+
+  // Run the program from its entry point until every fork point is
+  // exhausted, passing on what reaches the end of the main function.
+  bool run(const Program &prog, const Slot &input, const OutputSink &sink,
+           std::string &err);
 };
 
+// lhs <op> rhs as BINOP computes it; the compiler uses it to fold constants.
+bool apply_binop(BinOp op, const JvValuePtr &lhs, const JvValuePtr &rhs,
+                 JvValuePtr &out, std::string &err);
+
 } // namespace jq
 
 #endif // JQ_EXECUTOR_HPP
@@ -85,11 +85,57 @@ Token Lexer::read_number() {
   return Token(TokenType::NUMBER, num, start_line, start_col);
 }
 
+static void append_utf8(std::string &out, unsigned cp) {
+  if (cp < 0x80) {
+    out += static_cast<char>(cp);
+  } else if (cp < 0x800) {
+    out += static_cast<char>(0xC0 | (cp >> 6));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    out += static_cast<char>(0xE0 | (cp >> 12));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else {
+    out += static_cast<char>(0xF0 | (cp >> 18));
+    out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  }
+}
+
+// The four hex digits of a \u escape starting at input[at], or -1
+long Lexer::hex4(size_t at) const {
+  if (at + 4 > input.size())
+    return -1;
+  long cp = 0;
+  for (size_t i = at; i < at + 4; ++i) {
+    char c = input[i];
+    int digit = std::isdigit(static_cast<unsigned char>(c)) ? c - '0'
+                : c >= 'a' && c <= 'f'                      ? c - 'a' + 10
+                : c >= 'A' && c <= 'F'                      ? c - 'A' + 10
+                                                            : -1;
+    if (digit < 0)
+      return -1;
+    cp = cp * 16 + digit;
+  }
+  return cp;
+}
+
+// String literals take JSON's escapes. Interpolation is not supported, so
+// \( is an error rather than a literal parenthesis; so is any other unknown
+// escape and a string left open.
 Token Lexer::read_string() {
   size_t start_line = line;
   size_t start_col = column;
   advance(); // Skip opening quote
 
+  auto fail = [&](const std::string &msg) {
+    return Token(TokenType::ERROR,
+                 msg + " at line " + std::to_string(start_line) +
+                     ", column " + std::to_string(start_col),
+                 start_line, start_col);
+  };
+
   std::string str;
   while (current() != '"' && current() != '\0') {
     if (current() == '\\') {
@@ -119,10 +165,34 @@ Token Lexer::read_string() {
       case 'f':
         str += '\f';
         break;
-      default:
-        str += current();
+      case 'u': {
+        // a high surrogate pairs with a following \uDC00-\uDFFF escape; one
+        // left unpaired becomes U+FFFD, as in JSON input
+        long cp = hex4(pos + 1);
+        if (cp < 0)
+          return fail("Invalid \\u escape in string");
+        for (int i = 0; i < 4; ++i)
+          advance();
+        if (cp >= 0xD800 && cp <= 0xDBFF && peek() == '\\' &&
+            peek(2) == 'u') {
+          long lo = hex4(pos + 3);
+          if (lo >= 0xDC00 && lo <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            for (int i = 0; i < 6; ++i)
+              advance();
+          }
+        }
+        if (cp >= 0xD800 && cp <= 0xDFFF)
+          cp = 0xFFFD;
+        append_utf8(str, static_cast<unsigned>(cp));
         break;
       }
+      case '(':
+        return fail("String interpolation is not supported");
+      default:
+        return fail(std::string("Invalid escape \\") + current() +
+                    " in string");
+      }
       advance();
     } else {
       str += current();
@@ -130,8 +200,9 @@ Token Lexer::read_string() {
     }
   }
 
-  if (current() == '"')
-    advance();
+  if (current() != '"')
+    return fail("Unterminated string");
+  advance();
 
   return Token(TokenType::STRING, str, start_line, start_col);
 }
@@ -179,9 +250,9 @@ Token Lexer::next_token() {
   if (ch == '\0')
     return Token(TokenType::EOF_TOKEN, "", tok_line, tok_col);
 
-  // Numbers
-  if (std::isdigit(static_cast<unsigned char>(ch)) ||
-      (ch == '-' && std::isdigit(static_cast<unsigned char>(peek())))) {
+  // Numbers ('-' is always an operator, so `.a-1` is a subtraction; the
+  // parser folds `-1` into a literal)
+  if (std::isdigit(static_cast<unsigned char>(ch))) {
     return read_number();
   }
 
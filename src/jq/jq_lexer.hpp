@@ -65,7 +65,7 @@ enum class TokenType {
 
   // End
   EOF_TOKEN,
-  ERROR
+  ERROR // value: the offending character, or a message for a bad string
 };
 
 struct Token {
@@ -100,6 +100,7 @@ private:
 
   Token read_number();
   Token read_string();
+  long hex4(size_t at) const;
   Token read_identifier();
 };
 
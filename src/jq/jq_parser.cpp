@@ -49,20 +49,105 @@ void Parser::advance() {
     ++pos;
 }
 
+static const char *token_name(TokenType type) {
+  switch (type) {
+  case TokenType::PIPE:
+    return "'|'";
+  case TokenType::COMMA:
+    return "','";
+  case TokenType::SEMICOLON:
+    return "';'";
+  case TokenType::COLON:
+    return "':'";
+  case TokenType::LPAREN:
+    return "'('";
+  case TokenType::RPAREN:
+    return "')'";
+  case TokenType::LBRACKET:
+    return "'['";
+  case TokenType::RBRACKET:
+    return "']'";
+  case TokenType::LBRACE:
+    return "'{'";
+  case TokenType::RBRACE:
+    return "'}'";
+  case TokenType::IDENTIFIER:
+    return "identifier";
+  default:
+    return "token";
+  }
+}
+
 bool Parser::expect(TokenType type) {
   if (current().type != type) {
-    error_msg = "Expected token type at line " + std::to_string(current().line);
-    return false;
+    error_msg = std::string("Expected ") + token_name(type) + " at line " +
+                std::to_string(current().line) + ", column " +
+                std::to_string(current().column);
+    throw std::runtime_error(error_msg);
   }
   advance();
   return true;
 }
 
+bool Parser::at_keyword(const char *word) const {
+  return current().type == TokenType::IDENTIFIER && current().value == word;
+}
+
+void Parser::expect_keyword(const char *word) {
+  if (!at_keyword(word)) {
+    error_msg = std::string("Expected '") + word + "' at line " +
+                std::to_string(current().line) + ", column " +
+                std::to_string(current().column);
+    throw std::runtime_error(error_msg);
+  }
+  advance();
+}
+
+// Words that end or continue a construct and so never start a term.
+static bool is_reserved(const std::string &word) {
+  return word == "then" || word == "elif" || word == "else" ||
+         word == "end" || word == "as" || word == "catch";
+}
+
+// A word written directly after `dot` names a field; keywords and the
+// literal words are valid field names too (`.end`, `.null`). Separated by
+// whitespace it is not part of the path, so `if . then` stays `.`.
+static bool is_field_name(const Token &tok, const Token &dot) {
+  switch (tok.type) {
+  case TokenType::IDENTIFIER:
+    if (tok.value[0] == '$')
+      return false;
+    break;
+  case TokenType::TRUE:
+  case TokenType::FALSE:
+  case TokenType::NULL_VALUE:
+  case TokenType::AND:
+  case TokenType::OR:
+  case TokenType::NOT:
+    break;
+  default:
+    return false;
+  }
+  return tok.line == dot.line && tok.column == dot.column + 1;
+}
+
 ASTNodePtr Parser::parse() {
+  // The lexer stops at the first error, so it can only be the last token
+  if (!tokens.empty() && tokens.back().type == TokenType::ERROR) {
+    const Token &bad = tokens.back();
+    error_msg = bad.value.size() == 1
+                    ? "Unexpected character '" + bad.value + "' at line " +
+                          std::to_string(bad.line) + ", column " +
+                          std::to_string(bad.column)
+                    : bad.value;
+    return nullptr;
+  }
   try {
     auto result = parse_pipe();
     if (current().type != TokenType::EOF_TOKEN) {
       error_msg = "Unexpected token after expression";
+      if (!current().value.empty())
+        error_msg += ": " + current().value;
       return nullptr;
     }
     return result;
@@ -72,14 +157,19 @@ ASTNodePtr Parser::parse() {
   }
 }
 
-// Parse pipe operations: expr | expr
+// Parse pipe operations: expr | expr (right associative, like jq)
 ASTNodePtr Parser::parse_pipe() {
+  if (at_keyword("def")) {
+    auto def = parse_def();
+    def->children.push_back(parse_pipe());
+    return def;
+  }
+
   auto left = parse_comma();
 
-  while (current().type == TokenType::PIPE) {
+  if (current().type == TokenType::PIPE) {
     advance();
-    auto right = parse_comma();
-    left = ASTNode::make_pipe(left, right);
+    return ASTNode::make_pipe(left, parse_pipe());
   }
 
   return left;
@@ -103,16 +193,46 @@ ASTNodePtr Parser::parse_comma() {
   return node;
 }
 
-// Parse alternative operator: expr // expr
+// Parse alternative operator: expr // expr (right associative)
 ASTNodePtr Parser::parse_alternative() {
-  auto left = parse_comparison();
+  auto left = parse_or();
 
-  while (current().type == TokenType::DOUBLE_SLASH) {
+  if (current().type == TokenType::DOUBLE_SLASH) {
     advance();
-    auto right = parse_comparison();
     auto node = std::make_shared<ASTNode>(NodeType::ALTERNATIVE);
     node->children.push_back(left);
-    node->children.push_back(right);
+    node->children.push_back(parse_alternative());
+    return node;
+  }
+
+  return left;
+}
+
+// Parse boolean operators: expr or expr, expr and expr
+ASTNodePtr Parser::parse_or() {
+  auto left = parse_and();
+
+  while (current().type == TokenType::OR) {
+    advance();
+    auto node = std::make_shared<ASTNode>(NodeType::BINARY_OP);
+    node->op = "or";
+    node->children.push_back(left);
+    node->children.push_back(parse_and());
+    left = node;
+  }
+
+  return left;
+}
+
+ASTNodePtr Parser::parse_and() {
+  auto left = parse_comparison();
+
+  while (current().type == TokenType::AND) {
+    advance();
+    auto node = std::make_shared<ASTNode>(NodeType::BINARY_OP);
+    node->op = "and";
+    node->children.push_back(left);
+    node->children.push_back(parse_comparison());
     left = node;
   }
 
@@ -181,48 +301,68 @@ ASTNodePtr Parser::parse_multiplicative() {
   return left;
 }
 
+// Parse a bracket suffix: [] / [index] / [start:end], with either end of a
+// slice optional. `base` is null for a leading `.[...]`.
+ASTNodePtr Parser::parse_index(ASTNodePtr base) {
+  expect(TokenType::LBRACKET);
+  ASTNodePtr node;
+  if (current().type == TokenType::RBRACKET) {
+    advance();
+    node = std::make_shared<ASTNode>(NodeType::ITERATOR);
+  } else {
+    ASTNodePtr index_expr;
+    if (current().type != TokenType::COLON)
+      index_expr = parse_pipe();
+    if (current().type == TokenType::COLON) {
+      advance();
+      ASTNodePtr end_expr;
+      if (current().type != TokenType::RBRACKET)
+        end_expr = parse_pipe();
+      node = std::make_shared<ASTNode>(NodeType::SLICE);
+      node->children.push_back(
+          index_expr ? index_expr : ASTNode::make_literal(JvValue::null()));
+      node->children.push_back(
+          end_expr ? end_expr : ASTNode::make_literal(JvValue::null()));
+    } else {
+      node = std::make_shared<ASTNode>(NodeType::INDEX);
+      node->children.push_back(index_expr);
+    }
+    expect(TokenType::RBRACKET);
+    // The index expressions see the same input as the base, as in
+    // `.a[.i]`, so the base is kept as the last child instead of piped in.
+    if (base)
+      node->children.push_back(base);
+    return node;
+  }
+  return base ? ASTNode::make_pipe(base, node) : node;
+}
+
 // Parse postfix operations: field access, indexing, etc.
-ASTNodePtr Parser::parse_postfix() {
+ASTNodePtr Parser::parse_postfix(bool allow_binding) {
   auto base = parse_primary();
 
   while (true) {
     if (current().type == TokenType::DOT) {
+      const Token dot = current();
       advance();
 
-      // .identifier
-      if (current().type == TokenType::IDENTIFIER) {
+      // .identifier (written without a space, so `. then` stays `.`)
+      if (is_field_name(current(), dot)) {
         auto field = ASTNode::make_field(current().value);
         advance();
 
         auto pipe = ASTNode::make_pipe(base, field);
         base = pipe;
       }
-      // .[]
-      else if (current().type == TokenType::LBRACKET) {
+      // ."quoted key"
+      else if (current().type == TokenType::STRING) {
+        auto field = ASTNode::make_field(current().value);
         advance();
-        if (current().type == TokenType::RBRACKET) {
-          advance();
-          auto iter = std::make_shared<ASTNode>(NodeType::ITERATOR);
-          base = ASTNode::make_pipe(base, iter);
-        } else {
-          // .[index] or .[start:end]
-          auto index_expr = parse_pipe();
-
-          if (current().type == TokenType::COLON) {
-            advance();
-            auto end_expr = parse_pipe();
-            auto slice = std::make_shared<ASTNode>(NodeType::SLICE);
-            slice->children.push_back(index_expr);
-            slice->children.push_back(end_expr);
-            expect(TokenType::RBRACKET);
-            base = ASTNode::make_pipe(base, slice);
-          } else {
-            expect(TokenType::RBRACKET);
-            auto index = std::make_shared<ASTNode>(NodeType::INDEX);
-            index->children.push_back(index_expr);
-            base = ASTNode::make_pipe(base, index);
-          }
-        }
+        base = ASTNode::make_pipe(base, field);
+      }
+      // .[] / .[index] / .[start:end]
+      else if (current().type == TokenType::LBRACKET) {
+        base = parse_index(base);
       }
       // Just . (identity on result of base)
       else {
@@ -232,23 +372,30 @@ ASTNodePtr Parser::parse_postfix() {
     }
     // Direct [index] without dot
     else if (current().type == TokenType::LBRACKET) {
+      base = parse_index(base);
+    }
+    // term? is try term
+    else if (current().type == TokenType::QUESTION) {
       advance();
-      if (current().type == TokenType::RBRACKET) {
-        advance();
-        auto iter = std::make_shared<ASTNode>(NodeType::ITERATOR);
-        base = ASTNode::make_pipe(base, iter);
-      } else {
-        auto index_expr = parse_pipe();
-        expect(TokenType::RBRACKET);
-        auto index = std::make_shared<ASTNode>(NodeType::INDEX);
-        index->children.push_back(index_expr);
-        base = ASTNode::make_pipe(base, index);
-      }
+      auto node = std::make_shared<ASTNode>(NodeType::TRY);
+      node->children.push_back(base);
+      base = node;
     } else {
       break;
     }
   }
 
+  // term as $name | body
+  if (allow_binding && at_keyword("as")) {
+    advance();
+    auto node = std::make_shared<ASTNode>(NodeType::BINDING);
+    node->name = parse_variable_name("as");
+    expect(TokenType::PIPE);
+    node->children.push_back(base);
+    node->children.push_back(parse_pipe());
+    return node;
+  }
+
   return base;
 }
 
@@ -288,29 +435,23 @@ ASTNodePtr Parser::parse_primary() {
     advance();
 
     // .identifier
-    if (current().type == TokenType::IDENTIFIER) {
+    if (is_field_name(current(), tok)) {
       auto field = ASTNode::make_field(current().value);
       advance();
       return field;
     }
-    // .[]
-    else if (current().type == TokenType::LBRACKET) {
+    // ."quoted key"
+    if (current().type == TokenType::STRING) {
+      auto field = ASTNode::make_field(current().value);
       advance();
-      if (current().type == TokenType::RBRACKET) {
-        advance();
-        return std::make_shared<ASTNode>(NodeType::ITERATOR);
-      } else {
-        auto index_expr = parse_pipe();
-        expect(TokenType::RBRACKET);
-        auto index = std::make_shared<ASTNode>(NodeType::INDEX);
-        index->children.push_back(index_expr);
-        return index;
-      }
+      return field;
     }
-    // Just .
-    else {
-      return ASTNode::make_identity();
+    // .[] / .[index] / .[start:end]
+    if (current().type == TokenType::LBRACKET) {
+      return parse_index(nullptr);
     }
+    // Just .
+    return ASTNode::make_identity();
   }
 
   // Recursive descent
@@ -337,9 +478,56 @@ ASTNodePtr Parser::parse_primary() {
     return parse_object();
   }
 
-  // Function call or identifier
+  // Variables, keywords, function calls
   if (tok.type == TokenType::IDENTIFIER) {
     std::string name = tok.value;
+
+    if (name.size() > 1 && name[0] == '$') {
+      advance();
+      auto node = std::make_shared<ASTNode>(NodeType::VARIABLE);
+      node->name = name.substr(1);
+      return node;
+    }
+    if (name == "if")
+      return parse_if();
+    if (name == "reduce")
+      return parse_reduce(NodeType::REDUCE);
+    if (name == "foreach")
+      return parse_reduce(NodeType::FOREACH);
+    if (name == "def") {
+      auto def = parse_def();
+      def->children.push_back(parse_pipe());
+      return def;
+    }
+    if (name == "label") {
+      advance();
+      auto node = std::make_shared<ASTNode>(NodeType::LABEL);
+      node->name = parse_variable_name("label");
+      expect(TokenType::PIPE);
+      node->children.push_back(parse_pipe());
+      return node;
+    }
+    if (name == "break") {
+      advance();
+      auto node = std::make_shared<ASTNode>(NodeType::BREAK);
+      node->name = parse_variable_name("break");
+      return node;
+    }
+    if (name == "try") {
+      advance();
+      auto node = std::make_shared<ASTNode>(NodeType::TRY);
+      node->children.push_back(parse_postfix(false));
+      if (at_keyword("catch")) {
+        advance();
+        node->children.push_back(parse_postfix(false));
+      }
+      return node;
+    }
+    if (is_reserved(name)) {
+      error_msg = "Unexpected keyword: " + name;
+      throw std::runtime_error(error_msg);
+    }
+
     advance();
 
     if (current().type == TokenType::LPAREN) {
@@ -356,23 +544,28 @@ ASTNodePtr Parser::parse_primary() {
   if (tok.type == TokenType::MINUS) {
     advance();
     auto operand = parse_postfix();
+    if (operand->type == NodeType::LITERAL && operand->literal &&
+        operand->literal->is_number()) {
+      return ASTNode::make_literal(JvValue::number(-operand->literal->n));
+    }
     auto node = std::make_shared<ASTNode>(NodeType::UNARY_OP);
     node->op = "-";
     node->children.push_back(operand);
     return node;
   }
 
-  // NOT
+  // not is a filter in jq: `.a | not`
   if (tok.type == TokenType::NOT) {
     advance();
-    auto operand = parse_postfix();
-    auto node = std::make_shared<ASTNode>(NodeType::UNARY_OP);
-    node->op = "not";
-    node->children.push_back(operand);
+    auto node = std::make_shared<ASTNode>(NodeType::FUNCTION_CALL);
+    node->name = "not";
     return node;
   }
 
-  error_msg = "Unexpected token in primary: " + tok.value;
+  if (tok.type == TokenType::EOF_TOKEN)
+    error_msg = "Unexpected end of filter";
+  else
+    error_msg = "Unexpected token in primary: " + tok.value;
   throw std::runtime_error(error_msg);
 }
 
@@ -396,26 +589,48 @@ ASTNodePtr Parser::parse_object() {
 
   while (current().type != TokenType::RBRACE &&
          current().type != TokenType::EOF_TOKEN) {
-    // Parse key
+    // Parse key; {name}, {"name"} and {$name} are shorthand for name: .name
+    // (or $name)
     ASTNodePtr key;
-    if (current().type == TokenType::STRING) {
-      key = ASTNode::make_literal(JvValue::string(current().value));
-      advance();
-    } else if (current().type == TokenType::IDENTIFIER) {
-      key = ASTNode::make_literal(JvValue::string(current().value));
+    ASTNodePtr shorthand;
+    if (current().type == TokenType::STRING ||
+        current().type == TokenType::IDENTIFIER) {
+      std::string name = current().value;
+      bool variable = current().type == TokenType::IDENTIFIER &&
+                      name.size() > 1 && name[0] == '$';
+      if (variable) {
+        name = name.substr(1);
+        shorthand = std::make_shared<ASTNode>(NodeType::VARIABLE);
+        shorthand->name = name;
+      } else {
+        shorthand = ASTNode::make_field(name);
+      }
+      key = ASTNode::make_literal(JvValue::string(name));
       advance();
     } else if (current().type == TokenType::LPAREN) {
       advance();
       key = parse_pipe();
       expect(TokenType::RPAREN);
     } else {
-      break;
+      error_msg = "Invalid object key: " + current().value;
+      throw std::runtime_error(error_msg);
     }
 
-    expect(TokenType::COLON);
-
-    // Parse value
-    auto value = parse_pipe();
+    ASTNodePtr value;
+    if (current().type == TokenType::COLON) {
+      advance();
+      // values stop at ',' so they don't swallow the next member; pipes of
+      // such terms are allowed as in jq
+      value = parse_alternative();
+      while (current().type == TokenType::PIPE) {
+        advance();
+        value = ASTNode::make_pipe(value, parse_alternative());
+      }
+    } else if (shorthand) {
+      value = shorthand;
+    } else {
+      expect(TokenType::COLON);
+    }
 
     node->children.push_back(key);
     node->children.push_back(value);
@@ -450,4 +665,92 @@ ASTNodePtr Parser::parse_function_call(const std::string &name) {
   return node;
 }
 
+// def name: body;  or  def name(f; $v): body;
+// The caller appends the expression the definition is visible in.
+ASTNodePtr Parser::parse_def() {
+  expect_keyword("def");
+  if (current().type != TokenType::IDENTIFIER || current().value[0] == '$' ||
+      is_reserved(current().value)) {
+    error_msg = "Expected function name after 'def'";
+    throw std::runtime_error(error_msg);
+  }
+  auto node = std::make_shared<ASTNode>(NodeType::FUNCTION_DEF);
+  node->name = current().value;
+  advance();
+
+  if (current().type == TokenType::LPAREN) {
+    advance();
+    while (true) {
+      if (current().type != TokenType::IDENTIFIER) {
+        error_msg = "Expected parameter name in definition of " + node->name;
+        throw std::runtime_error(error_msg);
+      }
+      node->params.push_back(current().value);
+      advance();
+      if (current().type != TokenType::SEMICOLON)
+        break;
+      advance();
+    }
+    expect(TokenType::RPAREN);
+  }
+
+  expect(TokenType::COLON);
+  node->children.push_back(parse_pipe());
+  expect(TokenType::SEMICOLON);
+  return node;
+}
+
+// if c then a (elif c then a)* (else b)? end
+ASTNodePtr Parser::parse_if() {
+  advance(); // "if" or "elif"
+  auto node = std::make_shared<ASTNode>(NodeType::CONDITIONAL);
+  node->condition = parse_pipe();
+  expect_keyword("then");
+  node->then_branch = parse_pipe();
+
+  if (at_keyword("elif")) {
+    node->else_branch = parse_if(); // consumes the matching "end"
+    return node;
+  }
+  if (at_keyword("else")) {
+    advance();
+    node->else_branch = parse_pipe();
+  }
+  expect_keyword("end");
+  return node;
+}
+
+// The $name after a keyword, without the $
+std::string Parser::parse_variable_name(const char *after) {
+  if (current().type != TokenType::IDENTIFIER ||
+      current().value.size() < 2 || current().value[0] != '$') {
+    error_msg = std::string("Expected $name after '") + after + "'";
+    throw std::runtime_error(error_msg);
+  }
+  std::string name = current().value.substr(1);
+  advance();
+  return name;
+}
+
+// reduce term as $x (init; update)
+// foreach term as $x (init; update; extract)
+ASTNodePtr Parser::parse_reduce(NodeType type) {
+  advance(); // "reduce" / "foreach"
+  auto node = std::make_shared<ASTNode>(type);
+  node->children.push_back(parse_postfix(false));
+  expect_keyword("as");
+  node->name = parse_variable_name("as");
+
+  expect(TokenType::LPAREN);
+  node->children.push_back(parse_pipe());
+  expect(TokenType::SEMICOLON);
+  node->children.push_back(parse_pipe());
+  if (type == NodeType::FOREACH && current().type == TokenType::SEMICOLON) {
+    advance();
+    node->children.push_back(parse_pipe());
+  }
+  expect(TokenType::RPAREN);
+  return node;
+}
+
 } // namespace jq
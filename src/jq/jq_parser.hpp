@@ -16,8 +16,8 @@ enum class NodeType {
   // Identity and field access
   IDENTITY,  // .
   FIELD,     // .foo
-  INDEX,     // .[0] or .["key"]
-  SLICE,     // .[1:3]
+  INDEX,     // .[0] or .["key"]: index[, base]
+  SLICE,     // .[1:3]: start, end[, base]
   ITERATOR,  // .[]
   RECURSIVE, // ..
 
@@ -39,7 +39,16 @@ enum class NodeType {
   TRY,         // try-catch
 
   // Alternative operator
-  ALTERNATIVE // //
+  ALTERNATIVE, // //
+
+  // Variables and definitions
+  VARIABLE,     // $name
+  BINDING,      // term as $name | body
+  FUNCTION_DEF, // def name(params): body; rest
+  REDUCE,       // reduce term as $name (init; update)
+  FOREACH,      // foreach term as $name (init; update; extract)
+  LABEL,        // label $name | body
+  BREAK         // break $name
 };
 
 class ASTNode;
@@ -52,9 +61,12 @@ public:
   // For literals
   JvValuePtr literal;
 
-  // For identifiers/fields
+  // For identifiers/fields, variables (without the $) and definitions
   std::string name;
 
+  // For definitions: parameter names, value parameters keep their $
+  std::vector<std::string> params;
+
   // For operators
   std::string op;
 
@@ -91,20 +103,32 @@ private:
   void advance();
   bool expect(TokenType type);
 
+  bool at_keyword(const char *word) const;
+  void expect_keyword(const char *word);
+
   // Parsing methods (precedence order)
   ASTNodePtr parse_pipe();
   ASTNodePtr parse_comma();
   ASTNodePtr parse_alternative();
+  ASTNodePtr parse_or();
+  ASTNodePtr parse_and();
   ASTNodePtr parse_comparison();
   ASTNodePtr parse_additive();
   ASTNodePtr parse_multiplicative();
-  ASTNodePtr parse_postfix();
+  // `term as $x | body` is accepted here unless allow_binding is false
+  // (reduce/foreach, which have their own `as`)
+  ASTNodePtr parse_postfix(bool allow_binding = true);
   ASTNodePtr parse_primary();
 
   // Helper methods
   ASTNodePtr parse_array();
   ASTNodePtr parse_object();
   ASTNodePtr parse_function_call(const std::string &name);
+  ASTNodePtr parse_def();
+  ASTNodePtr parse_if();
+  ASTNodePtr parse_reduce(NodeType type);
+  std::string parse_variable_name(const char *after);
+  ASTNodePtr parse_index(ASTNodePtr base);
 };
 
 } // namespace jq
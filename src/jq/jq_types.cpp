@@ -1,90 +1,432 @@
 #include "jq_types.hpp"
 #include "../../include/jls.hpp"
 #include "../../include/libjsonval.hpp"
-#include <sstream>
+#include "../../include/metrics.hpp"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <limits>
+#include <mutex>
+#include <ostream>
+#include <shared_mutex>
+#include <unordered_map>
 
 namespace jq {
 
+// ================= Object Keys =================
+
+namespace {
+
+struct TextHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view s) const { return Key::hash(s); }
+};
+
+struct KeyTable {
+  std::shared_mutex mu;
+  // the views point into the Data they map to
+  std::unordered_map<std::string_view, std::unique_ptr<Key::Data>, TextHash,
+                     std::equal_to<>>
+      keys;
+  std::atomic<size_t> limit{size_t(1) << 20};
+};
+
+// Never destroyed: keys held by static objects may outlive any destructor.
+KeyTable &key_table() {
+  static KeyTable *table = new KeyTable;
+  return *table;
+}
+
+// Per-thread view of recently used keys, so records that repeat the same
+// keys do not take the table lock for each of them.
+constexpr size_t kKeyCacheSize = 256;
+thread_local const Key::Data *key_cache[kKeyCacheSize];
+
+} // namespace
+
+size_t Key::hash(std::string_view text) {
+  return std::hash<std::string_view>()(text);
+}
+
+Key::Key(std::string_view text) : d_(nullptr), owned_(false) {
+  const size_t h = hash(text);
+  const Key::Data *&cached = key_cache[h % kKeyCacheSize];
+  if (cached && cached->hash == h && cached->text == text) {
+    d_ = cached;
+    return;
+  }
+  KeyTable &table = key_table();
+  {
+    std::shared_lock lock(table.mu);
+    auto it = table.keys.find(text);
+    if (it != table.keys.end())
+      d_ = it->second.get();
+  }
+  if (!d_) {
+    std::unique_lock lock(table.mu);
+    auto it = table.keys.find(text);
+    if (it != table.keys.end()) {
+      d_ = it->second.get();
+    } else if (table.keys.size() < table.limit.load()) {
+      std::unique_ptr<Data> data(new Data{std::string(text), h, {}});
+      d_ = data.get();
+      table.keys.emplace(data->text, std::move(data));
+    }
+  }
+  if (d_) {
+    cached = d_;
+  } else {
+    d_ = new Data{std::string(text), h, {}};
+    owned_ = true;
+  }
+}
+
+JvValuePtr Key::value() const {
+  if (owned_)
+    return JvValue::string(d_->text);
+  const JvValuePtr *v = d_->value.load(std::memory_order_acquire);
+  if (!v) {
+    // racing first uses may each make one; the loser drops its own
+    auto *made = new JvValuePtr(JvValue::string(d_->text));
+    const JvValuePtr *expected = nullptr;
+    if (d_->value.compare_exchange_strong(expected, made,
+                                          std::memory_order_acq_rel,
+                                          std::memory_order_acquire)) {
+      v = made;
+    } else {
+      delete made;
+      v = expected;
+    }
+  }
+  return *v;
+}
+
+void set_key_intern_limit(size_t limit) { key_table().limit.store(limit); }
+
+size_t key_intern_limit() { return key_table().limit.load(); }
+
+size_t interned_key_count() {
+  KeyTable &table = key_table();
+  std::shared_lock lock(table.mu);
+  return table.keys.size();
+}
+
+// ================= Objects =================
+
+size_t JvObject::position(const Key &key) const {
+  if (!key.interned())
+    return position(key.str(), key.hash());
+  if (index_.empty()) {
+    for (size_t i = 0; i < members_.size(); ++i) {
+      if (members_[i].first == key)
+        return i;
+    }
+    return members_.size();
+  }
+  const size_t mask = index_.size() - 1;
+  for (size_t slot = key.hash() & mask; index_[slot]; slot = (slot + 1) & mask) {
+    if (members_[index_[slot] - 1].first == key)
+      return index_[slot] - 1;
+  }
+  return members_.size();
+}
+
+size_t JvObject::position(std::string_view key, size_t hash) const {
+  auto match = [&](const Member &m) {
+    return m.first.hash() == hash && m.first == key;
+  };
+  if (index_.empty()) {
+    for (size_t i = 0; i < members_.size(); ++i) {
+      if (match(members_[i]))
+        return i;
+    }
+    return members_.size();
+  }
+  const size_t mask = index_.size() - 1;
+  for (size_t slot = hash & mask; index_[slot]; slot = (slot + 1) & mask) {
+    if (match(members_[index_[slot] - 1]))
+      return index_[slot] - 1;
+  }
+  return members_.size();
+}
+
+const JvValuePtr *JvObject::find(const Key &key) const {
+  size_t i = position(key);
+  return i < members_.size() ? &members_[i].second : nullptr;
+}
+
+const JvValuePtr *JvObject::find(std::string_view key) const {
+  size_t i = position(key, Key::hash(key));
+  return i < members_.size() ? &members_[i].second : nullptr;
+}
+
+void JvObject::set(const Key &key, JvValuePtr value) {
+  size_t i = position(key);
+  if (i < members_.size()) {
+    members_[i].second = std::move(value);
+    return;
+  }
+  auto at = std::lower_bound(
+      members_.begin(), members_.end(), key.str(),
+      [](const Member &m, const std::string &k) { return m.first.str() < k; });
+  members_.emplace(at, key, std::move(value));
+  reindex();
+}
+
+void JvObject::assign(std::vector<Member> members) {
+  std::stable_sort(members.begin(), members.end(),
+                   [](const Member &a, const Member &b) {
+                     return a.first.str() < b.first.str();
+                   });
+  // keep the last of each run of equal keys
+  size_t out = 0;
+  for (size_t i = 0; i < members.size(); ++i) {
+    if (i + 1 < members.size() && members[i + 1].first == members[i].first)
+      continue;
+    if (out != i)
+      members[out] = std::move(members[i]);
+    ++out;
+  }
+  members.erase(members.begin() + static_cast<std::ptrdiff_t>(out),
+                members.end());
+  members_ = std::move(members);
+  reindex();
+}
+
+void JvObject::merge(const JvObject &other) {
+  if (other.empty())
+    return;
+  if (empty()) {
+    *this = other;
+    return;
+  }
+  std::vector<Member> merged;
+  merged.reserve(members_.size() + other.members_.size());
+  auto a = members_.begin();
+  auto b = other.members_.begin();
+  while (a != members_.end() || b != other.members_.end()) {
+    if (b == other.members_.end() ||
+        (a != members_.end() && a->first.str() < b->first.str())) {
+      merged.push_back(std::move(*a++));
+    } else {
+      if (a != members_.end() && a->first == b->first)
+        ++a; // replaced by other's member
+      merged.push_back(*b++);
+    }
+  }
+  members_ = std::move(merged);
+  reindex();
+}
+
+void JvObject::reindex() {
+  if (members_.size() < kIndexMin) {
+    index_.clear();
+    return;
+  }
+  size_t slots = 1;
+  while (slots < members_.size() * 2)
+    slots <<= 1;
+  index_.assign(slots, 0);
+  const size_t mask = slots - 1;
+  for (size_t i = 0; i < members_.size(); ++i) {
+    size_t slot = members_[i].first.hash() & mask;
+    while (index_[slot])
+      slot = (slot + 1) & mask;
+    index_[slot] = static_cast<uint32_t>(i + 1);
+  }
+}
+
 // ================= JvValue to String =================
 
-std::string JvValue::to_string() const {
-  switch (type) {
-  case ValueType::JV_NULL:
-    return "null";
-  case ValueType::JV_BOOLEAN:
-    return b ? "true" : "false";
-  case ValueType::JV_NUMBER: {
-    if (is_integer()) {
-      return std::to_string(as_integer());
+namespace {
+
+// Writes values into `out`. When `os` is set the buffer is handed over to
+// it whenever it grows past kFlushSize, so only one chunk is ever held.
+class JsonWriter {
+public:
+  JsonWriter(std::string &out, int indent, std::ostream *os = nullptr)
+      : out_(out), indent_(indent), os_(os) {}
+
+  void value(const JvValue *v, int depth) {
+    if (!v) {
+      out_ += "null";
+      return;
+    }
+    switch (v->type) {
+    case ValueType::JV_NULL:
+      out_ += "null";
+      break;
+    case ValueType::JV_BOOLEAN:
+      out_ += v->b ? "true" : "false";
+      break;
+    case ValueType::JV_NUMBER:
+      number(v->n);
+      break;
+    case ValueType::JV_STRING:
+      string(v->s);
+      break;
+    case ValueType::JV_ARRAY:
+      if (v->a.empty()) {
+        out_ += "[]";
+        break;
+      }
+      out_ += '[';
+      for (size_t i = 0; i < v->a.size(); ++i) {
+        if (i > 0)
+          out_ += ',';
+        newline(depth + 1);
+        value(v->a[i].get(), depth + 1);
+        flush();
+      }
+      newline(depth);
+      out_ += ']';
+      break;
+    case ValueType::JV_OBJECT: {
+      if (v->o.empty()) {
+        out_ += "{}";
+        break;
+      }
+      out_ += '{';
+      bool first = true;
+      for (const auto &kv : v->o) {
+        if (!first)
+          out_ += ',';
+        first = false;
+        newline(depth + 1);
+        string(kv.first.str());
+        out_ += indent_ > 0 ? ": " : ":";
+        value(kv.second.get(), depth + 1);
+        flush();
+      }
+      newline(depth);
+      out_ += '}';
+      break;
+    }
+    }
+  }
+
+  void flush(bool force = false) {
+    if (os_ && (force || out_.size() >= kFlushSize)) {
+      os_->write(out_.data(), static_cast<std::streamsize>(out_.size()));
+      out_.clear();
+    }
+  }
+
+private:
+  static constexpr size_t kFlushSize = 64 * 1024;
+
+  std::string &out_;
+  int indent_;
+  std::ostream *os_;
+
+  void newline(int depth) {
+    if (indent_ <= 0)
+      return;
+    out_ += '\n';
+    out_.append(static_cast<size_t>(depth) * static_cast<size_t>(indent_),
+                ' ');
+  }
+
+  void number(double n) {
+    if (std::isnan(n)) {
+      out_ += "null";
+      return;
+    }
+    if (std::isinf(n))
+      n = n > 0 ? std::numeric_limits<double>::max()
+                : std::numeric_limits<double>::lowest();
+    char buf[32];
+    std::to_chars_result r;
+    // integers print in full up to where doubles stop being exact
+    if (n == std::floor(n) && std::fabs(n) < 1e17) {
+      if (n == 0 && std::signbit(n)) {
+        out_ += "-0";
+        return;
+      }
+      r = std::to_chars(buf, buf + sizeof(buf), static_cast<long long>(n));
     } else {
-      std::ostringstream oss;
-      oss << n;
-      return oss.str();
+      r = std::to_chars(buf, buf + sizeof(buf), n);
     }
+    out_.append(buf, r.ptr);
   }
-  case ValueType::JV_STRING: {
-    // Simple JSON string escaping
-    std::string escaped;
-    escaped += '"';
-    for (char c : s) {
+
+  void string(const std::string &s) {
+    static const char hex[] = "0123456789abcdef";
+    out_ += '"';
+    size_t run = 0; // start of the bytes not yet copied
+    for (size_t i = 0; i < s.size(); ++i) {
+      unsigned char c = static_cast<unsigned char>(s[i]);
+      if (c >= 0x20 && c != '"' && c != '\\' && c != 0x7f)
+        continue;
+      out_.append(s, run, i - run);
+      run = i + 1;
       switch (c) {
       case '"':
-        escaped += "\\\"";
+        out_ += "\\\"";
         break;
       case '\\':
-        escaped += "\\\\";
+        out_ += "\\\\";
+        break;
+      case '\b':
+        out_ += "\\b";
+        break;
+      case '\f':
+        out_ += "\\f";
         break;
       case '\n':
-        escaped += "\\n";
+        out_ += "\\n";
         break;
       case '\r':
-        escaped += "\\r";
+        out_ += "\\r";
         break;
       case '\t':
-        escaped += "\\t";
+        out_ += "\\t";
         break;
-      default:
-        escaped += c;
+      default: {
+        const char esc[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+        out_.append(esc, sizeof(esc));
+      }
       }
     }
-    escaped += '"';
-    return escaped;
-  }
-  case ValueType::JV_ARRAY: {
-    std::string result = "[";
-    for (size_t i = 0; i < a.size(); ++i) {
-      if (i > 0)
-        result += ",";
-      result += a[i]->to_string();
-    }
-    result += "]";
-    return result;
-  }
-  case ValueType::JV_OBJECT: {
-    std::string result = "{";
-    bool first = true;
-    for (const auto &kv : o) {
-      if (!first)
-        result += ",";
-      result += "\"" + kv.first + "\":" + kv.second->to_string();
-      first = false;
-    }
-    result += "}";
-    return result;
-  }
+    out_.append(s, run, s.size() - run);
+    out_ += '"';
   }
-  return "null";
+};
+
+} // namespace
+
+void write_json(const JvValuePtr &v, std::string &out, int indent) {
+  metrics::Timer timer(metrics::SERIALIZE);
+  const size_t before = out.size();
+  JsonWriter(out, indent).value(v.get(), 0);
+  timer.set_bytes(out.size() - before);
+}
+
+void write_json(const JvValuePtr &v, std::ostream &os, int indent) {
+  metrics::Timer timer(metrics::SERIALIZE);
+  std::string buf;
+  JsonWriter w(buf, indent, &os);
+  w.value(v.get(), 0);
+  w.flush(true);
+}
+
+std::string JvValue::to_string(int indent) const {
+  metrics::Timer timer(metrics::SERIALIZE);
+  std::string out;
+  JsonWriter(out, indent).value(this, 0);
+  timer.set_bytes(out.size());
+  return out;
 }
 
 // ================= String to JvValue =================
 
 JvValuePtr JvValue::from_string(const std::string &json_text,
                                 std::string &err) {
-  JsonValue dom;
-  if (!parse_json_dom(json_text, dom, err)) {
+  JsonDocument doc;
+  if (!parse_json_document(json_text, doc, err)) {
     return null();
   }
-  return from_json_value(dom);
+  return from_json_view(doc.root());
 }
 
 // ================= Converters =================
@@ -114,12 +456,58 @@ JvValuePtr from_json_value(const JsonValue &jv) {
       result->a.push_back(from_json_value(elem));
     }
     break;
-  case JsonValue::T_OBJECT:
+  case JsonValue::T_OBJECT: {
     result->type = ValueType::JV_OBJECT;
+    std::vector<JvObject::Member> members;
+    members.reserve(jv.o.size());
     for (const auto &kv : jv.o) {
-      result->o[kv.first] = from_json_value(kv.second);
+      members.emplace_back(Key(kv.first), from_json_value(kv.second));
+    }
+    result->o.assign(std::move(members));
+    break;
+  }
+  }
+
+  return result;
+}
+
+JvValuePtr from_json_view(const JsonView &jv) {
+  auto result = std::make_shared<JvValue>();
+
+  switch (jv.type()) {
+  case JsonValue::T_NULL:
+    result->type = ValueType::JV_NULL;
+    break;
+  case JsonValue::T_BOOL:
+    result->type = ValueType::JV_BOOLEAN;
+    result->b = jv.as_bool();
+    break;
+  case JsonValue::T_NUMBER:
+    result->type = ValueType::JV_NUMBER;
+    result->n = jv.as_number();
+    break;
+  case JsonValue::T_STRING:
+    result->type = ValueType::JV_STRING;
+    result->s = jv.as_string();
+    break;
+  case JsonValue::T_ARRAY:
+    result->type = ValueType::JV_ARRAY;
+    result->a.reserve(jv.size());
+    for (const JsonView &elem : jv) {
+      result->a.push_back(from_json_view(elem));
     }
     break;
+  case JsonValue::T_OBJECT: {
+    result->type = ValueType::JV_OBJECT;
+    std::vector<JvObject::Member> members;
+    members.reserve(jv.size());
+    for (auto it = jv.begin(); it != jv.end(); ++it) {
+      members.emplace_back(Key(it.key()), from_json_view(*it));
+    }
+    // duplicate keys: the last one wins, as in parse_json_dom
+    result->o.assign(std::move(members));
+    break;
+  }
   }
 
   return result;
@@ -158,7 +546,7 @@ JsonValue to_json_value(const JvValuePtr &jv) {
   case ValueType::JV_OBJECT:
     result.t = JsonValue::T_OBJECT;
     for (const auto &kv : jv->o) {
-      result.o[kv.first] = to_json_value(kv.second);
+      result.o[kv.first.str()] = to_json_value(kv.second);
     }
     break;
   }
@@ -166,46 +554,90 @@ JsonValue to_json_value(const JvValuePtr &jv) {
   return result;
 }
 
-JvValuePtr from_jls_value(const std::shared_ptr<jls::Value> &v) {
-  if (!v) {
-    return JvValue::null();
+namespace {
+
+// JLS containers over a jq array or object; see to_jls_value.
+struct JsonListObject : jls::ListObject {
+  JvValuePtr json;
+  explicit JsonListObject(JvValuePtr v) : json(std::move(v)) {
+    pending = true;
+  }
+  void fill() override {
+    list.reserve(json->a.size());
+    for (const auto &elem : json->a) {
+      list.push_back(to_jls_value(elem));
+    }
+    pending = false;
   }
+};
 
-  auto result = std::make_shared<JvValue>();
+struct JsonMapObject : jls::MapObject {
+  JvValuePtr json;
+  explicit JsonMapObject(JvValuePtr v) : json(std::move(v)) {
+    pending = true;
+  }
+  void fill() override {
+    for (const auto &kv : json->o) {
+      map[kv.first.str()] = to_jls_value(kv.second);
+    }
+    pending = false;
+  }
+};
+
+} // namespace
 
+JvValuePtr from_jls_value(const jls::Value &v) {
   using JlsValueType = jls::ValueType;
-  switch (v->type) {
+  if (v.type() == JlsValueType::LIST) {
+    auto obj = dynamic_cast<const JsonListObject *>(v.heap());
+    if (obj && !obj->written) {
+      return obj->json;
+    }
+  } else if (v.type() == JlsValueType::MAP) {
+    auto obj = dynamic_cast<const JsonMapObject *>(v.heap());
+    if (obj && !obj->written) {
+      return obj->json;
+    }
+  }
+
+  auto result = std::make_shared<JvValue>();
+
+  switch (v.type()) {
   case JlsValueType::NIL:
     result->type = ValueType::JV_NULL;
     break;
   case JlsValueType::BOOLEAN:
     result->type = ValueType::JV_BOOLEAN;
-    result->b = v->b;
+    result->b = v.b();
     break;
   case JlsValueType::INTEGER:
     result->type = ValueType::JV_NUMBER;
-    result->n = v->i;
+    result->n = v.i();
     break;
   case JlsValueType::FLOAT:
     result->type = ValueType::JV_NUMBER;
-    result->n = v->f;
+    result->n = v.f();
     break;
   case JlsValueType::STRING:
     result->type = ValueType::JV_STRING;
-    result->s = v->s;
+    result->s = v.s();
     break;
   case JlsValueType::LIST:
     result->type = ValueType::JV_ARRAY;
-    for (const auto &item : v->list) {
+    for (const auto &item : v.list()) {
       result->a.push_back(from_jls_value(item));
     }
     break;
-  case JlsValueType::MAP:
+  case JlsValueType::MAP: {
     result->type = ValueType::JV_OBJECT;
-    for (const auto &kv : v->map) {
-      result->o[kv.first] = from_jls_value(kv.second);
+    std::vector<JvObject::Member> members;
+    members.reserve(v.map().size());
+    for (const auto &kv : v.map()) {
+      members.emplace_back(Key(kv.first), from_jls_value(kv.second));
     }
+    result->o.assign(std::move(members));
     break;
+  }
   default:
     // FUNCTION, LAMBDA - cannot convert
     result->type = ValueType::JV_NULL;
@@ -215,49 +647,129 @@ JvValuePtr from_jls_value(const std::shared_ptr<jls::Value> &v) {
   return result;
 }
 
-std::shared_ptr<jls::Value> to_jls_value(const JvValuePtr &jv) {
+jls::Value to_jls_value(const JvValuePtr &jv) {
   if (!jv) {
-    return std::make_shared<jls::Value>();
+    return jls::Value();
   }
 
-  auto result = std::make_shared<jls::Value>();
-
   switch (jv->type) {
   case ValueType::JV_NULL:
-    result->type = jls::ValueType::NIL;
-    break;
+    return jls::Value();
   case ValueType::JV_BOOLEAN:
-    result->type = jls::ValueType::BOOLEAN;
-    result->b = jv->b;
-    break;
+    return jls::Value(jv->b);
   case ValueType::JV_NUMBER:
     if (jv->is_integer()) {
-      result->type = jls::ValueType::INTEGER;
-      result->i = jv->as_integer();
-    } else {
-      result->type = jls::ValueType::FLOAT;
-      result->f = jv->n;
+      return jls::Value(jv->as_integer());
     }
-    break;
+    return jls::Value(jv->n);
   case ValueType::JV_STRING:
-    result->type = jls::ValueType::STRING;
-    result->s = jv->s;
-    break;
+    return jls::Value(jv->s);
   case ValueType::JV_ARRAY:
-    result->type = jls::ValueType::LIST;
-    for (const auto &elem : jv->a) {
-      result->list.push_back(to_jls_value(elem));
-    }
-    break;
+    return jls::Value::from_heap(jls::ValueType::LIST, new JsonListObject(jv));
   case ValueType::JV_OBJECT:
-    result->type = jls::ValueType::MAP;
-    for (const auto &kv : jv->o) {
-      result->map[kv.first] = to_jls_value(kv.second);
+    return jls::Value::from_heap(jls::ValueType::MAP, new JsonMapObject(jv));
+  }
+
+  return jls::Value();
+}
+
+// ================= Comparison =================
+
+const char *type_name(const JvValuePtr &v) {
+  switch (v ? v->type : ValueType::JV_NULL) {
+  case ValueType::JV_NULL:
+    return "null";
+  case ValueType::JV_BOOLEAN:
+    return "boolean";
+  case ValueType::JV_NUMBER:
+    return "number";
+  case ValueType::JV_STRING:
+    return "string";
+  case ValueType::JV_ARRAY:
+    return "array";
+  case ValueType::JV_OBJECT:
+    return "object";
+  }
+  return "null";
+}
+
+std::string describe_value(const JvValuePtr &v) {
+  std::string text = v ? v->to_string() : "null";
+  if (text.size() > 11)
+    text = text.substr(0, 10) + "...";
+  return std::string(type_name(v)) + " (" + text + ")";
+}
+
+bool is_truthy(const JvValuePtr &v) {
+  if (!v || v->is_null())
+    return false;
+  return !v->is_bool() || v->b;
+}
+
+// null < false < true < numbers < strings < arrays < objects
+static int type_rank(const JvValuePtr &v) {
+  switch (v ? v->type : ValueType::JV_NULL) {
+  case ValueType::JV_NULL:
+    return 0;
+  case ValueType::JV_BOOLEAN:
+    return v->b ? 2 : 1;
+  case ValueType::JV_NUMBER:
+    return 3;
+  case ValueType::JV_STRING:
+    return 4;
+  case ValueType::JV_ARRAY:
+    return 5;
+  case ValueType::JV_OBJECT:
+    return 6;
+  }
+  return 0;
+}
+
+int compare_values(const JvValuePtr &a, const JvValuePtr &b) {
+  int ra = type_rank(a), rb = type_rank(b);
+  if (ra != rb)
+    return ra < rb ? -1 : 1;
+  if (!a || !b)
+    return 0;
+
+  switch (a->type) {
+  case ValueType::JV_NUMBER:
+    return a->n < b->n ? -1 : (a->n > b->n ? 1 : 0);
+  case ValueType::JV_STRING: {
+    int c = a->s.compare(b->s);
+    return c < 0 ? -1 : (c > 0 ? 1 : 0);
+  }
+  case ValueType::JV_ARRAY: {
+    size_t n = std::min(a->a.size(), b->a.size());
+    for (size_t i = 0; i < n; ++i) {
+      if (int c = compare_values(a->a[i], b->a[i]))
+        return c;
     }
-    break;
+    return a->a.size() < b->a.size() ? -1
+                                       : (a->a.size() > b->a.size() ? 1 : 0);
+  }
+  case ValueType::JV_OBJECT: {
+    // Key sets first (as sorted arrays), then the values key by key.
+    auto ia = a->o.begin(), ib = b->o.begin();
+    for (; ia != a->o.end() && ib != b->o.end(); ++ia, ++ib) {
+      if (int c = ia->first.str().compare(ib->first.str()))
+        return c < 0 ? -1 : 1;
+    }
+    if (ia != a->o.end() || ib != b->o.end())
+      return ia == a->o.end() ? -1 : 1;
+    for (ia = a->o.begin(), ib = b->o.begin(); ia != a->o.end(); ++ia, ++ib) {
+      if (int c = compare_values(ia->second, ib->second))
+        return c;
+    }
+    return 0;
+  }
+  default:
+    return 0; // null, or booleans of the same rank
   }
+}
 
-  return result;
+bool values_equal(const JvValuePtr &a, const JvValuePtr &b) {
+  return a == b || compare_values(a, b) == 0;
 }
 
 } // namespace jq
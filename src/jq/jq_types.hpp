@@ -1,19 +1,24 @@
 #ifndef JQ_TYPES_HPP
 #define JQ_TYPES_HPP
 
+#include <atomic>
 #include <cmath>
-#include <map>
+#include <cstdint>
+#include <iosfwd>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
 // Forward declarations
 struct JsonValue;
+class JsonView;
 
 namespace jls {
-struct Value;
+class Value;
 }
 
 namespace jq {
@@ -34,6 +39,106 @@ enum class ValueType {
 class JvValue;
 using JvValuePtr = std::shared_ptr<JvValue>;
 
+// ================= Object Keys =================
+
+// An object key. Key texts are interned in a process-wide table, so a key
+// repeated across a million records is stored once and two keys compare by
+// pointer. Once the table holds key_intern_limit() texts no new ones are
+// added: such keys carry a private copy and compare by text, so arbitrary
+// input cannot grow the table without bound.
+class Key {
+public:
+  struct Data {
+    std::string text;
+    size_t hash;
+    // interned keys: the text as a shared string value, made on first use
+    // and never freed, like the interned Data itself
+    mutable std::atomic<const JvValuePtr *> value;
+  };
+
+  explicit Key(std::string_view text);
+  Key(const Key &o)
+      : d_(o.owned_ ? new Data{o.d_->text, o.d_->hash, {}} : o.d_),
+        owned_(o.owned_) {}
+  Key(Key &&o) noexcept : d_(o.d_), owned_(o.owned_) { o.owned_ = false; }
+  Key &operator=(Key o) noexcept {
+    std::swap(d_, o.d_);
+    std::swap(owned_, o.owned_);
+    return *this;
+  }
+  ~Key() {
+    if (owned_)
+      delete d_;
+  }
+
+  const std::string &str() const { return d_->text; }
+  size_t hash() const { return d_->hash; }
+  // The key as a JSON string value; interned keys hand out one shared value
+  // instead of allocating a new one per call.
+  JvValuePtr value() const;
+  bool interned() const { return !owned_; }
+
+  bool operator==(const Key &o) const {
+    return d_ == o.d_ || ((owned_ || o.owned_) && d_->hash == o.d_->hash &&
+                          d_->text == o.d_->text);
+  }
+  bool operator==(std::string_view text) const { return d_->text == text; }
+
+  static size_t hash(std::string_view text);
+
+private:
+  const Data *d_;
+  bool owned_;
+};
+
+// Upper bound on distinct interned key texts (default 1 << 20); 0 turns
+// interning off. Keys already interned stay valid.
+void set_key_intern_limit(size_t limit);
+size_t key_intern_limit();
+size_t interned_key_count();
+
+// Members of a JSON object, sorted by key text (jq's output order). Small
+// objects are searched linearly, which with interned keys is a pointer
+// compare per member; from kIndexMin members on an open-addressing index
+// over the key hashes is kept alongside the sorted vector.
+class JvObject {
+public:
+  using Member = std::pair<Key, JvValuePtr>;
+  using const_iterator = std::vector<Member>::const_iterator;
+
+  static constexpr size_t kIndexMin = 16;
+
+  const_iterator begin() const { return members_.begin(); }
+  const_iterator end() const { return members_.end(); }
+  size_t size() const { return members_.size(); }
+  bool empty() const { return members_.empty(); }
+
+  // The member's value, or nullptr if there is none
+  const JvValuePtr *find(const Key &key) const;
+  const JvValuePtr *find(std::string_view key) const;
+
+  // Insert or replace one member
+  void set(const Key &key, JvValuePtr value);
+  void set(std::string_view key, JvValuePtr value) {
+    set(Key(key), std::move(value));
+  }
+
+  // Replace every member; `members` may be in any order and for repeated
+  // keys the last one wins.
+  void assign(std::vector<Member> members);
+
+  // Add the members of `other`, replacing those with the same key.
+  void merge(const JvObject &other);
+
+private:
+  std::vector<Member> members_;
+  std::vector<uint32_t> index_; // position + 1 per slot, 0 when free
+
+  size_t position(const Key &key) const;
+  size_t position(std::string_view key, size_t hash) const;
+  void reindex();
+};
+
 class JvValue {
 public:
   ValueType type;
@@ -41,7 +146,7 @@ public:
   double n = 0.0;                      // number
   std::string s;                       // string
   std::vector<JvValuePtr> a;           // array
-  std::map<std::string, JvValuePtr> o; // object
+  JvObject o;                          // object
 
   // Constructors
   JvValue() : type(ValueType::JV_NULL) {}
@@ -97,14 +202,20 @@ public:
     return a[i];
   }
 
-  JvValuePtr object_get(const std::string &key) const {
+  JvValuePtr object_get(std::string_view key) const {
     if (type != ValueType::JV_OBJECT) {
       return null();
     }
-    auto it = o.find(key);
-    if (it == o.end())
+    const JvValuePtr *v = o.find(key);
+    return v ? *v : null();
+  }
+
+  JvValuePtr object_get(const Key &key) const {
+    if (type != ValueType::JV_OBJECT) {
       return null();
-    return it->second;
+    }
+    const JvValuePtr *v = o.find(key);
+    return v ? *v : null();
   }
 
   void array_push(const JvValuePtr &v) {
@@ -113,30 +224,68 @@ public:
     }
   }
 
-  void object_set(const std::string &key, const JvValuePtr &v) {
+  void object_set(std::string_view key, const JvValuePtr &v) {
     if (type == ValueType::JV_OBJECT) {
-      o[key] = v;
+      o.set(key, v);
     }
   }
 
-  // Conversion to/from string representation (for debugging)
-  std::string to_string() const;
+  // Conversion to/from JSON text; to_string() is write_json() into a fresh
+  // string, pretty-printed when indent > 0
+  std::string to_string(int indent = 0) const;
   static JvValuePtr from_string(const std::string &json_text, std::string &err);
 };
 
+// ================= Serialization =================
+
+// Appends `v` as JSON to `out` without building any intermediate strings,
+// so one buffer can be reused across many values. indent = 0 writes compact
+// JSON; indent > 0 pretty-prints with that many spaces per level, laid out
+// as jq does. Strings are escaped per RFC 8259 (control characters and DEL
+// as \u00XX), numbers use the shortest text that reads back as the same
+// double; NaN is written as null and infinities as +/-DBL_MAX. A null
+// pointer reads as null.
+void write_json(const JvValuePtr &v, std::string &out, int indent = 0);
+
+// Same, streaming to `os` in chunks instead of holding the whole text.
+void write_json(const JvValuePtr &v, std::ostream &os, int indent = 0);
+
 // ================= Converters =================
 
 // Convert from libjsonval JsonValue to jq JvValue
 JvValuePtr from_json_value(const JsonValue &jv);
 
+// Convert a value of a parsed JsonDocument to jq JvValue
+JvValuePtr from_json_view(const JsonView &jv);
+
 // Convert from jq JvValue to libjsonval JsonValue
 JsonValue to_json_value(const JvValuePtr &jv);
 
-// Convert from JLS Value to jq JvValue
-JvValuePtr from_jls_value(const std::shared_ptr<jls::Value> &v);
+// Convert from JLS Value to jq JvValue. A list or map made by to_jls_value
+// that was not written to since gives back the JvValue it came from.
+JvValuePtr from_jls_value(const jls::Value &v);
+
+// Convert from jq JvValue to JLS Value. Arrays and objects become lists and
+// maps that keep `jv` and build their elements on first access, so a result
+// handed straight back to jq is never copied.
+jls::Value to_jls_value(const JvValuePtr &jv);
+
+// ================= Comparison =================
+
+// jq type name: "null", "boolean", "number", "string", "array", "object"
+const char *type_name(const JvValuePtr &v);
+
+// Type and value for error messages: `number (1)`, long values cut short
+std::string describe_value(const JvValuePtr &v);
+
+// false and null are false, everything else is true
+bool is_truthy(const JvValuePtr &v);
 
-// Convert from jq JvValue to JLS Value
-std::shared_ptr<jls::Value> to_jls_value(const JvValuePtr &jv);
+// Total order used by jq's comparisons and sort: null < false < true <
+// numbers < strings < arrays < objects, containers compared element-wise.
+// Returns <0, 0 or >0. A null pointer reads as null.
+int compare_values(const JvValuePtr &a, const JvValuePtr &b);
+bool values_equal(const JvValuePtr &a, const JvValuePtr &b);
 
 // ================= Error Handling =================
 